@@ -0,0 +1,158 @@
+//****************************************************************************
+/// @file afu_decode.h
+/// @brief Block decode of AFU output lines into per-lane leaf index arrays.
+///
+/// The merge wants the leaf indices of one lane for many packets, while the
+/// AFU writes them packet by packet (afu_output.h): a row of 16 indices per
+/// input line, one or two rows per output line.  AfuLeafDecoder turns whole
+/// blocks of rows into a structure of arrays, lane k of row i at lane(k)[i],
+/// eight rows at a time with an SSE2 8x8 transpose of each half row, and
+/// masks every index to the tree's index bits on the way.  The arrays are
+/// allocated once by init() and reused for every block, so the merge tasks
+/// point straight into them.
+//****************************************************************************
+#ifndef __AFU_DECODE_H__
+#define __AFU_DECODE_H__
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <emmintrin.h>
+#include "afu_output.h"
+
+typedef unsigned short int bt16bitInt;
+
+/// @brief Leaf indices of a block of AFU output, lane by lane.
+class AfuLeafDecoder
+{
+public:
+   AfuLeafDecoder() :
+      m_buf(NULL),
+      m_lanes(0),
+      m_stride(0),
+      m_rows(0),
+      m_mask(0xffff)
+   {}
+
+   ~AfuLeafDecoder()
+   {
+      free(m_buf);
+   }
+
+   /// @param lanes      Lanes to keep, at most AFU_OUT_LANES
+   /// @param indexBits  Significant bits of an index, 0 keeps all 16
+   /// @param maxRows    Largest block decode() is given
+   bool init(unsigned lanes, unsigned indexBits, size_t maxRows)
+   {
+      free(m_buf);
+      m_buf    = NULL;
+      m_lanes  = lanes < AFU_OUT_LANES ? lanes : AFU_OUT_LANES;
+      m_stride = (maxRows + 7) & ~(size_t)7;
+      m_rows   = 0;
+      m_mask   = (indexBits && indexBits < 16) ? (bt16bitInt)((1u << indexBits) - 1) : (bt16bitInt)0xffff;
+      void *p  = NULL;
+      if ( 0 != posix_memalign(&p, 64, m_lanes * m_stride * sizeof(bt16bitInt)) ) {
+         return false;
+      }
+      m_buf = static_cast<bt16bitInt *>(p);
+      for ( unsigned k = 0; k < AFU_OUT_LANES; k++ ) {
+         m_lane[k] = m_buf + m_stride * (k < m_lanes ? k : 0);
+      }
+      return true;
+   }
+
+   /// @brief Decode input lines [first, first+n) of the output at out; n is
+   /// clipped to maxRows.  Rows must be 16-byte aligned (any workspace
+   /// buffer is).  Returns the rows decoded.
+   size_t decode(const AfuOutputFormat &fmt, const void *out, size_t first, size_t n)
+   {
+      if ( n > m_stride ) {
+         n = m_stride;
+      }
+      const __m128i mask = _mm_set1_epi16((short)m_mask);
+      const bool    high = m_lanes > 8;
+      size_t i = 0;
+      for ( ; i + 8 <= n; i += 8 ) {
+         __m128i lo[8], hi[8];
+         for ( int r = 0; r < 8; r++ ) {
+            const __m128i *s = reinterpret_cast<const __m128i *>(fmt.row(out, first + i + r));
+            lo[r] = _mm_load_si128(s);
+            if ( high ) {
+               hi[r] = _mm_load_si128(s + 1);
+            }
+         }
+         transpose8(lo);
+         store8(lo, 0, i, mask);
+         if ( high ) {
+            transpose8(hi);
+            store8(hi, 8, i, mask);
+         }
+      }
+      for ( ; i < n; i++ ) {
+         const bt16bitInt *s = fmt.row(out, first + i);
+         for ( unsigned k = 0; k < m_lanes; k++ ) {
+            m_lane[k][i] = s[k] & m_mask;
+         }
+      }
+      m_rows = n;
+      return n;
+   }
+
+   unsigned lanes() const { return m_lanes; }
+
+   /// Rows of the last decode().
+   size_t rows() const { return m_rows; }
+
+   /// Lane k of every decoded row.
+   const bt16bitInt * lane(unsigned k) const { return m_lane[k]; }
+
+   /// @brief Lane pointers of the rows from first on: dst[k][t] is lane k
+   /// of row first+t.  dst holds lanes() pointers.
+   void taskLanes(size_t first, const bt16bitInt **dst) const
+   {
+      for ( unsigned k = 0; k < m_lanes; k++ ) {
+         dst[k] = m_lane[k] + first;
+      }
+   }
+
+   /// @brief The lanes of row i, as the per-packet merge takes them.
+   void packet(size_t i, bt16bitInt *dst) const
+   {
+      for ( unsigned k = 0; k < m_lanes; k++ ) {
+         dst[k] = m_lane[k][i];
+      }
+   }
+
+private:
+   /// Rows in, columns out: r[c] becomes word c of the eight input rows.
+   static void transpose8(__m128i *r)
+   {
+      __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+      __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+      __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+      __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+      __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+      __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+      __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+      __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+      r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+      r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+      r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+      r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+   }
+
+   void store8(const __m128i *col, unsigned lane0, size_t i, __m128i mask)
+   {
+      for ( unsigned c = 0; c < 8 && lane0 + c < m_lanes; c++ ) {
+         _mm_store_si128(reinterpret_cast<__m128i *>(m_lane[lane0 + c] + i), _mm_and_si128(col[c], mask));
+      }
+   }
+
+   bt16bitInt  *m_buf;
+   bt16bitInt  *m_lane[AFU_OUT_LANES];
+   unsigned     m_lanes;
+   size_t       m_stride;               ///< Words from one lane to the next, a multiple of 8
+   size_t       m_rows;
+   bt16bitInt   m_mask;
+};
+
+#endif // __AFU_DECODE_H__
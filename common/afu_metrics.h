@@ -0,0 +1,325 @@
+//****************************************************************************
+/// @file afu_metrics.h
+/// @brief AFU and host-side performance counters as one structured snapshot.
+///
+/// Three sources are combined per transaction:
+///  - DSR counters: at task end afu_core writes dsr_latency_cnt (cycles from
+///    the context read to its arrival) to DSM line csr_id_addr+4 and
+///    dsr_performance_cnt (cycles spent streaming the task) to line +5,
+///    and to line +8 the read window and where the trees' cycles went: busy
+///    with input, or starved with the window full, on reads in flight, or
+///    with no read issued.
+///  - QPI cache-controller counters in PCI config space, the same selector
+///    (0x27c) / value (0x28c) pair get_performance.sh drives with setpci.
+///    They are read through /sys/bus/pci/devices/<bdf>/config with pread and
+///    pwrite, which needs write access to that file (udev rule or capability)
+///    but no shell; when it is not accessible those fields stay zero.
+///  - Host stage timings: setup, wait for first output, merge per block.
+//****************************************************************************
+#ifndef __AFU_METRICS_H__
+#define __AFU_METRICS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ostream>
+#include <algorithm>
+
+// DSM lines written by afu_core at task end (AFU_CSR__LATENCY_CNT / __PERFORMANCE_CNT)
+#define AFU_DSR_LATENCY_LINE        4
+#define AFU_DSR_PERFORMANCE_LINE    5
+#define AFU_DSR_RD_STATS_LINE       8        // AFU_CSR__RD_STATS, dwords below
+#define AFU_DSR_RD_BUSY             0
+#define AFU_DSR_RD_STARVE_WINDOW    1
+#define AFU_DSR_RD_STARVE_MEM       2
+#define AFU_DSR_RD_STARVE_ISSUE     3
+#define AFU_DSR_RD_PEND_MAX         4
+#define AFU_DSR_RD_WINDOW           5
+#define AFU_DSR_UNSET               0xffffffffu    // written by the host before the task starts
+
+// QPI cache-controller performance counters, PCI config space
+#define AFU_PCI_VENDOR              0x8086
+#define AFU_PCI_DEVICE              0xbcbc
+#define AFU_PCI_PERF_SELECT         0x27c
+#define AFU_PCI_PERF_VALUE          0x28c
+#define AFU_PCI_PERF_RESET          0x10000000u
+#define AFU_PCI_PERF_PORT1          0x80000000u
+
+#define AFU_CACHE_RD_HIT            0x0
+#define AFU_CACHE_WR_HIT            0x1
+#define AFU_CACHE_RD_MISS           0x2
+#define AFU_CACHE_WR_MISS           0x3
+#define AFU_CACHE_EVICT             0xa
+
+#ifndef AFU_CLOCK_MHZ
+# define AFU_CLOCK_MHZ              200      // afu_core clock, for cycle -> time conversion
+#endif // AFU_CLOCK_MHZ
+
+/// @brief Cache-controller counters of both ports, summed.
+struct AfuCacheCounters {
+   unsigned long long rdHit;
+   unsigned long long wrHit;
+   unsigned long long rdMiss;
+   unsigned long long wrMiss;
+   unsigned long long evict;
+};
+
+/// @brief Everything known about one transaction.
+struct AfuMetricsSnapshot {
+   bool               dsrValid;         ///< AFU wrote its DSR counters
+   unsigned           latencyCycles;    ///< dsr_latency_cnt
+   unsigned           runCycles;        ///< dsr_performance_cnt
+   bool               rdValid;          ///< AFU wrote its read counters
+   unsigned           rdWindowLines;    ///< Source lines read ahead of the trees
+   unsigned           rdPendMax;        ///< Most lines ever in the window
+   unsigned           rdBusyCycles;     ///< Trees had input
+   unsigned           rdStarveWindowCycles; ///< Trees waited with the window full
+   unsigned           rdStarveMemCycles;    ///< Trees waited on reads in flight
+   unsigned           rdStarveIssueCycles;  ///< Trees waited with no read issued
+   bool               cacheValid;       ///< Cache counters were readable
+   AfuCacheCounters   cache;
+   double             setupMs;          ///< Host: workspace setup
+   double             firstOutputMs;    ///< Host: start to first output line
+   double             totalMs;          ///< Host: start to last block merged
+   double             mergeMs;          ///< Host: sum of block merge times
+   double             blockMergeMinMs;
+   double             blockMergeMaxMs;
+   unsigned long long blocks;
+   unsigned long long lines;
+
+   /// AFU busy time from its own cycle count.
+   double afuRunMs() const { return runCycles / (AFU_CLOCK_MHZ * 1000.0); }
+
+   /// Share of the task the trees waited for input.
+   double rdStarvedFraction() const
+   {
+      double starved = (double)rdStarveWindowCycles + rdStarveMemCycles + rdStarveIssueCycles;
+      return (starved + rdBusyCycles) > 0 ? starved / (starved + rdBusyCycles) : 0.0;
+   }
+
+   /// One JSON object.
+   void write(std::ostream &os) const
+   {
+      os << "{\"dsr\":{\"valid\":" << (dsrValid ? "true" : "false")
+         << ",\"latency_cycles\":" << latencyCycles
+         << ",\"run_cycles\":" << runCycles
+         << ",\"run_ms\":" << afuRunMs() << "}"
+         << ",\"rd\":{\"valid\":" << (rdValid ? "true" : "false")
+         << ",\"window_lines\":" << rdWindowLines
+         << ",\"pend_max\":" << rdPendMax
+         << ",\"busy_cycles\":" << rdBusyCycles
+         << ",\"starve_window_cycles\":" << rdStarveWindowCycles
+         << ",\"starve_mem_cycles\":" << rdStarveMemCycles
+         << ",\"starve_issue_cycles\":" << rdStarveIssueCycles
+         << ",\"starved\":" << rdStarvedFraction() << "}"
+         << ",\"cache\":{\"valid\":" << (cacheValid ? "true" : "false")
+         << ",\"rd_hit\":" << cache.rdHit << ",\"wr_hit\":" << cache.wrHit
+         << ",\"rd_miss\":" << cache.rdMiss << ",\"wr_miss\":" << cache.wrMiss
+         << ",\"evict\":" << cache.evict << "}"
+         << ",\"host\":{\"setup_ms\":" << setupMs
+         << ",\"first_output_ms\":" << firstOutputMs
+         << ",\"total_ms\":" << totalMs
+         << ",\"merge_ms\":" << mergeMs
+         << ",\"block_merge_min_ms\":" << blockMergeMinMs
+         << ",\"block_merge_max_ms\":" << blockMergeMaxMs
+         << ",\"blocks\":" << blocks
+         << ",\"lines\":" << lines << "}}";
+   }
+};
+
+/// @brief Cache-controller counters through the device's sysfs config file.
+class PciPerfCounters
+{
+public:
+   PciPerfCounters() : m_fd(-1) {}
+   ~PciPerfCounters() { close(); }
+
+   /// Find the first device with the given ids and open its config space.
+   bool open(unsigned vendor = AFU_PCI_VENDOR, unsigned device = AFU_PCI_DEVICE)
+   {
+      close();
+      DIR *d = opendir("/sys/bus/pci/devices");
+      if ( NULL == d ) {
+         return false;
+      }
+      struct dirent *e;
+      while ( m_fd < 0 && NULL != (e = readdir(d)) ) {
+         if ( '.' == e->d_name[0] ) {
+            continue;
+         }
+         char path[320];
+         snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/vendor", e->d_name);
+         unsigned v = readHex(path);
+         snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/device", e->d_name);
+         unsigned id = readHex(path);
+         if ( v == vendor && id == device ) {
+            snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/config", e->d_name);
+            m_fd = ::open(path, O_RDWR);
+         }
+      }
+      closedir(d);
+      return m_fd >= 0;
+   }
+
+   void close()
+   {
+      if ( m_fd >= 0 ) {
+         ::close(m_fd);
+      }
+      m_fd = -1;
+   }
+
+   bool isOpen() const { return m_fd >= 0; }
+
+   /// Clear all counters.
+   bool reset()
+   {
+      return select(AFU_PCI_PERF_RESET) && select(0);
+   }
+
+   /// Both ports of every event, summed.
+   bool read(AfuCacheCounters &c)
+   {
+      memset(&c, 0, sizeof(c));
+      bool ok = true;
+      for ( unsigned port = 0; port < 2; port++ ) {
+         unsigned base = port ? AFU_PCI_PERF_PORT1 : 0;
+         c.rdHit  += event(base | AFU_CACHE_RD_HIT, ok);
+         c.wrHit  += event(base | AFU_CACHE_WR_HIT, ok);
+         c.rdMiss += event(base | AFU_CACHE_RD_MISS, ok);
+         c.wrMiss += event(base | AFU_CACHE_WR_MISS, ok);
+         c.evict  += event(base | AFU_CACHE_EVICT, ok);
+      }
+      return ok;
+   }
+
+private:
+   bool select(uint32_t v)
+   {
+      return m_fd >= 0 && sizeof(v) == pwrite(m_fd, &v, sizeof(v), AFU_PCI_PERF_SELECT);
+   }
+
+   uint32_t event(uint32_t sel, bool &ok)
+   {
+      uint32_t v = 0;
+      if ( !select(sel) || sizeof(v) != pread(m_fd, &v, sizeof(v), AFU_PCI_PERF_VALUE) ) {
+         ok = false;
+         return 0;
+      }
+      return v;
+   }
+
+   static unsigned readHex(const char *path)
+   {
+      unsigned v = 0;
+      FILE    *f = fopen(path, "r");
+      if ( f ) {
+         if ( 1 != fscanf(f, "%x", &v) ) {
+            v = 0;
+         }
+         fclose(f);
+      }
+      return v;
+   }
+
+   int m_fd;
+};
+
+/// @brief Per-transaction collector; the app brackets its stages with these calls.
+class AfuMetrics
+{
+public:
+   AfuMetrics() : m_dsm(NULL) { clear(); }
+
+   /// Look for the cache counters once; harmless if the device is not visible.
+   bool openPci() { return m_pci.open(); }
+
+   /// Before the transaction starts: mark the DSR lines unset and clear the counters.
+   void beginTransaction(volatile void *dsm, double setupMs)
+   {
+      clear();
+      m_dsm = reinterpret_cast<volatile unsigned char *>(dsm);
+      m_snap.setupMs = setupMs;
+      if ( m_dsm ) {
+         dsrWord(AFU_DSR_LATENCY_LINE)     = AFU_DSR_UNSET;
+         dsrWord(AFU_DSR_PERFORMANCE_LINE) = AFU_DSR_UNSET;
+         dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_WINDOW) = AFU_DSR_UNSET;
+      }
+      if ( m_pci.isOpen() ) {
+         m_pci.reset();
+      }
+      m_start = now();
+   }
+
+   /// First output line seen.
+   void firstOutput() { m_snap.firstOutputMs = now() - m_start; }
+
+   /// One block of lines merged in mergeMs.
+   void blockMerged(unsigned long long lines, double mergeMs)
+   {
+      m_snap.blocks++;
+      m_snap.lines   += lines;
+      m_snap.mergeMs += mergeMs;
+      m_snap.blockMergeMinMs = (1 == m_snap.blocks) ? mergeMs : std::min(m_snap.blockMergeMinMs, mergeMs);
+      m_snap.blockMergeMaxMs = std::max(m_snap.blockMergeMaxMs, mergeMs);
+   }
+
+   /// After the AFU reported done: collect the device counters.
+   const AfuMetricsSnapshot & endTransaction()
+   {
+      m_snap.totalMs = now() - m_start;
+      if ( m_dsm ) {
+         m_snap.latencyCycles = dsrWord(AFU_DSR_LATENCY_LINE);
+         m_snap.runCycles     = dsrWord(AFU_DSR_PERFORMANCE_LINE);
+         m_snap.dsrValid      = AFU_DSR_UNSET != m_snap.latencyCycles &&
+                                AFU_DSR_UNSET != m_snap.runCycles;
+         m_snap.rdWindowLines        = dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_WINDOW);
+         m_snap.rdValid              = AFU_DSR_UNSET != m_snap.rdWindowLines;
+         if ( m_snap.rdValid ) {
+            m_snap.rdPendMax            = dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_PEND_MAX);
+            m_snap.rdBusyCycles         = dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_BUSY);
+            m_snap.rdStarveWindowCycles = dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_STARVE_WINDOW);
+            m_snap.rdStarveMemCycles    = dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_STARVE_MEM);
+            m_snap.rdStarveIssueCycles  = dsrWord(AFU_DSR_RD_STATS_LINE, AFU_DSR_RD_STARVE_ISSUE);
+         } else {
+            m_snap.rdWindowLines = 0;
+         }
+      }
+      m_snap.cacheValid = m_pci.isOpen() && m_pci.read(m_snap.cache);
+      return m_snap;
+   }
+
+   const AfuMetricsSnapshot & snapshot() const { return m_snap; }
+
+   /// Monotonic milliseconds.
+   static double now()
+   {
+      timespec t;
+      clock_gettime(CLOCK_MONOTONIC, &t);
+      return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+   }
+
+private:
+   volatile uint32_t & dsrWord(int line, int dword = 0)
+   {
+      return reinterpret_cast<volatile uint32_t *>(m_dsm + 64 * line)[dword];
+   }
+
+   void clear()
+   {
+      memset(&m_snap, 0, sizeof(m_snap));
+      m_start = now();
+   }
+
+   volatile unsigned char *m_dsm;
+   PciPerfCounters         m_pci;
+   AfuMetricsSnapshot      m_snap;
+   double                  m_start;
+};
+
+#endif // __AFU_METRICS_H__
@@ -0,0 +1,149 @@
+//****************************************************************************
+/// @file afu_output.h
+/// @brief AFU output line formats, their negotiation, and the host-side view.
+///
+/// The host asks for a format by writing AFU_CSR_OUT_FMT before the DSR base
+/// (i.e. before StartTransactionContext).  afu_core answers in the AFU ID
+/// line at the start of the DSM with the format it accepted and the line
+/// geometry; a bitstream that predates the CSR leaves those bytes zero, which
+/// reads as SPARSE.
+///
+///   SPARSE : output line o = input line o, leaf index of key k in word k,
+///            words 16..31 padding (0x1313)
+///   DENSE  : output line o = input lines 2o and 2o+1, words 0..15 and 16..31
+///   MATCH  : no leaf indices; the AFU intersects the rule lists itself and
+///            writes the best rule of each packet (matchLanes lanes of a
+///            line), 16/matchLanes ids per input line, AFU_NO_MATCH if the
+///            lists have nothing in common
+///
+/// Either way the 16 indices of input line i start at word rowWords() * i,
+/// so DENSE output is already an array of 16-index rows and needs no
+/// unpacking at all; compactRows() strips the padding of SPARSE output.
+/// MATCH rows are rowWords() rule ids in packet order.
+//****************************************************************************
+#ifndef __AFU_OUTPUT_H__
+#define __AFU_OUTPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <emmintrin.h>
+#include <algorithm>
+
+typedef unsigned short int bt16bitInt;
+
+#define AFU_CSR_OUT_FMT             0xa10    // afu_csr AFU_CSR_OUT_FMT (10'h284)
+
+#define AFU_OUT_FMT_SPARSE          0
+#define AFU_OUT_FMT_DENSE           1
+#define AFU_OUT_FMT_MATCH           2
+
+#define AFU_OUT_LANES               16       // leaf indices per input line
+#define AFU_OUT_PAD                 0x1313
+#define AFU_NO_MATCH                0xffff   // MATCH: packet lists have no common rule
+
+// AFU ID line (DSM line 0) written by afu_core
+#define AFU_DSM_FMT_BYTE            8        // accepted format
+#define AFU_DSM_INDEX_BITS_BYTE     9        // significant bits per index
+#define AFU_DSM_LINES_PER_CL_BYTE   10       // input lines per output line
+#define AFU_DSM_MATCH_LANES_BYTE    11       // lanes intersected per packet (MATCH)
+#define AFU_DSM_FMT_CAPS_BYTE       12       // bit f: format f supported
+
+/// @brief Negotiated output format of one transaction.
+struct AfuOutputFormat {
+   unsigned format;
+   unsigned linesPerCl;               ///< Input lines per output line
+   unsigned indexBits;                ///< 0 if the AFU did not report it
+   unsigned matchLanes;               ///< Lanes per packet of the match stage
+   unsigned caps;                     ///< Supported formats, 0 if not reported
+
+   AfuOutputFormat() : format(AFU_OUT_FMT_SPARSE), linesPerCl(1), indexBits(0), matchLanes(0), caps(0) {}
+
+   /// Read what the AFU accepted from its ID line; false (and SPARSE) if it
+   /// reported nothing.
+   bool readDsm(const volatile void *dsm)
+   {
+      const volatile unsigned char *b = reinterpret_cast<const volatile unsigned char *>(dsm);
+      *this = AfuOutputFormat();
+      if ( NULL == b || 0 == b[AFU_DSM_FMT_CAPS_BYTE] ) {
+         return false;
+      }
+      caps       = b[AFU_DSM_FMT_CAPS_BYTE];
+      format     = b[AFU_DSM_FMT_BYTE];
+      indexBits  = b[AFU_DSM_INDEX_BITS_BYTE];
+      matchLanes = b[AFU_DSM_MATCH_LANES_BYTE];
+      linesPerCl = b[AFU_DSM_LINES_PER_CL_BYTE] ? b[AFU_DSM_LINES_PER_CL_BYTE] : 1;
+      return true;
+   }
+
+   bool isDense() const { return AFU_OUT_FMT_DENSE == format; }
+   bool isMatch() const { return AFU_OUT_FMT_MATCH == format; }
+   bool supports(unsigned fmt) const { return 0 != (caps & (1u << fmt)); }
+
+   /// Output lines written for numInLines input lines.
+   size_t outLines(size_t numInLines) const { return (numInLines + linesPerCl - 1) / linesPerCl; }
+
+   /// Output line holding input line i.
+   size_t outLineOf(size_t i) const { return i / linesPerCl; }
+
+   /// 16-bit words from one input line's indices to the next.
+   size_t rowWords() const { return 32 / linesPerCl; }
+
+   /// The 16 leaf indices (MATCH: the rule ids) of input line i.
+   const bt16bitInt * row(const void *out, size_t i) const
+   {
+      return reinterpret_cast<const bt16bitInt *>(out) + rowWords() * i;
+   }
+
+   bt16bitInt * row(void *out, size_t i) const
+   {
+      return reinterpret_cast<bt16bitInt *>(out) + rowWords() * i;
+   }
+
+   /// Copy the indices of input lines [first, first+n) to dst as contiguous
+   /// 16-index rows.  Both ends 16-byte aligned.
+   void compactRows(const void *out, size_t first, size_t n, bt16bitInt *dst) const
+   {
+      for ( size_t i = 0; i < n; i++ ) {
+         const __m128i *s = reinterpret_cast<const __m128i *>(row(out, first + i));
+         __m128i       *d = reinterpret_cast<__m128i *>(dst + AFU_OUT_LANES * i);
+         _mm_store_si128(d + 0, _mm_load_si128(s + 0));
+         _mm_store_si128(d + 1, _mm_load_si128(s + 1));
+      }
+   }
+};
+
+/// Write the first numLists rule lists as the list table of the AFU match
+/// stage (rule_match.v, $readmemh): one list per line, id 0 in the low word.
+inline bool writeRuleListHex(const char *path, bt16bitInt *const *lists, size_t numLists, int listSize)
+{
+   FILE *f = fopen(path, "w");
+   if ( NULL == f ) {
+      return false;
+   }
+   for ( size_t l = 0; l < numLists; l++ ) {
+      for ( int k = listSize - 1; k >= 0; k-- ) {
+         fprintf(f, "%04x", lists[l][k]);
+      }
+      fprintf(f, "\n");
+   }
+   return 0 == fclose(f);
+}
+
+/// Best rule of one packet as the match stage computes it: the lowest id
+/// of the first (ascending) list that is in every other list.
+inline bt16bitInt firstCommonRule(const bt16bitInt *const *lists, int numLists, int listSize)
+{
+   for ( int i = 0; i < listSize; i++ ) {
+      bool inAll = true;
+      for ( int l = 1; l < numLists && inAll; l++ ) {
+         inAll = std::find(lists[l], lists[l] + listSize, lists[0][i]) != lists[l] + listSize;
+      }
+      if ( inAll ) {
+         return lists[0][i];
+      }
+   }
+   return AFU_NO_MATCH;
+}
+
+#endif // __AFU_OUTPUT_H__
@@ -0,0 +1,286 @@
+//****************************************************************************
+/// @file afu_queue.h
+/// @brief Job descriptor ring between the host and the AFU.
+///
+/// One SPL transaction serves any number of jobs: the host writes job
+/// descriptors into a ring in the workspace and rings the tail doorbell
+/// (AFU_CSR_Q_TAIL, jobs submitted so far); the AFU fetches them on its own,
+/// classifies each job's lines, writes a completion record per job and
+/// reports jobs completed as the head in DSM line AFU_DSM_Q_HEAD_LINE.
+/// AFU_CSR_Q_STOP lets the transaction finish once the ring is drained.
+///
+/// Ring of 2^bits entries: descriptor lines 0..2^bits-1, then the completion
+/// record of entry i in line 2^bits+i.  A record carries the job's sequence
+/// number (1 for the first job of the ring), so a stale record of the
+/// previous lap is never taken for a new one.
+///
+/// The ring runs as the AFU's second tenant (afu_tenants.h): it is set up
+/// before the transaction starts, with shared mode on.  SoftAfu serves the
+/// same ring in-process with TreeWalkEngine, so AfuJobQueue<SoftAfu> runs
+/// where no AFU is present.
+//****************************************************************************
+#ifndef __AFU_QUEUE_H__
+#define __AFU_QUEUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "hybrid_dispatch.h"
+#include "afu_tenants.h"
+
+typedef unsigned short int bt16bitInt;
+
+#define AFU_CSR_Q_BASEL             0xa2c    // afu_csr AFU_CSR_Q_BASEL (10'h28b), starts the ring
+#define AFU_CSR_Q_BASEH             0xa30    // afu_csr AFU_CSR_Q_BASEH (10'h28c)
+#define AFU_CSR_Q_SIZE              0xa34    // log2 ring entries, before AFU_CSR_Q_BASEL
+#define AFU_CSR_Q_TAIL              0xa38    // tail doorbell: jobs submitted
+#define AFU_CSR_Q_STOP              0xa3c    // finish the transaction once the ring is drained
+
+#define AFU_DSM_Q_BITS_BYTE         14       // ID line byte: log2 of the largest ring, 0 without one
+#define AFU_DSM_Q_HEAD_LINE         7        // DSM line: jobs completed in dword 0
+
+/// @brief Largest ring the AFU serves, as log2 entries; 0 if it has none.
+inline unsigned afuJobQueueBits(const volatile void *dsm)
+{
+   return reinterpret_cast<const volatile unsigned char *>(dsm)[AFU_DSM_Q_BITS_BYTE];
+}
+
+/// @brief Cache lines of a ring of 2^bits entries.
+inline size_t afuJobRingLines(unsigned bits)
+{
+   return size_t(2) << bits;
+}
+
+/// @brief Ring entry, laid out like VAFU2_CNTXT with the job id in dword 0.
+struct AfuJobDesc {
+   uint32_t          jobId;
+   uint32_t          rsvd0;
+   uint64_t          src;             ///< Input lines, inside the workspace
+   uint64_t          dst;             ///< Output lines, inside the workspace
+   uint32_t          numCl;           ///< Input lines
+   uint32_t          rsvd[9];
+} __attribute__((aligned(64)));
+
+/// @brief Completion record of a ring entry.
+struct AfuJobCompletion {
+   volatile uint32_t done;            ///< 1
+   volatile uint32_t jobId;
+   volatile uint32_t seq;             ///< Jobs of the ring completed, this one included
+   volatile uint32_t numCl;
+   uint32_t          rsvd[12];
+} __attribute__((aligned(64)));
+
+/// @brief Host side of the ring; Svc provides CSRWrite().  Any thread may
+/// submit and any thread may reap.
+template <class Svc>
+class AfuJobQueue
+{
+public:
+   AfuJobQueue() :
+      m_svc(NULL),
+      m_desc(NULL),
+      m_cpl(NULL),
+      m_mask(0),
+      m_tail(0),
+      m_reaped(0)
+   {
+      pthread_mutex_init(&m_submitLock, NULL);
+      pthread_mutex_init(&m_reapLock, NULL);
+   }
+
+   ~AfuJobQueue()
+   {
+      pthread_mutex_destroy(&m_reapLock);
+      pthread_mutex_destroy(&m_submitLock);
+   }
+
+   /// @brief Set the ring up; before the transaction starts.
+   /// @param ring  afuJobRingLines(bits) cache lines inside the workspace
+   void init(Svc *svc, void *ring, unsigned bits)
+   {
+      m_svc    = svc;
+      m_desc   = reinterpret_cast<AfuJobDesc *>(ring);
+      m_cpl    = reinterpret_cast<AfuJobCompletion *>(m_desc + (size_t(1) << bits));
+      m_mask   = (1u << bits) - 1;
+      m_tail   = 0;
+      m_reaped = 0;
+      ::memset(ring, 0, afuJobRingLines(bits) * sizeof(AfuJobDesc));
+
+      uint64_t addr = reinterpret_cast<uintptr_t>(ring);
+      m_svc->CSRWrite(AFU_CSR_Q_SIZE, bits);
+      m_svc->CSRWrite(AFU_CSR_Q_BASEH, (uint32_t)(addr >> 32));
+      m_svc->CSRWrite(AFU_CSR_Q_BASEL, (uint32_t)addr);
+   }
+
+   unsigned capacity() const { return m_mask + 1; }
+
+   /// Jobs submitted and not yet reaped.
+   unsigned inFlight() const { return m_tail - m_reaped; }
+
+   /// Head doorbell: jobs the AFU reported complete, valid once it completed
+   /// one of this ring; completion records are what reap() goes by.
+   static unsigned head(const volatile void *dsm)
+   {
+      return reinterpret_cast<const volatile uint32_t *>(
+         reinterpret_cast<const volatile unsigned char *>(dsm) + 64 * AFU_DSM_Q_HEAD_LINE)[0];
+   }
+
+   /// @brief Queue a job without waiting; false when every entry is in
+   /// flight (reap to free them).
+   bool submit(const void *src, void *dst, uint32_t numCl, uint32_t jobId)
+   {
+      pthread_mutex_lock(&m_submitLock);
+      if ( m_tail - m_reaped > m_mask ) {
+         pthread_mutex_unlock(&m_submitLock);
+         return false;
+      }
+      AfuJobDesc *d = &m_desc[m_tail & m_mask];
+      ::memset(d, 0, sizeof(AfuJobDesc));
+      d->jobId = jobId;
+      d->src   = reinterpret_cast<uintptr_t>(src);
+      d->dst   = reinterpret_cast<uintptr_t>(dst);
+      d->numCl = numCl;
+      __sync_synchronize();
+      m_tail++;
+      m_svc->CSRWrite(AFU_CSR_Q_TAIL, m_tail);
+      pthread_mutex_unlock(&m_submitLock);
+      return true;
+   }
+
+   /// @brief Take the oldest job if it is complete; jobs complete in
+   /// submission order.  Its output lines are in place once this is true.
+   bool reap(uint32_t &jobId, uint32_t &numCl)
+   {
+      pthread_mutex_lock(&m_reapLock);
+      const AfuJobCompletion *c = &m_cpl[m_reaped & m_mask];
+      bool ready = (m_reaped != m_tail) && c->done && c->seq == m_reaped + 1;
+      if ( ready ) {
+         __sync_synchronize();
+         jobId  = c->jobId;
+         numCl  = c->numCl;
+         __sync_fetch_and_add(&m_reaped, 1);
+      }
+      pthread_mutex_unlock(&m_reapLock);
+      return ready;
+   }
+
+   /// @brief No more jobs: the transaction finishes once the ring is drained.
+   void stop()
+   {
+      m_svc->CSRWrite(AFU_CSR_Q_STOP, 1);
+   }
+
+private:
+   Svc               *m_svc;
+   AfuJobDesc        *m_desc;
+   AfuJobCompletion  *m_cpl;
+   unsigned           m_mask;
+   unsigned           m_tail;         ///< Jobs submitted, what the tail doorbell holds
+   volatile unsigned  m_reaped;
+   pthread_mutex_t    m_submitLock;
+   pthread_mutex_t    m_reapLock;
+};
+
+/// @brief In-process AFU serving the job ring with TreeWalkEngine.  It
+/// takes the ring CSRs through CSRWrite() and reports in its own DSM, so it
+/// stands in for the SPL service wherever AfuJobQueue is used.
+class SoftAfu
+{
+public:
+   explicit SoftAfu(const TreeWalkEngine &engine) :
+      m_engine(engine),
+      m_ring(0),
+      m_bits(0),
+      m_tail(0),
+      m_stop(false),
+      m_running(false)
+   {
+      ::memset(m_dsm, 0, sizeof(m_dsm));
+      m_dsm[AFU_DSM_CTX_NUM_BYTE] = 2;
+      m_dsm[AFU_DSM_Q_BITS_BYTE]  = 16;
+   }
+
+   ~SoftAfu()
+   {
+      m_stop = true;
+      join();
+   }
+
+   volatile void *dsm() { return m_dsm; }
+
+   bool CSRWrite(uint32_t offset, uint32_t value)
+   {
+      switch ( offset ) {
+         case AFU_CSR_Q_SIZE  : m_bits = value & 0x1f; break;
+         case AFU_CSR_Q_BASEH : m_ring = (m_ring & 0xffffffffULL) | ((uint64_t)value << 32); break;
+         case AFU_CSR_Q_TAIL  : m_tail = value; break;
+         case AFU_CSR_Q_STOP  : m_stop = true; break;
+         case AFU_CSR_Q_BASEL :
+            join();
+            m_ring    = (m_ring & ~0xffffffffULL) | value;
+            m_tail    = 0;
+            m_stop    = false;
+            m_running = true;
+            pthread_create(&m_thread, NULL, run, this);
+            break;
+         default : break;
+      }
+      return true;
+   }
+
+   /// @brief Wait until a stopped ring is drained.
+   void join()
+   {
+      if ( m_running ) {
+         pthread_join(m_thread, NULL);
+         m_running = false;
+      }
+   }
+
+private:
+   static void *run(void *arg)
+   {
+      SoftAfu *afu = static_cast<SoftAfu *>(arg);
+      AfuJobDesc *desc = reinterpret_cast<AfuJobDesc *>((uintptr_t)afu->m_ring);
+      AfuJobCompletion *cpl = reinterpret_cast<AfuJobCompletion *>(desc + (size_t(1) << afu->m_bits));
+      unsigned mask = (1u << afu->m_bits) - 1;
+      volatile uint32_t *head = reinterpret_cast<volatile uint32_t *>(afu->m_dsm + 64 * AFU_DSM_Q_HEAD_LINE);
+      uint32_t done = 0;
+
+      for ( ;; ) {
+         if ( done == afu->m_tail ) {
+            if ( afu->m_stop && done == afu->m_tail ) {
+               break;
+            }
+            sched_yield();
+            continue;
+         }
+         __sync_synchronize();
+         const AfuJobDesc *d = &desc[done & mask];
+         afu->m_engine.afuOutputLines(reinterpret_cast<const bt16bitInt *>((uintptr_t)d->src), d->numCl,
+                                      reinterpret_cast<bt16bitInt *>((uintptr_t)d->dst), 0, d->numCl);
+         AfuJobCompletion *c = &cpl[done & mask];
+         c->jobId = d->jobId;
+         c->numCl = d->numCl;
+         c->seq   = done + 1;
+         __sync_synchronize();
+         c->done  = 1;
+         done++;
+         *head = done;
+      }
+      return NULL;
+   }
+
+   const TreeWalkEngine  &m_engine;
+   unsigned char          m_dsm[64 * 8] __attribute__((aligned(64)));
+   uint64_t               m_ring;
+   unsigned               m_bits;
+   volatile uint32_t      m_tail;
+   volatile bool          m_stop;
+   bool                   m_running;
+   pthread_t              m_thread;
+};
+
+#endif // __AFU_QUEUE_H__
@@ -0,0 +1,170 @@
+//****************************************************************************
+/// @file afu_tenants.h
+/// @brief Second tenant of a shared AFU, with a software fallback.
+///
+/// An AFU that reports AFU_DSM_CTX_NUM_BYTE > 1 in its ID line can run a
+/// second context next to the transaction's own one.  Sharing is switched
+/// on with AFU_CSR_SHARE before the transaction starts; a tenant then
+/// attaches by writing the address of its descriptor (VAFU2_CNTXT layout)
+/// to AFU_CSR_CTX1_BASEH / AFU_CSR_CTX1_BASEL.  Source reads of the two
+/// tenants are interleaved weighted round robin at output line boundaries,
+/// each tenant looks up its own bank of the tree tables, and the AFU writes
+/// 1 to the descriptor's status line when the tenant's output is complete.
+///
+/// AfuTenantPool hands out the AFU's tenant slot and runs a submission on
+/// the CPU with TreeWalkEngine (same output lines) when the slot is taken
+/// or the bitstream has no second context.
+//****************************************************************************
+#ifndef __AFU_TENANTS_H__
+#define __AFU_TENANTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "hybrid_dispatch.h"
+#include "tree_tables.h"
+
+typedef unsigned short int bt16bitInt;
+
+#define AFU_CSR_CTX1_BASEL          0xa1c    // afu_csr AFU_CSR_CTX1_BASEL (10'h287), attaches tenant 1
+#define AFU_CSR_CTX1_BASEH          0xa20    // afu_csr AFU_CSR_CTX1_BASEH (10'h288)
+#define AFU_CSR_SHARE               0xa24    // bit 0 shared, bits 8+8t: read weight of tenant t
+#define AFU_CSR_TBL_CTX             0xa28    // tenant whose bank the next table load writes
+
+#define AFU_DSM_CTX_NUM_BYTE        13       // ID line byte: contexts the AFU runs at once
+#define AFU_TENANT_SW               (-1)     // submit() ran on the CPU, already complete
+
+/// @brief Contexts the AFU can run at once, 1 on bitstreams that predate it.
+inline unsigned afuTenantSlots(const volatile void *dsm)
+{
+   unsigned n = reinterpret_cast<const volatile unsigned char *>(dsm)[AFU_DSM_CTX_NUM_BYTE];
+   return n ? n : 1;
+}
+
+/// @brief AFU_CSR_SHARE value.  A weight is the number of source bursts a
+/// tenant reads per turn; 0 counts as 1.
+inline uint32_t afuShareWord(bool shared, unsigned weight0, unsigned weight1)
+{
+   return (shared ? 1u : 0u) | ((weight0 & 0xff) << 8) | ((weight1 & 0xff) << 16);
+}
+
+/// @brief Load the tree tables of one tenant's bank (shared mode only;
+/// otherwise the load swaps banks as described in tree_tables.h).
+template <class Svc>
+inline void requestTenantTreeLoad(Svc *svc, unsigned tenant, const void *image)
+{
+   svc->CSRWrite(AFU_CSR_TBL_CTX, tenant & 1);
+   requestTreeLoad(svc, image);
+}
+
+/// @brief Tenant descriptor, laid out like VAFU2_CNTXT: the AFU reads the
+/// first line and writes its completion to the second.
+struct AfuTenantDesc {
+   uint64_t          qword0;
+   uint64_t          src;             ///< Input lines, inside the workspace
+   uint64_t          dst;             ///< Output lines, inside the workspace
+   uint32_t          numCl;           ///< Input lines
+   uint32_t          rsvd[9];
+   volatile uint32_t status;          ///< 1 once the output is written
+   uint32_t          rsvd2[15];
+} __attribute__((aligned(64)));
+
+/// @brief Hands out the AFU's second tenant; Svc provides CSRWrite().
+template <class Svc>
+class AfuTenantPool
+{
+public:
+   AfuTenantPool() :
+      m_svc(NULL),
+      m_desc(NULL),
+      m_engine(NULL),
+      m_afu(false),
+      m_busy(false)
+   {
+      pthread_mutex_init(&m_lock, NULL);
+   }
+
+   ~AfuTenantPool()
+   {
+      pthread_mutex_destroy(&m_lock);
+   }
+
+   /// @param desc    Descriptor inside the workspace, NULL runs everything on the CPU
+   /// @param slots   afuTenantSlots() of the AFU
+   /// @param engine  CPU walk with the AFU's output format and levels
+   void init(Svc *svc, AfuTenantDesc *desc, unsigned slots, const TreeWalkEngine *engine)
+   {
+      m_svc    = svc;
+      m_desc   = desc;
+      m_engine = engine;
+      m_afu    = (NULL != desc) && (slots > 1);
+      m_busy   = false;
+   }
+
+   bool afuAvailable() const { return m_afu; }
+
+   /// @brief Classify numInLines input lines at src into AFU output lines at
+   /// dst.  Returns the tenant the AFU runs it on, or AFU_TENANT_SW when it
+   /// has already been done on the CPU.  src and dst must be inside the
+   /// workspace for the AFU to reach them.
+   int submit(const bt16bitInt *src, bt16bitInt *dst, uint32_t numInLines)
+   {
+      pthread_mutex_lock(&m_lock);
+      bool take = m_afu && !m_busy;
+      if ( take ) {
+         m_busy = true;
+      }
+      pthread_mutex_unlock(&m_lock);
+
+      if ( !take ) {
+         m_engine->afuOutputLines(src, numInLines, dst, 0, numInLines);
+         return AFU_TENANT_SW;
+      }
+
+      ::memset(m_desc, 0, sizeof(AfuTenantDesc));
+      m_desc->src   = reinterpret_cast<uintptr_t>(src);
+      m_desc->dst   = reinterpret_cast<uintptr_t>(dst);
+      m_desc->numCl = numInLines;
+      __sync_synchronize();
+      uint64_t addr = reinterpret_cast<uintptr_t>(m_desc);
+      m_svc->CSRWrite(AFU_CSR_CTX1_BASEH, (uint32_t)(addr >> 32));
+      m_svc->CSRWrite(AFU_CSR_CTX1_BASEL, (uint32_t)addr);
+      return 1;
+   }
+
+   /// @brief True once the output of a submission is complete.
+   bool done(int tenant) const
+   {
+      return AFU_TENANT_SW == tenant || 0 != (m_desc->status & 1);
+   }
+
+   /// @brief Wait for a submission, at most spins polls; frees the slot
+   /// when it completed.  Returns false on timeout (the slot stays taken).
+   bool wait(int tenant, unsigned long spins)
+   {
+      for ( unsigned long i = 0; !done(tenant); i++ ) {
+         if ( i == spins ) {
+            return false;
+         }
+         sched_yield();
+      }
+      if ( AFU_TENANT_SW != tenant ) {
+         pthread_mutex_lock(&m_lock);
+         m_busy = false;
+         pthread_mutex_unlock(&m_lock);
+      }
+      return true;
+   }
+
+private:
+   Svc                  *m_svc;
+   AfuTenantDesc        *m_desc;
+   const TreeWalkEngine *m_engine;
+   bool                  m_afu;
+   bool                  m_busy;
+   pthread_mutex_t       m_lock;
+};
+
+#endif // __AFU_TENANTS_H__
@@ -0,0 +1,252 @@
+//****************************************************************************
+/// @file classify_batch.h
+/// @brief Per-packet classification API with coalescing of small batches.
+///
+/// classify(headers, n, results) accepts anything from one packet upwards.
+/// Concurrent callers are combined: the first caller to find no batch open
+/// becomes its leader, waits until the batch holds maxBatch packets or
+/// maxDelayUs has passed, then encodes every queued packet into cache lines
+/// and hands them to the engine in one call.  The other callers just sleep
+/// until their results are filled in.  maxBatch = 1 or maxDelayUs = 0 gives
+/// the lowest latency; larger values trade latency for engine efficiency.
+///
+/// The engine is anything that classifies encoded lines: the software lookup
+/// and merge, or an AFU fed through a doorbell queue.
+//****************************************************************************
+#ifndef __CLASSIFY_BATCH_H__
+#define __CLASSIFY_BATCH_H__
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+#include "pcap_reader.h"
+#include "result_cache.h"
+
+#define CB_DEFAULT_BATCH            64
+#define CB_DEFAULT_DELAY_US         20
+#define CB_LATENCY_BUCKETS          40       // log2 buckets of nanoseconds
+
+/// @brief Rule ids matched by one packet, as the result caches keep them.
+typedef CachedRules ClassifyResult;
+
+/// @brief Back end that classifies packets already encoded as cache lines.
+class ClassifyEngine
+{
+public:
+   virtual ~ClassifyEngine() {}
+
+   /// @param lines       numPackets * linesPerPacket 64-byte lines in the engine's layout
+   /// @param numPackets  Packets to classify
+   /// @param out         One result per packet
+   /// @param slot        Counter slot of the caller (result caches, merge planner);
+   ///                    calls that may overlap pass different slots
+   virtual void classifyLines(const unsigned char *lines, size_t numPackets, ClassifyResult *out,
+                              int slot) = 0;
+};
+
+/// @brief Counters of a submitter.
+struct ClassifyBatchStats {
+   unsigned long long requests;
+   unsigned long long packets;
+   unsigned long long batches;
+   unsigned long long largestBatch;
+};
+
+class BatchSubmitter
+{
+public:
+   /// @param ingest  Encoder matching the engine's line layout and fields
+   /// @param slot    Engine counter slot of this submitter's calls; they never
+   ///                overlap each other, whichever thread leads the batch
+   BatchSubmitter(ClassifyEngine &engine, const PacketIngest &ingest,
+                  size_t maxBatch = CB_DEFAULT_BATCH, unsigned maxDelayUs = CB_DEFAULT_DELAY_US,
+                  int slot = 0) :
+      m_engine(engine),
+      m_ingest(ingest),
+      m_maxBatch(std::max(maxBatch, (size_t)1)),
+      m_maxDelayUs(maxDelayUs),
+      m_slot(slot),
+      m_pending(0),
+      m_leader(false)
+   {
+      pthread_mutex_init(&m_lock, NULL);
+      pthread_mutex_init(&m_engineLock, NULL);
+      pthread_cond_init(&m_arrived, NULL);
+      pthread_cond_init(&m_completed, NULL);
+      resetStats();
+   }
+
+   ~BatchSubmitter()
+   {
+      pthread_cond_destroy(&m_completed);
+      pthread_cond_destroy(&m_arrived);
+      pthread_mutex_destroy(&m_engineLock);
+      pthread_mutex_destroy(&m_lock);
+   }
+
+   /// Latency/batch-size trade-off; applies from the next batch on.
+   void configure(size_t maxBatch, unsigned maxDelayUs)
+   {
+      pthread_mutex_lock(&m_lock);
+      m_maxBatch   = std::max(maxBatch, (size_t)1);
+      m_maxDelayUs = maxDelayUs;
+      pthread_mutex_unlock(&m_lock);
+   }
+
+   /// Classify n packets; returns once out[0..n-1] is filled.  Thread safe.
+   void classify(const PacketHeader *headers, size_t n, ClassifyResult *out)
+   {
+      if ( 0 == n ) {
+         return;
+      }
+      Request r;
+      r.headers   = headers;
+      r.n         = n;
+      r.out       = out;
+      r.done      = false;
+      r.submitted = nowNs();
+
+      pthread_mutex_lock(&m_lock);
+      m_queue.push_back(&r);
+      m_pending += n;
+      if ( m_leader ) {
+         if ( m_pending >= m_maxBatch ) {
+            pthread_cond_signal(&m_arrived);
+         }
+         while ( !r.done ) {
+            pthread_cond_wait(&m_completed, &m_lock);
+         }
+         pthread_mutex_unlock(&m_lock);
+         return;
+      }
+
+      // leader: collect followers until the batch is full or the delay is up
+      m_leader = true;
+      if ( m_maxDelayUs > 0 ) {
+         timespec deadline;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += (long)m_maxDelayUs * 1000;
+         deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+         deadline.tv_nsec %= 1000000000;
+         while ( m_pending < m_maxBatch ) {
+            if ( ETIMEDOUT == pthread_cond_timedwait(&m_arrived, &m_lock, &deadline) ) {
+               break;
+            }
+         }
+      }
+      std::vector<Request *> batch;
+      batch.swap(m_queue);
+      size_t packets = m_pending;
+      m_pending = 0;
+      m_leader  = false;             // the next caller opens a new batch meanwhile
+      pthread_mutex_unlock(&m_lock);
+
+      execute(batch, packets);
+
+      pthread_mutex_lock(&m_lock);
+      unsigned long long t = nowNs();
+      for ( size_t i = 0; i < batch.size(); i++ ) {
+         batch[i]->done = true;
+         m_latency[bucketOf(t - batch[i]->submitted)]++;
+      }
+      m_stats.requests    += batch.size();
+      m_stats.packets     += packets;
+      m_stats.batches     += 1;
+      m_stats.largestBatch = std::max(m_stats.largestBatch, (unsigned long long)packets);
+      pthread_cond_broadcast(&m_completed);
+      pthread_mutex_unlock(&m_lock);
+   }
+
+   ClassifyBatchStats stats() const { return m_stats; }
+
+   /// Request latency (submit to results) below which a fraction p of requests fell,
+   /// at power-of-two resolution.
+   double latencyPercentileUs(double p) const
+   {
+      unsigned long long total = 0;
+      for ( int b = 0; b < CB_LATENCY_BUCKETS; b++ ) {
+         total += m_latency[b];
+      }
+      unsigned long long seen = 0;
+      for ( int b = 0; b < CB_LATENCY_BUCKETS; b++ ) {
+         seen += m_latency[b];
+         if ( total && seen >= p * total ) {
+            return (double)(1ULL << b) / 1000.0;
+         }
+      }
+      return 0.0;
+   }
+
+   void resetStats()
+   {
+      memset(&m_stats, 0, sizeof(m_stats));
+      memset(m_latency, 0, sizeof(m_latency));
+   }
+
+private:
+   struct Request {
+      const PacketHeader *headers;
+      size_t              n;
+      ClassifyResult     *out;
+      bool                done;
+      unsigned long long  submitted;
+   };
+
+   void execute(const std::vector<Request *> &batch, size_t packets)
+   {
+      size_t                      stride = 64 * m_ingest.fields().linesPerPacket();
+      std::vector<unsigned char>  lines(packets * stride);
+      std::vector<ClassifyResult> results(packets);
+      size_t                      p = 0;
+      for ( size_t i = 0; i < batch.size(); i++ ) {
+         for ( size_t k = 0; k < batch[i]->n; k++, p++ ) {
+            m_ingest.encode(batch[i]->headers[k], &lines[p * stride]);
+         }
+      }
+
+      pthread_mutex_lock(&m_engineLock);
+      m_engine.classifyLines(&lines[0], packets, &results[0], m_slot);
+      pthread_mutex_unlock(&m_engineLock);
+
+      p = 0;
+      for ( size_t i = 0; i < batch.size(); i++ ) {
+         memcpy(batch[i]->out, &results[p], batch[i]->n * sizeof(ClassifyResult));
+         p += batch[i]->n;
+      }
+   }
+
+   static unsigned long long nowNs()
+   {
+      timespec t;
+      clock_gettime(CLOCK_MONOTONIC, &t);
+      return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+   }
+
+   static int bucketOf(unsigned long long ns)
+   {
+      int b = ns ? 64 - __builtin_clzll(ns) : 0;
+      return std::min(b, CB_LATENCY_BUCKETS - 1);
+   }
+
+   ClassifyEngine         &m_engine;
+   const PacketIngest     &m_ingest;
+   size_t                  m_maxBatch;
+   unsigned                m_maxDelayUs;
+   int                     m_slot;
+   pthread_mutex_t         m_lock;
+   pthread_mutex_t         m_engineLock;
+   pthread_cond_t          m_arrived;
+   pthread_cond_t          m_completed;
+   std::vector<Request *>  m_queue;
+   size_t                  m_pending;
+   bool                    m_leader;
+   ClassifyBatchStats      m_stats;
+   unsigned long long      m_latency[CB_LATENCY_BUCKETS];
+};
+
+#endif // __CLASSIFY_BATCH_H__
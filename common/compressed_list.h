@@ -0,0 +1,221 @@
+//****************************************************************************
+/// @file compressed_list.h
+/// @brief Bit-packed sorted rule lists with SSE2 block decode and skip info.
+///
+/// Lists are cut into blocks of 128 values.  Each block stores its values as
+/// differences to the value 8 positions earlier (the first 8 relative to the
+/// block's first value), packed at the smallest bit width that holds the
+/// largest difference.  The packing is vertical in the style of BP128: value
+/// i sits in 16-bit lane i%8, so a block is 16 rows of 8 lanes and decoding
+/// is one shift/or/mask plus one add per row, all 8 lanes at once.
+///
+/// A block directory keeps the first and last value of every block, which
+/// lets the intersection skip blocks that cannot contain a candidate without
+/// decoding them.
+//****************************************************************************
+#ifndef __COMPRESSED_LIST_H__
+#define __COMPRESSED_LIST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <emmintrin.h>
+
+typedef unsigned short int bt16bitInt;
+
+#define CPL_BLOCK_VALUES            128
+#define CPL_LANES                   8                          // 16-bit lanes per SSE2 register
+#define CPL_ROWS                    (CPL_BLOCK_VALUES / CPL_LANES)
+
+/// @brief Directory entry of one block.
+struct CplBlockInfo {
+   bt16bitInt    first;       ///< Smallest value in the block
+   bt16bitInt    last;        ///< Largest value in the block
+   unsigned char bits;        ///< Packed width, 0..16
+   unsigned char count;       ///< Values in the block minus one (1..128)
+   bt16bitInt    pad;
+   unsigned      offset;      ///< First packed register of the block
+};
+
+/// @brief All lists of a rule set, compressed into one buffer.
+class CompressedRuleStore
+{
+public:
+   CompressedRuleStore() :
+      m_data(NULL),
+      m_numRegs(0),
+      m_rawBytes(0),
+      m_listSize(0),
+      m_blocksPerList(0)
+   {}
+   ~CompressedRuleStore() { free(m_data); }
+
+   /// Compress numLists sorted lists of listSize values each.
+   bool build(bt16bitInt **rows, size_t numLists, int listSize)
+   {
+      free(m_data);
+      m_data = NULL;
+      size_t blocksPerList = (listSize + CPL_BLOCK_VALUES - 1) / CPL_BLOCK_VALUES;
+      m_listSize = listSize;
+      m_blocksPerList = blocksPerList;
+      m_rawBytes = numLists * listSize * sizeof(bt16bitInt);
+      m_blocks.resize(numLists * blocksPerList);
+
+      // pass 1: widths, in parallel
+      long nblocks = (long)m_blocks.size();
+      #pragma omp parallel for schedule(static)
+      for ( long b = 0; b < nblocks; b++ ) {
+         size_t            list = b / blocksPerList;
+         size_t            base = (b % blocksPerList) * CPL_BLOCK_VALUES;
+         const bt16bitInt *v    = rows[list] + base;
+         size_t            n    = std::min((size_t)CPL_BLOCK_VALUES, (size_t)listSize - base);
+         CplBlockInfo     &bi   = m_blocks[b];
+         bt16bitInt        maxd = 0;
+         for ( size_t i = 0; i < n; i++ ) {
+            bt16bitInt d = (bt16bitInt)(v[i] - ((i < CPL_LANES) ? v[0] : v[i - CPL_LANES]));
+            maxd |= d;
+         }
+         bi.first = v[0];
+         bi.last  = v[n - 1];
+         bi.count = (unsigned char)(n - 1);
+         bi.bits  = (unsigned char)(maxd ? 32 - __builtin_clz(maxd) : 0);
+         bi.pad   = 0;
+      }
+
+      // registers per block = bits; prefix sum gives the offsets
+      m_numRegs = 0;
+      for ( size_t b = 0; b < m_blocks.size(); b++ ) {
+         m_blocks[b].offset = (unsigned)m_numRegs;
+         m_numRegs += m_blocks[b].bits;
+      }
+      if ( posix_memalign((void **)&m_data, 64, (m_numRegs + 1) * sizeof(__m128i)) ) {
+         m_data = NULL;
+         return false;
+      }
+      memset(m_data, 0, (m_numRegs + 1) * sizeof(__m128i));
+
+      // pass 2: pack, in parallel
+      #pragma omp parallel for schedule(static)
+      for ( long b = 0; b < nblocks; b++ ) {
+         size_t list = b / blocksPerList;
+         size_t base = (b % blocksPerList) * CPL_BLOCK_VALUES;
+         pack(rows[list] + base, m_blocks[b]);
+      }
+      return true;
+   }
+
+   size_t numLists()      const { return m_blocksPerList ? m_blocks.size() / m_blocksPerList : 0; }
+   size_t listSize()      const { return m_listSize; }
+   size_t bytes()         const { return m_numRegs * sizeof(__m128i) + m_blocks.size() * sizeof(CplBlockInfo); }
+   size_t rawBytes()      const { return m_rawBytes; }
+
+   /// Decode one block into out[128]; returns the number of values.
+   size_t decodeBlock(const CplBlockInfo &bi, bt16bitInt *out) const
+   {
+      __m128i        acc  = _mm_set1_epi16((short)bi.first);
+      __m128i       *dst  = reinterpret_cast<__m128i *>(out);
+      const __m128i *src  = m_data + bi.offset;
+      unsigned       bits = bi.bits;
+
+      if ( 0 == bits ) {
+         for ( int r = 0; r < CPL_ROWS; r++ ) {
+            _mm_storeu_si128(dst + r, acc);
+         }
+      } else {
+         __m128i mask = _mm_set1_epi16((short)((1u << bits) - 1));
+         for ( int r = 0; r < CPL_ROWS; r++ ) {
+            unsigned bit = r * bits;
+            unsigned k   = bit >> 4;
+            unsigned s   = bit & 15;
+            __m128i  d   = _mm_srl_epi16(_mm_load_si128(src + k), _mm_cvtsi32_si128(s));
+            if ( s + bits > 16 ) {
+               d = _mm_or_si128(d, _mm_sll_epi16(_mm_load_si128(src + k + 1), _mm_cvtsi32_si128(16 - s)));
+            }
+            acc = _mm_add_epi16(acc, _mm_and_si128(d, mask));
+            _mm_storeu_si128(dst + r, acc);
+         }
+      }
+      return (size_t)bi.count + 1;
+   }
+
+   /// Decode a whole list.
+   void decodeList(size_t list, std::vector<bt16bitInt> &out) const
+   {
+      bt16bitInt buf[CPL_BLOCK_VALUES] __attribute__((aligned(16)));
+      out.clear();
+      for ( size_t b = 0; b < m_blocksPerList; b++ ) {
+         size_t n = decodeBlock(m_blocks[list * m_blocksPerList + b], buf);
+         out.insert(out.end(), buf, buf + n);
+      }
+   }
+
+   /// Sorted candidates intersected with a compressed list.  Blocks whose
+   /// [first, last] range holds no remaining candidate are never decoded.
+   /// @return Number of values written to out (capacity n).
+   size_t intersect(const bt16bitInt *cand, size_t n, size_t list, bt16bitInt *out) const
+   {
+      bt16bitInt buf[CPL_BLOCK_VALUES] __attribute__((aligned(16)));
+      size_t     i = 0;
+      size_t     o = 0;
+      for ( size_t b = 0; b < m_blocksPerList && i < n; b++ ) {
+         const CplBlockInfo &bi = m_blocks[list * m_blocksPerList + b];
+         if ( bi.last < cand[i] ) {
+            continue;                         // skip pointer: block entirely below
+         }
+         while ( i < n && cand[i] < bi.first ) {
+            i++;
+         }
+         if ( i == n || cand[i] > bi.last ) {
+            continue;
+         }
+         size_t m = decodeBlock(bi, buf);
+         size_t j = 0;
+         while ( i < n && j < m ) {
+            if ( cand[i] < buf[j] ) {
+               i++;
+            } else if ( buf[j] < cand[i] ) {
+               j++;
+            } else {
+               out[o++] = cand[i];
+               i++;
+               j++;
+            }
+         }
+      }
+      return o;
+   }
+
+private:
+   void pack(const bt16bitInt *v, const CplBlockInfo &bi)
+   {
+      size_t     n = (size_t)bi.count + 1;
+      bt16bitInt padded[CPL_BLOCK_VALUES];
+      for ( size_t i = 0; i < CPL_BLOCK_VALUES; i++ ) {
+         padded[i] = (i < n) ? v[i] : v[n - 1];
+      }
+      bt16bitInt *words = reinterpret_cast<bt16bitInt *>(m_data + bi.offset);
+      for ( size_t i = 0; i < CPL_BLOCK_VALUES && bi.bits; i++ ) {
+         unsigned d    = (bt16bitInt)(padded[i] - ((i < CPL_LANES) ? padded[0] : padded[i - CPL_LANES]));
+         unsigned lane = i % CPL_LANES;
+         unsigned bit  = (i / CPL_LANES) * bi.bits;
+         unsigned k    = bit >> 4;
+         unsigned s    = bit & 15;
+         words[k * CPL_LANES + lane] |= (bt16bitInt)(d << s);
+         if ( s + bi.bits > 16 ) {
+            words[(k + 1) * CPL_LANES + lane] |= (bt16bitInt)(d >> (16 - s));
+         }
+      }
+   }
+
+   __m128i                   *m_data;
+   size_t                     m_numRegs;
+   size_t                     m_rawBytes;
+   size_t                     m_listSize;
+   size_t                     m_blocksPerList;
+   std::vector<CplBlockInfo>  m_blocks;
+};
+
+#endif // __COMPRESSED_LIST_H__
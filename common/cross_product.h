@@ -0,0 +1,243 @@
+//****************************************************************************
+/// @file cross_product.h
+/// @brief RFC-style cross-product tables for lane pairs with few distinct rule sets.
+///
+/// Each lane maps a tree leaf to a sorted rule list (a setData row).  Many
+/// leaves of a lane carry the very same list, so leaves are first reduced to
+/// equivalence classes (one id per distinct list).  For a pair of lanes whose
+/// class counts multiply to something that fits the memory budget, the
+/// intersection of every (classA, classB) combination is computed once and
+/// stored as a class of its own; merge() then replaces two list walks by
+/// two array loads.  This is phase 1 of Recursive Flow Classification
+/// (Gupta & McKeown) applied to the decomposed lanes of this classifier.
+//****************************************************************************
+#ifndef __CROSS_PRODUCT_H__
+#define __CROSS_PRODUCT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "rule_dedup.h"
+
+typedef unsigned short int bt16bitInt;
+
+/// @brief Distinct sorted rule lists, each identified by a dense class id.
+class RuleListPool
+{
+public:
+   /// Class id of a list, adding it if it is new.
+   unsigned intern(const bt16bitInt *list, size_t n)
+   {
+      uint64_t                 h  = ruleListHash(list, n);
+      std::vector<unsigned>   &ids = m_byHash[h];
+      for ( size_t i = 0; i < ids.size(); i++ ) {
+         if ( size(ids[i]) == n && (0 == n || 0 == memcmp(data(ids[i]), list, n * sizeof(bt16bitInt))) ) {
+            return ids[i];
+         }
+      }
+      unsigned id = (unsigned)m_offset.size();
+      m_offset.push_back(m_data.size());
+      m_size.push_back((unsigned)n);
+      if ( n ) {
+         m_data.insert(m_data.end(), list, list + n);
+      }
+      ids.push_back(id);
+      return id;
+   }
+
+   size_t             numClasses()       const { return m_offset.size(); }
+   const bt16bitInt * data(unsigned id)  const { return m_size[id] ? &m_data[m_offset[id]] : NULL; }
+   size_t             size(unsigned id)  const { return m_size[id]; }
+   size_t             bytes()            const { return m_data.size() * sizeof(bt16bitInt) +
+                                                        m_offset.size() * (sizeof(size_t) + sizeof(unsigned)); }
+
+   void clear()
+   {
+      m_data.clear();
+      m_offset.clear();
+      m_size.clear();
+      m_byHash.clear();
+   }
+
+private:
+   std::vector<bt16bitInt>                       m_data;
+   std::vector<size_t>                           m_offset;
+   std::vector<unsigned>                         m_size;
+   std::map<uint64_t, std::vector<unsigned> >    m_byHash;
+};
+
+/// @brief Leaf -> equivalence class of one lane.
+///
+/// Classes refer to a representative setData row rather than copying it.
+class LaneClasses
+{
+public:
+   LaneClasses() : m_rows(NULL), m_listSize(0) {}
+
+   void build(bt16bitInt **rows, int numLeaves, int listSize)
+   {
+      m_rows     = rows;
+      m_listSize = listSize;
+      ruleListIds(rows, numLeaves, listSize, m_classOf, &m_rep);
+   }
+
+   unsigned           classOf(int leaf)    const { return m_classOf[leaf]; }
+   size_t             numClasses()         const { return m_rep.size(); }
+   const bt16bitInt * list(unsigned cls)   const { return m_rows[m_rep[cls]]; }
+   size_t             listSize()           const { return m_listSize; }
+
+private:
+   bt16bitInt          **m_rows;
+   size_t                m_listSize;
+   std::vector<unsigned> m_classOf;   ///< Class of each leaf
+   std::vector<size_t>   m_rep;       ///< Representative leaf of each class
+};
+
+/// @brief Precomputed intersections of all class combinations of two lanes.
+class CrossProductTable
+{
+public:
+   CrossProductTable() : m_laneA(-1), m_laneB(-1), m_numB(0) {}
+
+   /// Build the table; false if it would not fit budgetBytes.
+   bool build(int laneA, const LaneClasses &a, int laneB, const LaneClasses &b, size_t budgetBytes)
+   {
+      size_t na = a.numClasses();
+      size_t nb = b.numClasses();
+      if ( na * nb * sizeof(unsigned) > budgetBytes ) {
+         return false;
+      }
+      m_laneA = laneA;
+      m_laneB = laneB;
+      m_numB  = nb;
+      m_table.assign(na * nb, 0);
+      m_results.clear();
+
+      std::vector<bt16bitInt> tmp;
+      for ( size_t ca = 0; ca < na; ca++ ) {
+         const bt16bitInt *la = a.list((unsigned)ca);
+         size_t            sa = a.listSize();
+         for ( size_t cb = 0; cb < nb; cb++ ) {
+            const bt16bitInt *lb = b.list((unsigned)cb);
+            size_t            sb = b.listSize();
+            tmp.resize(std::min(sa, sb));
+            size_t n = std::set_intersection(la, la + sa, lb, lb + sb, tmp.begin()) - tmp.begin();
+            m_table[ca * nb + cb] = m_results.intern(tmp.empty() ? NULL : &tmp[0], n);
+         }
+         if ( bytes() > budgetBytes ) {
+            m_table.clear();
+            m_results.clear();
+            return false;
+         }
+      }
+      return true;
+   }
+
+   int laneA() const { return m_laneA; }
+   int laneB() const { return m_laneB; }
+
+   /// Intersection of the two lanes' lists for a pair of classes.
+   void lookup(unsigned classA, unsigned classB, const bt16bitInt *&list, size_t &n) const
+   {
+      unsigned id = m_table[classA * m_numB + classB];
+      list = m_results.data(id);
+      n    = m_results.size(id);
+   }
+
+   size_t bytes() const { return m_table.size() * sizeof(unsigned) + m_results.bytes(); }
+
+private:
+   int                   m_laneA;
+   int                   m_laneB;
+   size_t                m_numB;
+   std::vector<unsigned> m_table;     ///< classA * numB + classB -> result class
+   RuleListPool          m_results;
+};
+
+/// @brief Pair selection and lookup for all lanes of a rule set.
+///
+/// Lanes are paired greedily, smallest class-count product first, each lane
+/// in at most one pair and only with a lane of the same group, until the
+/// memory budget or the pair limit is used up.  A pair may join lanes of
+/// different fields; groups only keep apart lanes that must be merged
+/// separately.  Lanes that end up unpaired are merged from their lists as
+/// before.
+class CrossProductStage
+{
+public:
+   CrossProductStage() : m_bytes(0) {}
+
+   /// @param rows       setData: row lane * numLeaves + leaf
+   /// @param group      Group of each lane, -1 if it may not be paired
+   /// @param maxPairs   Most tables to build
+   void build(bt16bitInt **rows, int numLanes, int numLeaves, int listSize,
+              const std::vector<int> &group, size_t budgetBytes, int maxPairs)
+   {
+      m_classes.assign(numLanes, LaneClasses());
+      m_tables.clear();
+      m_pairOf.assign(numLanes, -1);
+      m_bytes = 0;
+
+      #pragma omp parallel for schedule(dynamic, 1)
+      for ( int lane = 0; lane < numLanes; lane++ ) {
+         if ( group[lane] >= 0 ) {
+            m_classes[lane].build(rows + (size_t)lane * numLeaves, numLeaves, listSize);
+         }
+      }
+
+      std::vector< std::pair<double, std::pair<int, int> > > cand;
+      for ( int a = 0; a < numLanes; a++ ) {
+         for ( int b = a + 1; b < numLanes; b++ ) {
+            if ( group[a] >= 0 && group[a] == group[b] ) {
+               double cost = (double)m_classes[a].numClasses() * m_classes[b].numClasses();
+               cand.push_back(std::make_pair(cost, std::make_pair(a, b)));
+            }
+         }
+      }
+      std::sort(cand.begin(), cand.end());
+
+      for ( size_t i = 0; i < cand.size() && numPairs() < maxPairs; i++ ) {
+         int a = cand[i].second.first;
+         int b = cand[i].second.second;
+         if ( m_pairOf[a] >= 0 || m_pairOf[b] >= 0 ) {
+            continue;
+         }
+         if ( cand[i].first * sizeof(unsigned) > (double)(budgetBytes - m_bytes) ) {
+            break;                        // sorted: no later pair fits either
+         }
+         CrossProductTable t;
+         if ( t.build(a, m_classes[a], b, m_classes[b], budgetBytes - m_bytes) ) {
+            m_bytes += t.bytes();
+            m_pairOf[a] = m_pairOf[b] = (int)m_tables.size();
+            m_tables.push_back(t);
+         }
+      }
+   }
+
+   int    numPairs() const { return (int)m_tables.size(); }
+   size_t bytes()    const { return m_bytes; }
+
+   const CrossProductTable & pair(int p) const { return m_tables[p]; }
+
+   /// Table index covering a lane, or -1.
+   int pairOf(int lane) const { return (lane < (int)m_pairOf.size()) ? m_pairOf[lane] : -1; }
+
+   /// Pre-intersected list of a pair for the leaves of its two lanes.
+   void lookup(int p, int leafA, int leafB, const bt16bitInt *&list, size_t &n) const
+   {
+      const CrossProductTable &t = m_tables[p];
+      t.lookup(m_classes[t.laneA()].classOf(leafA), m_classes[t.laneB()].classOf(leafB), list, n);
+   }
+
+private:
+   std::vector<LaneClasses>       m_classes;
+   std::vector<CrossProductTable> m_tables;
+   std::vector<int>               m_pairOf;
+   size_t                         m_bytes;
+};
+
+#endif // __CROSS_PRODUCT_H__
@@ -0,0 +1,180 @@
+//****************************************************************************
+/// @file field_layout.h
+/// @brief Wide header fields split into 16-bit tree lanes.
+///
+/// Every tree (tree.v, HelloSPLLBApp::lookup) compares a 16-bit key, so a
+/// 32-bit IPv4 or 128-bit IPv6 address is looked up as 2 or 8 independent
+/// chunks, one lane each.  A rule matches the field only if it is in the rule
+/// set of every chunk, so the merge intersects the lanes of one field first
+/// and then intersects the fields.  FieldLayout records which lanes belong to
+/// which field and where each lane sits in the packet's cache lines.
+///
+/// Lanes are numbered chunk-major across fields (chunk 0 of every field, then
+/// chunk 1, ...).  With 8 AFU cores per line this spreads the chunks of one
+/// address over different tree cores instead of stacking them on one line.
+//****************************************************************************
+#ifndef __FIELD_LAYOUT_H__
+#define __FIELD_LAYOUT_H__
+
+#include <vector>
+
+#define FL_MAX_FIELDS               16
+#define FL_MAX_LANES                64
+#define FL_MAX_FIELD_BITS           128
+
+// Field layout presets
+#define FL_PRESET_IPV4              0    // 32-bit addresses, ports, protocol and extra header fields
+#define FL_PRESET_IPV6              1    // 128-bit addresses, ports, protocol
+
+/// @brief Header fields that can be classified on.
+enum PacketField {
+   PF_NONE = 0,
+   PF_SRC_IP,         ///< 32 bits: IPv4 address; 128 bits: IPv6 (IPv4-mapped for v4 packets)
+   PF_DST_IP,
+   PF_SRC_PORT,
+   PF_DST_PORT,
+   PF_PROTO,
+   PF_TOS,
+   PF_TTL,
+   PF_TCP_FLAGS,
+   PF_VLAN,
+   PF_ETH_TYPE,
+   PF_LENGTH
+};
+
+/// @brief Field to lane assignment of one classifier configuration.
+class FieldLayout
+{
+public:
+   /// @param lanesPerLine  16 for both the sw_app line format and afu_user.v
+   ///                      (8 cores of two trees), see pcap_reader.h.
+   FieldLayout(int lanesPerLine) :
+      m_lanesPerLine(lanesPerLine),
+      m_linesPerPacket(1)
+   {}
+
+   /// Add a field.  Width is rounded up to a multiple of 16 bits.
+   /// @return Field index, or -1 if the field or lane budget is exhausted.
+   int addField(int field, int widthBits)
+   {
+      int chunks = (widthBits + 15) / 16;
+      if ( chunks < 1 || widthBits > FL_MAX_FIELD_BITS ||
+           (int)m_fieldId.size() >= FL_MAX_FIELDS ||
+           numLanes() + chunks > FL_MAX_LANES ) {
+         return -1;
+      }
+      m_fieldId.push_back(field);
+      m_fieldChunks.push_back(chunks);
+      m_fieldLanes.push_back(std::vector<int>(chunks, -1));
+      place();
+      return (int)m_fieldId.size() - 1;
+   }
+
+   /// Replace the configuration by one of the FL_PRESET_* layouts.
+   void preset(int which)
+   {
+      clear();
+      if ( FL_PRESET_IPV6 == which ) {
+         addField(PF_SRC_IP,   128);
+         addField(PF_DST_IP,   128);
+         addField(PF_SRC_PORT, 16);
+         addField(PF_DST_PORT, 16);
+         addField(PF_PROTO,    16);
+      } else {
+         addField(PF_SRC_IP,   32);
+         addField(PF_DST_IP,   32);
+         addField(PF_SRC_PORT, 16);
+         addField(PF_DST_PORT, 16);
+         addField(PF_PROTO,    16);
+         // remaining lanes of the first line carry secondary header fields
+         static const int extra[] = { PF_TOS, PF_TCP_FLAGS, PF_VLAN, PF_ETH_TYPE, PF_LENGTH, PF_TTL };
+         for ( unsigned e = 0; e < sizeof(extra) / sizeof(extra[0]) && numLanes() < m_lanesPerLine; e++ ) {
+            addField(extra[e], 16);
+         }
+      }
+   }
+
+   void clear()
+   {
+      m_fieldId.clear();
+      m_fieldChunks.clear();
+      m_fieldLanes.clear();
+      m_laneField.clear();
+      m_laneChunk.clear();
+      m_linesPerPacket = 1;
+   }
+
+   int numFields()      const { return (int)m_fieldId.size(); }
+   int numLanes()       const { return (int)m_laneField.size(); }
+   int lanesPerLine()   const { return m_lanesPerLine; }
+   int linesPerPacket() const { return m_linesPerPacket; }
+
+   int fieldId(int f)        const { return m_fieldId[f]; }
+   int fieldChunks(int f)    const { return m_fieldChunks[f]; }
+   int fieldBits(int f)      const { return 16 * m_fieldChunks[f]; }
+
+   /// Fields every packet of a flow carries unchanged (addresses, ports,
+   /// protocol, VLAN, EtherType), one bit per field index.
+   unsigned flowFields() const
+   {
+      unsigned mask = 0;
+      for ( int f = 0; f < numFields(); f++ ) {
+         switch ( m_fieldId[f] ) {
+         case PF_SRC_IP: case PF_DST_IP: case PF_SRC_PORT: case PF_DST_PORT:
+         case PF_PROTO:  case PF_VLAN:   case PF_ETH_TYPE:
+            mask |= 1u << f;
+            break;
+         default:
+            break;
+         }
+      }
+      return mask;
+   }
+
+   /// Lanes of a field, most significant chunk first.
+   const std::vector<int> & fieldLanes(int f) const { return m_fieldLanes[f]; }
+
+   int laneField(int lane) const { return m_laneField[lane]; }
+   int laneChunk(int lane) const { return m_laneChunk[lane]; }
+
+   /// Cache line of the packet (0..linesPerPacket-1) and slot in it holding a lane.
+   int laneLine(int lane) const { return lane / m_lanesPerLine; }
+   int laneSlot(int lane) const { return lane % m_lanesPerLine; }
+
+private:
+   // chunk-major numbering: lane n holds chunk c of field f in round-robin order
+   void place()
+   {
+      int maxChunks = 0;
+      for ( int f = 0; f < numFields(); f++ ) {
+         if ( m_fieldChunks[f] > maxChunks ) {
+            maxChunks = m_fieldChunks[f];
+         }
+      }
+      m_laneField.clear();
+      m_laneChunk.clear();
+      for ( int c = 0; c < maxChunks; c++ ) {
+         for ( int f = 0; f < numFields(); f++ ) {
+            if ( c < m_fieldChunks[f] ) {
+               m_fieldLanes[f][c] = (int)m_laneField.size();
+               m_laneField.push_back(f);
+               m_laneChunk.push_back(c);
+            }
+         }
+      }
+      m_linesPerPacket = (numLanes() + m_lanesPerLine - 1) / m_lanesPerLine;
+      if ( m_linesPerPacket < 1 ) {
+         m_linesPerPacket = 1;
+      }
+   }
+
+   int                             m_lanesPerLine;
+   int                             m_linesPerPacket;
+   std::vector<int>                m_fieldId;       ///< PacketField of each field index
+   std::vector<int>                m_fieldChunks;   ///< 16-bit chunks of each field
+   std::vector< std::vector<int> > m_fieldLanes;    ///< Lane of each chunk of each field
+   std::vector<int>                m_laneField;     ///< Field index of each lane
+   std::vector<int>                m_laneChunk;     ///< Chunk number of each lane
+};
+
+#endif // __FIELD_LAYOUT_H__
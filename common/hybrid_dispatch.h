@@ -0,0 +1,399 @@
+//****************************************************************************
+/// @file hybrid_dispatch.h
+/// @brief CPU SIMD tree walk and AFU/CPU block dispatch for the lookup stage.
+///
+/// The workspace is cut into blocks.  Each transaction splits them once:
+/// the AFU is started over the first afuBlocks only and the merge loop
+/// claims them from the front as their output arrives; CPU workers claim
+/// the disjoint tail from the back with TreeWalkEngine, which writes output
+/// lines in the AFU's format so the merge stage cannot tell the two apart.
+/// No output line is written by both engines.
+///
+/// Per-engine throughput is kept as an EWMA across transactions and sizes
+/// the next split; while there is no history the CPU gets a probe share so
+/// both rates get measured.
+//****************************************************************************
+#ifndef __HYBRID_DISPATCH_H__
+#define __HYBRID_DISPATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <emmintrin.h>
+#include "afu_output.h"
+
+typedef unsigned short int bt16bitInt;
+
+#define HD_EWMA_WEIGHT              0.25     // weight of the newest throughput sample
+#define HD_CPU_PROBE_BLOCKS         2        // blocks per CPU worker while no rate is known
+#define HD_AFU_LANES                16       // keys per AFU input line, words 0..15
+#define HD_AFU_IDX_WORD             16       // start-index bits of the 16 keys
+#define HD_WALK16_LEVELS            14       // levels whose indices fit 16-bit lanes (3*2^n-2)
+
+/// @brief Eight tree walks at once in SSE2 registers.
+///
+/// Same walk as the host lookup(): start at the index bit, go to 2i+1 when
+/// the key is below the node and 2i+2 otherwise.  Node loads are masked to
+/// the level width.  Indices outgrow 16 bits after HD_WALK16_LEVELS levels;
+/// deeper trees finish in 32-bit lanes and report the low 16 bits of the
+/// leaf, which is all the merge's leaf % num_setgroup looks at.
+///
+/// When the AFU holds only the top levels (its index bits are below the
+/// host depth) finishAfuRows() walks the spilled levels for AFU blocks,
+/// starting from the AFU's indices.
+class TreeWalkEngine
+{
+public:
+   TreeWalkEngine() : m_levels(NULL), m_depth(0), m_mask(0), m_afuLevels(0),
+                      m_lists(NULL), m_numLists(0), m_listSize(0) {}
+
+   /// @param levels  levels[i][node], each level width entries
+   void init(bt16bitInt **levels, int depth, unsigned width)
+   {
+      m_levels = levels;
+      m_depth  = depth;
+      m_mask   = width - 1;
+      m_afuLevels = depth;
+   }
+
+   /// Levels the AFU walks itself; the rest are spilled to finishAfuRows().
+   void setAfuLevels(int levels) { m_afuLevels = std::min(std::max(levels, 0), m_depth); }
+   int  spillLevels() const      { return m_depth - m_afuLevels; }
+
+   /// Leaf indices of 8 keys.
+   __m128i walk8(__m128i keys, __m128i idx) const
+   {
+      return walkFrom8(keys, idx, 0);
+   }
+
+   /// Levels [from, depth) of 8 walks that have already done levels [0, from).
+   __m128i walkFrom8(__m128i keys, __m128i idx, int from) const
+   {
+      const int mid = std::min(m_depth, HD_WALK16_LEVELS);
+      if ( from < mid ) {
+         idx = walk16(keys, idx, from, mid);
+      }
+      if ( m_depth > mid ) {
+         const __m128i zero = _mm_setzero_si128();
+         __m128i lo = walk32(_mm_unpacklo_epi16(keys, zero), _mm_unpacklo_epi16(idx, zero), std::max(from, mid));
+         __m128i hi = walk32(_mm_unpackhi_epi16(keys, zero), _mm_unpackhi_epi16(idx, zero), std::max(from, mid));
+         // low 16 bits of each lane, packs saturates so sign-extend them first
+         lo  = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+         hi  = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+         idx = _mm_packs_epi32(lo, hi);
+      }
+      return idx;
+   }
+
+   /// Finish the AFU's rows of input lines [first, last) in place: levels
+   /// the AFU does not hold, from its indices and the keys in src.
+   void finishAfuRows(const bt16bitInt *src, bt16bitInt *dst, size_t first, size_t last) const
+   {
+      if ( m_afuLevels >= m_depth || m_outFmt.isMatch() ) {   // MATCH rows hold rule ids
+         return;
+      }
+      for ( size_t i = first; i < last; i++ ) {
+         bt16bitInt *row = m_outFmt.row(dst, i);
+         for ( int h = 0; h < 2; h++ ) {
+            __m128i keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32 * i + 8 * h));
+            __m128i idx  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 8 * h));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(row + 8 * h), walkFrom8(keys, idx, m_afuLevels));
+         }
+      }
+   }
+
+   /// One AFU-layout input line (keys in words 0..15, index bits in word 16)
+   /// to its 16 leaf indices.  The AFU walks keys 0..7 and 8..15 on the two
+   /// BRAM ports of each tree core; here they are two walk8() calls.
+   void walkAfuLine(const bt16bitInt *in, bt16bitInt *out16) const
+   {
+      __m128i sel  = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+      for ( int h = 0; h < 2; h++ ) {
+         __m128i keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 8 * h));
+         __m128i bits = _mm_and_si128(_mm_set1_epi16((short)(in[HD_AFU_IDX_WORD] >> (8 * h))), sel);
+         __m128i idx  = _mm_srli_epi16(_mm_cmpeq_epi16(bits, sel), 15);
+         _mm_storeu_si128(reinterpret_cast<__m128i *>(out16 + 8 * h), walk8(keys, idx));
+      }
+   }
+
+   /// Rows of input lines [first, last) in the AFU's negotiated output format
+   /// (see afu_output.h): SPARSE pads words 16..31 of every line with 0x1313,
+   /// DENSE rows are back to back, MATCH rows hold the packets' best rules.
+   void afuOutputLines(const bt16bitInt *src, size_t numInLines, bt16bitInt *dst,
+                       size_t first, size_t last) const
+   {
+      if ( m_outFmt.isMatch() ) {
+         matchOutputLines(src, numInLines, dst, first, last);
+         return;
+      }
+      for ( size_t i = first; i < last; i++ ) {
+         bt16bitInt *line = m_outFmt.row(dst, i);
+         if ( i < numInLines ) {
+            walkAfuLine(src + 32 * i, line);
+         } else {
+            memset(line, 0, HD_AFU_LANES * sizeof(bt16bitInt));
+         }
+         if ( !m_outFmt.isDense() ) {
+            for ( int w = HD_AFU_LANES; w < 32; w++ ) {
+               line[w] = AFU_OUT_PAD;
+            }
+         }
+      }
+   }
+
+   /// Input lines of [first, last) whose MATCH row in afuOut differs from
+   /// firstCommonRule() over the host's lists, i.e. where the AFU's match
+   /// stage and the host disagree.
+   size_t matchMismatches(const bt16bitInt *src, size_t numInLines, const bt16bitInt *afuOut,
+                          size_t first, size_t last) const
+   {
+      bt16bitInt rules[HD_AFU_LANES];
+      size_t     bad = 0;
+      for ( size_t i = first; i < last && i < numInLines && NULL != m_lists; i++ ) {
+         int n = matchLine(src + 32 * i, rules);
+         bad += (0 != memcmp(m_outFmt.row(afuOut, i), rules, n * sizeof(bt16bitInt)));
+      }
+      return bad;
+   }
+
+   /// Test vectors of the AFU tree cores (rtl/afu2/tb_tree.v, $readmemh):
+   /// one text line per input line of src, most significant word first:
+   /// the leaf indices a tree of afuLevels levels gives the 16 keys (words
+   /// 32..17, afuLevels bits each), the index bits (word 16), the keys.
+   /// The levels must hold the AFU's tables (loadTreeInitFiles()).
+   bool writeAfuVectors(const char *path, const bt16bitInt *src, size_t numLines, int afuLevels) const
+   {
+      if ( afuLevels < 1 || afuLevels > m_depth ) {
+         return false;
+      }
+      FILE *f = fopen(path, "w");
+      if ( NULL == f ) {
+         return false;
+      }
+      TreeWalkEngine afu;
+      bt16bitInt     leaf[HD_AFU_LANES];
+      const unsigned mask = (1u << afuLevels) - 1;
+      afu.init(m_levels, afuLevels, m_mask + 1);
+      for ( size_t i = 0; i < numLines; i++ ) {
+         const bt16bitInt *in = src + 32 * i;
+         afu.walkAfuLine(in, leaf);
+         for ( int w = HD_AFU_LANES - 1; w >= 0; w-- ) {
+            fprintf(f, "%04x", leaf[w] & mask);
+         }
+         for ( int w = HD_AFU_IDX_WORD; w >= 0; w-- ) {
+            fprintf(f, "%04x", in[w]);
+         }
+         fprintf(f, "\n");
+      }
+      return 0 == fclose(f);
+   }
+
+   /// Format the AFU accepted for this transaction; CPU blocks must match it.
+   void setOutputFormat(const AfuOutputFormat &fmt) { m_outFmt = fmt; }
+   const AfuOutputFormat & outputFormat() const     { return m_outFmt; }
+
+   /// Rule lists of the MATCH format, leaf l uses lists[l % numLists] like
+   /// the host merge.
+   void setRuleLists(bt16bitInt *const *lists, size_t numLists, int listSize)
+   {
+      m_lists    = lists;
+      m_numLists = numLists;
+      m_listSize = listSize;
+   }
+
+private:
+   /// Levels [from, to) in 16-bit lanes.
+   __m128i walk16(__m128i keys, __m128i idx, int from, int to) const
+   {
+      const __m128i bias = _mm_set1_epi16((short)0x8000);
+      const __m128i two  = _mm_set1_epi16(2);
+      __m128i       k    = _mm_xor_si128(keys, bias);       // unsigned compare via signed
+      bt16bitInt    lane[8] __attribute__((aligned(16)));
+
+      for ( int i = from; i < to; i++ ) {
+         _mm_store_si128(reinterpret_cast<__m128i *>(lane), idx);
+         const bt16bitInt *level = m_levels[i];
+         __m128i node = _mm_set_epi16((short)level[lane[7] & m_mask], (short)level[lane[6] & m_mask],
+                                      (short)level[lane[5] & m_mask], (short)level[lane[4] & m_mask],
+                                      (short)level[lane[3] & m_mask], (short)level[lane[2] & m_mask],
+                                      (short)level[lane[1] & m_mask], (short)level[lane[0] & m_mask]);
+         __m128i lt   = _mm_cmplt_epi16(k, _mm_xor_si128(node, bias));   // -1 where key < node
+         idx = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(idx, idx), two), lt);
+      }
+      return idx;
+   }
+
+   /// Levels [from, depth) of 4 zero-extended keys in 32-bit lanes.
+   __m128i walk32(__m128i keys, __m128i idx, int from) const
+   {
+      const __m128i two = _mm_set1_epi32(2);
+      uint32_t      lane[4] __attribute__((aligned(16)));
+
+      for ( int i = from; i < m_depth; i++ ) {
+         _mm_store_si128(reinterpret_cast<__m128i *>(lane), idx);
+         const bt16bitInt *level = m_levels[i];
+         __m128i node = _mm_set_epi32(level[lane[3] & m_mask], level[lane[2] & m_mask],
+                                      level[lane[1] & m_mask], level[lane[0] & m_mask]);
+         __m128i lt   = _mm_cmplt_epi32(keys, node);     // both below 2^16, signed compare is exact
+         idx = _mm_add_epi32(_mm_add_epi32(_mm_add_epi32(idx, idx), two), lt);
+      }
+      return idx;
+   }
+
+   void matchOutputLines(const bt16bitInt *src, size_t numInLines, bt16bitInt *dst,
+                         size_t first, size_t last) const
+   {
+      for ( size_t i = first; i < last; i++ ) {
+         bt16bitInt *row = m_outFmt.row(dst, i);
+         if ( i >= numInLines || NULL == m_lists ) {
+            memset(row, 0xff, m_outFmt.rowWords() * sizeof(bt16bitInt));
+            continue;
+         }
+         matchLine(src + 32 * i, row);
+      }
+   }
+
+   /// Best rule of each packet of one input line; returns the packets per line.
+   int matchLine(const bt16bitInt *in, bt16bitInt *rules) const
+   {
+      const int          lanes = m_outFmt.matchLanes ? (int)m_outFmt.matchLanes : 1;
+      bt16bitInt         leaf[HD_AFU_LANES] __attribute__((aligned(16)));
+      const bt16bitInt  *pkt[HD_AFU_LANES];
+
+      walkAfuLine(in, leaf);
+      for ( int p = 0; p < HD_AFU_LANES / lanes; p++ ) {
+         for ( int l = 0; l < lanes; l++ ) {
+            pkt[l] = m_lists[leaf[lanes * p + l] % m_numLists];
+         }
+         rules[p] = firstCommonRule(pkt, lanes, m_listSize);
+      }
+      return HD_AFU_LANES / lanes;
+   }
+
+   bt16bitInt **m_levels;
+   int          m_depth;
+   unsigned     m_mask;
+   int          m_afuLevels;
+   AfuOutputFormat m_outFmt;
+   bt16bitInt *const *m_lists;
+   size_t       m_numLists;
+   int          m_listSize;
+};
+
+/// @brief AFU/CPU block split, claiming and per-engine throughput.
+class HybridDispatcher
+{
+public:
+   enum { ENGINE_AFU = 0, ENGINE_CPU = 1, NUM_ENGINES = 2 };
+
+   HybridDispatcher() : m_front(0), m_back(0), m_numBlocks(0), m_afuBlocks(0), m_afuAvailable(true)
+   {
+      m_rate[ENGINE_AFU] = m_rate[ENGINE_CPU] = 0.0;
+   }
+
+   /// Start a transaction over numBlocks blocks, [0, afuBlocks) the AFU's
+   /// and the rest the CPU's.
+   void reset(unsigned numBlocks, unsigned afuBlocks)
+   {
+      m_numBlocks = numBlocks;
+      m_afuBlocks = std::min(afuBlocks, numBlocks);
+      m_front     = 0;
+      m_back      = numBlocks;
+      m_done.assign(numBlocks, 0);
+      m_produced[ENGINE_AFU] = m_produced[ENGINE_CPU] = 0;
+   }
+
+   unsigned numBlocks() const { return m_numBlocks; }
+
+   /// AFU usable at all (service allocated, not being reconfigured).
+   void setAfuAvailable(bool on) { m_afuAvailable = on; }
+   bool afuAvailable() const     { return m_afuAvailable; }
+
+   /// Blocks to hand the next AFU transaction: its share of the measured
+   /// combined throughput, rounded to nearest; without history all but
+   /// HD_CPU_PROBE_BLOCKS per CPU worker (at most half of them).  The AFU
+   /// keeps at least one block and the CPU its probe share, so neither rate
+   /// goes stale.
+   unsigned afuBlocks(unsigned numBlocks, unsigned cpuWorkers) const
+   {
+      if ( !m_afuAvailable ) {
+         return 0;
+      }
+      const unsigned probe = std::min(numBlocks / 2, cpuWorkers * HD_CPU_PROBE_BLOCKS);
+      unsigned       n     = numBlocks - probe;
+      if ( m_rate[ENGINE_AFU] > 0.0 && m_rate[ENGINE_CPU] > 0.0 ) {
+         double share = m_rate[ENGINE_AFU] / (m_rate[ENGINE_AFU] + m_rate[ENGINE_CPU]);
+         n = std::min(n, std::max(1u, (unsigned)(share * numBlocks + 0.5)));
+      }
+      return n;
+   }
+
+   /// Claim the lowest unclaimed AFU block, -1 once the AFU's share is out.
+   int claimFront()
+   {
+      for ( ;; ) {
+         unsigned f = m_front;
+         if ( f >= m_afuBlocks ) {
+            return -1;
+         }
+         if ( __sync_bool_compare_and_swap(&m_front, f, f + 1) ) {
+            return (int)f;
+         }
+      }
+   }
+
+   /// Claim the highest unclaimed CPU block for a worker, -1 once the tail
+   /// is out.
+   int claimBack()
+   {
+      for ( ;; ) {
+         unsigned b = m_back;
+         if ( b <= m_afuBlocks ) {
+            return -1;
+         }
+         if ( __sync_bool_compare_and_swap(&m_back, b, b - 1) ) {
+            return (int)(b - 1);
+         }
+      }
+   }
+
+   /// Block finished by an engine; the merge stage may consume it.
+   void blockDone(unsigned block, int engine)
+   {
+      __sync_fetch_and_add(&m_produced[engine], 1);
+      __sync_synchronize();
+      m_done[block] = (unsigned char)(1 + engine);
+   }
+
+   /// 0 = not ready, else 1 + engine that produced it.
+   int blockReady(unsigned block) const { return *(volatile const unsigned char *)&m_done[block]; }
+
+   unsigned produced(int engine) const { return m_produced[engine]; }
+
+   /// Fold one transaction's throughput (blocks per second) into the EWMA.
+   void recordRate(int engine, double blocks, double seconds)
+   {
+      if ( seconds <= 0.0 || blocks <= 0.0 ) {
+         return;
+      }
+      double r = blocks / seconds;
+      m_rate[engine] = (m_rate[engine] > 0.0) ? (1.0 - HD_EWMA_WEIGHT) * m_rate[engine] + HD_EWMA_WEIGHT * r : r;
+   }
+
+   double rate(int engine) const { return m_rate[engine]; }
+
+private:
+   volatile unsigned          m_front;       ///< Next AFU block
+   volatile unsigned          m_back;        ///< One past the last unclaimed CPU block
+   unsigned                   m_numBlocks;
+   unsigned                   m_afuBlocks;   ///< AFU/CPU boundary of this transaction
+   bool                       m_afuAvailable;
+   std::vector<unsigned char> m_done;
+   unsigned                   m_produced[NUM_ENGINES];
+   double                     m_rate[NUM_ENGINES];
+};
+
+#endif // __HYBRID_DISPATCH_H__
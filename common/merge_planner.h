@@ -0,0 +1,164 @@
+//****************************************************************************
+/// @file merge_planner.h
+/// @brief Online field selectivity statistics and adaptive merge ordering.
+///
+/// The merge intersects the fields into one running candidate set and stops
+/// at the first empty result, so the order in which fields are intersected
+/// decides how much work a rejected packet costs.  MergePlanner counts, per
+/// field, how many candidates are left after it and how often none are, and
+/// periodically re-sorts the fields so the ones expected to leave the fewest
+/// candidates run first.  Counters live in per-thread shards, indexed by the
+/// slot the caller passes, and are folded into exponentially decayed totals
+/// at every re-plan, so the order follows traffic as it shifts.
+///
+/// A "field" here is whatever the caller intersects as one unit; sw_app
+/// plans its merge steps (a cross-product lane pair, or the unpaired lanes
+/// of one header field).
+///
+/// The plan is packed into one 64-bit word (4 bits per step, up to 16 fields)
+/// so merge workers read it with a single load while a re-plan publishes it.
+//****************************************************************************
+#ifndef __MERGE_PLANNER_H__
+#define __MERGE_PLANNER_H__
+
+#include <string.h>
+#include <algorithm>
+
+#define MP_MAX_FIELDS               16
+#define MP_MAX_SHARDS               64
+#define MP_REPLAN_INTERVAL          4096     // packets per shard between re-plans
+
+/// @brief Counters of one worker thread, cache-line aligned.
+struct MergeShardStats {
+   unsigned long long packets;
+   unsigned long long evals[MP_MAX_FIELDS];     ///< Times the field was intersected
+   unsigned long long empties[MP_MAX_FIELDS];   ///< Times it left no candidate
+   unsigned long long sumSize[MP_MAX_FIELDS];   ///< Sum of the candidates it left
+} __attribute__((aligned(64)));
+
+class MergePlanner
+{
+public:
+   MergePlanner(int numFields = 0, unsigned interval = MP_REPLAN_INTERVAL) :
+      m_interval(interval)
+   {
+      reset(numFields);
+   }
+
+   /// Start over with the identity order and no history.
+   void reset(int numFields)
+   {
+      m_numFields = std::min(numFields, MP_MAX_FIELDS);
+      m_plan      = 0;
+      m_replans   = 0;
+      m_busy      = 0;
+      for ( int f = 0; f < m_numFields; f++ ) {
+         m_plan |= (unsigned long long)f << (4 * f);
+      }
+      memset(m_shards, 0, sizeof(m_shards));
+      memset(m_evals,   0, sizeof(m_evals));
+      memset(m_empties, 0, sizeof(m_empties));
+      memset(m_sumSize, 0, sizeof(m_sumSize));
+   }
+
+   int numFields() const { return m_numFields; }
+
+   /// Current order, decode with planStep().
+   unsigned long long plan() const { return *(volatile const unsigned long long *)&m_plan; }
+
+   /// Field processed at a step of a plan.
+   static int planStep(unsigned long long plan, int step) { return (int)((plan >> (4 * step)) & 0xf); }
+
+   /// Record the candidates left after a field (0 = the packet is rejected
+   /// there); shard is the calling thread's slot.
+   void record(int shard, int field, size_t size)
+   {
+      MergeShardStats &s = m_shards[shard % MP_MAX_SHARDS];
+      s.evals[field]++;
+      s.sumSize[field] += size;
+      if ( 0 == size ) {
+         s.empties[field]++;
+      }
+   }
+
+   /// Count one merged packet; re-plans once the shard has seen an interval of packets.
+   void packetDone(int shard)
+   {
+      MergeShardStats &s = m_shards[shard % MP_MAX_SHARDS];
+      if ( ++s.packets >= m_interval ) {
+         s.packets = 0;
+         replan();
+      }
+   }
+
+   /// Fold the shards into the decayed totals and publish a new order.
+   /// Concurrent callers return immediately while another one re-plans.
+   void replan()
+   {
+      if ( !__sync_bool_compare_and_swap(&m_busy, 0, 1) ) {
+         return;
+      }
+      for ( int f = 0; f < m_numFields; f++ ) {
+         m_evals[f]   /= 2;
+         m_empties[f] /= 2;
+         m_sumSize[f] /= 2;
+         for ( int sh = 0; sh < MP_MAX_SHARDS; sh++ ) {
+            MergeShardStats &s = m_shards[sh];
+            m_evals[f]   += s.evals[f];
+            m_empties[f] += s.empties[f];
+            m_sumSize[f] += s.sumSize[f];
+            s.evals[f] = s.empties[f] = s.sumSize[f] = 0;
+         }
+      }
+
+      int order[MP_MAX_FIELDS];
+      for ( int step = 0; step < m_numFields; step++ ) {
+         order[step] = planStep(m_plan, step);
+      }
+      // stable insertion sort keeps the current order among equal fields
+      for ( int i = 1; i < m_numFields; i++ ) {
+         int f = order[i];
+         int j = i - 1;
+         while ( j >= 0 && survivors(f) < survivors(order[j]) ) {
+            order[j + 1] = order[j];
+            j--;
+         }
+         order[j + 1] = f;
+      }
+      unsigned long long plan = 0;
+      for ( int step = 0; step < m_numFields; step++ ) {
+         plan |= (unsigned long long)order[step] << (4 * step);
+      }
+      *(volatile unsigned long long *)&m_plan = plan;
+      m_replans++;
+      __sync_lock_release(&m_busy);
+   }
+
+   /// Fraction of the field's intersections that left no candidate.
+   double emptyRate(int f) const { return m_evals[f] ? (double)m_empties[f] / m_evals[f] : 0.0; }
+
+   /// Mean candidates left after the field.
+   double meanSize(int f) const { return m_evals[f] ? (double)m_sumSize[f] / m_evals[f] : 0.0; }
+
+   unsigned long long replans() const { return m_replans; }
+
+private:
+   // Expected candidates left by the field; fields without history sort last
+   // so they are only promoted once their numbers are known.
+   double survivors(int f) const
+   {
+      return m_evals[f] ? meanSize(f) : 1e30;
+   }
+
+   int                 m_numFields;
+   unsigned            m_interval;
+   unsigned long long  m_plan;
+   unsigned long long  m_replans;
+   volatile int        m_busy;
+   unsigned long long  m_evals[MP_MAX_FIELDS];
+   unsigned long long  m_empties[MP_MAX_FIELDS];
+   unsigned long long  m_sumSize[MP_MAX_FIELDS];
+   MergeShardStats     m_shards[MP_MAX_SHARDS];
+};
+
+#endif // __MERGE_PLANNER_H__
@@ -0,0 +1,422 @@
+//****************************************************************************
+/// @file numa_topology.h
+/// @brief NUMA topology discovery, thread pinning and node-local rule-set arena.
+///
+/// The merge stage reads setData lists at random, so on a multi-socket host
+/// every remote access pays the socket interconnect.  This header discovers
+/// the node layout from sysfs, pins merge workers next to the workspace the
+/// AFU writes to, and keeps the rule lists either replicated per node or
+/// interleaved across nodes.  No libnuma dependency: the two memory policy
+/// syscalls are issued directly and failures fall back to first-touch.
+//****************************************************************************
+#ifndef __NUMA_TOPOLOGY_H__
+#define __NUMA_TOPOLOGY_H__
+
+#include <sched.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <algorithm>
+
+#ifndef NUMA_MAX_NODES
+# define NUMA_MAX_NODES          64
+#endif // NUMA_MAX_NODES
+
+// Memory policy modes and flags from <linux/mempolicy.h>
+#define NUMA_MPOL_PREFERRED      1
+#define NUMA_MPOL_BIND           2
+#define NUMA_MPOL_INTERLEAVE     3
+#define NUMA_MPOL_F_NODE         (1<<0)
+#define NUMA_MPOL_F_ADDR         (1<<1)
+
+// Rule-set placement policies
+#define NUMA_FIRST_TOUCH         0    // single copy, placed by the constructor thread
+#define NUMA_INTERLEAVE          1    // single copy, pages spread round-robin over nodes
+#define NUMA_REPLICATE           2    // one copy per node, workers read the local one
+
+typedef unsigned short int bt16bitInt;
+
+/// @brief Per-node merge counters, padded so each node owns its cache line.
+struct NumaNodeStats {
+   volatile unsigned long long tasks;      ///< Packets merged by workers of this node.
+   volatile unsigned long long listReads;  ///< Rule lists those packets read.
+   volatile unsigned long long localHits;  ///< Reads whose list page is on this node (get_mempolicy).
+   volatile unsigned long long threads;    ///< Workers pinned to this node.
+   unsigned long long          pad[4];
+};
+
+/// @brief Socket/node layout of the host as seen through sysfs.
+class NumaTopology
+{
+public:
+   NumaTopology() { discover(); }
+
+   int numNodes() const { return (int)m_nodeCpus.size(); }
+   int numCpus()  const { return (int)m_cpuNode.size(); }
+
+   const std::vector<int> & cpusOfNode(int node) const { return m_nodeCpus[node]; }
+
+   int nodeOfCpu(int cpu) const
+   {
+      return (cpu >= 0 && cpu < (int)m_cpuNode.size()) ? m_cpuNode[cpu] : 0;
+   }
+
+   /// Kernel node number of a node index (memory-only nodes are not indexed).
+   int nodeId(int node) const { return m_nodeIds[node]; }
+
+   /// Node index currently backing the page at addr, or -1 if the kernel cannot say.
+   int nodeOfAddress(const void *addr) const
+   {
+      int id = -1;
+      if ( 1 == numNodes() ) {
+         return 0;
+      }
+      if ( 0 != syscall(SYS_get_mempolicy, &id, NULL, 0, addr,
+                        NUMA_MPOL_F_NODE | NUMA_MPOL_F_ADDR) ) {
+         return -1;
+      }
+      for ( int n = 0; n < numNodes(); n++ ) {
+         if ( m_nodeIds[n] == id ) {
+            return n;
+         }
+      }
+      return -1;
+   }
+
+   /// CPU list ordered by distance preference: the given node first, then the rest.
+   std::vector<int> cpusNearNode(int node) const
+   {
+      std::vector<int> cpus;
+      if ( node < 0 || node >= numNodes() ) {
+         node = 0;
+      }
+      for ( int n = 0; n < numNodes(); n++ ) {
+         const std::vector<int> &c = m_nodeCpus[(node + n) % numNodes()];
+         cpus.insert(cpus.end(), c.begin(), c.end());
+      }
+      return cpus;
+   }
+
+   /// Pin the calling thread to a single CPU.
+   bool pinCurrentThread(int cpu) const
+   {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      return 0 == sched_setaffinity(0, sizeof(set), &set);
+   }
+
+   /// Pin the calling thread to every CPU of a node; the previous mask is
+   /// left in saved if given.
+   bool bindCurrentThreadToNode(int node, cpu_set_t *saved = NULL) const
+   {
+      cpu_set_t set;
+      if ( NULL != saved && 0 != sched_getaffinity(0, sizeof(*saved), saved) ) {
+         return false;
+      }
+      CPU_ZERO(&set);
+      for ( size_t i = 0; i < m_nodeCpus[node].size(); i++ ) {
+         CPU_SET(m_nodeCpus[node][i], &set);
+      }
+      return 0 == sched_setaffinity(0, sizeof(set), &set);
+   }
+
+   /// Apply a memory policy to an untouched mapping.  Bit n of mask selects kernel node n.
+   bool setPolicy(void *addr, size_t len, int mode, unsigned long mask) const
+   {
+      if ( 1 == numNodes() ) {
+         return true;
+      }
+      // maxnode counts one past the last valid bit
+      return 0 == syscall(SYS_mbind, addr, len, mode, &mask,
+                          (unsigned long)(8 * sizeof(mask) + 1), 0);
+   }
+
+   unsigned long nodeMask(int node) const { return 1UL << (m_nodeIds[node] % (8 * sizeof(unsigned long))); }
+
+   unsigned long allNodesMask() const
+   {
+      unsigned long mask = 0;
+      for ( int n = 0; n < numNodes(); n++ ) {
+         mask |= nodeMask(n);
+      }
+      return mask;
+   }
+
+private:
+   void discover()
+   {
+      long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+      if ( ncpu < 1 ) {
+         ncpu = 1;
+      }
+      m_cpuNode.assign(ncpu, 0);
+
+      for ( int node = 0; node < NUMA_MAX_NODES; node++ ) {
+         char path[128];
+         snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+         FILE *f = fopen(path, "r");
+         if ( NULL == f ) {
+            break;
+         }
+         std::vector<int> cpus;
+         int lo, hi;
+         char sep;
+         while ( fscanf(f, "%d", &lo) == 1 ) {
+            hi = lo;
+            if ( fscanf(f, "%c", &sep) == 1 && sep == '-' ) {
+               if ( fscanf(f, "%d", &hi) != 1 ) {
+                  hi = lo;
+               }
+               if ( fscanf(f, "%c", &sep) != 1 ) {
+                  sep = '\n';
+               }
+            }
+            for ( int c = lo; c <= hi; c++ ) {
+               cpus.push_back(c);
+               if ( c < ncpu ) {
+                  m_cpuNode[c] = (int)m_nodeCpus.size();
+               }
+            }
+            if ( sep != ',' ) {
+               break;
+            }
+         }
+         fclose(f);
+         if ( !cpus.empty() ) {       // memory-only nodes carry no workers
+            m_nodeCpus.push_back(cpus);
+            m_nodeIds.push_back(node);
+         }
+      }
+
+      if ( m_nodeCpus.empty() ) {     // no sysfs node information: one flat node
+         std::vector<int> cpus;
+         for ( int c = 0; c < ncpu; c++ ) {
+            cpus.push_back(c);
+         }
+         m_nodeCpus.push_back(cpus);
+         m_nodeIds.push_back(0);
+      }
+   }
+
+   std::vector< std::vector<int> > m_nodeCpus;   ///< CPUs of each node with CPUs
+   std::vector<int>                m_nodeIds;    ///< Kernel node number of each index
+   std::vector<int>                m_cpuNode;    ///< Node index of each CPU
+};
+
+
+/// @brief setData storage with a per-node placement policy.
+///
+/// The rule lists live in one flat mapping per copy, and lists(node) hands out
+/// a row table of the same shape as the original bt16bitInt ** setData, so the
+/// merge kernels index it exactly as before.  After compact() rows with equal
+/// contents share one stored list, and only the distinct lists are replicated.
+class RuleSetArena
+{
+public:
+   RuleSetArena() :
+      m_numLists(0),
+      m_listSize(0),
+      m_bytes(0),
+      m_usedBytes(0),
+      m_policy(NUMA_FIRST_TOUCH),
+      m_pageBytes(4096)
+   {
+      memset(m_stats, 0, sizeof(m_stats));
+   }
+
+   ~RuleSetArena() { release(); }
+
+   /// Allocate the primary copy.  The caller fills lists(0) and then calls publish().
+   bool allocate(const NumaTopology &topo, int numLists, int listSize, int policy)
+   {
+      release();
+      m_numLists = numLists;
+      m_listSize = listSize;
+      m_bytes    = (size_t)numLists * listSize * sizeof(bt16bitInt);
+      m_usedBytes = m_bytes;
+      m_policy   = (topo.numNodes() > 1) ? policy : NUMA_FIRST_TOUCH;
+
+      bt16bitInt *base = map(m_bytes);
+      if ( NULL == base ) {
+         return false;
+      }
+      if ( NUMA_INTERLEAVE == m_policy ) {
+         topo.setPolicy(base, m_bytes, NUMA_MPOL_INTERLEAVE, topo.allNodesMask());
+      }
+      m_copies.push_back(base);
+      m_rows.push_back(makeRows(base));
+      return true;
+   }
+
+   /// Keep one copy of each distinct list.  ids[i] is the list id of row i as
+   /// returned by ruleListIds(), numUnique their count.  Call after filling
+   /// lists(0) and before publish(); the freed tail of the mapping goes back
+   /// to the kernel.
+   void compact(const std::vector<unsigned> &ids, size_t numUnique)
+   {
+      if ( m_copies.size() != 1 || ids.size() != (size_t)m_numLists ) {
+         return;
+      }
+      // ids are assigned in order of first appearance, so the first row of id u
+      // is at or after slot u and moving lists down never overwrites a pending one
+      bt16bitInt *base = m_copies[0];
+      unsigned    next = 0;
+      for ( int i = 0; i < m_numLists; i++ ) {
+         if ( ids[i] == next ) {
+            if ( (int)next != i ) {
+               memcpy(base + (size_t)next * m_listSize, base + (size_t)i * m_listSize,
+                      m_listSize * sizeof(bt16bitInt));
+            }
+            next++;
+         }
+      }
+      m_ids       = ids;
+      m_usedBytes = numUnique * m_listSize * sizeof(bt16bitInt);
+
+      long   page = sysconf(_SC_PAGESIZE);
+      size_t keep = (m_usedBytes + page - 1) / page * page;
+      if ( keep < m_bytes ) {
+         madvise(reinterpret_cast<char *>(base) + keep, m_bytes - keep, MADV_DONTNEED);
+      }
+      delete [] m_rows[0];
+      m_rows[0] = makeRows(base);
+   }
+
+   /// Id of the stored list behind a row; equal ids mean equal lists.
+   unsigned listId(int row) const { return m_ids.empty() ? (unsigned)row : m_ids[row]; }
+
+   /// Bytes of list data per copy.
+   size_t bytes() const { return m_usedBytes; }
+
+   /// Make the filled primary copy visible on every node according to the
+   /// policy, then record the node each page of each copy ended up on.
+   void publish(const NumaTopology &topo)
+   {
+      if ( NUMA_REPLICATE == m_policy ) {
+         replicate(topo);
+      }
+      mapPages(topo);
+   }
+
+   /// Row table for the copy closest to a node.
+   bt16bitInt ** lists(int node) const
+   {
+      if ( node < 0 || node >= (int)m_rows.size() ) {
+         node = 0;
+      }
+      return m_rows[node];
+   }
+
+   int  numCopies() const { return (int)m_copies.size(); }
+   int  policy()    const { return m_policy; }
+
+   /// True if the page holding list (a row of any copy) was on the node when
+   /// publish() looked; false if it was elsewhere or the kernel could not say.
+   bool isLocal(int node, const bt16bitInt *list) const
+   {
+      for ( size_t c = 0; c < m_copies.size(); c++ ) {
+         size_t off = (const char *)list - (const char *)m_copies[c];
+         if ( (const char *)list >= (const char *)m_copies[c] && off < m_usedBytes ) {
+            return m_pageNodes[c][off / m_pageBytes] == node;
+         }
+      }
+      return false;
+   }
+
+   NumaNodeStats & stats(int node) { return m_stats[node % NUMA_MAX_NODES]; }
+
+   void resetStats()
+   {
+      for ( int n = 0; n < NUMA_MAX_NODES; n++ ) {
+         m_stats[n].tasks     = 0;
+         m_stats[n].listReads = 0;
+         m_stats[n].localHits = 0;
+      }
+   }
+
+private:
+   void replicate(const NumaTopology &topo)
+   {
+      for ( int node = 1; node < topo.numNodes(); node++ ) {
+         bt16bitInt *copy = map(m_usedBytes);
+         if ( NULL == copy ) {
+            break;                     // out of memory: remaining nodes read copy 0
+         }
+         topo.setPolicy(copy, m_usedBytes, NUMA_MPOL_BIND, topo.nodeMask(node));
+         m_copies.push_back(copy);
+         m_rows.push_back(makeRows(copy));
+      }
+      // One thread per node first-touches its replica.  Iteration n runs on team
+      // thread n, so the calling thread (node 0, the primary copy) is never re-pinned;
+      // the pool threads get their mask back so later parallel regions run anywhere.
+      int nodes = (int)m_copies.size();
+      #pragma omp parallel for num_threads(nodes) schedule(static, 1)
+      for ( int node = 0; node < nodes; node++ ) {
+         if ( node > 0 ) {
+            cpu_set_t saved;
+            bool bound = topo.bindCurrentThreadToNode(node, &saved);
+            memcpy(m_copies[node], m_copies[0], m_usedBytes);
+            if ( bound ) {
+               sched_setaffinity(0, sizeof(saved), &saved);
+            }
+         }
+      }
+   }
+
+   void mapPages(const NumaTopology &topo)
+   {
+      m_pageBytes = sysconf(_SC_PAGESIZE);
+      m_pageNodes.assign(m_copies.size(), std::vector<int>());
+      for ( size_t c = 0; c < m_copies.size(); c++ ) {
+         for ( size_t off = 0; off < m_usedBytes; off += m_pageBytes ) {
+            m_pageNodes[c].push_back(topo.nodeOfAddress((const char *)m_copies[c] + off));
+         }
+      }
+   }
+
+   bt16bitInt * map(size_t bytes)
+   {
+      void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      return (MAP_FAILED == p) ? NULL : reinterpret_cast<bt16bitInt *>(p);
+   }
+
+   bt16bitInt ** makeRows(bt16bitInt *base)
+   {
+      bt16bitInt **rows = new bt16bitInt * [m_numLists];
+      for ( int i = 0; i < m_numLists; i++ ) {
+         rows[i] = base + (size_t)listId(i) * m_listSize;
+      }
+      return rows;
+   }
+
+   void release()
+   {
+      for ( size_t i = 0; i < m_copies.size(); i++ ) {
+         munmap(m_copies[i], i ? m_usedBytes : m_bytes);
+         delete [] m_rows[i];
+      }
+      m_copies.clear();
+      m_rows.clear();
+      m_ids.clear();
+      m_pageNodes.clear();
+   }
+
+   int                         m_numLists;
+   int                         m_listSize;
+   size_t                      m_bytes;       ///< Mapping size of the primary copy
+   size_t                      m_usedBytes;   ///< Distinct lists only, size of the replicas
+   int                         m_policy;
+   std::vector<bt16bitInt *>   m_copies;      ///< One flat block per copy, index = node
+   std::vector<bt16bitInt **>  m_rows;        ///< setData-shaped row table per copy
+   std::vector<unsigned>       m_ids;         ///< Stored list of each row, empty = identity
+   size_t                      m_pageBytes;
+   std::vector< std::vector<int> > m_pageNodes; ///< Node index of each page per copy, -1 unknown
+   NumaNodeStats               m_stats[NUMA_MAX_NODES];
+};
+
+#endif // __NUMA_TOPOLOGY_H__
@@ -0,0 +1,472 @@
+//****************************************************************************
+/// @file pcap_reader.h
+/// @brief pcap/pcapng ingest: parse L3/L4 headers and build AFU input cache lines.
+///
+/// The capture is mmap'ed and indexed by a single pass over the record headers
+/// (a few bytes per packet).  Header parsing and cache-line emission then run
+/// in parallel over packet ranges, writing straight into the workspace source
+/// buffer in the layout the lookup engine expects.  Fields wider than 16 bits
+/// are split into lanes by FieldLayout; a packet whose lanes do not fit one
+/// line occupies FieldLayout::linesPerPacket() consecutive lines.
+///
+///   CL_LAYOUT_SW  : 16 lanes, key j in 16-bit word 31-j, index bit j in
+///                   word 15 bit (15-j)                (sw_app lookup loop)
+///   CL_LAYOUT_AFU : 16 lanes, key k in bits [16k+15:16k], index bit k in
+///                   bit 256+k                          (afu_user.v)
+//****************************************************************************
+#ifndef __PCAP_READER_H__
+#define __PCAP_READER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "field_layout.h"
+
+typedef unsigned short int bt16bitInt;
+
+// Link types we can decode
+#define PCAP_LINKTYPE_ETHERNET      1
+#define PCAP_LINKTYPE_RAW           101
+#define PCAP_LINKTYPE_RAW_BSD       12
+#define PCAP_LINKTYPE_RAW_OPENBSD   14
+#define PCAP_LINKTYPE_LINUX_SLL     113
+
+// Cache-line layouts
+#define CL_LAYOUT_SW                0
+#define CL_LAYOUT_AFU               1
+
+#define CL_LANES_SW                 16
+#define CL_LANES_AFU                16
+
+/// @brief Header fields of one packet, addresses in network byte order.
+struct PacketHeader {
+   unsigned char  ipVersion;      ///< 4, 6, or 0 when the frame carries no IP
+   unsigned char  proto;          ///< IPv4 protocol / IPv6 upper-layer next header
+   unsigned char  tos;            ///< IPv4 TOS / IPv6 traffic class
+   unsigned char  ttl;            ///< IPv4 TTL / IPv6 hop limit
+   unsigned char  tcpFlags;
+   unsigned char  pad[3];
+   bt16bitInt     ethType;
+   bt16bitInt     vlan;           ///< outer VLAN id, 0 if untagged
+   bt16bitInt     srcPort;        ///< L4 ports; ICMP type/code
+   bt16bitInt     dstPort;
+   bt16bitInt     length;         ///< IP total length
+   bt16bitInt     pad2;
+   unsigned char  srcIp[16];      ///< IPv4 uses the first 4 bytes
+   unsigned char  dstIp[16];
+};
+
+inline bt16bitInt rd16be(const unsigned char *p) { return (bt16bitInt)((p[0] << 8) | p[1]); }
+
+/// @brief Decode L2-L4 headers of one captured frame.
+/// @return false if the frame is truncated before the IP header.
+inline bool parsePacket(const unsigned char *p, size_t caplen, int linktype, PacketHeader &h)
+{
+   memset(&h, 0, sizeof(h));
+   size_t     off  = 0;
+   bt16bitInt type = 0;
+
+   switch ( linktype ) {
+      case PCAP_LINKTYPE_ETHERNET :
+         if ( caplen < 14 ) return false;
+         type = rd16be(p + 12);
+         off  = 14;
+         while ( (0x8100 == type || 0x88a8 == type || 0x9100 == type) && caplen >= off + 4 ) {
+            if ( 0 == h.vlan ) {
+               h.vlan = rd16be(p + off) & 0x0fff;
+            }
+            type = rd16be(p + off + 2);
+            off += 4;
+         }
+         break;
+      case PCAP_LINKTYPE_LINUX_SLL :
+         if ( caplen < 16 ) return false;
+         type = rd16be(p + 14);
+         off  = 16;
+         break;
+      case PCAP_LINKTYPE_RAW :
+      case PCAP_LINKTYPE_RAW_BSD :
+      case PCAP_LINKTYPE_RAW_OPENBSD :
+         if ( caplen < 1 ) return false;
+         type = ((p[0] >> 4) == 6) ? 0x86dd : 0x0800;
+         break;
+      default :
+         return false;
+   }
+   h.ethType = type;
+
+   const unsigned char *ip  = p + off;
+   size_t               len = caplen - off;
+   size_t               l4;
+   unsigned char        nh;
+
+   if ( 0x0800 == type ) {
+      if ( len < 20 || (ip[0] >> 4) != 4 ) return false;
+      size_t ihl = (ip[0] & 0x0f) * 4;
+      h.ipVersion = 4;
+      h.tos       = ip[1];
+      h.length    = rd16be(ip + 2);
+      h.ttl       = ip[8];
+      h.proto     = ip[9];
+      memcpy(h.srcIp, ip + 12, 4);
+      memcpy(h.dstIp, ip + 16, 4);
+      if ( rd16be(ip + 6) & 0x1fff ) {
+         return true;                 // non-first fragment: no L4 header
+      }
+      l4 = ihl;
+      nh = h.proto;
+   } else if ( 0x86dd == type ) {
+      if ( len < 40 || (ip[0] >> 4) != 6 ) return false;
+      h.ipVersion = 6;
+      h.tos       = (unsigned char)(((ip[0] & 0x0f) << 4) | (ip[1] >> 4));
+      h.length    = (bt16bitInt)(rd16be(ip + 4) + 40);
+      h.ttl       = ip[7];
+      memcpy(h.srcIp, ip + 8, 16);
+      memcpy(h.dstIp, ip + 24, 16);
+      nh = ip[6];
+      l4 = 40;
+      // walk extension headers up to the upper-layer protocol
+      while ( (0 == nh || 43 == nh || 60 == nh || 44 == nh) && len >= l4 + 8 ) {
+         unsigned char next = ip[l4];
+         if ( 44 == nh ) {
+            if ( rd16be(ip + l4 + 2) & 0xfff8 ) {
+               h.proto = next;
+               return true;           // non-first fragment
+            }
+            l4 += 8;
+         } else {
+            l4 += (ip[l4 + 1] + 1) * 8;
+         }
+         nh = next;
+      }
+      h.proto = nh;
+   } else {
+      return true;                    // not IP: only L2 fields are set
+   }
+
+   const unsigned char *t = ip + l4;
+   switch ( nh ) {
+      case 6 :                        // TCP
+         if ( len >= l4 + 14 ) {
+            h.srcPort  = rd16be(t);
+            h.dstPort  = rd16be(t + 2);
+            h.tcpFlags = t[13];
+         }
+         break;
+      case 17 :                       // UDP
+      case 132 :                      // SCTP
+      case 136 :                      // UDP-Lite
+         if ( len >= l4 + 4 ) {
+            h.srcPort = rd16be(t);
+            h.dstPort = rd16be(t + 2);
+         }
+         break;
+      case 1 :                        // ICMP
+      case 58 :                       // ICMPv6
+         if ( len >= l4 + 2 ) {
+            h.srcPort = t[0];
+            h.dstPort = t[1];
+         }
+         break;
+      default :
+         break;
+   }
+   return true;
+}
+
+/// @brief One 16-bit chunk of a field, chunk 0 being the most significant.
+///
+/// Addresses are 32-bit IPv4 or 128-bit IPv6 depending on the field width;
+/// a 128-bit field of an IPv4 packet holds the IPv4-mapped address.
+inline bt16bitInt packetFieldChunk(const PacketHeader &h, int field, int bits, int chunk)
+{
+   if ( PF_SRC_IP == field || PF_DST_IP == field ) {
+      const unsigned char *a = (PF_SRC_IP == field) ? h.srcIp : h.dstIp;
+      if ( bits > 32 && 4 == h.ipVersion ) {
+         static const unsigned char mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+         return (chunk < 6) ? rd16be(mapped + 2 * chunk) : rd16be(a + 2 * (chunk - 6));
+      }
+      return rd16be(a + 2 * chunk);
+   }
+   if ( chunk != (bits / 16) - 1 ) {
+      return 0;                       // narrow field zero-extended to the configured width
+   }
+   switch ( field ) {
+      case PF_SRC_PORT   : return h.srcPort;
+      case PF_DST_PORT   : return h.dstPort;
+      case PF_PROTO      : return h.proto;
+      case PF_TOS        : return h.tos;
+      case PF_TTL        : return h.ttl;
+      case PF_TCP_FLAGS  : return h.tcpFlags;
+      case PF_VLAN       : return h.vlan;
+      case PF_ETH_TYPE   : return h.ethType;
+      case PF_LENGTH     : return h.length;
+      default            : return 0;
+   }
+}
+
+
+/// @brief Memory-mapped pcap or pcapng capture with a packet index.
+class PcapFile
+{
+public:
+   struct Record {
+      size_t         offset;      ///< Frame start within the file
+      unsigned int   caplen;
+      unsigned short linktype;
+   };
+
+   PcapFile() : m_base(NULL), m_size(0) {}
+   ~PcapFile() { close(); }
+
+   /// Map and index a capture.  Returns false on I/O or format errors.
+   bool open(const char *path)
+   {
+      close();
+      int fd = ::open(path, O_RDONLY);
+      if ( fd < 0 ) {
+         return false;
+      }
+      struct stat st;
+      if ( fstat(fd, &st) != 0 || st.st_size < 24 ) {
+         ::close(fd);
+         return false;
+      }
+      void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+      ::close(fd);
+      if ( MAP_FAILED == p ) {
+         return false;
+      }
+      m_base = reinterpret_cast<const unsigned char *>(p);
+      m_size = st.st_size;
+      madvise(p, m_size, MADV_SEQUENTIAL);
+
+      uint32_t magic = rd32(m_base, false);
+      bool ok = (0x0A0D0D0A == magic) ? indexPcapng() : indexPcap(magic);
+      if ( !ok ) {
+         close();
+      }
+      return ok;
+   }
+
+   void close()
+   {
+      if ( m_base ) {
+         munmap(const_cast<unsigned char *>(m_base), m_size);
+      }
+      m_base = NULL;
+      m_size = 0;
+      m_records.clear();
+   }
+
+   size_t               numPackets() const       { return m_records.size(); }
+   const Record &       record(size_t i) const   { return m_records[i]; }
+   const unsigned char *frame(size_t i) const    { return m_base + m_records[i].offset; }
+
+private:
+   static uint32_t rd32(const unsigned char *p, bool swap)
+   {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      return swap ? __builtin_bswap32(v) : v;
+   }
+
+   static unsigned short rd16(const unsigned char *p, bool swap)
+   {
+      unsigned short v;
+      memcpy(&v, p, 2);
+      return swap ? (unsigned short)((v >> 8) | (v << 8)) : v;
+   }
+
+   bool indexPcap(uint32_t magic)
+   {
+      bool swap;
+      if ( 0xa1b2c3d4 == magic || 0xa1b23c4d == magic ) {
+         swap = false;
+      } else if ( 0xd4c3b2a1 == magic || 0x4d3cb2a1 == magic ) {
+         swap = true;
+      } else {
+         return false;
+      }
+      unsigned short linktype = (unsigned short)rd32(m_base + 20, swap);
+      size_t off = 24;
+      while ( off + 16 <= m_size ) {
+         Record r;
+         r.caplen   = rd32(m_base + off + 8, swap);
+         r.offset   = off + 16;
+         r.linktype = linktype;
+         if ( r.offset + r.caplen > m_size ) {
+            break;                    // truncated capture
+         }
+         m_records.push_back(r);
+         off = r.offset + r.caplen;
+      }
+      return true;
+   }
+
+   bool indexPcapng()
+   {
+      bool                        swap = false;
+      std::vector<unsigned short> ifLink;
+      size_t                      off  = 0;
+
+      while ( off + 12 <= m_size ) {
+         uint32_t type = rd32(m_base + off, swap);
+         if ( 0x0A0D0D0A == type ) {   // section header: byte order may change here
+            uint32_t bom = rd32(m_base + off + 8, false);
+            if ( 0x1A2B3C4D == bom ) {
+               swap = false;
+            } else if ( 0x4D3C2B1A == bom ) {
+               swap = true;
+            } else {
+               return false;
+            }
+            ifLink.clear();
+         }
+         uint32_t blen = rd32(m_base + off + 4, swap);
+         if ( blen < 12 || (blen & 3) || off + blen > m_size ) {
+            break;
+         }
+         const unsigned char *b = m_base + off + 8;
+         Record r;
+         r.linktype = 0;
+         r.caplen   = 0;
+         switch ( type ) {
+            case 1 :                  // interface description
+               ifLink.push_back(rd16(b, swap));
+               break;
+            case 6 :                  // enhanced packet
+               if ( blen >= 32 ) {
+                  uint32_t ifc = rd32(b, swap);
+                  r.caplen   = rd32(b + 12, swap);
+                  r.offset   = off + 28;
+                  r.linktype = (ifc < ifLink.size()) ? ifLink[ifc] : 0;
+               }
+               break;
+            case 3 :                  // simple packet, always interface 0
+               if ( blen >= 16 ) {
+                  uint32_t orig = rd32(b, swap);
+                  r.caplen   = (orig < blen - 16) ? orig : blen - 16;
+                  r.offset   = off + 12;
+                  r.linktype = ifLink.empty() ? 0 : ifLink[0];
+               }
+               break;
+            case 2 :                  // obsolete packet block
+               if ( blen >= 32 ) {
+                  unsigned short ifc = rd16(b, swap);
+                  r.caplen   = rd32(b + 12, swap);
+                  r.offset   = off + 28;
+                  r.linktype = (ifc < ifLink.size()) ? ifLink[ifc] : 0;
+               }
+               break;
+            default :
+               break;
+         }
+         if ( r.caplen && r.linktype && r.offset + r.caplen <= off + blen ) {
+            m_records.push_back(r);
+         }
+         off += blen;
+      }
+      return true;
+   }
+
+   const unsigned char *m_base;
+   size_t               m_size;
+   std::vector<Record>  m_records;
+};
+
+
+/// @brief Builds AFU input cache lines from a capture.
+class PacketIngest
+{
+public:
+   PacketIngest(int layout) :
+      m_layout(layout),
+      m_fields((CL_LAYOUT_AFU == layout) ? CL_LANES_AFU : CL_LANES_SW),
+      m_idxBits(0),
+      m_parsed(0),
+      m_nonIp(0)
+   {
+      m_fields.preset(FL_PRESET_IPV4);
+   }
+
+   /// Field to lane assignment; edit it or replace it with a preset before emit().
+   FieldLayout &       fields()       { return m_fields; }
+   const FieldLayout & fields() const { return m_fields; }
+
+   /// Start-index bit fed to every lane's first tree level.
+   void setIndexBits(bt16bitInt bits) { m_idxBits = bits; }
+
+   /// Encode one packet into fields().linesPerPacket() 64-byte cache lines.
+   void encode(const PacketHeader &h, unsigned char *cl) const
+   {
+      bt16bitInt *w = reinterpret_cast<bt16bitInt *>(cl);
+      memset(cl, 0, 64 * m_fields.linesPerPacket());
+      for ( int lane = 0; lane < m_fields.numLanes(); lane++ ) {
+         int         f    = m_fields.laneField(lane);
+         bt16bitInt  key  = packetFieldChunk(h, m_fields.fieldId(f), m_fields.fieldBits(f),
+                                             m_fields.laneChunk(lane));
+         bt16bitInt *line = w + 32 * m_fields.laneLine(lane);
+         int         slot = m_fields.laneSlot(lane);
+         bt16bitInt  bit  = (m_idxBits >> slot) & 0x1;
+         if ( CL_LAYOUT_AFU == m_layout ) {
+            line[slot]          = key;
+            line[CL_LANES_AFU] |= bit << slot;
+         } else {
+            line[31 - slot]     = key;
+            line[15]           |= bit << (15 - slot);
+         }
+      }
+   }
+
+   /// Fill numLines cache lines at dst from the capture, starting at packet
+   /// firstPkt and wrapping around so short captures can fill large workspaces.
+   /// Only whole packets are written.
+   /// @return Number of lines written (0 if the capture has no packets).
+   size_t emit(const PcapFile &pcap, size_t firstPkt, void *dst, size_t numLines)
+   {
+      size_t npkt = pcap.numPackets();
+      if ( 0 == npkt ) {
+         return 0;
+      }
+      unsigned char *out     = reinterpret_cast<unsigned char *>(dst);
+      size_t         stride  = 64 * m_fields.linesPerPacket();
+      long           packets = (long)(numLines / m_fields.linesPerPacket());
+      unsigned long  parsed  = 0;
+      unsigned long  nonIp   = 0;
+
+      #pragma omp parallel for schedule(static, 4096) reduction(+:parsed, nonIp)
+      for ( long n = 0; n < packets; n++ ) {
+         size_t                 pkt = (firstPkt + n) % npkt;
+         const PcapFile::Record &r  = pcap.record(pkt);
+         PacketHeader           h;
+         if ( parsePacket(pcap.frame(pkt), r.caplen, r.linktype, h) && h.ipVersion ) {
+            parsed++;
+         } else {
+            nonIp++;
+         }
+         encode(h, out + (size_t)n * stride);
+      }
+      m_parsed += parsed;
+      m_nonIp  += nonIp;
+      return (size_t)packets * m_fields.linesPerPacket();
+   }
+
+   unsigned long long parsed() const { return m_parsed; }
+   unsigned long long nonIp()  const { return m_nonIp; }
+
+private:
+   int                m_layout;
+   FieldLayout        m_fields;
+   bt16bitInt         m_idxBits;
+   unsigned long long m_parsed;
+   unsigned long long m_nonIp;
+};
+
+#endif // __PCAP_READER_H__
@@ -0,0 +1,324 @@
+//****************************************************************************
+/// @file result_cache.h
+/// @brief Bounded, set-associative result cache with SIMD tag probing.
+///
+/// Used as the flow cache (a flow's invariant lane keys -> rules those lanes
+/// leave) and as the merge memo (leaf-index tuple -> merge outcome).  The table is an array
+/// of 16-way buckets; a key hashes to exactly one bucket, whose 16 one-byte
+/// tags are compared with a single SSE2 instruction before any full key is
+/// touched.  Memory is fixed at construction.
+///
+///  - Concurrency: every bucket carries a sequence counter.  Readers never
+///    block or write shared state other than the CLOCK reference bit; a probe
+///    that overlaps a writer is simply reported as a miss.  Writers take the
+///    bucket by making the counter odd and give up (drop the insert) if
+///    another writer holds it.
+///  - Eviction: CLOCK per bucket over the reference bits.
+///  - Invalidation: entries are stamped with the table epoch; invalidate()
+///    bumps the epoch, which retires every entry in O(1) when rules change.
+///
+/// Hit/miss counters are kept in per-caller slots to avoid false sharing; the
+/// caller passes its slot, so OpenMP and pthread callers alike never share one.
+//****************************************************************************
+#ifndef __RESULT_CACHE_H__
+#define __RESULT_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <vector>
+#include <algorithm>
+
+#include "workspace_buffer.h"
+
+typedef unsigned short int bt16bitInt;
+
+#define RC_WAYS                     16       // entries per bucket, one SSE2 tag compare
+#define RC_MAX_RULES                7        // rule ids stored per result
+#define RC_FLOW_RULES               256      // rule ids a flow-cache entry can hold
+#define RC_MAX_THREADS              64
+
+#define RC_COMPILER_BARRIER()       __asm__ __volatile__("" ::: "memory")
+
+/// @brief Cached merge outcome: how many rules matched and the lowest ids
+/// among them in ascending order; rules[0] is the final (highest-priority) rule.
+/// A producer that stops at the first common rule (hw_app's merge) stores
+/// total 0, count 1: only rules[0] is known.
+struct CachedRules {
+   bt16bitInt total;                  ///< Rules matched, 0 if unknown
+   bt16bitInt count;                  ///< Ids stored below, at most RC_MAX_RULES
+   bt16bitInt rules[RC_MAX_RULES];
+};
+
+/// @brief Rules left by a flow's invariant lanes, one bit per rule id.  The
+/// lanes that change from packet to packet are intersected into it per packet.
+struct FlowRules {
+   uint64_t bits[RC_FLOW_RULES / 64];
+};
+
+/// @brief Per-caller counters, one cache line each.
+struct ResultCacheStats {
+   unsigned long long hits;
+   unsigned long long misses;
+   unsigned long long inserts;
+   unsigned long long evictions;
+   unsigned long long pad[4];
+};
+
+template <int KeyWords, class Value>
+class ResultCache
+{
+public:
+   struct Key {
+      bt16bitInt w[KeyWords];
+   };
+
+   ResultCache() :
+      m_buckets(NULL),
+      m_numBuckets(0),
+      m_bytes(0),
+      m_epoch(1)
+   {
+      memset(m_stats, 0, sizeof(m_stats));
+   }
+
+   ~ResultCache() { release(); }
+
+   /// Allocate the table within maxBytes (rounded down to a power-of-two bucket count).
+   bool create(size_t maxBytes)
+   {
+      release();
+      size_t n = 1;
+      while ( 2 * n * sizeof(Bucket) <= maxBytes ) {
+         n *= 2;
+      }
+      m_bytes   = n * sizeof(Bucket);
+      m_buckets = reinterpret_cast<Bucket *>(allocHugeBuffer(m_bytes, NULL));
+      if ( NULL == m_buckets ) {
+         return false;
+      }
+      memset(m_buckets, 0, m_bytes);
+      m_numBuckets = n;
+      return true;
+   }
+
+   bool   isValid()  const { return NULL != m_buckets; }
+   size_t capacity() const { return m_numBuckets * RC_WAYS; }
+   size_t bytes()    const { return m_bytes; }
+
+   /// Retire every entry, e.g. after the rule sets were rebuilt.
+   void invalidate() { __sync_fetch_and_add(&m_epoch, 1); }
+
+   /// @param slot  Caller's counter slot; concurrent callers pass different slots.
+   bool lookup(const Key &key, Value &value, int slot)
+   {
+      ResultCacheStats &st = m_stats[slot % RC_MAX_THREADS];
+      if ( NULL == m_buckets ) {
+         return false;
+      }
+      uint64_t      h     = hash(key);
+      Bucket       &b     = m_buckets[h & (m_numBuckets - 1)];
+      unsigned char tag   = tagOf(h);
+      unsigned      epoch = m_epoch;
+
+      unsigned v = b.version;
+      RC_COMPILER_BARRIER();
+      if ( 0 == (v & 1) ) {
+         unsigned mask = matchTags(b, tag);
+         while ( mask ) {
+            int way = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if ( b.epoch[way] == epoch && 0 == memcmp(&b.key[way], &key, sizeof(Key)) ) {
+               Value tmp = b.value[way];
+               RC_COMPILER_BARRIER();     // x86 keeps loads in order; stop the compiler reordering
+               if ( b.version == v ) {
+                  b.ref |= (unsigned short)(1u << way);
+                  value = tmp;
+                  st.hits++;
+                  return true;
+               }
+               break;
+            }
+         }
+      }
+      st.misses++;
+      return false;
+   }
+
+   void insert(const Key &key, const Value &value, int slot)
+   {
+      if ( NULL == m_buckets ) {
+         return;
+      }
+      ResultCacheStats &st    = m_stats[slot % RC_MAX_THREADS];
+      uint64_t          h     = hash(key);
+      Bucket           &b     = m_buckets[h & (m_numBuckets - 1)];
+      unsigned char     tag   = tagOf(h);
+      unsigned          epoch = m_epoch;
+
+      unsigned v = b.version;
+      if ( (v & 1) || !__sync_bool_compare_and_swap(&b.version, v, v + 1) ) {
+         return;                          // bucket busy: a cache may drop inserts
+      }
+
+      int      way  = -1;
+      unsigned mask = matchTags(b, tag);
+      while ( mask ) {                    // same key already present: refresh in place
+         int w = __builtin_ctz(mask);
+         mask &= mask - 1;
+         if ( 0 == memcmp(&b.key[w], &key, sizeof(Key)) ) {
+            way = w;
+            break;
+         }
+      }
+      for ( int w = 0; way < 0 && w < RC_WAYS; w++ ) {
+         if ( 0 == b.tag[w] || b.epoch[w] != epoch ) {
+            way = w;
+         }
+      }
+      if ( way < 0 ) {                    // CLOCK: skip and clear referenced ways
+         while ( b.ref & (1u << b.hand) ) {
+            b.ref &= (unsigned short)~(1u << b.hand);
+            b.hand = (b.hand + 1) % RC_WAYS;
+         }
+         way    = b.hand;
+         b.hand = (b.hand + 1) % RC_WAYS;
+         st.evictions++;
+      }
+      b.tag[way]   = tag;
+      b.epoch[way] = epoch;
+      b.key[way]   = key;
+      b.value[way] = value;
+      b.ref       |= (unsigned short)(1u << way);
+      st.inserts++;
+
+      RC_COMPILER_BARRIER();
+      b.version = v + 2;
+   }
+
+   /// Sum of the per-caller counters.
+   ResultCacheStats stats() const
+   {
+      ResultCacheStats s;
+      memset(&s, 0, sizeof(s));
+      for ( int t = 0; t < RC_MAX_THREADS; t++ ) {
+         s.hits      += m_stats[t].hits;
+         s.misses    += m_stats[t].misses;
+         s.inserts   += m_stats[t].inserts;
+         s.evictions += m_stats[t].evictions;
+      }
+      return s;
+   }
+
+   void resetStats() { memset(m_stats, 0, sizeof(m_stats)); }
+
+private:
+   struct Bucket {
+      unsigned char     tag[RC_WAYS];     ///< 0 = never used
+      volatile unsigned version;          ///< Odd while a writer owns the bucket
+      unsigned short    ref;              ///< CLOCK reference bit per way
+      unsigned char     hand;             ///< CLOCK hand
+      unsigned char     pad[9];
+      unsigned          epoch[RC_WAYS];
+      Key               key[RC_WAYS];
+      Value             value[RC_WAYS];
+   } __attribute__((aligned(64)));
+
+   static uint64_t hash(const Key &key)
+   {
+      const unsigned char *p = reinterpret_cast<const unsigned char *>(&key);
+      uint64_t             h = 0x9e3779b97f4a7c15ULL;
+      size_t               i = 0;
+      for ( ; i + 8 <= sizeof(Key); i += 8 ) {
+         uint64_t w;
+         memcpy(&w, p + i, 8);
+         h = (h ^ w) * 0xff51afd7ed558ccdULL;
+         h ^= h >> 32;
+      }
+      for ( ; i < sizeof(Key); i++ ) {
+         h = (h ^ p[i]) * 0x100000001b3ULL;
+      }
+      h ^= h >> 29;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 32;
+      return h;
+   }
+
+   static unsigned char tagOf(uint64_t h)
+   {
+      unsigned char t = (unsigned char)(h >> 56);
+      return t ? t : 1;
+   }
+
+   static unsigned matchTags(const Bucket &b, unsigned char tag)
+   {
+      __m128i tags = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b.tag));
+      return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag)));
+   }
+
+   void release()
+   {
+      freeHugeBuffer(m_buckets, m_bytes);
+      m_buckets    = NULL;
+      m_numBuckets = 0;
+   }
+
+   Bucket           *m_buckets;
+   size_t            m_numBuckets;
+   size_t            m_bytes;
+   volatile unsigned m_epoch;
+   ResultCacheStats  m_stats[RC_MAX_THREADS];
+};
+
+/// Store a merge result (ascending ids): its size and its first RC_MAX_RULES ids.
+inline void packRules(const std::vector<bt16bitInt> &rules, CachedRules &c)
+{
+   memset(&c, 0, sizeof(c));
+   c.total = (bt16bitInt)rules.size();
+   c.count = (bt16bitInt)std::min(rules.size(), (size_t)RC_MAX_RULES);
+   for ( int i = 0; i < c.count; i++ ) {
+      c.rules[i] = rules[i];
+   }
+}
+
+/// Store an ascending rule list as a flow-cache bitmap; the flow cache is only
+/// enabled when every rule id is below RC_FLOW_RULES.
+inline void packFlowRules(const std::vector<bt16bitInt> &rules, FlowRules &f)
+{
+   memset(&f, 0, sizeof(f));
+   for ( size_t i = 0; i < rules.size(); i++ ) {
+      if ( rules[i] < RC_FLOW_RULES ) {
+         f.bits[rules[i] / 64] |= 1ULL << (rules[i] % 64);
+      }
+   }
+}
+
+/// The rule ids of a flow-cache bitmap, ascending.
+inline void unpackFlowRules(const FlowRules &f, std::vector<bt16bitInt> &rules)
+{
+   rules.clear();
+   for ( int w = 0; w < RC_FLOW_RULES / 64; w++ ) {
+      for ( uint64_t b = f.bits[w]; b; b &= b - 1 ) {
+         rules.push_back((bt16bitInt)(64 * w + __builtin_ctzll(b)));
+      }
+   }
+}
+
+// Flow cache: words 0..FLOW_KEY_LANES-1 hold the keys of the packet's
+// flow-invariant lanes, the last two words their start-index bits (the tree
+// result depends on both).  Lanes such as length, TCP flags and TTL change
+// within a flow and stay out of the key.
+#define FLOW_KEY_WORDS              32
+#define FLOW_KEY_LANES              (FLOW_KEY_WORDS - 2)
+
+typedef ResultCache<FLOW_KEY_WORDS, FlowRules> FlowCache;
+
+// Merge memo: one word per lane, the leaf index reduced to its setData row.
+// Leaf tuples repeat far more often than header tuples, so this keeps hitting
+// on high-cardinality traffic where the flow cache does not.
+#define MERGE_MEMO_WORDS            16
+
+typedef ResultCache<MERGE_MEMO_WORDS, CachedRules> MergeMemo;
+
+#endif // __RESULT_CACHE_H__
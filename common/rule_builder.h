@@ -0,0 +1,130 @@
+//****************************************************************************
+/// @file rule_builder.h
+/// @brief Parallel generation of the setData rule lists and keyData tables.
+///
+/// Every list draws from its own Xoshiro256 stream (workload_rng.h), seeded
+/// from (seed, list index), so the result is identical whatever the thread
+/// count or schedule.  A list is built in a thread-local buffer (histogram or
+/// std::sort, whichever suits the value range) and streamed to its row with
+/// non-temporal stores, keeping the hundreds of megabytes of freshly written
+/// rules from evicting the caches.
+//****************************************************************************
+#ifndef __RULE_BUILDER_H__
+#define __RULE_BUILDER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include <emmintrin.h>
+#include <omp.h>
+
+#include "workload_rng.h"
+
+typedef unsigned short int bt16bitInt;
+
+#define RB_HISTOGRAM_MAX            4096     // value ranges up to this are counted, not sorted
+
+/// @brief Wall-clock breakdown of one build.
+struct RuleBuildTiming {
+   double seconds;            ///< Whole build
+   size_t lists;              ///< Lists written
+   size_t bytes;              ///< Bytes written
+   int    threads;            ///< Threads used
+};
+
+class RuleBuilder
+{
+public:
+   /// @param seed  Base seed, 0 = seed from the clock.
+   explicit RuleBuilder(uint64_t seed = 0) : m_seed(seed ? seed : (uint64_t)time(NULL)) {}
+
+   uint64_t seed() const { return m_seed; }
+
+   /// Fill numLists rows with listSize values in [0, maxValue), each row sorted.
+   RuleBuildTiming buildSorted(bt16bitInt **rows, size_t numLists, int listSize, unsigned maxValue)
+   {
+      return run(rows, numLists, listSize, maxValue, true);
+   }
+
+   /// Fill numLists rows with listSize values in [0, maxValue), unsorted.
+   RuleBuildTiming buildRandom(bt16bitInt **rows, size_t numLists, int listSize, unsigned maxValue)
+   {
+      return run(rows, numLists, listSize, maxValue, false);
+   }
+
+private:
+   RuleBuildTiming run(bt16bitInt **rows, size_t numLists, int listSize, unsigned maxValue, bool sorted)
+   {
+      RuleBuildTiming t;
+      double          start = omp_get_wtime();
+      long            n     = (long)numLists;
+      int             nthr  = 1;
+
+      #pragma omp parallel
+      {
+         std::vector<bt16bitInt> buf(listSize + 8);
+         std::vector<unsigned>   hist;
+         if ( sorted && maxValue <= RB_HISTOGRAM_MAX ) {
+            hist.resize(maxValue);
+         }
+         #pragma omp single nowait
+         nthr = omp_get_num_threads();
+
+         #pragma omp for schedule(static)
+         for ( long l = 0; l < n; l++ ) {
+            Xoshiro256 rng(m_seed, (uint64_t)l);
+            if ( !hist.empty() ) {
+               std::fill(hist.begin(), hist.end(), 0u);
+               for ( int k = 0; k < listSize; k++ ) {
+                  hist[rng.uniform(maxValue)]++;
+               }
+               int k = 0;
+               for ( unsigned v = 0; v < maxValue; v++ ) {
+                  for ( unsigned c = hist[v]; c; c-- ) {
+                     buf[k++] = (bt16bitInt)v;
+                  }
+               }
+            } else {
+               for ( int k = 0; k < listSize; k++ ) {
+                  buf[k] = (bt16bitInt)rng.uniform(maxValue);
+               }
+               if ( sorted ) {
+                  std::sort(buf.begin(), buf.begin() + listSize);
+               }
+            }
+            streamRow(rows[l], &buf[0], listSize);
+         }
+         _mm_sfence();
+      }
+
+      t.seconds = omp_get_wtime() - start;
+      t.lists   = numLists;
+      t.bytes   = numLists * listSize * sizeof(bt16bitInt);
+      t.threads = nthr;
+      return t;
+   }
+
+   // Non-temporal copy of the aligned middle of a row, ordinary stores at the ends.
+   static void streamRow(bt16bitInt *dst, const bt16bitInt *src, int n)
+   {
+      int k = 0;
+      while ( k < n && (reinterpret_cast<uintptr_t>(dst + k) & 15) ) {
+         dst[k] = src[k];
+         k++;
+      }
+      for ( ; k + 8 <= n; k += 8 ) {
+         _mm_stream_si128(reinterpret_cast<__m128i *>(dst + k),
+                          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + k)));
+      }
+      for ( ; k < n; k++ ) {
+         dst[k] = src[k];
+      }
+   }
+
+   uint64_t m_seed;
+};
+
+#endif // __RULE_BUILDER_H__
@@ -0,0 +1,136 @@
+//****************************************************************************
+/// @file rule_dedup.h
+/// @brief Content-hash deduplication of leaf rule lists.
+///
+/// In a decomposition classifier many leaves carry exactly the same rule
+/// list.  ruleListIds() gives every row a dense list id, equal ids meaning
+/// equal contents; DedupRuleStore keeps each distinct list once and hands out
+/// a setData-shaped row table whose rows point into the shared copies.  Since
+/// intersecting a list with itself is a no-op, the merge can compare ids to
+/// drop repeated lists before touching any data.
+//****************************************************************************
+#ifndef __RULE_DEDUP_H__
+#define __RULE_DEDUP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <map>
+
+typedef unsigned short int bt16bitInt;
+
+/// @brief Content hash of a rule list.
+inline uint64_t ruleListHash(const bt16bitInt *list, size_t n)
+{
+   uint64_t h = 0xcbf29ce484222325ULL ^ n;
+   for ( size_t i = 0; i < n; i++ ) {
+      h = (h ^ list[i]) * 0x100000001b3ULL;
+   }
+   return h ^ (h >> 31);
+}
+
+/// @brief Assign list ids by content, in order of first appearance.
+/// @param[out] ids   Id of every row.
+/// @param[out] reps  First row holding each id (may be NULL).
+/// @return Number of distinct lists.
+inline size_t ruleListIds(bt16bitInt **rows, size_t numRows, int listSize,
+                          std::vector<unsigned> &ids, std::vector<size_t> *reps)
+{
+   std::vector<uint64_t> hashes(numRows);
+   long                  n = (long)numRows;
+
+   #pragma omp parallel for schedule(static)
+   for ( long r = 0; r < n; r++ ) {
+      hashes[r] = ruleListHash(rows[r], listSize);
+   }
+
+   std::map<uint64_t, std::vector<unsigned> > byHash;
+   std::vector<size_t>                        rep;
+   ids.resize(numRows);
+   for ( size_t r = 0; r < numRows; r++ ) {
+      std::vector<unsigned> &cand = byHash[hashes[r]];
+      unsigned               id   = (unsigned)rep.size();
+      for ( size_t i = 0; i < cand.size(); i++ ) {
+         if ( 0 == memcmp(rows[rep[cand[i]]], rows[r], listSize * sizeof(bt16bitInt)) ) {
+            id = cand[i];
+            break;
+         }
+      }
+      if ( id == rep.size() ) {
+         rep.push_back(r);
+         cand.push_back(id);
+      }
+      ids[r] = id;
+   }
+   size_t numUnique = rep.size();
+   if ( reps ) {
+      reps->swap(rep);
+   }
+   return numUnique;
+}
+
+/// @brief Rule lists stored once per distinct content.
+class DedupRuleStore
+{
+public:
+   DedupRuleStore() : m_rows(NULL), m_unique(NULL), m_data(NULL), m_numRows(0), m_numUnique(0), m_listSize(0) {}
+   ~DedupRuleStore() { release(); }
+
+   /// Copy the distinct lists of rows into shared storage.  The caller may
+   /// free its own rows afterwards and use rows() in their place.
+   bool build(bt16bitInt **rows, size_t numRows, int listSize)
+   {
+      release();
+      std::vector<size_t> reps;
+      m_numUnique = ruleListIds(rows, numRows, listSize, m_ids, &reps);
+      m_numRows   = numRows;
+      m_listSize  = listSize;
+      m_data      = new bt16bitInt [m_numUnique * listSize];
+      m_unique    = new bt16bitInt * [m_numUnique];
+      m_rows      = new bt16bitInt * [numRows];
+
+      long nu = (long)m_numUnique;
+      #pragma omp parallel for schedule(static)
+      for ( long u = 0; u < nu; u++ ) {
+         m_unique[u] = m_data + (size_t)u * listSize;
+         memcpy(m_unique[u], rows[reps[u]], listSize * sizeof(bt16bitInt));
+      }
+      for ( size_t r = 0; r < numRows; r++ ) {
+         m_rows[r] = m_unique[m_ids[r]];
+      }
+      return true;
+   }
+
+   bt16bitInt ** rows()       const { return m_rows; }         ///< numRows(), setData shaped
+   bt16bitInt ** uniqueRows() const { return m_unique; }       ///< numUnique(), indexed by list id
+   unsigned      listId(size_t row) const { return m_ids[row]; }
+
+   size_t numRows()   const { return m_numRows; }
+   size_t numUnique() const { return m_numUnique; }
+   size_t bytes()     const { return m_numUnique * m_listSize * sizeof(bt16bitInt) +
+                                     m_numRows * (sizeof(bt16bitInt *) + sizeof(unsigned)); }
+   size_t rawBytes()  const { return m_numRows * m_listSize * sizeof(bt16bitInt); }
+
+private:
+   void release()
+   {
+      delete [] m_rows;
+      delete [] m_unique;
+      delete [] m_data;
+      m_rows   = NULL;
+      m_unique = NULL;
+      m_data   = NULL;
+      m_ids.clear();
+   }
+
+   bt16bitInt          **m_rows;
+   bt16bitInt          **m_unique;
+   bt16bitInt           *m_data;
+   size_t                m_numRows;
+   size_t                m_numUnique;
+   size_t                m_listSize;
+   std::vector<unsigned> m_ids;
+};
+
+#endif // __RULE_DEDUP_H__
@@ -0,0 +1,153 @@
+//****************************************************************************
+/// @file tree_tables.h
+/// @brief Runtime reload of the AFU tree tables from host memory.
+///
+/// Every tree level of the AFU keeps two banks of its table.  Keys look up
+/// the active bank; a load writes the other one and then swaps, so a new
+/// ruleset takes effect without reprogramming the bitstream and without
+/// stopping lookups.  The host puts a table image in the workspace and
+/// writes its address to AFU_CSR_TBL_BASEH / AFU_CSR_TBL_BASEL (BASEL
+/// starts the load).  afu_core fetches the image between source bursts and
+/// reports every completed swap in DSM line AFU_DSM_TBL_STATUS_LINE.
+///
+/// Image: the node tables of AFU levels 1..afuLevels-1 in order, level n
+/// holding its 2^n thresholds (what the tree_data_<n-1> init files hold),
+/// 32 per cache line; a level smaller than a line still takes a whole line.
+/// Level 0 is a constant in the AFU and not part of the image.
+///
+/// The host walks (lookup(), TreeWalkEngine) mask the index to the full
+/// table width, while AFU level n only sees the low n bits of it.  Their
+/// tables agree once level 0 holds the AFU's constant and level n repeats
+/// its 2^n thresholds across the width: foldTreeLevels() does that to
+/// keys built on the host, loadTreeInitFiles() reads the init files.
+//****************************************************************************
+#ifndef __TREE_TABLES_H__
+#define __TREE_TABLES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef unsigned short int bt16bitInt;
+
+#define AFU_CSR_TBL_BASEL           0xa14    // afu_csr AFU_CSR_TBL_BASEL (10'h285), starts the load
+#define AFU_CSR_TBL_BASEH           0xa18    // afu_csr AFU_CSR_TBL_BASEH (10'h286)
+
+#define AFU_TBL_WORDS_PER_CL        32
+#define AFU_TREE_ROOT_KEY           16       // tree_start_level Data_out, the level 0 threshold
+#define AFU_DSM_TBL_STATUS_LINE     6        // DSM line: active bank in dword 0, loads done in dword 1
+
+/// @brief Cache lines of the table image of an AFU with afuLevels levels.
+inline size_t treeImageLines(int afuLevels)
+{
+   size_t lines = 0;
+   for ( int n = 1; n < afuLevels; n++ ) {
+      size_t words = size_t(1) << n;
+      lines += (words + AFU_TBL_WORDS_PER_CL - 1) / AFU_TBL_WORDS_PER_CL;
+   }
+   return lines;
+}
+
+/// @brief Give levels[0..depth) the AFU's addressing: level 0 is the
+/// root constant, level n its first 2^n thresholds repeated across width.
+inline void foldTreeLevels(bt16bitInt *const *levels, int depth, unsigned width)
+{
+   for ( unsigned j = 0; j < width; j++ ) {
+      levels[0][j] = AFU_TREE_ROOT_KEY;
+   }
+   for ( int n = 1; n < depth; n++ ) {
+      size_t words = size_t(1) << n;
+      for ( size_t j = words; j < width; j++ ) {
+         levels[n][j] = levels[n][j % words];
+      }
+   }
+}
+
+/// @brief Read the init tables the bitstream was built with, level n from
+/// <prefix><n-1 in hex> (one hex threshold per line, as tree.v names
+/// them), and fold levels[0..depth) like foldTreeLevels().  Returns the
+/// levels that now match the AFU's: 1 + the files read before the first
+/// missing or short one.  Levels from there on keep their keys, folded.
+inline int loadTreeInitFiles(bt16bitInt *const *levels, int depth, unsigned width, const char *prefix)
+{
+   int loaded = 1;
+   for ( ; loaded < depth; loaded++ ) {
+      char path[256];
+      snprintf(path, sizeof(path), "%s%x", prefix, loaded - 1);
+      FILE *f = fopen(path, "r");
+      if ( NULL == f ) {
+         break;
+      }
+      size_t   words = size_t(1) << loaded, j = 0;
+      unsigned v;
+      for ( ; j < words && j < width && 1 == fscanf(f, "%x", &v); j++ ) {
+         levels[loaded][j] = (bt16bitInt)v;
+      }
+      fclose(f);
+      if ( j < words ) {
+         break;
+      }
+   }
+   foldTreeLevels(levels, depth, width);
+   return loaded;
+}
+
+/// @brief Lay out levels[1..afuLevels-1] as a table image at dst, which
+/// must hold treeImageLines(afuLevels) cache lines.
+inline void buildTreeImage(bt16bitInt *const *levels, int afuLevels, void *dst)
+{
+   bt16bitInt *out = reinterpret_cast<bt16bitInt *>(dst);
+   ::memset(dst, 0, treeImageLines(afuLevels) * AFU_TBL_WORDS_PER_CL * sizeof(bt16bitInt));
+   for ( int n = 1; n < afuLevels; n++ ) {
+      size_t words = size_t(1) << n;
+      ::memcpy(out, levels[n], words * sizeof(bt16bitInt));
+      out += (words + AFU_TBL_WORDS_PER_CL - 1) / AFU_TBL_WORDS_PER_CL * AFU_TBL_WORDS_PER_CL;
+   }
+}
+
+/// @brief Write levels[1..afuLevels-1] as the tables a testbench loads
+/// into a bank (rtl/afu2/tb_tree.v, $readmemh): one hex threshold per
+/// line, level n's 2^n from line 2^n-2 on.
+inline bool writeTreeLevelsHex(const char *path, bt16bitInt *const *levels, int afuLevels)
+{
+   FILE *f = fopen(path, "w");
+   if ( NULL == f ) {
+      return false;
+   }
+   for ( int n = 1; n < afuLevels; n++ ) {
+      for ( size_t j = 0; j < (size_t(1) << n); j++ ) {
+         fprintf(f, "%04x\n", levels[n][j]);
+      }
+   }
+   return 0 == fclose(f);
+}
+
+/// @brief Ask the AFU to load the image at image (cache line aligned,
+/// inside the workspace).  One load at a time: wait for the status
+/// generation to move before requesting the next.
+template <class Svc>
+inline void requestTreeLoad(Svc *svc, const void *image)
+{
+   uint64_t addr = reinterpret_cast<uintptr_t>(image);
+   svc->CSRWrite(AFU_CSR_TBL_BASEH, (uint32_t)(addr >> 32));
+   svc->CSRWrite(AFU_CSR_TBL_BASEL, (uint32_t)addr);
+}
+
+/// @brief Table bank state as last reported by the AFU.
+struct TreeTableStatus {
+   unsigned gen;                      ///< Loads completed since reset
+   unsigned bank;                     ///< Bank new keys look up
+
+   TreeTableStatus() : gen(0), bank(0) {}
+
+   void readDsm(const volatile void *dsm)
+   {
+      const volatile uint32_t *d = reinterpret_cast<const volatile uint32_t *>(
+         reinterpret_cast<const volatile unsigned char *>(dsm) + 64 * AFU_DSM_TBL_STATUS_LINE);
+      bank = d[0] & 1;
+      gen  = d[1];
+   }
+};
+
+#endif // __TREE_TABLES_H__
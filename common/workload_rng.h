@@ -0,0 +1,269 @@
+//****************************************************************************
+/// @file workload_rng.h
+/// @brief Seedable, reentrant random generators and workload distributions.
+///
+/// Every generator is a plain value seeded from (seed, stream), so parallel
+/// code gives each list, chunk or thread its own stream and reproduces the
+/// same data for any thread count.  Xoshiro256 (xoshiro256**) serves scalar
+/// draws; Xoshiro128x4 runs four xoshiro128++ streams in one SSE2 register
+/// for bulk fills at 16 bytes per step.  On top of them sit uniform, Zipf
+/// and header-realistic distributions for the source buffer and rule lists.
+//****************************************************************************
+#ifndef __WORKLOAD_RNG_H__
+#define __WORKLOAD_RNG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <emmintrin.h>
+
+#include "pcap_reader.h"
+
+// Source buffer contents when no capture is replayed
+#define WL_SOURCE_UNIFORM           0        // uniform random bytes
+#define WL_SOURCE_HEADERS           1        // header-realistic packets, Zipf flow popularity
+
+/// @brief splitmix64 step, used to expand (seed, stream) into generator state.
+inline uint64_t wlSplitMix64(uint64_t &state)
+{
+   uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+/// @brief Scalar xoshiro256** generator.
+class Xoshiro256
+{
+public:
+   Xoshiro256(uint64_t seed, uint64_t stream = 0)
+   {
+      uint64_t sm = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+      for ( int i = 0; i < 4; i++ ) {
+         m_s[i] = wlSplitMix64(sm);
+      }
+   }
+
+   uint64_t next()
+   {
+      uint64_t r = rotl(m_s[1] * 5, 7) * 9;
+      uint64_t t = m_s[1] << 17;
+      m_s[2] ^= m_s[0];
+      m_s[3] ^= m_s[1];
+      m_s[1] ^= m_s[2];
+      m_s[0] ^= m_s[3];
+      m_s[2] ^= t;
+      m_s[3]  = rotl(m_s[3], 45);
+      return r;
+   }
+
+   /// Uniform in [0, n), multiply-shift (n < 2^32).
+   unsigned uniform(unsigned n) { return (unsigned)(((next() >> 32) * n) >> 32); }
+
+   /// Uniform in [0, 1).
+   double uniformDouble() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+   static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+   uint64_t m_s[4];
+};
+
+/// @brief Four xoshiro128++ streams in one SSE2 register.
+class Xoshiro128x4
+{
+public:
+   Xoshiro128x4(uint64_t seed, uint64_t stream = 0)
+   {
+      uint64_t sm = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+      uint32_t s[4][4];
+      for ( int i = 0; i < 4; i++ ) {
+         for ( int lane = 0; lane < 4; lane++ ) {
+            s[i][lane] = (uint32_t)wlSplitMix64(sm);
+         }
+      }
+      for ( int i = 0; i < 4; i++ ) {
+         m_s[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s[i]));
+      }
+   }
+
+   /// 16 random bytes.
+   __m128i next()
+   {
+      __m128i r = _mm_add_epi32(rotl(_mm_add_epi32(m_s[0], m_s[3]), 7), m_s[0]);
+      __m128i t = _mm_slli_epi32(m_s[1], 9);
+      m_s[2] = _mm_xor_si128(m_s[2], m_s[0]);
+      m_s[3] = _mm_xor_si128(m_s[3], m_s[1]);
+      m_s[1] = _mm_xor_si128(m_s[1], m_s[2]);
+      m_s[0] = _mm_xor_si128(m_s[0], m_s[3]);
+      m_s[2] = _mm_xor_si128(m_s[2], t);
+      m_s[3] = rotl(m_s[3], 11);
+      return r;
+   }
+
+   /// One 64-byte line; cl must be 16-byte aligned.
+   void fillLine(unsigned char *cl)
+   {
+      __m128i *d = reinterpret_cast<__m128i *>(cl);
+      _mm_store_si128(d + 0, next());
+      _mm_store_si128(d + 1, next());
+      _mm_store_si128(d + 2, next());
+      _mm_store_si128(d + 3, next());
+   }
+
+   void fill(void *dst, size_t bytes)
+   {
+      unsigned char *p = reinterpret_cast<unsigned char *>(dst);
+      for ( ; bytes >= 16; bytes -= 16, p += 16 ) {
+         _mm_storeu_si128(reinterpret_cast<__m128i *>(p), next());
+      }
+      if ( bytes ) {
+         unsigned char tail[16];
+         _mm_storeu_si128(reinterpret_cast<__m128i *>(tail), next());
+         memcpy(p, tail, bytes);
+      }
+   }
+
+private:
+   static __m128i rotl(__m128i x, int k)
+   {
+      return _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - k));
+   }
+
+   __m128i m_s[4];
+};
+
+/// @brief Zipf-distributed ranks 0..n-1 (rank 0 most frequent), by inverse CDF.
+class ZipfDistribution
+{
+public:
+   ZipfDistribution(size_t n = 1, double s = 1.0) { reset(n, s); }
+
+   void reset(size_t n, double s)
+   {
+      m_cdf.resize(n ? n : 1);
+      double sum = 0.0;
+      for ( size_t k = 0; k < m_cdf.size(); k++ ) {
+         sum += 1.0 / pow((double)(k + 1), s);
+         m_cdf[k] = sum;
+      }
+      for ( size_t k = 0; k < m_cdf.size(); k++ ) {
+         m_cdf[k] /= sum;
+      }
+   }
+
+   size_t size() const { return m_cdf.size(); }
+
+   template <class Rng>
+   size_t sample(Rng &rng) const
+   {
+      double u = rng.uniformDouble();
+      size_t k = std::upper_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin();
+      return std::min(k, m_cdf.size() - 1);
+   }
+
+private:
+   std::vector<double> m_cdf;
+};
+
+/// @brief Header-realistic traffic: a fixed flow population with Zipf popularity.
+///
+/// Flows are drawn once from the seed: mostly TCP to a handful of service
+/// ports, some UDP, a little ICMP; addresses from a limited set of /24s with
+/// clients on the source side; ephemeral source ports; OS-typical TTLs.
+class HeaderModel
+{
+public:
+   HeaderModel(uint64_t seed, size_t numFlows = 65536, double zipf = 1.1) :
+      m_popularity(numFlows, zipf)
+   {
+      static const bt16bitInt services[] = { 443, 80, 53, 22, 25, 123, 993, 8080, 3306, 5060 };
+      Xoshiro256 rng(seed, ~0ULL);
+      ZipfDistribution svc(sizeof(services) / sizeof(services[0]), 1.0);
+      m_flows.resize(numFlows);
+      for ( size_t f = 0; f < numFlows; f++ ) {
+         PacketHeader &h = m_flows[f];
+         memset(&h, 0, sizeof(h));
+         unsigned mix = rng.uniform(100);
+         h.ipVersion = 4;
+         h.ethType   = 0x0800;
+         h.proto     = (mix < 80) ? 6 : (mix < 98) ? 17 : 1;
+         h.ttl       = (rng.uniform(4) == 0) ? 128 : 64;
+         h.tos       = (rng.uniform(20) == 0) ? 0xb8 : 0;
+         h.length    = (bt16bitInt)(40 + rng.uniform(1460));
+         h.srcIp[0]  = 10;
+         h.srcIp[1]  = (unsigned char)rng.uniform(4);
+         h.srcIp[2]  = (unsigned char)rng.uniform(256);
+         h.srcIp[3]  = (unsigned char)(1 + rng.uniform(254));
+         h.dstIp[0]  = (unsigned char)(192 + rng.uniform(32));
+         h.dstIp[1]  = (unsigned char)rng.uniform(8);
+         h.dstIp[2]  = (unsigned char)rng.uniform(16);
+         h.dstIp[3]  = (unsigned char)(1 + rng.uniform(254));
+         if ( 1 == h.proto ) {
+            h.srcPort = 8;                              // echo request, code 0
+         } else {
+            h.srcPort = (bt16bitInt)(32768 + rng.uniform(28232));
+            h.dstPort = services[svc.sample(rng)];
+         }
+         if ( 6 == h.proto ) {
+            h.tcpFlags = 0x10;                          // ACK
+         }
+      }
+   }
+
+   size_t numFlows() const { return m_flows.size(); }
+
+   /// Next packet: a popular flow, with per-packet length and TCP flags.
+   template <class Rng>
+   void sample(Rng &rng, PacketHeader &h) const
+   {
+      h = m_flows[m_popularity.sample(rng)];
+      h.length = (bt16bitInt)(40 + rng.uniform(1460));
+      if ( 6 == h.proto ) {
+         unsigned r = rng.uniform(100);
+         h.tcpFlags = (r < 2) ? 0x02 : (r < 4) ? 0x11 : (r < 30) ? 0x18 : 0x10;   // SYN, FIN, PSH, ACK
+      }
+   }
+
+private:
+   ZipfDistribution          m_popularity;
+   std::vector<PacketHeader> m_flows;
+};
+
+/// @brief parallelStreamFill() generator of uniform random lines.
+struct UniformLineGen {
+   Xoshiro128x4 rng;
+
+   UniformLineGen(uint64_t seed, unsigned long long chunk) : rng(seed, chunk) {}
+
+   void fill(unsigned char *cl) { rng.fillLine(cl); }
+};
+
+/// @brief Fill numLines cache lines with header-realistic packets, in parallel.
+/// Packets are drawn in blocks of 4096 with one stream per block.
+/// @return Number of lines written (whole packets only).
+inline size_t fillHeaderLines(const HeaderModel &model, const PacketIngest &ingest,
+                              uint64_t seed, void *dst, size_t numLines)
+{
+   unsigned char *out     = reinterpret_cast<unsigned char *>(dst);
+   size_t         lpp     = ingest.fields().linesPerPacket();
+   long           packets = (long)(numLines / lpp);
+   long           blocks  = (packets + 4095) / 4096;
+
+   #pragma omp parallel for schedule(static)
+   for ( long b = 0; b < blocks; b++ ) {
+      Xoshiro256 rng(seed, (uint64_t)b);
+      long       last = std::min(packets, (b + 1) * 4096);
+      for ( long n = b * 4096; n < last; n++ ) {
+         PacketHeader h;
+         model.sample(rng, h);
+         ingest.encode(h, out + (size_t)n * 64 * lpp);
+      }
+   }
+   return (size_t)packets * lpp;
+}
+
+#endif // __WORKLOAD_RNG_H__
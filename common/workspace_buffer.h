@@ -0,0 +1,180 @@
+//****************************************************************************
+/// @file workspace_buffer.h
+/// @brief Huge-page backed buffers, parallel pre-faulting and streaming fills.
+///
+/// A 512 MB source plus 512 MB destination workspace is 256K 4K pages.  Taking
+/// every fault and TLB miss on the thread that fills the buffer costs seconds
+/// before the AFU starts.  These helpers back buffers with 2 MB pages where the
+/// kernel allows it, touch every page from all cores up front, and initialise
+/// with non-temporal stores so the fill does not evict the merge working set.
+//****************************************************************************
+#ifndef __WORKSPACE_BUFFER_H__
+#define __WORKSPACE_BUFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <emmintrin.h>       // SSE2 streaming stores
+#include <omp.h>
+
+#define WS_PAGE_SIZE            4096
+#define WS_HUGE_PAGE_SIZE       (2 * 1024 * 1024)
+#define WS_FILL_CHUNK           (64 * 1024)     // unit of work handed to one thread
+
+#ifndef MADV_HUGEPAGE
+# define MADV_HUGEPAGE          14
+#endif // MADV_HUGEPAGE
+#ifndef MAP_HUGETLB
+# define MAP_HUGETLB            0x40000
+#endif // MAP_HUGETLB
+
+/// @brief Ask for transparent huge pages on the 2 MB aligned interior of a range.
+///
+/// Used on workspaces we do not allocate ourselves (software/ASE AFU backends).
+/// Must run before the pages are first touched to have any effect.
+inline bool adviseHugePages(void *addr, size_t bytes)
+{
+   uintptr_t lo = ((uintptr_t)addr + WS_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(WS_HUGE_PAGE_SIZE - 1);
+   uintptr_t hi = ((uintptr_t)addr + bytes) & ~(uintptr_t)(WS_HUGE_PAGE_SIZE - 1);
+   if ( hi <= lo ) {
+      return false;
+   }
+   return 0 == madvise((void *)lo, hi - lo, MADV_HUGEPAGE);
+}
+
+/// @brief Anonymous buffer on explicit huge pages, else THP-advised 4K pages.
+///
+/// @param[in]  bytes   Requested size; rounded up to a 2 MB multiple.
+/// @param[out] isHuge  Set when hugetlbfs pages were obtained.
+/// @return Buffer or NULL.  Release with freeHugeBuffer(p, bytes).
+inline void * allocHugeBuffer(size_t bytes, bool *isHuge)
+{
+   size_t len = (bytes + WS_HUGE_PAGE_SIZE - 1) & ~(size_t)(WS_HUGE_PAGE_SIZE - 1);
+   void  *p   = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if ( isHuge ) {
+      *isHuge = (MAP_FAILED != p);
+   }
+   if ( MAP_FAILED == p ) {
+      p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if ( MAP_FAILED == p ) {
+         return NULL;
+      }
+      madvise(p, len, MADV_HUGEPAGE);
+   }
+   return p;
+}
+
+inline void freeHugeBuffer(void *p, size_t bytes)
+{
+   if ( p ) {
+      munmap(p, (bytes + WS_HUGE_PAGE_SIZE - 1) & ~(size_t)(WS_HUGE_PAGE_SIZE - 1));
+   }
+}
+
+/// @brief Fault in every page of a range from all threads.
+///
+/// Each page gets one read-modify-write of its first byte, so the contents
+/// are preserved and the page is mapped writable.
+inline void prefaultParallel(void *addr, size_t bytes)
+{
+   volatile char *base  = reinterpret_cast<volatile char *>(addr);
+   long           pages = (long)((bytes + WS_PAGE_SIZE - 1) / WS_PAGE_SIZE);
+
+   #pragma omp parallel for schedule(static)
+   for ( long pg = 0; pg < pages; pg++ ) {
+      base[pg * WS_PAGE_SIZE] = base[pg * WS_PAGE_SIZE];
+   }
+}
+
+/// @brief Store one 64-byte line with non-temporal stores.  dst must be 16-byte aligned.
+inline void streamStoreCL(void *dst, const void *src)
+{
+   __m128i       *d = reinterpret_cast<__m128i *>(dst);
+   const __m128i *s = reinterpret_cast<const __m128i *>(src);
+   _mm_stream_si128(d + 0, _mm_loadu_si128(s + 0));
+   _mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+   _mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+   _mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+}
+
+/// @brief memset replacement for large, cache-line aligned buffers.
+inline void streamFill(void *dst, unsigned char pattern, size_t bytes)
+{
+   unsigned char *base   = reinterpret_cast<unsigned char *>(dst);
+   size_t         lines  = bytes / 64;
+   long           chunks = (long)((lines * 64 + WS_FILL_CHUNK - 1) / WS_FILL_CHUNK);
+
+   if ( ((uintptr_t)base & 15) != 0 ) {
+      memset(dst, pattern, bytes);
+      return;
+   }
+
+   #pragma omp parallel
+   {
+      __m128i v = _mm_set1_epi8((char)pattern);
+      #pragma omp for schedule(static)
+      for ( long c = 0; c < chunks; c++ ) {
+         size_t first = (size_t)c * (WS_FILL_CHUNK / 64);
+         size_t last  = first + WS_FILL_CHUNK / 64;
+         if ( last > lines ) {
+            last = lines;
+         }
+         for ( size_t l = first; l < last; l++ ) {
+            __m128i *d = reinterpret_cast<__m128i *>(base + l * 64);
+            _mm_stream_si128(d + 0, v);
+            _mm_stream_si128(d + 1, v);
+            _mm_stream_si128(d + 2, v);
+            _mm_stream_si128(d + 3, v);
+         }
+      }
+      _mm_sfence();
+   }
+   memset(base + lines * 64, pattern, bytes - lines * 64);
+}
+
+/// @brief Fill a buffer line by line from a per-chunk generator, in parallel.
+///
+/// Generator must provide a constructor Generator(uint64_t seed, unsigned long
+/// long chunk) and void fill(unsigned char cl[64]).  Seeding by chunk index
+/// rather than by thread keeps the contents identical for any thread count.
+template <class Generator>
+void parallelStreamFill(void *dst, size_t bytes, uint64_t seed)
+{
+   unsigned char *base   = reinterpret_cast<unsigned char *>(dst);
+   size_t         lines  = bytes / 64;
+   long           chunks = (long)((lines * 64 + WS_FILL_CHUNK - 1) / WS_FILL_CHUNK);
+   bool           stream = ((uintptr_t)base & 15) == 0;
+
+   #pragma omp parallel
+   {
+      unsigned char cl[64] __attribute__((aligned(16)));
+      #pragma omp for schedule(static)
+      for ( long c = 0; c < chunks; c++ ) {
+         Generator gen(seed, (unsigned long long)c);
+         size_t first = (size_t)c * (WS_FILL_CHUNK / 64);
+         size_t last  = first + WS_FILL_CHUNK / 64;
+         if ( last > lines ) {
+            last = lines;
+         }
+         for ( size_t l = first; l < last; l++ ) {
+            gen.fill(cl);
+            if ( stream ) {
+               streamStoreCL(base + l * 64, cl);
+            } else {
+               memcpy(base + l * 64, cl, 64);
+            }
+         }
+      }
+      _mm_sfence();
+   }
+   if ( bytes > lines * 64 ) {        // partial tail line
+      unsigned char cl[64] __attribute__((aligned(16)));
+      Generator gen(seed, (unsigned long long)chunks);
+      gen.fill(cl);
+      memcpy(base + lines * 64, cl, bytes - lines * 64);
+   }
+}
+
+#endif // __WORKSPACE_BUFFER_H__
@@ -62,6 +62,7 @@
 #include <ctime>
 #include <time.h>
 #include <sys/time.h>
+#include <fstream>
 #include <stdlib.h>
 #include <vector>
 #include <algorithm>
@@ -72,6 +73,21 @@
 #include <omp.h>
 #include <stdio.h>
 
+#include "numa_topology.h"
+#include "rule_builder.h"
+#include "workload_rng.h"
+#include "afu_metrics.h"
+#include "hybrid_dispatch.h"
+#include "rule_dedup.h"
+#include "workspace_buffer.h"
+#include "field_layout.h"
+#include "pcap_reader.h"
+#include "result_cache.h"
+#include "tree_tables.h"
+#include "afu_tenants.h"
+#include "afu_queue.h"
+#include "afu_decode.h"
+
 //****************************************************************************
 // UN-COMMENT appropriate #define in order to enable either Hardware or ASE.
 //    DEFAULT is to use Software Simulation.
@@ -122,8 +138,66 @@ using namespace AAL;
 #define num_setgroup            16384
 #define num_set                 2
 #define num_setSize             8
+// Levels beyond the AFU's own (its index bits) are finished on the host, up to 20
 #define tree_depth              14
 
+// Placement of setData on multi-socket hosts: NUMA_FIRST_TOUCH, NUMA_INTERLEAVE or NUMA_REPLICATE
+#define numa_ruleset_policy     NUMA_REPLICATE
+
+// Header fields looked up per packet: FL_PRESET_IPV4 or FL_PRESET_IPV6 (see field_layout.h)
+#define key_layout              FL_PRESET_IPV4
+
+// Memory of the leaf-tuple memo between the AFU output and the merge, 0 disables it
+#define merge_memo_MB           64
+// Seed of the generated rule lists and tree keys, 0 = seed from the clock
+#define ruleset_seed            1
+// Source buffer without a capture: WL_SOURCE_UNIFORM or WL_SOURCE_HEADERS (see workload_rng.h)
+#define source_model            WL_SOURCE_UNIFORM
+// Seed of the generated source buffer
+#define source_seed             1
+// Per-transaction metrics snapshot (JSON) is appended here, "" only logs it
+#define metrics_file            "afu_metrics.json"
+// CPU threads walking lookup blocks from the back of the workspace while the AFU
+// streams from the front, 0 = AFU only
+#define hybrid_cpu_workers      4
+// AFU output lines: AFU_OUT_FMT_SPARSE (16 indices + padding), AFU_OUT_FMT_DENSE
+// (32 indices, half the write traffic) or AFU_OUT_FMT_MATCH (the AFU intersects the
+// rule lists, the host only reads rule ids); falls back to sparse on older bitstreams
+#define out_format              AFU_OUT_FMT_DENSE
+// The first 2^tree_depth rule lists are written here for the rule_lists init file
+// of the AFU match stage (built with TREE_LEVEL = tree_depth), "" skips it
+#define rule_list_hex           ""
+// 1: once the task runs, load keyData into the shadow bank of the AFU tree
+// tables and swap banks while lookups go on (the bitstream's init tables are
+// replaced without reprogramming); the image sits at the end of the workspace
+#define tree_reload             0
+// init tables of the bitstream (tree.v ram_init_data), read into keyData when
+// the tables are not reloaded so the CPU walks the thresholds the AFU holds
+#define tree_init_files         "tree_data_"
+// The first tree_vector_lines source lines and their leaf indices after
+// tree_vector_levels levels (afu_user TREE_LEVEL) are written here as test
+// vectors of the tree cores (rtl/afu2/tb_tree.v), "" skips it
+#define tree_vector_file        ""
+#define tree_vector_levels      10
+#define tree_vector_lines       256
+// keyData's levels for tb_tree.v to load into a table bank; with them the
+// vectors also hold when keyData is not the init tables (tree_reload), "" skips it
+#define tree_vector_tables      ""
+// 1: share the AFU between the transaction and a second tenant that re-runs the
+// first block through its own descriptor and checks the output against the
+// transaction's (on the CPU when the bitstream runs a single context)
+#define afu_shared              0
+// 1: the transaction stays open after its own lines and serves a ring of
+// 2^job_queue_bits job descriptors; the first blocks go through it again and
+// are checked against the transaction's output (on the in-process SoftAfu when
+// the bitstream has no ring), then the ring is stopped
+#define job_queue               0
+#define job_queue_bits          3
+// workspace lines behind the source and destination buffers: the job ring and
+// its output, the second tenant's output and descriptor, the tree table image
+#define ws_tail_lines           (treeImageLines(tree_depth) + (afu_shared ? block_size + 2 : 0) \
+                                 + (job_queue ? afuJobRingLines(job_queue_bits) + (block_size << job_queue_bits) : 0))
+
 typedef unsigned short int bt16bitInt;
 
 /// @addtogroup HelloSPLLB
@@ -134,18 +208,6 @@ typedef unsigned short int bt16bitInt;
 /// We implement a Service client within, to handle AAL Service allocation/free.
 /// We also implement a Semaphore for synchronization with the AAL runtime.
 
-static int rand_x = 200, rand_y = 50, rand_z = 3000;
-
-static int 
-random_function() {
-    rand_x = ( rand_x * 171 ) % 30269;
-    rand_y = ( rand_y * 172 ) % 30307;
-    rand_z = ( rand_z * 170 ) % 30323;
-    float n = ((((float)rand_x)/30269.0) + (((float)rand_y)/30307.0) + (((float)rand_z)/30323.0)) * 100;
-    return n;
-}
-
-
 class RuntimeClient : public CAASBase,
                       public IRuntimeClient
 {
@@ -282,6 +344,17 @@ IRuntime * RuntimeClient::getRuntime()
 ///          The Service Client contains the application logic.
 ///
 /// When we request an AFU (Service) from AAL, the request will be fulfilled by calling into this interface.
+class HelloSPLLBApp;
+
+/// @brief Work of one CPU lookup thread in the hybrid dispatch.
+struct CpuLookupArgs {
+   HelloSPLLBApp    *app;
+   const bt16bitInt *src;        ///< AFU-layout input lines
+   size_t            inLines;
+   bt16bitInt       *dst;        ///< Output lines in the AFU's format
+   double            seconds;    ///< Busy time, filled in by the thread
+};
+
 class HelloSPLLBApp: public CAASBase, public IServiceClient, public ISPLClient
 {
 public:
@@ -290,6 +363,9 @@ public:
    ~HelloSPLLBApp();
 
    btInt run();
+
+   /// Replay a pcap/pcapng capture instead of filling the source buffer with random data.
+   void setTraceFile(const char *path) { m_TraceFile = path; }
    void Show2CLs(void *pCLExpected,
                  void *pCLFound,
                  ostringstream &oss);
@@ -307,7 +383,7 @@ public:
 				          bt16bitInt * idx, bt16bitInt * result);
 				  
    void setIntersec16par(int numSetGroup, int numSet, bt16bitInt ** setData, 
-				   bt16bitInt ** idxOutGroup, bt16bitInt * result, int threadCount);
+				   const bt16bitInt *const * idxLanes, bt16bitInt * result, int threadCount);
 				   
    void setIntersec16serial(int numSetGroup, 
                    int numSet, int numTasks, bt16bitInt ** setData, 
@@ -315,6 +391,11 @@ public:
 				   
    timespec calculate_time_interval(timespec late, timespec early);
 
+   void pinMergeThread(int tid, int &node);
+   void countListRead(int node, const bt16bitInt *list);
+   static void * cpuLookupThread(void *arg);
+   void showNumaStats();
+
    // <ISPLClient>
    virtual void OnTransactionStarted(TransactionID const &TranID,
                                      btVirtAddr AFUDSM,
@@ -367,6 +448,17 @@ protected:
   bt16bitInt ** setData;
 
   bt16bitInt ** keyData;
+
+   NumaTopology     m_Topology;       ///< Sockets and their CPUs
+   RuleSetArena     m_RuleArena;      ///< Backing store of setData, per-node copies
+   std::vector<int> m_MergeCpus;      ///< CPUs for merge workers, nearest the workspace first
+
+   const char      *m_TraceFile;      ///< Capture to replay, NULL for random source data
+   MergeMemo        m_MergeMemo;      ///< Leaf-index tuple -> first common rule (rules[0] only)
+   AfuMetrics       m_Metrics;        ///< DSR, cache-controller and host stage counters
+   HybridDispatcher m_Dispatch;       ///< Block split between the AFU and the CPU tree walk
+   TreeWalkEngine   m_TreeWalk;       ///< SSE2 tree walk over keyData, AFU output format
+   bool             m_TablesMatch;    ///< keyData holds the AFU's tables for the whole transaction
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -382,7 +474,9 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
    m_pWkspcVirt(NULL),
    m_WkspcSize(0),
    m_AFUDSMVirt(NULL),
-   m_AFUDSMSize(0)
+   m_AFUDSMSize(0),
+   m_TraceFile(NULL),
+   m_TablesMatch(false)
 {
    SetSubClassInterface(iidServiceClient, dynamic_cast<IServiceClient *>(this));
    SetInterface(iidSPLClient, dynamic_cast<ISPLClient *>(this));
@@ -395,22 +489,33 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
    //Initialize setData
    const int max_num = 1<<5-1;  
    
-   setData  = new bt16bitInt * [num_setgroup*num_set];  //
-   for(int i = 0; i < num_setgroup*num_set; i++) {
-        setData[i] = new bt16bitInt[num_setSize];
-    }
+   m_RuleArena.allocate(m_Topology, num_setgroup*num_set, num_setSize, numa_ruleset_policy);
+   setData = m_RuleArena.lists(0);
    
-   //std::srand((uint)std::time(0));
-   for(int i = 0; i < num_setgroup*num_set; i++)
-	   for(int k = 0; k < num_setSize; k++)
-	   {
-		   setData[i][k] = (bt16bitInt)(random_function() % max_num);
-	   }
+   // fill and sort on all cores, one seeded stream per list
+   RuleBuilder builder(ruleset_seed);
+   RuleBuildTiming bt = builder.buildSorted(setData, num_setgroup*num_set, num_setSize, max_num);
+   MSG("Built " << bt.lists << " rule lists (" << bt.bytes << " bytes) in " << bt.seconds
+       << " s on " << bt.threads << " threads, seed " << builder.seed());
 
+	// leaves with identical lists share one stored copy
+	{
+		std::vector<unsigned> listIds;
+		size_t numUnique = ruleListIds(setData, num_setgroup*num_set, num_setSize, listIds, NULL);
+		m_RuleArena.compact(listIds, numUnique);
+		setData = m_RuleArena.lists(0);
+		MSG("Rule lists: " << numUnique << " distinct of " << num_setgroup*num_set
+		    << ", " << m_RuleArena.bytes() << " bytes per copy");
+	}
+
+	// replicate/interleave the finished lists over the sockets
+	m_RuleArena.publish(m_Topology);
+	m_MergeCpus = m_Topology.cpusNearNode(0);
 
-    for(int i = 0; i < num_setgroup*num_set; i++)
-	    //std::sort(setData[i], num_setSize, sizeof(bt16bitInt), compareUint);
-		std::sort(setData[i], setData[i]+num_setSize);
+	// memoized merge results are only valid for the lists they came from
+	if (merge_memo_MB > 0 && num_set <= MERGE_MEMO_WORDS)
+	    m_MergeMemo.create(MB(merge_memo_MB));
+	m_MergeMemo.invalidate();
 	
 	//Initialize keyData
 	// char ram_init_data[] = "tree_data_0";
@@ -421,12 +526,23 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
         keyData[i] = new bt16bitInt[1<<tree_depth];
      }
    
-    //std::srand((uint)std::time(0));
-    for(int i = 0; i < tree_depth; i++)
-	   for(int k = 0; k < (1<<tree_depth); k++)
-	   {
-		   keyData[i][k] = (bt16bitInt)(random_function() % max_num);
-	   }
+    bt = builder.buildRandom(keyData, tree_depth, 1<<tree_depth, max_num);
+    MSG("Built tree keys in " << bt.seconds << " s");
+    // a reload swaps the AFU's tables in the middle of the transaction, so only
+    // the init tables are the same on both sides for every block
+    if (tree_reload) {
+        foldTreeLevels(keyData, tree_depth, 1<<tree_depth);
+    } else {
+        int init_levels = loadTreeInitFiles(keyData, tree_depth, 1<<tree_depth, tree_init_files);
+        m_TablesMatch = (init_levels >= tree_depth);
+        if (!m_TablesMatch)
+            ERR("Only " << init_levels << " of " << tree_depth << " levels in " << tree_init_files
+                << "*, the CPU cannot walk the AFU's tables");
+    }
+    m_TreeWalk.init(keyData, tree_depth, 1<<tree_depth);
+    m_TreeWalk.setRuleLists(setData, num_setgroup, num_setSize);
+    if (rule_list_hex[0] != '\0' && !writeRuleListHex(rule_list_hex, setData, std::min(num_setgroup, 1<<tree_depth), num_setSize))
+        ERR("Cannot write " << rule_list_hex);
 
 
 }
@@ -434,10 +550,7 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
 HelloSPLLBApp::~HelloSPLLBApp()
 {
    m_Sem.Destroy();
-   for(int i = 0; i < num_setgroup*num_set; ++i) {
-        delete [] setData[i];
-    }
-    delete [] setData;
+   // setData rows belong to m_RuleArena
 	
 	 for(int i = 0; i < tree_depth; ++i) {
         delete [] keyData[i];
@@ -605,6 +718,8 @@ void HelloSPLLBApp::setIntersec16func(int numSetGroup,
 	   std::cout<<std::endl;
 	}*/
 	
+	// 0 unless the lists have a rule in common; the caller's buffer is reused
+	result[0] = 0;
 	while(!finished && !findsec)
 	{
 		finished = 0;
@@ -651,7 +766,7 @@ void HelloSPLLBApp::setIntersec16func(int numSetGroup,
 void HelloSPLLBApp::setIntersec16par(int numSetGroup, 
                    int numSet,
                    bt16bitInt ** setData, 
-				   bt16bitInt ** idxOutGroup,
+				   const bt16bitInt *const * idxLanes,
 				   bt16bitInt * result,
 				   int threadCount)
 {
@@ -661,53 +776,174 @@ void HelloSPLLBApp::setIntersec16par(int numSetGroup,
 	int k = 0;
 	bt16bitInt ** setData_tmp;	
 	bt16bitInt * idx_tmp;
+	bt16bitInt ** setData_local;
+	int node;
 	
 	omp_set_dynamic(0);
 	omp_set_num_threads(threadCount); 
-    #pragma omp parallel shared(numSetGroup, numSet, setData, idxOutGroup,   \
+    #pragma omp parallel shared(numSetGroup, numSet, setData, idxLanes,   \
                                 result, nthreads) \
-                        private(i, j, k, tid, setData_tmp, idx_tmp)
+                        private(i, j, k, tid, setData_tmp, idx_tmp, setData_local, node)
 	{
 		tid = omp_get_thread_num();
         nthreads = omp_get_num_threads();
+
+		// stay next to the workspace and read the rule lists from the local copy
+		pinMergeThread(tid, node);
+		setData_local = m_RuleArena.lists(node);
+		// one packet per thread
+		__sync_fetch_and_add(&m_RuleArena.stats(node).tasks, 1);
 	    //if(tid == 0)
         //    std::cout<<"Num of threads"<<nthreads<<std::endl;
 		
-		setData_tmp = new bt16bitInt* [num_set];
-		idx_tmp = new bt16bitInt [num_set];
+		// same leaves, same answer: skip the list copies and the walk
+		MergeMemo::Key mkey;
+		CachedRules    memo;
+		::memset(&mkey, 0, sizeof(mkey));
+		for(j = 0; j < num_set; j++)
+		    mkey.w[j] = idxLanes[j][tid] % num_setgroup;
+
+		// all lanes on the same stored list: the first common rule is its head
+		bool sameList = true;
+		for(j = 1; j < num_set; j++)
+		    sameList = sameList && m_RuleArena.listId(idxLanes[j][tid] % num_setgroup + 0*num_setgroup) ==
+		                           m_RuleArena.listId(idxLanes[0][tid] % num_setgroup + 0*num_setgroup);
+
+		if (m_MergeMemo.lookup(mkey, memo, tid)) {
+		    result[tid] = memo.rules[0];
+		} else if (sameList) {
+		    countListRead(node, setData_local[idxLanes[0][tid] % num_setgroup + 0*num_setgroup]);
+		    result[tid] = setData_local[idxLanes[0][tid] % num_setgroup + 0*num_setgroup][0];
+		} else {
+			setData_tmp = new bt16bitInt* [num_set];
+			idx_tmp = new bt16bitInt [num_set];
 		
-	    for(j = 0; j < num_set; j++) {
-            setData_tmp[j] = new bt16bitInt[num_setSize];
-        }
+		    for(j = 0; j < num_set; j++) {
+	            setData_tmp[j] = new bt16bitInt[num_setSize];
+	        }
 				
-		for(j = 0; j<num_set; j++)
-	    {
-		    idx_tmp[j] = 0;
-	    }		    
+			for(j = 0; j<num_set; j++)
+		    {
+			    idx_tmp[j] = 0;
+		    }		    
 		
-        for(j = 0; j < num_set; j++)
-	      for(k = 0; k < num_setSize; k++)
-	    {   
-	       bt16bitInt idxOut = idxOutGroup[tid][j] % num_setgroup;
-		   //setData_tmp[j][k] = setData[idxOut+j*num_setgroup][k];
+	        for(j = 0; j < num_set; j++)
+		        countListRead(node, setData_local[idxLanes[j][tid] % num_setgroup + 0*num_setgroup]);
+
+	        for(j = 0; j < num_set; j++)
+		      for(k = 0; k < num_setSize; k++)
+		    {   
+		       bt16bitInt idxOut = idxLanes[j][tid] % num_setgroup;
+			   //setData_tmp[j][k] = setData[idxOut+j*num_setgroup][k];
 		   
-		   //TEST1
-		   setData_tmp[j][k] = setData[idxOut+0*num_setgroup][k];
-	    }
+			   //TEST1
+			   setData_tmp[j][k] = setData_local[idxOut+0*num_setgroup][k];
+		    }
 	   
-	   setIntersec16func(num_setgroup,num_set,setData_tmp,idx_tmp,result+tid);	   
+		   setIntersec16func(num_setgroup,num_set,setData_tmp,idx_tmp,result+tid);	   
 	   
-	   delete [] idx_tmp;  
+		   delete [] idx_tmp;  
 	   
-	   for(int j = 0; j < num_set; ++j) {
-          delete [] setData_tmp[j];
-       }
-	   delete [] setData_tmp;
+		   for(int j = 0; j < num_set; ++j) {
+	          delete [] setData_tmp[j];
+	       }
+		   delete [] setData_tmp;
+
+		    // setIntersec16func stops at the first common rule, so the memo
+		    // carries rules[0] only; total 0 marks the match count as unknown
+		    ::memset(&memo, 0, sizeof(memo));
+		    memo.count = 1;
+		    memo.rules[0] = result[tid];
+		    m_MergeMemo.insert(mkey, memo, tid);
+		}
 	}	
 }
 
 
 
+// CPU side of the hybrid lookup: walk the blocks behind the AFU's share,
+// claimed from the back, and publish them to the merge loop.
+void * HelloSPLLBApp::cpuLookupThread(void *arg)
+{
+	CpuLookupArgs *a = reinterpret_cast<CpuLookupArgs *>(arg);
+	double start = AfuMetrics::now();
+	int b;
+
+	while ((b = a->app->m_Dispatch.claimBack()) >= 0) {
+	    a->app->m_TreeWalk.afuOutputLines(a->src, a->inLines, a->dst,
+	                                      (size_t)b * block_size, (size_t)(b + 1) * block_size);
+	    a->app->m_Dispatch.blockDone(b, HybridDispatcher::ENGINE_CPU);
+	}
+	a->seconds = (AfuMetrics::now() - start) / 1000;
+	return NULL;
+}
+
+// Job ring check: the first blocks go through the ring again and each
+// output is compared with the transaction's.  Returns the blocks that
+// differ, -1 on timeout.
+template <class Svc>
+static int checkJobRing(AfuJobQueue<Svc> &jobs, const AfuOutputFormat &fmt, btVirtAddr pSource,
+                        btVirtAddr pDest, btVirtAddr pRingDest, unsigned numBlocks)
+{
+	size_t   out_bytes = CL(fmt.outLineOf(block_size - 1) + 1);
+	unsigned sub = 0, got = 0;
+	int      bad = 0;
+
+	for (int t = 0; got < numBlocks; ) {
+	    // job id is the block, its output slot the ring entry
+	    while (sub < numBlocks
+	           && jobs.submit(pSource + CL((size_t)sub * block_size),
+	                          pRingDest + CL((size_t)(sub % jobs.capacity()) * block_size), block_size, sub))
+	        sub++;
+	    uint32_t id, n;
+	    if (jobs.reap(id, n)) {
+	        if (::memcmp(pRingDest + CL((size_t)(id % jobs.capacity()) * block_size),
+	                     pDest + CL(fmt.outLineOf((size_t)id * block_size)), out_bytes) != 0)
+	            bad++;
+	        got++;
+	    } else if (++t > timeout * 1000) {
+	        return -1;
+	    } else {
+	        SleepMilli(1);
+	    }
+	}
+	return bad;
+}
+
+// Pin an OpenMP merge worker to its CPU once; later calls only look up the node.
+void HelloSPLLBApp::pinMergeThread(int tid, int &node)
+{
+	static __thread int pinned_cpu = -1;
+	int cpu = m_MergeCpus[tid % m_MergeCpus.size()];
+
+	if (pinned_cpu != cpu) {
+	    if (m_Topology.pinCurrentThread(cpu))
+	        __sync_fetch_and_add(&m_RuleArena.stats(m_Topology.nodeOfCpu(cpu)).threads, 1);
+	    pinned_cpu = cpu;
+	}
+	node = m_Topology.nodeOfCpu(cpu);
+}
+
+// Count a rule list a merge worker reads, and whether its page is on the worker's node.
+void HelloSPLLBApp::countListRead(int node, const bt16bitInt *list)
+{
+	__sync_fetch_and_add(&m_RuleArena.stats(node).listReads, 1);
+	if (m_RuleArena.isLocal(node, list))
+	    __sync_fetch_and_add(&m_RuleArena.stats(node).localHits, 1);
+}
+
+
+void HelloSPLLBApp::showNumaStats()
+{
+	MSG("NUMA nodes " << m_Topology.numNodes() << ", rule-set copies " << m_RuleArena.numCopies());
+	for (int n = 0; n < m_Topology.numNodes(); n++) {
+	    NumaNodeStats &st = m_RuleArena.stats(n);
+	    MSG("  node " << n << ": workers " << st.threads << ", packets merged " << st.tasks
+	        << ", list reads " << st.listReads << ", node-local " << st.localHits);
+	}
+}
+
+
 void HelloSPLLBApp::setIntersec16serial(int numSetGroup, 
                    int numSet,
 				   int numTasks,
@@ -854,9 +1090,26 @@ btInt HelloSPLLBApp::run()
       MSG("Allocated " << WSLen << "-byte Workspace at virtual address "
                        << std::hex << (void *)pWSUsrVirt);
 
+      // Take every page fault now, from all cores, instead of inside the fill loop
+      timespec setup_start, setup_end, setup_diff;
+      clock_gettime(CLOCK_REALTIME, &setup_start);
+      prefaultParallel(pWSUsrVirt, WSLen);
+
       // Number of bytes in each of the source and destination buffers (4 MiB in this case)
-      btUnsigned32bitInt a_num_bytes= (btUnsigned32bitInt) ((WSLen - sizeof(VAFU2_CNTXT)) / 2);
+      // the tree table image, the second tenant and the job ring take the last lines
+      btUnsigned32bitInt a_num_bytes= (btUnsigned32bitInt) ((WSLen - sizeof(VAFU2_CNTXT) - CL(ws_tail_lines)) / 2);
       btUnsigned32bitInt a_num_cl   = a_num_bytes / CL(1);  // number of cache lines in buffer
+      // the AFU is started over its measured share of the blocks only, CPU workers
+      // cover the rest; a CPU walk over other tables than the AFU's would give
+      // other leaves
+      const int cpu_workers = m_TablesMatch ? hybrid_cpu_workers : 0;
+      if ( hybrid_cpu_workers > 0 && cpu_workers == 0 ) {
+         MSG("CPU lookup workers off, keyData does not hold the AFU's tree tables");
+      }
+      btUnsigned32bitInt a_afu_blocks = a_num_cl / block_size;
+      if ( cpu_workers > 0 ) {
+         a_afu_blocks = m_Dispatch.afuBlocks(a_num_cl / block_size, cpu_workers);
+      }
 
       // VAFU Context is at the beginning of the buffer
       VAFU2_CNTXT       *pVAFU2_cntxt = reinterpret_cast<VAFU2_CNTXT *>(pWSUsrVirt);
@@ -880,7 +1133,7 @@ btInt HelloSPLLBApp::run()
 
       // Initialize the command buffer
       ::memset(pVAFU2_cntxt, 0, sizeof(VAFU2_CNTXT));
-      pVAFU2_cntxt->num_cl  = a_num_cl;
+      pVAFU2_cntxt->num_cl  = (a_afu_blocks < a_num_cl / block_size) ? a_afu_blocks * block_size : a_num_cl;
       pVAFU2_cntxt->pSource = pSource;
       pVAFU2_cntxt->pDest   = pDest;
 
@@ -892,25 +1145,56 @@ btInt HelloSPLLBApp::run()
           " 0x"            << std::hex << pVAFU2_cntxt->num_cl * CL(1) << std::dec << ")");
 
       // Init the src/dest buffers, based on the desired sequence (either fixed or random).
-      MSG("Initializing source buffer with random pattern. (src=random 32 bits unsigned integer)");
-
-      //std::srand((uint)std::time(0));
-
-
-
-
-
-      for (int i = 0; i < a_num_bytes; i++) {
-          //char random = (char) (std::rand() % 256);
-          char random = (char) (random_function() % 256);
-          ::memset( pSource + i, random, 1);
+      PcapFile trace;
+      if ( (NULL != m_TraceFile) && trace.open(m_TraceFile) && (trace.numPackets() > 0) ) {
+         MSG("Initializing source buffer from capture " << m_TraceFile << " (" << trace.numPackets() << " packets)");
+         // hardware and ASE run the same afu_user.v: keys [255:0], index bits [271:256]
+         PacketIngest ingest(CL_LAYOUT_AFU);
+         ingest.fields().preset(key_layout);
+         MSG("Lookup lanes per packet " << ingest.fields().numLanes() << " in "
+             << ingest.fields().linesPerPacket() << " cache line(s)");
+         ingest.emit(trace, 0, pSource, a_num_cl);
+         MSG("Packets parsed=" << ingest.parsed() << " non-IP=" << ingest.nonIp());
+      } else {
+         if ( NULL != m_TraceFile ) {
+            ERR("Cannot read capture " << m_TraceFile << ", falling back to random source data");
+         }
+         if ( WL_SOURCE_HEADERS == source_model ) {
+            PacketIngest ingest(CL_LAYOUT_AFU);
+            ingest.fields().preset(key_layout);
+            HeaderModel model(source_seed);
+            MSG("Initializing source buffer with generated headers (" << model.numFlows() << " Zipf flows)");
+            ::memset(pSource, 0, a_num_bytes);
+            fillHeaderLines(model, ingest, source_seed, pSource, a_num_cl);
+         } else {
+            MSG("Initializing source buffer with random pattern. (src=random 32 bits unsigned integer)");
+            // Parallel fill with non-temporal stores, one stream per chunk
+            parallelStreamFill<UniformLineGen>(pSource, a_num_bytes, source_seed);
+         }
       }
-     
+
+      // keyData is the AFU's init tables (m_TablesMatch) or goes with its tables file
+      if (tree_vector_tables[0] != '\0' && !writeTreeLevelsHex(tree_vector_tables, keyData, tree_vector_levels))
+          ERR("Cannot write " << tree_vector_tables);
+      if (tree_vector_file[0] != '\0' && (m_TablesMatch || tree_vector_tables[0] != '\0')
+          && !m_TreeWalk.writeAfuVectors(tree_vector_file, reinterpret_cast<const bt16bitInt *>(pSource),
+                                         std::min<size_t>(tree_vector_lines, a_num_cl), tree_vector_levels))
+          ERR("Cannot write " << tree_vector_file);
 
       MSG("Initializing destination buffer with fixed pattern. (dest=0xbebebebe)");
       
       //::memset( pSource, 0xAF, a_num_bytes - 3);
-      ::memset( pDest,   0xBE, a_num_bytes );
+      streamFill( pDest,   0xBE, a_num_bytes );
+
+      clock_gettime(CLOCK_REALTIME, &setup_end);
+      setup_diff = calculate_time_interval(setup_end, setup_start);
+      MSG("Workspace setup takes " << (double)setup_diff.tv_sec*1000 + (double)setup_diff.tv_nsec/1000000 << "ms");
+
+      // Merge workers go to the socket holding the destination buffer the AFU writes
+      int ws_node = m_Topology.nodeOfAddress(pDest);
+      m_MergeCpus = m_Topology.cpusNearNode(ws_node < 0 ? 0 : ws_node);
+      MSG("Workspace on NUMA node " << ws_node << " of " << m_Topology.numNodes());
+      m_RuleArena.resetStats();
 
       // Buffers have been initialized
       ////////////////////////////////////////////////////////////////////////////
@@ -921,9 +1205,77 @@ btInt HelloSPLLBApp::run()
       // Acquire the AFU. Once acquired in a TransactionContext, can issue CSR Writes and access DSM.
       // Provide a workspace and so also start the task.
       // The VAFU2 Context is assumed to be at the start of the workspace.
-      MSG("Starting SPL Transaction with Workspace");
-      m_SPLService->StartTransactionContext(TransactionID(), pWSUsrVirt, 100);
-      m_Sem.Wait();
+      AfuJobQueue<ISPLAFU> jobs;
+      btVirtAddr pRing     = pWSUsrVirt + WSLen - CL(ws_tail_lines);
+      btVirtAddr pRingDest = pRing + CL(afuJobRingLines(job_queue_bits));
+      // the CPU walk keeps the format of the last transaction when there is none
+      AfuOutputFormat out_fmt = m_TreeWalk.outputFormat();
+      bool match_rejected = false;
+      bool match_checked = false;
+      // an AFU share of no blocks runs no transaction, the CPU workers claim them all
+      const bool afu_run = (a_afu_blocks > 0);
+      if (afu_run) {
+         MSG("Starting SPL Transaction with Workspace");
+         // the output format is latched when the DSR base is written, so ask first
+         m_SPLService->CSRWrite(AFU_CSR_OUT_FMT, out_format);
+         // the job ring is served as the second tenant
+         m_SPLService->CSRWrite(AFU_CSR_SHARE, afuShareWord(afu_shared || job_queue, 1, 1));
+         if (job_queue)
+             jobs.init(m_SPLService, pRing, job_queue_bits);
+         m_SPLService->StartTransactionContext(TransactionID(), pWSUsrVirt, 100);
+         m_Sem.Wait();
+
+         // the AFU ID line answers with the format it accepted
+         for (int t = 0; t < timeout * 1000 / sleep_interval
+                         && 0 == *reinterpret_cast<volatile btUnsigned32bitInt *>(m_AFUDSMVirt); t++)
+             SleepMilli(sleep_interval);
+         if (!out_fmt.readDsm(m_AFUDSMVirt))
+             MSG("AFU does not report its output format, assuming sparse lines");
+         MSG("AFU output format " << out_fmt.format << ", " << out_fmt.linesPerCl << " input lines per output line");
+         m_TreeWalk.setOutputFormat(out_fmt);
+         m_TreeWalk.setAfuLevels(out_fmt.indexBits ? (int)out_fmt.indexBits : tree_depth);
+         if (m_TreeWalk.spillLevels() > 0)
+             MSG("AFU walks " << out_fmt.indexBits << " of " << tree_depth << " levels, the rest are finished on the host");
+         // rule_match.v addresses its lists by the AFU's INDEX_BITS (its tree
+         // depth); any other host depth picks different lists
+         if (out_fmt.isMatch() && out_fmt.indexBits != tree_depth) {
+             ERR("AFU match stage uses " << out_fmt.indexBits << "-bit leaves, the host tree has " << tree_depth
+                 << " levels: MATCH rejected, the CPU recomputes the AFU's blocks");
+             match_rejected = true;
+         }
+      } else {
+         MSG("AFU gets no blocks, no SPL Transaction; the CPU walks all " << a_num_cl / block_size);
+      }
+      TreeTableStatus tbl_status;
+      tbl_status.readDsm(m_AFUDSMVirt);
+      const unsigned tbl_gen = tbl_status.gen;
+      if (tree_reload && afu_run) {
+          int afu_levels = out_fmt.indexBits ? (int)out_fmt.indexBits : tree_depth;
+          if (afu_levels > tree_depth) {
+              ERR("AFU holds " << afu_levels << " levels, keyData only " << tree_depth << ", tables not reloaded");
+          } else {
+              btVirtAddr pImage = pWSUsrVirt + WSLen - CL(treeImageLines(tree_depth));
+              buildTreeImage(keyData, afu_levels, pImage);
+              requestTreeLoad(m_SPLService, pImage);
+              MSG("Reloading " << afu_levels << " AFU tree levels, " << treeImageLines(afu_levels) << " lines");
+          }
+      }
+      AfuTenantPool<ISPLAFU> tenants;
+      btVirtAddr pTenantDesc = pWSUsrVirt + WSLen - CL(treeImageLines(tree_depth)) - CL(2);
+      btVirtAddr pTenantDest = pTenantDesc - CL(block_size);
+      if (afu_shared && afu_run) {
+          // a job ring takes the AFU's second tenant
+          tenants.init(m_SPLService, reinterpret_cast<AfuTenantDesc *>(pTenantDesc),
+                       job_queue ? 1 : afuTenantSlots(m_AFUDSMVirt), &m_TreeWalk);
+          MSG("AFU runs " << afuTenantSlots(m_AFUDSMVirt) << " contexts"
+              << (tenants.afuAvailable() ? ", second tenant attached in shared mode" : ", second tenant runs on the CPU"));
+      }
+      if ( !m_Metrics.openPci() ) {
+         MSG("QPI cache counters not accessible, reporting DSR and host counters only");
+      }
+      if (afu_run)
+         m_Metrics.beginTransaction(m_AFUDSMVirt,
+                                    (double)setup_diff.tv_sec*1000 + (double)setup_diff.tv_nsec/1000000);
 
       // The AFU is running
       ////////////////////////////////////////////////////////////////////////////
@@ -965,7 +1317,31 @@ btInt HelloSPLLBApp::run()
      // check whether curr_line has been sorted
      btUnsigned32bitInt curr_block = 1;
      btUnsigned32bitInt a_num_block = a_num_cl / block_size;
+
+     // CPU lookup workers claim the blocks behind the AFU's, from the back
+     m_Dispatch.reset(a_num_block, a_afu_blocks);
+     struct CpuLookupArgs cpu_args[hybrid_cpu_workers > 0 ? hybrid_cpu_workers : 1];
+     pthread_t            cpu_threads[hybrid_cpu_workers > 0 ? hybrid_cpu_workers : 1];
+     double               afu_last_ms = AfuMetrics::now();
+     double               afu_first_ms = afu_last_ms;
+     bool                 afu_stalled  = false;
+     unsigned             afu_taken    = 0;      // AFU blocks walked here after a stall
+     for (int w = 0; w < cpu_workers; w++) {
+         cpu_args[w].app      = this;
+         cpu_args[w].src      = reinterpret_cast<const bt16bitInt *>(pSource);
+         cpu_args[w].inLines  = a_num_cl;
+         cpu_args[w].dst      = reinterpret_cast<bt16bitInt *>(pDest);
+         cpu_args[w].seconds  = 0.0;
+         pthread_create(&cpu_threads[w], NULL, cpuLookupThread, &cpu_args[w]);
+     }
 	 btUnsigned32bitInt num_tasks = num_threads;
+
+	 // leaf indices of a block, lane by lane; merge task t reads lane k at
+	 // task_lanes[k][t], so nothing is copied or allocated per packet
+	 AfuLeafDecoder leaf_decode;
+	 leaf_decode.init(num_set, tree_depth, block_size);
+	 const bt16bitInt *task_lanes[num_set];
+	 std::vector<bt16bitInt> task_result(num_tasks);
 	 
 	  MSG("Value of a_num_cl");
 	  MSG(a_num_cl);
@@ -978,11 +1354,13 @@ btInt HelloSPLLBApp::run()
 	  
      while (curr_block <= a_num_block) {	
    
-        if (::memcmp(tCacheLine, &pDestCL[0], CL(1)) != 0 && hw_started == false) {
+        if ((::memcmp(tCacheLine, &pDestCL[0], CL(1)) != 0 || m_Dispatch.produced(HybridDispatcher::ENGINE_CPU) > 0)
+            && hw_started == false) {
 	    //if (::memcmp(0xbe, (&pDestCL[0]), sizeof(btUnsigned32bitInt)) != 0 
 		         //&& hw_started == false) 
             clock_gettime(CLOCK_REALTIME, &start_time);
             hw_started = true;
+            m_Metrics.firstOutput();
          }
 
         //if (::memcmp(tCacheLine, &pDestCL[1], CL(1)) != 0 && time_recorded == false) {
@@ -994,7 +1372,7 @@ btInt HelloSPLLBApp::run()
         // }
 		 
 		 /*
-         if (::memcmp(tCacheLine, &pDestCL[a_num_cl-1], CL(1)) != 0 && hw_sorted == false) {
+         if (::memcmp(tCacheLine, &pDestCL[out_fmt.outLineOf(a_num_cl-1)], CL(1)) != 0 && hw_sorted == false) {
               //clock_gettime(CLOCK_REALTIME, &curr_time);
               //diff = calculate_time_interval(curr_time, start_time);
               //
@@ -1005,52 +1383,64 @@ btInt HelloSPLLBApp::run()
          }*/
 
 
-         if (::memcmp(tCacheLine, &pDestCL[(curr_block) *  block_size - 1], CL(1)) != 0
- 		       && hw_started == true ) 
+         // an AFU block counts once its last line arrived
+         int blk = curr_block - 1;
+         if (!m_Dispatch.blockReady(blk) && blk < (int)a_afu_blocks) {
+             if (!afu_stalled
+                 && ::memcmp(tCacheLine, &pDestCL[out_fmt.outLineOf((curr_block) *  block_size - 1)], CL(1)) != 0
+                 && m_Dispatch.claimFront() == blk) {
+                 // levels spilled from the AFU, in place before the block is published
+                 m_TreeWalk.finishAfuRows(reinterpret_cast<const bt16bitInt *>(pSource), reinterpret_cast<bt16bitInt *>(pDest),
+                                          (size_t)blk * block_size, (size_t)(blk + 1) * block_size);
+                 if (out_fmt.isMatch() && match_rejected) {
+                     m_TreeWalk.afuOutputLines(reinterpret_cast<const bt16bitInt *>(pSource), a_num_cl,
+                                               reinterpret_cast<bt16bitInt *>(pDest),
+                                               (size_t)blk * block_size, (size_t)(blk + 1) * block_size);
+                 } else if (out_fmt.isMatch() && !match_checked) {
+                     // the first MATCH block from the AFU against the host's lists
+                     size_t bad = m_TreeWalk.matchMismatches(reinterpret_cast<const bt16bitInt *>(pSource), a_num_cl,
+                                                             reinterpret_cast<const bt16bitInt *>(pDest),
+                                                             (size_t)blk * block_size, (size_t)(blk + 1) * block_size);
+                     if (bad)
+                         ERR("MATCH block " << blk << ": " << bad << " of " << block_size
+                             << " lines differ from firstCommonRule() over the host lists (rule_lists not from this run?)");
+                     else
+                         MSG("MATCH block " << blk << " agrees with firstCommonRule() over the host lists");
+                     match_checked = true;
+                 }
+                 m_Dispatch.blockDone(blk, HybridDispatcher::ENGINE_AFU);
+                 afu_last_ms = AfuMetrics::now();
+             } else if (m_TablesMatch && (afu_stalled || AfuMetrics::now() - afu_last_ms > timeout * 1000)
+                        && m_Dispatch.claimFront() == blk) {
+                 // no AFU line for a whole timeout: walk the rest of its share here
+                 if (!afu_stalled)
+                     ERR("AFU stalled at block " << blk << ", walking its remaining blocks on the CPU");
+                 afu_stalled = true;
+                 m_TreeWalk.afuOutputLines(reinterpret_cast<const bt16bitInt *>(pSource), a_num_cl,
+                                           reinterpret_cast<bt16bitInt *>(pDest),
+                                           (size_t)blk * block_size, (size_t)(blk + 1) * block_size);
+                 m_Dispatch.blockDone(blk, HybridDispatcher::ENGINE_CPU);
+                 afu_taken++;
+             }
+         }
+
+         if (m_Dispatch.blockReady(blk) && hw_started == true ) 
 		//if (::memcmp(0xbe, (&pDestCL[(curr_block) *  block_size - 1]), sizeof(btUnsigned32bitInt)) != 0 && hw_started == true) 
 		 {
 
-			 btUnsigned32bitInt *pDestNext = pDestInt + (curr_block - 1) * 16 * block_size;		 
-			 
+			 double block_start = AfuMetrics::now();
+			 if (!out_fmt.isMatch())
+			     leaf_decode.decode(out_fmt, pDest, (size_t)(curr_block - 1) * block_size, block_size);
 			 
-			for(int jj = 0; jj < block_size/num_tasks; jj++) {  
-			   
-                btUnsigned32bitInt *pDestNextMulti = pDestNext + jj*num_tasks*16;
-				
-			    bt16bitInt ** idxOutGroup = new bt16bitInt *[num_tasks];
-				//bt16bitInt *idxOutGroup = reinterpret_cast<bt16bitInt *> pDestNextMulti;
-				//btUnsigned32bitInt *pDestInt = reinterpret_cast<btUnsigned32bitInt *>(pDest);
-		        bt16bitInt *result = new bt16bitInt [num_tasks];
-			     
-			    for(int i = 0; i < num_tasks; i++) {
-                    idxOutGroup[i] = new bt16bitInt[num_set];
-			        result[i] = 0;
-                }
+			// MATCH output already holds the best rule per packet, nothing to merge
+			for(int jj = 0; jj < block_size/num_tasks && !out_fmt.isMatch(); jj++) {  
+			    leaf_decode.taskLanes(jj*num_tasks, task_lanes);
 			 
-                //merge_hardware(pDestInt + (curr_block - 1) * 16 * block_size, 16 * block_size);
-			    for(int i = 0; i < num_tasks; i++){
-	               for(int k = 0; k < num_set; k++)
-	              {
-		        //bt16bitInt setIdx = setGroupIdx[i] % (1<<tree_depth);		   
-		            //idxOutGroup[i][k] = ((bt16bitInt)(*(pDestNextMulti 
-		            //                     // + (curr_block - 1) * 32 * block_size    //one block 16 cache lines
-		 			//					 + i*16          // one cl 16 32-bit data
-		 			//					 //+ j*num_set   // one cl two set groups
-					//		             + k
-		 			//					   )));
-					
-					//TEST1
-					idxOutGroup[i][k] = 5;
-		       // std::cout<<setData[i][k]<<",";
-	              }
-	            // std::cout<<std::endl;
-	           }
-	         
 			    //if(jj == 1 && curr_block == 1)
 		        //    clock_gettime(CLOCK_REALTIME, &merge_start);			
 			
                //call parallel
-			   setIntersec16par(num_setgroup,num_set,setData,idxOutGroup,result,num_tasks);
+			   setIntersec16par(num_setgroup,num_set,setData,task_lanes,&task_result[0],num_tasks);
 			   
 			   //if(jj == 1 && curr_block == 1){
 		       //    clock_gettime(CLOCK_REALTIME, &merge_end);		
@@ -1058,17 +1448,10 @@ btInt HelloSPLLBApp::run()
 			   //    double elaps = (double)diff.tv_sec*1000000000 + (double)diff.tv_nsec;
                //    MSG("***CPU merge latency is " << elaps << "ns");
 			   //}
-			    
-			    for(int i = 0; i < num_tasks; ++i) {
-                  delete [] idxOutGroup[i];
-               }
-               
-	           delete [] idxOutGroup;
-               delete [] result;
-			   
 			}
 			
 			
+			m_Metrics.blockMerged(block_size, AfuMetrics::now() - block_start);
 			curr_block += 1;
          }
 		 
@@ -1079,9 +1462,82 @@ btInt HelloSPLLBApp::run()
 
       diff = calculate_time_interval(curr_time, start_time);
       MSG("The whole look up and merge process takes " << (double)diff.tv_sec*1000 + (double)diff.tv_nsec/1000000 << "ms");
+
+      // every block is merged, so both engines are done with the lookup: fold
+      // their rates in now, m_Dispatch sizes the split of the next run() by them
+      for (int w = 0; w < cpu_workers; w++)
+          pthread_join(cpu_threads[w], NULL);
+      if (cpu_workers > 0) {
+          double cpu_sec = 0.0;
+          for (int w = 0; w < cpu_workers; w++)
+              cpu_sec = std::max(cpu_sec, cpu_args[w].seconds);
+          unsigned afu_n = m_Dispatch.produced(HybridDispatcher::ENGINE_AFU);
+          unsigned cpu_n = m_Dispatch.produced(HybridDispatcher::ENGINE_CPU) - afu_taken;
+          if (!afu_stalled)
+              m_Dispatch.recordRate(HybridDispatcher::ENGINE_AFU, afu_n, (afu_last_ms - afu_first_ms) / 1000);
+          m_Dispatch.recordRate(HybridDispatcher::ENGINE_CPU, cpu_n, cpu_sec);
+          MSG("Lookup blocks: AFU " << afu_n << " of " << a_afu_blocks << ", CPU " << cpu_n
+              << " of " << a_num_block - a_afu_blocks << "; rates " << m_Dispatch.rate(HybridDispatcher::ENGINE_AFU)
+              << " / " << m_Dispatch.rate(HybridDispatcher::ENGINE_CPU) << " blocks/s");
+      }
+      if (tree_reload && afu_run) {
+          for (int t = 0; t < timeout * 1000 / sleep_interval && tbl_status.gen == tbl_gen; t++) {
+              SleepMilli(sleep_interval);
+              tbl_status.readDsm(m_AFUDSMVirt);
+          }
+          if (tbl_status.gen == tbl_gen)
+              ERR("AFU did not report the tree table swap");
+          else
+              MSG("AFU tree tables swapped, bank " << tbl_status.bank << ", load " << tbl_status.gen);
+      }
+      // both tenants and the CPU fallback must walk the same tables (a reload only
+      // rewrites the transaction's bank); spilled levels are finished in place in
+      // the transaction's output
+      if (afu_shared && afu_run && m_TablesMatch && m_TreeWalk.spillLevels() == 0
+          && a_num_cl >= (btUnsigned32bitInt)block_size) {
+          int tenant = tenants.submit(reinterpret_cast<const bt16bitInt *>(pSource),
+                                      reinterpret_cast<bt16bitInt *>(pTenantDest), block_size);
+          if (!tenants.wait(tenant, (unsigned long)timeout * 1000000))
+              ERR("Second tenant did not complete");
+          else if (::memcmp(pTenantDest, pDest, CL(out_fmt.outLineOf(block_size - 1) + 1)) != 0)
+              ERR("Second tenant's output of block 0 differs from the transaction's");
+          else
+              MSG("Second tenant " << (AFU_TENANT_SW == tenant ? "(CPU)" : "(AFU)") << " matches block 0");
+      }
+      if (job_queue && afu_run && m_TablesMatch && m_TreeWalk.spillLevels() == 0) {
+          unsigned ring_blocks = std::min(a_num_block, 4u << job_queue_bits);
+          int ring_bad;
+          if (afuJobQueueBits(m_AFUDSMVirt) >= job_queue_bits) {
+              ring_bad = checkJobRing(jobs, out_fmt, pSource, pDest, pRingDest, ring_blocks);
+          } else {
+              // same ring protocol, served in-process
+              SoftAfu soft_afu(m_TreeWalk);
+              AfuJobQueue<SoftAfu> soft_jobs;
+              soft_jobs.init(&soft_afu, pRing, job_queue_bits);
+              ring_bad = checkJobRing(soft_jobs, out_fmt, pSource, pDest, pRingDest, ring_blocks);
+              soft_jobs.stop();
+              MSG("AFU has no job ring, SoftAfu served it");
+          }
+          if (ring_bad < 0)
+              ERR("Job ring timed out");
+          else if (ring_bad > 0)
+              ERR(ring_bad << " of " << ring_blocks << " job ring blocks differ from the transaction's");
+          else
+              MSG("Job ring: " << ring_blocks << " blocks match the transaction's");
+      }
+      // the transaction finishes once the ring is drained
+      if (job_queue && afu_run)
+          jobs.stop();
+      showNumaStats();
+
+      if (m_MergeMemo.isValid()) {
+          ResultCacheStats mm = m_MergeMemo.stats();
+          MSG("Merge memo: " << m_MergeMemo.capacity() << " entries, hits " << mm.hits
+              << ", misses " << mm.misses << ", evictions " << mm.evictions);
+      }
 	  
 
-      done = pVAFU2_cntxt->Status & VAFU2_CNTXT_STATUS_DONE;
+      done = afu_run ? (pVAFU2_cntxt->Status & VAFU2_CNTXT_STATUS_DONE) : 1;
       
       while (!done && count > 0) {
           SleepMilli(delay);
@@ -1090,6 +1546,10 @@ btInt HelloSPLLBApp::run()
       }
 
 
+      // a hung or stalled AFU gets no blocks in the next run(); CPU workers carry the lookup
+      if (afu_run)
+          m_Dispatch.setAfuAvailable(done != 0 && !afu_stalled);
+
       if ( !done ) {
          // must have dropped out of loop due to count -- never saw update
          ERR("AFU never signaled it was done. Timing out anyway. Results may be strange.\n");
@@ -1110,14 +1570,31 @@ btInt HelloSPLLBApp::run()
          // }
       }
 
+      // AFU cycle counters are written at task end, so collect after done
+      if (afu_run) {
+         const AfuMetricsSnapshot &snap = m_Metrics.endTransaction();
+         ostringstream metrics;
+         snap.write(metrics);
+         MSG("Metrics: " << metrics.str());
+         if (snap.rdValid)
+             MSG("Trees waited for input " << 100.0 * snap.rdStarvedFraction() << "% of the task, read window "
+                 << snap.rdWindowLines << " lines, peak " << snap.rdPendMax);
+         if ( ::strlen(metrics_file) > 0 ) {
+            std::ofstream mf(metrics_file, std::ios::app);
+            mf << metrics.str() << std::endl;
+         }
+      }
+
       ////////////////////////////////////////////////////////////////////////////
      // Stop the AFU
 
      // Issue Stop Transaction and wait for OnTransactionStopped
-     MSG("Stopping SPL Transaction");
-     m_SPLService->StopTransactionContext(TransactionID());
-     m_Sem.Wait();
-     MSG("SPL Transaction complete");
+     if (afu_run) {
+        MSG("Stopping SPL Transaction");
+        m_SPLService->StopTransactionContext(TransactionID());
+        m_Sem.Wait();
+        MSG("SPL Transaction complete");
+     }
 
      ////////////////////////////////////////////////////////////////////////////
      // Check the buffers to make sure they copied okay
@@ -1253,7 +1730,8 @@ void HelloSPLLBApp::serviceAllocated(IBase *pServiceBase,
    #define LB_BUFFER_SIZE MB(num_MB)
    #endif
 
-   m_SPLService->WorkspaceAllocate(sizeof(VAFU2_CNTXT) + LB_BUFFER_SIZE + LB_BUFFER_SIZE,
+   m_SPLService->WorkspaceAllocate(sizeof(VAFU2_CNTXT) + LB_BUFFER_SIZE + LB_BUFFER_SIZE
+                                   + CL(ws_tail_lines),
       TransactionID());
 
 }
@@ -1285,6 +1763,12 @@ void HelloSPLLBApp::OnWorkspaceAllocated(TransactionID const &TranID,
    m_pWkspcVirt = WkspcVirt;
    m_WkspcSize = WkspcSize;
 
+#if !defined( HWAFU )
+   // Software/ASE backends hand out ordinary process memory: ask for 2MB pages
+   // before anything touches it.  The hardware workspace is pinned driver memory.
+   adviseHugePages(WkspcVirt, WkspcSize);
+#endif
+
    MSG("Got Workspace");         // Got workspace so unblock the Run() thread
    m_Sem.Post(1);
 }
@@ -1408,6 +1892,9 @@ int main(int argc, char *argv[])
       ERR("Runtime Failed to Start");
       exit(1);
    }
+   if ( argc > 1 ) {
+      theApp.setTraceFile(argv[1]);
+   }
    btInt Result = theApp.run();
 
    MSG("Done");
@@ -28,7 +28,14 @@
 `include "spl_defines.vh"
 
 
-module afu_core (
+module afu_core #(
+    // source lines read ahead of the trees: requested and not yet taken in,
+    // also the depth of the afu_user input FIFO that has to hold them
+    parameter RD_WINDOW_BITS = 7+`MAX_TRANSFER_SIZE,
+    // init files of the tree tables and the rule lists, see afu_user
+    parameter TREE_INIT_DATA = "/import/usc/home/renchen/ren_ancs/rtl/afu2/tree_data_",
+    parameter LIST_INIT_DATA = "/import/usc/home/renchen/ren_ancs/rtl/afu2/rule_lists"
+) (
     input  wire                             clk,
     input  wire                             reset_n,
     
@@ -70,7 +77,30 @@ module afu_core (
         
      // afu_csr --> afu_core, afu_ctx   
     input  wire                             csr_ctx_base_valid,
-    input  wire [57:0]                      csr_ctx_base
+    input  wire [57:0]                      csr_ctx_base,
+
+     // afu_csr --> afu_core, output line format requested by the host
+    input  wire [1:0]                       csr_out_fmt,
+
+     // afu_csr --> afu_core, tree table image to load
+    input  wire                             csr_tbl_valid,
+    output reg                              csr_tbl_done,
+    input  wire [57:0]                      csr_tbl_base,
+
+     // afu_csr --> afu_core, further tenants of a shared AFU
+    input  wire                             csr_ctx1_valid,
+    output reg                              csr_ctx1_done,
+    input  wire [57:0]                      csr_ctx1_base,
+    input  wire                             csr_shared,
+    input  wire [15:0]                      csr_ctx_weight,
+    input  wire                             csr_tbl_ctx,
+
+     // afu_csr --> afu_core, job descriptor ring
+    input  wire                             csr_q_on,
+    input  wire [57:0]                      csr_q_base,
+    input  wire [4:0]                       csr_q_bits,
+    input  wire [31:0]                      csr_q_tail,
+    input  wire                             csr_q_stop
 );
 
 
@@ -83,17 +113,22 @@ module afu_core (
         TX_RD_STATE_RUN        = 3'b101,
         TX_RD_STATE_RUN1       = 3'b110;
         
-    localparam [0:0]
-        RX_RD_STATE__IDLE       = 1'b0,
-        RX_RD_STATE__RUN        = 1'b1;
-        
-    localparam [2:0]
-        TX_WR_STATE_IDLE       = 3'b000,
-        TX_WR_STATE_CTX        = 3'b001,
-        TX_WR_STATE_RUN        = 3'b010,
-        TX_WR_STATE_STATUS     = 3'b011,
-        TX_WR_STATE_FENCE      = 3'b100,
-        TX_WR_STATE_TASKDONE   = 3'b101;
+    localparam [3:0]
+        TX_WR_STATE_IDLE       = 4'b0000,
+        TX_WR_STATE_CTX        = 4'b0001,
+        TX_WR_STATE_RUN        = 4'b0010,
+        TX_WR_STATE_STATUS     = 4'b0011,
+        TX_WR_STATE_FENCE      = 4'b0100,
+        TX_WR_STATE_TASKDONE   = 4'b0101,
+        TX_WR_STATE_DONE1      = 4'b0110,   // tenant 1 completion record, after its fence
+        TX_WR_STATE_QHEAD      = 4'b0111,   // ring head doorbell
+        TX_WR_STATE_RDSTAT     = 4'b1000;   // read-starved counters, at task end
+
+    // what a read response is, kept in request order in rd_tag
+    localparam [1:0]
+        RD_KIND_DATA           = 2'b00,
+        RD_KIND_CTX            = 2'b01,
+        RD_KIND_TBL            = 2'b10;
                         
     localparam [1:0]        
         RXQ_RD_STATE_IDLE      = 2'b00,
@@ -104,49 +139,142 @@ module afu_core (
                 
     localparam [5:0]                
         AFU_CSR__LATENCY_CNT        = 6'b00_0100,
-        AFU_CSR__PERFORMANCE_CNT    = 6'b00_0101;
+        AFU_CSR__PERFORMANCE_CNT    = 6'b00_0101,
+        AFU_CSR__TBL_STATUS         = 6'b00_0110,
+        AFU_CSR__Q_HEAD             = 6'b00_0111,
+        AFU_CSR__RD_STATS           = 6'b00_1000;
                
     localparam AFU_ID               = 64'h111_00181;
+    // tenants: 0 owns the SPL transaction, 1 attaches through AFU_CSR_CTX1_BASEL
+    // once the host set shared mode; one tree table bank each
+    localparam [7:0] CTX_NUM        = 8'd2;
+    // job ring: tenant 1 takes its descriptors from a ring in host memory
+    // instead of AFU_CSR_CTX1_BASEL, up to 2^Q_BITS_MAX entries
+    localparam [7:0] Q_BITS_MAX     = 8'd16;
                         
                         
     reg                             tx_wr_run;
     reg  [5:0]                      tx_wr_cnt;
 
     reg  [2:0]                      tx_rd_state;
-    reg  [2:0]                      tx_wr_state;
-    reg                             rx_rd_state;
+    reg  [3:0]                      tx_wr_state;
     
     reg                             ctx_valid;
+    reg  [1:0]                      ctx_valid_d;
+    reg                             ctx_new1;       // tenant 1 descriptor arrived
 //    reg  [31:0]                     ctx_delay;
 //    reg  [15:0]                     ctx_threshold;
-    reg  [57:0]                     ctx_src_ptr;
-    reg  [57:0]                     ctx_dst_ptr;
-    reg  [31:0]                     ctx_length;
+    reg  [57:0]                     ctx_src_ptr [0:1];
+    reg  [57:0]                     ctx_dst_ptr [0:1];
+    reg  [31:0]                     ctx_length [0:1];
+    reg  [57:0]                     ctx1_base;
+    reg                             ctx1_active;    // attached, status line not yet written
+    reg                             ctx1_fin;       // tenant 1 status line written
+    reg  [31:0]                     ctx1_job;       // job id, dword 0 of the descriptor
+
+    // job ring: entries 0..2^csr_q_bits-1 are descriptors, the next as many
+    // lines their completion records; the host rings the tail, the AFU
+    // reports jobs completed as the head in DSM line AFU_CSR__Q_HEAD
+    reg  [31:0]                     q_fetch;        // descriptors fetched
+    reg  [31:0]                     q_done;         // completion records written
+    wire [31:0]                     q_slot;
+    wire [57:0]                     q_desc_addr;
+    wire [57:0]                     q_cpl_addr;
+    wire                            q_hold;         // tenant 0 stays open for the ring
+    wire [31:0]                     dsr_q_head_addr;
     
-    reg  [31:0]                     src_cnt;
+    reg  [31:0]                     src_cnt [0:1];
+    reg  [57:0]                     src_ptr [0:1];
+    reg  [1:0]                      rd_run;
     
     reg                             tx_rd_valid;
     reg  [5:0]                      tx_rd_len;
     reg  [57:0]                     tx_rd_addr;
-    reg  [57:0]                     tx_rd_addr_next;
+    reg  [1:0]                      tx_rd_kind;
+    reg                             tx_rd_ctx;
+    reg  [1:0]                      cor_tx_rd_kind;
+    reg                             cor_tx_rd_ctx;
     wire [6:0]                      tx_rd_addr_next_try;
     
     wire [6:0]                      tx_wr_addr_next_try;
     
-    reg  [9:0]                      tr_pend_cnt;
+    reg  [RD_WINDOW_BITS:0]         tr_pend_cnt;
     wire                            tr_pend_full;
+    wire                            rxq_input_re;
+    wire                            rxq_input_empty;
+
+    // where the trees' time goes while a task runs: busy with input, or
+    // starved with the read window full, with reads in flight, or with no
+    // read issued although source lines are left
+    reg  [31:0]                     rd_busy_cnt;
+    reg  [31:0]                     rd_starve_window_cnt;
+    reg  [31:0]                     rd_starve_mem_cnt;
+    reg  [31:0]                     rd_starve_issue_cnt;
+    reg  [31:0]                     rd_pend_max;    // most lines ever in the window
+    wire [31:0]                     dsr_rd_stats_addr;
+
+    // read arbitration between tenants: rd_cur keeps the read stream for
+    // its weight in bursts, and only hands it over on a whole output line
+    // (rd_turn lines, a multiple of out_lines_per_cl) so no output line
+    // mixes tenants
+    reg                             rd_cur;
+    reg  [15:0]                     rd_turn;
+    wire [7:0]                      rd_weight;
+    wire                            rd_turn_over;
+    wire                            rd_aligned;
+    wire [1:0]                      rd_has;         // tenant has source lines left
+    wire [1:0]                      rd_hold;        // tenant's bank is being loaded
+    wire                            rd_flow_ok;
+    wire                            rd_cur_ok;
+    wire                            rd_other_ok;
+
+    // responses: the tag of the oldest request, lines of it already received
+    wire [8:0]                      rd_tag_din;
+    wire [8:0]                      rd_tag;
+    wire                            rd_tag_empty;
+    wire                            rd_tag_re;
+    reg  [5:0]                      rd_tag_line;
+    reg  [31:0]                     rx_left [0:1];  // source lines still to arrive per tenant
+
+    // tree table reload: the image is read line by line into tree_loader
+    // between source bursts
+    reg                             tbl_loading;    // until tree_loader is done
+    reg                             tbl_ctx_r;
+    reg  [15:0]                     tbl_rd_left;
+    reg  [57:0]                     tbl_rd_addr;
+    reg  [15:0]                     tbl_rx_cnt;
+    reg                             tbl_we;
+    reg  [511:0]                    tbl_din;
+    reg                             tbl_load_start;
+    wire [15:0]                     tbl_lines;
+    wire [RD_WINDOW_BITS-1:0]       tbl_count;
+    wire                            tbl_room;
+    wire                            active_bank;
+    wire                            load_done;
+    reg  [31:0]                     tbl_gen;        // loads completed
+    reg                             tbl_status_pend;
+    wire [31:0]                     dsr_tbl_status_addr;
     
-    reg  [57:0]                     dst_ptr;
-    reg  [31:0]                     dst_cnt;
+    reg  [57:0]                     dst_ptr [0:1];
+    reg  [31:0]                     dst_cnt [0:1];
+    reg  [1:0]                      wr_run;
+    reg  [1:0]                      wr_done;
+    wire [1:0]                      wr_fin;         // tenant's lines all written, status pending
+    wire                            wr_idle;
+    wire                            rxq_rd_hold;
         
     reg  [511:0]                    rxq_din;
+    reg                             rxq_ctx;
+    reg                             rxq_last;
     reg                             rxq_we;
     reg                             rxq_re;
     wire [511:0]                    rxq_dout;
+    wire                            rxq_dout_ctx;
+    reg                             tx_data_ctx;
     wire                            rxq_empty;
     wire                            rxq_almostempty;
     wire                            rxq_full    /* synthesis syn_keep=1 */;
-    wire [3+`MAX_TRANSFER_SIZE:0]   rxq_count    /* synthesis syn_keep=1 */;
+    wire [RD_WINDOW_BITS-1:0]       rxq_count    /* synthesis syn_keep=1 */;
     wire                            rxq_almostfull;
     reg  [31:0]                     rxq_wr_cnt;
     reg  [31:0]                     rxq_rd_cnt;    
@@ -169,7 +297,14 @@ module afu_core (
     reg                             csr_scratch_done_tw;
     reg                             csr_scratch_done_rxq;
     
+    wire [1:0]                      out_fmt;
+    wire [7:0]                      out_fmt_caps;
+    wire [7:0]                      out_lines_per_cl;
+    wire [7:0]                      out_index_bits;
+    wire [7:0]                      out_match_lanes;
+
     reg  [57:0]                     status_addr;
+    reg  [57:0]                     status_addr1;
     reg                             status_addr_valid;
     reg                             status_addr_cr;
     
@@ -207,21 +342,42 @@ module afu_core (
 */
     afu_user #(.CORE_NUM_BITS(3),    // 8 search tree core
                .BLOCK_SIZE_BITS(8),  //  256 cachelines per 64B-block
-               .INPUT_FIFO_DEPTH_BITS(5+`MAX_TRANSFER_SIZE),
-               .OUTPUT_FIFO_DEPTH_BITS(5+`MAX_TRANSFER_SIZE)
+               .INPUT_FIFO_DEPTH_BITS(RD_WINDOW_BITS),
+               .OUTPUT_FIFO_DEPTH_BITS(5+`MAX_TRANSFER_SIZE),
+               .TREE_INIT_DATA(TREE_INIT_DATA),
+               .LIST_INIT_DATA(LIST_INIT_DATA)
                ) afu_user_mergesort (
         .clk(clk),
         .reset_n(reset_n & (~spl_reset)),
-        .ctx_length(ctx_length),
+        .out_fmt_req(csr_out_fmt),
+        .out_fmt(out_fmt),
+        .out_fmt_caps(out_fmt_caps),
+        .out_lines_per_cl(out_lines_per_cl),
+        .out_index_bits(out_index_bits),
+        .out_match_lanes(out_match_lanes),
         .rxq_din(rxq_din),
+        .rxq_ctx(rxq_ctx),
+        .rxq_last(rxq_last),
         .rxq_we(rxq_we),
         .rxq_re(rxq_re),
         .rxq_dout(rxq_dout),
+        .rxq_dout_ctx(rxq_dout_ctx),
         .rxq_output_empty(rxq_empty),
         .rxq_output_almost_empty(rxq_almostempty),
         .rxq_input_full(rxq_full),
         .rxq_input_count(rxq_count),
-        .rxq_input_almostfull(rxq_almostfull)
+        .rxq_input_almostfull(rxq_almostfull),
+        .rxq_input_re(rxq_input_re),
+        .rxq_input_empty(rxq_input_empty),
+        .load_start(tbl_load_start),
+        .shared(csr_shared),
+        .load_ctx(tbl_ctx_r),
+        .tbl_lines(tbl_lines),
+        .tbl_din(tbl_din),
+        .tbl_we(tbl_we),
+        .tbl_count(tbl_count),
+        .active_bank(active_bank),
+        .load_done(load_done)
     );
         
     //-----------------------------------------------------------
@@ -232,8 +388,29 @@ module afu_core (
     assign csr_scratch_update = csr_scratch_valid & (~csr_scratch_done) & (~spl_tx_wr_almostfull);   // disable DSR insertion
     assign dsr_latency_cnt_addr = csr_id_addr + AFU_CSR__LATENCY_CNT;
     assign dsr_performance_cnt_addr = csr_id_addr + AFU_CSR__PERFORMANCE_CNT;
+    assign dsr_tbl_status_addr = csr_id_addr + AFU_CSR__TBL_STATUS;
+    assign dsr_q_head_addr = csr_id_addr + AFU_CSR__Q_HEAD;
+    assign dsr_rd_stats_addr = csr_id_addr + AFU_CSR__RD_STATS;
     assign csr_scratch_done = csr_scratch_done_tw | csr_scratch_done_rxq;
-    assign tx_wr_addr_next_try = dst_ptr[5:0] + `MAX_TRANSFER_SIZE;
+    assign tx_wr_addr_next_try = dst_ptr[0][5:0] + `MAX_TRANSFER_SIZE;
+    assign wr_fin[0] = wr_run[0] & (~wr_done[0]) & (dst_cnt[0] == 32'b0) & (tx_wr_cnt == 6'b0) & (~q_hold);
+    assign wr_fin[1] = wr_run[1] & (~wr_done[1]) & (dst_cnt[1] == 32'b0) & (tx_wr_cnt == 6'b0);
+    assign wr_idle = (~tx_data_valid[0]) & (rxq_rd_active == 3'b0) & (~rxq_re);
+    // output lines stop coming while a tenant's status goes out
+    assign rxq_rd_hold = (|wr_fin) | (tx_wr_state != TX_WR_STATE_RUN);
+
+    // output lines for a tenant's input lines, lines_per_cl is a power of 2
+    function [31:0] out_lines;
+        input [31:0] in_lines;
+        input [7:0] lines_per_cl;
+        integer b;
+        begin
+            out_lines = in_lines;
+            for (b=1; b<8; b=b+1)
+                if (lines_per_cl == (8'd1 << b))
+                    out_lines = ({1'b0, in_lines} + lines_per_cl - 1'b1) >> b;
+        end
+    endfunction
     
            
     always @(posedge clk) begin
@@ -245,6 +422,12 @@ module afu_core (
             csr_id_done <= 1'b0;
             tx_wr_run <= 1'b0; 
             csr_scratch_done_tw <= 1'b0;
+            tbl_gen <= 32'b0;
+            tbl_status_pend <= 1'b0;
+            wr_run <= 2'b0;
+            wr_done <= 2'b0;
+            ctx1_fin <= 1'b0;
+            q_done <= 32'b0;
             tx_wr_state <= TX_WR_STATE_IDLE;
         end
         
@@ -252,8 +435,22 @@ module afu_core (
             cor_tx_wr_valid <= 1'b0;
             cor_tx_dsr_valid <= 1'b0;
             cor_tx_fence_valid <= 1'b0;
+            cor_tx_done_valid <= 1'b0;
             csr_id_done <= 1'b0;
             csr_scratch_done_tw <= 1'b0;       
+            ctx1_fin <= 1'b0;
+
+            if (ctx_new1) begin
+                dst_ptr[1] <= ctx_dst_ptr[1];
+                dst_cnt[1] <= out_lines(ctx_length[1], out_lines_per_cl);
+                wr_run[1] <= 1'b1;
+                wr_done[1] <= 1'b0;
+            end
+
+            if (load_done) begin
+                tbl_gen <= tbl_gen + 1'b1;
+                tbl_status_pend <= 1'b1;
+            end
 
             case (tx_wr_state)
                 TX_WR_STATE_IDLE : begin
@@ -262,14 +459,15 @@ module afu_core (
                         cor_tx_dsr_valid <= 1'b1;
                         cor_tx_wr_len <= 6'h1;
                         cor_tx_wr_addr <= {26'b0, csr_id_addr};
-                        cor_tx_data <= {448'b0, AFU_ID};
+                        // AFU_ID, then the accepted output format and its geometry
+                        cor_tx_data <= {392'b0, Q_BITS_MAX, CTX_NUM, out_fmt_caps, out_match_lanes, out_lines_per_cl, out_index_bits, 6'b0, out_fmt, AFU_ID};
                         csr_id_done <= 1'b1;                    
                         tx_wr_state <= TX_WR_STATE_CTX;
                     end
                 end
                 
                 TX_WR_STATE_CTX : begin
-                    casex ({csr_scratch_update, ctx_valid})
+                    casex ({csr_scratch_update, ctx_valid_d[1]})
                         2'b1? : begin
                             cor_tx_wr_valid <= 1'b1;
                             cor_tx_dsr_valid <= 1'b1;
@@ -280,8 +478,9 @@ module afu_core (
                         end
                     
                         2'b01 : begin                                                            
-                            dst_ptr <= ctx_dst_ptr;
-                            dst_cnt <= ctx_length;
+                            dst_ptr[0] <= ctx_dst_ptr[0];
+                            dst_cnt[0] <= out_lines(ctx_length[0], out_lines_per_cl);
+                            wr_run[0] <= 1'b1;
                             tx_wr_run <= 1'b1;
                             tx_wr_cnt <= 1'b0;
                             tx_wr_state <= TX_WR_STATE_RUN;
@@ -292,7 +491,7 @@ module afu_core (
                 TX_WR_STATE_RUN : begin
                     if (tx_data_valid[0]) begin
                         cor_tx_wr_valid <= 1'b1;
-                        cor_tx_wr_addr <= dst_ptr;                             
+                        cor_tx_wr_addr <= dst_ptr[0];                             
                         cor_tx_data <= tx_data[0];
                         
                         if (tx_dsr_valid[0]) begin
@@ -301,29 +500,37 @@ module afu_core (
                             cor_tx_wr_len <= 6'h1;                       
                         end
                         
+                        else if (csr_shared) begin
+                            // tenants' lines interleave: one line per write
+                            cor_tx_wr_addr <= dst_ptr[tx_data_ctx];
+                            cor_tx_wr_len <= 1'b1;
+                            dst_cnt[tx_data_ctx] <= dst_cnt[tx_data_ctx] - 1'b1;
+                            dst_ptr[tx_data_ctx] <= dst_ptr[tx_data_ctx] + 1'b1;
+                        end
+                        
                         else begin
-                            cor_tx_wr_addr <= dst_ptr;
+                            cor_tx_wr_addr <= dst_ptr[0];
 //                            dst_ptr <= dst_ptr + 1'b1;
 //                            dst_cnt <= dst_cnt - 1'b1;      
                                                             
                             if (tx_wr_cnt == 6'b0) begin    // driving header
-                                if (dst_cnt >= `MAX_TRANSFER_SIZE) begin
+                                if (dst_cnt[0] >= `MAX_TRANSFER_SIZE) begin
                                     if (tx_wr_addr_next_try[6]) begin      // cross 4k boundary
                                         cor_tx_wr_len <= 1'b1;
-                                        dst_cnt <= dst_cnt - 1'b1;   
-                                        dst_ptr <= dst_ptr + 1'b1;
+                                        dst_cnt[0] <= dst_cnt[0] - 1'b1;   
+                                        dst_ptr[0] <= dst_ptr[0] + 1'b1;
                                     end                                
                                     else begin  // not cross 4k boundary                                                                      
                                         cor_tx_wr_len <= `MAX_TRANSFER_SIZE;
-                                        dst_cnt <= dst_cnt - `MAX_TRANSFER_SIZE;
-                                        dst_ptr <= {dst_ptr[57:6], tx_wr_addr_next_try[5:0]};
+                                        dst_cnt[0] <= dst_cnt[0] - `MAX_TRANSFER_SIZE;
+                                        dst_ptr[0] <= {dst_ptr[0][57:6], tx_wr_addr_next_try[5:0]};
                                         tx_wr_cnt <= `MAX_TRANSFER_SIZE - 1'b1;
                                     end                                
                                 end
                                 else begin
                                     cor_tx_wr_len <= 1'b1;
-                                    dst_cnt <= dst_cnt - 1'b1;   
-                                    dst_ptr <= dst_ptr + 1'b1;                                    
+                                    dst_cnt[0] <= dst_cnt[0] - 1'b1;   
+                                    dst_ptr[0] <= dst_ptr[0] + 1'b1;                                    
                                 end                                                                                                                                                                                                                            
                             end
                             
@@ -338,7 +545,16 @@ module afu_core (
                     end 
 
                     else begin
-                        if ((dst_cnt == 32'b0) & (tx_wr_cnt == 6'b0) & (~spl_tx_wr_almostfull)) begin
+                        if (tbl_status_pend & (~load_done) & (tx_wr_cnt == 6'b0) & (~spl_tx_wr_almostfull)) begin
+                            // between bursts: report the table swap
+                            cor_tx_wr_valid <= 1'b1;
+                            cor_tx_dsr_valid <= 1'b1;
+                            cor_tx_wr_len <= 6'h1;
+                            cor_tx_wr_addr <= {26'b0, dsr_tbl_status_addr};
+                            cor_tx_data <= {448'b0, tbl_gen, 31'b0, active_bank};
+                            tbl_status_pend <= 1'b0;
+                        end
+                        else if (wr_fin[0] & wr_idle & (~spl_tx_wr_almostfull)) begin
                             cor_tx_wr_valid <= 1'b1;
                             cor_tx_dsr_valid <= 1'b1;
                             cor_tx_wr_len <= 6'h1; 
@@ -346,6 +562,11 @@ module afu_core (
                             cor_tx_data <= {448'b0, dsr_latency_cnt};
                             tx_wr_state <= TX_WR_STATE_STATUS;   
                         end
+                        else if (wr_fin[1] & wr_idle & (~spl_tx_wr_almostfull)) begin
+                            cor_tx_wr_valid <= 1'b1;
+                            cor_tx_fence_valid <= 1'b1;
+                            tx_wr_state <= TX_WR_STATE_DONE1;
+                        end
                     end                                  
                 end    
 
@@ -356,10 +577,22 @@ module afu_core (
                         cor_tx_wr_len <= 6'h1; 
                         cor_tx_wr_addr <= {26'b0, dsr_performance_cnt_addr};
                         cor_tx_data <= {448'b0, dsr_performance_cnt};
-                        tx_wr_state <= TX_WR_STATE_FENCE;  
+                        tx_wr_state <= TX_WR_STATE_RDSTAT;  
                     end
                 end  
                 
+                TX_WR_STATE_RDSTAT : begin
+                    if (~spl_tx_wr_almostfull) begin
+                        cor_tx_wr_valid <= 1'b1;
+                        cor_tx_dsr_valid <= 1'b1;
+                        cor_tx_wr_len <= 6'h1;
+                        cor_tx_wr_addr <= {26'b0, dsr_rd_stats_addr};
+                        cor_tx_data <= {352'b0, 32'b1 << RD_WINDOW_BITS, rd_pend_max, rd_starve_issue_cnt,
+                                        rd_starve_mem_cnt, rd_starve_window_cnt, rd_busy_cnt};
+                        tx_wr_state <= TX_WR_STATE_FENCE;
+                    end
+                end
+
                 TX_WR_STATE_FENCE : begin
                     if (~spl_tx_wr_almostfull) begin
                         cor_tx_wr_valid <= 1'b1;
@@ -369,15 +602,43 @@ module afu_core (
                 end  
                                 
                 TX_WR_STATE_TASKDONE : begin
-                    if ((~spl_tx_wr_almostfull) & (~cor_tx_done_valid)) begin
+                    if (~spl_tx_wr_almostfull) begin
                         cor_tx_wr_valid <= 1'b1;
                         cor_tx_done_valid <= 1'b1;
                         cor_tx_wr_len <= 6'h1;
                         cor_tx_wr_addr <= status_addr;
                         cor_tx_data[0] <= 1'b1;
+                        wr_done[0] <= 1'b1;
+                        // other tenants and table loads go on after the owner's task
+                        tx_wr_state <= TX_WR_STATE_RUN;
                     end
                 end  
 
+                TX_WR_STATE_DONE1 : begin
+                    if (~spl_tx_wr_almostfull) begin
+                        // done, job id, sequence number, input lines
+                        cor_tx_wr_valid <= 1'b1;
+                        cor_tx_wr_len <= 6'h1;
+                        cor_tx_wr_addr <= status_addr1;
+                        cor_tx_data <= {384'b0, ctx_length[1], q_done + 1'b1, ctx1_job, 32'b1};
+                        q_done <= q_done + 1'b1;
+                        wr_done[1] <= 1'b1;
+                        ctx1_fin <= 1'b1;
+                        tx_wr_state <= csr_q_on ? TX_WR_STATE_QHEAD : TX_WR_STATE_RUN;
+                    end
+                end
+
+                TX_WR_STATE_QHEAD : begin
+                    if (~spl_tx_wr_almostfull) begin
+                        cor_tx_wr_valid <= 1'b1;
+                        cor_tx_dsr_valid <= 1'b1;
+                        cor_tx_wr_len <= 6'h1;
+                        cor_tx_wr_addr <= {26'b0, dsr_q_head_addr};
+                        cor_tx_data <= {480'b0, q_done};
+                        tx_wr_state <= TX_WR_STATE_RUN;
+                    end
+                end
+
             endcase                    
         end
     end
@@ -432,8 +693,8 @@ module afu_core (
                         csr_scratch_done_rxq <= 1'b1;                 
                         rxq_rd_active[0] <= 1'b1;
                     end                                                   
-                    else if (((~rxq_re) & (~spl_tx_wr_almostfull) & (~rxq_empty)) |
-                             (rxq_re & (~spl_tx_wr_almostfull) & (~rxq_almostempty))) begin
+                    else if ((~rxq_rd_hold) & (((~rxq_re) & (~spl_tx_wr_almostfull) & (~rxq_empty)) |
+                             (rxq_re & (~spl_tx_wr_almostfull) & (~rxq_almostempty)))) begin
                         rxq_re <= 1'b1;      
                         rxq_rd_active[0] <= 1'b1;  
                         rxq_rd_cnt <= rxq_rd_cnt + 1'b1; 
@@ -449,6 +710,7 @@ module afu_core (
                         end
                         else begin                        
                             tx_data[0] <= rxq_dout;
+                            tx_data_ctx <= rxq_dout_ctx;
                         end
                         tx_data_valid[0] <= 1'b1;
                         rxq_rd_active[1] <= 1'b0;
@@ -471,8 +733,8 @@ module afu_core (
                         csr_scratch_done_rxq <= 1'b1;                 
                         rxq_rd_active[1] <= 1'b1;
                     end                               
-                    else if (((~rxq_re) & (~spl_tx_wr_almostfull) & (~rxq_empty)) |
-                             (rxq_re & (~spl_tx_wr_almostfull) & (~rxq_almostempty))) begin
+                    else if ((~rxq_rd_hold) & (((~rxq_re) & (~spl_tx_wr_almostfull) & (~rxq_empty)) |
+                             (rxq_re & (~spl_tx_wr_almostfull) & (~rxq_almostempty)))) begin
                         rxq_re <= 1'b1; 
                         rxq_rd_active[1] <= 1'b1;  
                         rxq_rd_cnt <= rxq_rd_cnt + 1'b1; 
@@ -488,6 +750,7 @@ module afu_core (
                         end
                         else begin                    
                             tx_data[0] <= rxq_dout;
+                            tx_data_ctx <= rxq_dout_ctx;
                         end
                         
                         tx_data_valid[0] <= 1'b1;
@@ -508,6 +771,7 @@ module afu_core (
                         end
                         else begin                       
                             tx_data[0] <= rxq_dout;
+                            tx_data_ctx <= rxq_dout_ctx;
                         end
                         
                         tx_data_valid[0] <= 1'b1;
@@ -525,8 +789,8 @@ module afu_core (
                         csr_scratch_done_rxq <= 1'b1;                 
                         rxq_rd_active[2] <= 1'b1;
                     end                                          
-                    else if (((~rxq_re) & (~spl_tx_wr_almostfull) & (~rxq_empty)) |
-                             (rxq_re & (~spl_tx_wr_almostfull) & (~rxq_almostempty))) begin
+                    else if ((~rxq_rd_hold) & (((~rxq_re) & (~spl_tx_wr_almostfull) & (~rxq_empty)) |
+                             (rxq_re & (~spl_tx_wr_almostfull) & (~rxq_almostempty)))) begin
                         rxq_re <= 1'b1; 
                         rxq_rd_active[2] <= 1'b1;  
                         rxq_rd_cnt <= rxq_rd_cnt + 1'b1;
@@ -543,21 +807,68 @@ module afu_core (
     //-----------------------------------------------------
     // TX_RD request
     //-----------------------------------------------------    
-    assign tx_rd_addr_next_try = tx_rd_addr_next[5:0] + `MAX_TRANSFER_SIZE;  //cfg_pagesize;
+    assign tx_rd_addr_next_try = src_ptr[rd_cur][5:0] + `MAX_TRANSFER_SIZE;  //cfg_pagesize;
+    // image lines requested but not yet out of the loader FIFO stay below its depth
+    assign tbl_room = (tbl_count + tbl_lines - tbl_rd_left - tbl_rx_cnt) < 2**RD_WINDOW_BITS - 4;
+
+    assign rd_weight = rd_cur ? csr_ctx_weight[15:8] : csr_ctx_weight[7:0];
+    assign rd_turn_over = (rd_turn >= ((rd_weight == 8'b0) ? 8'd1 : rd_weight) * `MAX_TRANSFER_SIZE);
+    assign rd_aligned = ((rd_turn & (out_lines_per_cl - 1'b1)) == 16'b0);
+    assign rd_has[0] = rd_run[0] & (src_cnt[0] > 32'b0);
+    assign rd_has[1] = rd_run[1] & (src_cnt[1] > 32'b0);
+    assign rd_hold[0] = csr_shared & tbl_loading & (tbl_ctx_r == 1'b0);
+    assign rd_hold[1] = csr_shared & tbl_loading & (tbl_ctx_r == 1'b1);
+    assign rd_flow_ok = (~spl_tx_rd_almostfull) & (~rxq_almostfull) & (~tr_pend_full);
+    // a held tenant still finishes the output line it started
+    assign rd_cur_ok = rd_has[rd_cur] & ~(rd_hold[rd_cur] & rd_aligned);
+    assign rd_other_ok = rd_has[~rd_cur] & ~rd_hold[~rd_cur];
+
+    assign q_slot = q_fetch & ((32'b1 << csr_q_bits) - 1'b1);
+    assign q_desc_addr = csr_q_base + q_slot;
+    assign q_cpl_addr = csr_q_base + (32'b1 << csr_q_bits) + q_slot;
+    // until the host stopped the ring and every job in it is complete
+    assign q_hold = csr_q_on & ~(csr_q_stop & (q_fetch == csr_q_tail) & (~ctx1_active));
     
     always @(posedge clk) begin
         if ((~reset_n) | spl_reset) begin
             cor_tx_rd_valid <= 1'b0; 
             status_addr_valid <= 1'b0;
             status_addr_cr <= 1'b0;
+            csr_tbl_done <= 1'b0;
+            csr_ctx1_done <= 1'b0;
+            ctx1_active <= 1'b0;
+            rd_run <= 2'b0;
+            rd_cur <= 1'b0;
+            rd_turn <= 16'b0;
+            q_fetch <= 32'b0;
+            tbl_loading <= 1'b0;
+            tbl_rd_left <= 16'b0;
+            tbl_load_start <= 1'b0;
             tx_rd_state <= TX_RD_STATE_IDLE;            
         end
 
         else begin
             cor_tx_rd_valid <= 1'b0;
             tx_rd_valid <= 1'b0;
+            csr_tbl_done <= 1'b0;
+            csr_ctx1_done <= 1'b0;
+            tbl_load_start <= 1'b0;
             
             dsr_performance_cnt <= dsr_performance_cnt + 1'b1;
+
+            if (ctx_new1) begin
+                src_ptr[1] <= ctx_src_ptr[1];
+                src_cnt[1] <= ctx_length[1];
+                rd_run[1] <= 1'b1;
+            end
+
+            if (ctx1_fin) begin
+                ctx1_active <= 1'b0;
+            end
+
+            if (load_done) begin
+                tbl_loading <= 1'b0;
+            end
                     
             case (tx_rd_state)
                 TX_RD_STATE_IDLE : begin
@@ -565,6 +876,8 @@ module afu_core (
                         cor_tx_rd_valid <= 1'b1;
                         cor_tx_rd_addr <= csr_ctx_base;
                         cor_tx_rd_len <= 6'h1;
+                        cor_tx_rd_kind <= RD_KIND_CTX;
+                        cor_tx_rd_ctx <= 1'b0;
                         dsr_latency_cnt <= 32'b0;
                         tx_rd_state <= TX_RD_STATE_CTX;
                                                 
@@ -581,8 +894,9 @@ module afu_core (
                     dsr_latency_cnt <= dsr_latency_cnt + 1'b1;
                     
                     if (ctx_valid) begin                     
-                        tx_rd_addr_next <= ctx_src_ptr;
-                        src_cnt <= ctx_length;  // - 1'b1;
+                        src_ptr[0] <= ctx_src_ptr[0];
+                        src_cnt[0] <= ctx_length[0];  // - 1'b1;
+                        rd_run[0] <= 1'b1;
                         
                         dsr_performance_cnt <= 32'b0;                                                
                         tx_rd_state <= TX_RD_STATE_RUN;
@@ -595,35 +909,88 @@ module afu_core (
                         cor_tx_rd_valid <= 1'b1; 
                         cor_tx_rd_len <= tx_rd_len;
                         cor_tx_rd_addr <= tx_rd_addr;
+                        cor_tx_rd_kind <= tx_rd_kind;
+                        cor_tx_rd_ctx <= tx_rd_ctx;
+                    end
+
+                    // table reload, one load at a time
+                    if (csr_tbl_valid & (~csr_tbl_done) & (~tbl_loading)) begin
+                        tbl_loading <= 1'b1;
+                        tbl_ctx_r <= csr_tbl_ctx;
+                        tbl_rd_left <= tbl_lines;
+                        tbl_rd_addr <= csr_tbl_base;
+                        tbl_load_start <= 1'b1;
+                        csr_tbl_done <= 1'b1;
                     end
                                             
-                    // prepare next
-                    if ((src_cnt > 32'b0) & (~spl_tx_rd_almostfull) & (~rxq_almostfull) & (~tr_pend_full)) begin
+                    // prepare next: tenant descriptor, table line, source burst
+                    if (csr_shared & (csr_q_on ? (q_fetch != csr_q_tail) : (csr_ctx1_valid & (~csr_ctx1_done)))
+                        & (~ctx1_active) & (~spl_tx_rd_almostfull)) begin
                         tx_rd_valid <= 1'b1;
+                        tx_rd_kind <= RD_KIND_CTX;
+                        tx_rd_ctx <= 1'b1;
+                        tx_rd_len <= 1'b1;
+                        ctx1_active <= 1'b1;
+                        if (csr_q_on) begin
+                            // next ring entry, its record goes to the completion half
+                            tx_rd_addr <= q_desc_addr;
+                            status_addr1 <= q_cpl_addr;
+                            q_fetch <= q_fetch + 1'b1;
+                        end
+                        else begin
+                            tx_rd_addr <= csr_ctx1_base;
+                            status_addr1 <= csr_ctx1_base + 1'b1;
+                            csr_ctx1_done <= 1'b1;
+                        end
+                    end
+
+                    else if ((tbl_rd_left > 16'b0) & (~tbl_load_start) & (~spl_tx_rd_almostfull) & tbl_room) begin
+                        tx_rd_valid <= 1'b1;
+                        tx_rd_kind <= RD_KIND_TBL;
+                        tx_rd_len <= 1'b1;
+                        tx_rd_addr <= tbl_rd_addr;
+                        tbl_rd_addr <= tbl_rd_addr + 1'b1;
+                        tbl_rd_left <= tbl_rd_left - 1'b1;
+                    end
+
+                    else if (rd_flow_ok & rd_cur_ok & ~(rd_aligned & rd_turn_over & rd_other_ok)) begin
+                        tx_rd_valid <= 1'b1;
+                        tx_rd_kind <= RD_KIND_DATA;
+                        tx_rd_ctx <= rd_cur;
 
-                        if (src_cnt >= `MAX_TRANSFER_SIZE) begin     
+                        if (src_cnt[rd_cur] >= `MAX_TRANSFER_SIZE) begin     
                             if (tx_rd_addr_next_try[6]) begin      // cross 4k boundary
                                 tx_rd_len <= 1'b1;
 //                                tx_rd_addr <= tx_rd_addr + 1'b1;
-                                tx_rd_addr <= tx_rd_addr_next;
-                                tx_rd_addr_next <= tx_rd_addr_next + 1'b1;       
-                                src_cnt <= src_cnt - 1'b1;
+                                tx_rd_addr <= src_ptr[rd_cur];
+                                src_ptr[rd_cur] <= src_ptr[rd_cur] + 1'b1;       
+                                src_cnt[rd_cur] <= src_cnt[rd_cur] - 1'b1;
+                                rd_turn <= rd_turn + 1'b1;
                             end
                             
                             else begin  // not cross 4k boundary                                
                                 tx_rd_len <= `MAX_TRANSFER_SIZE;
-                                tx_rd_addr <= tx_rd_addr_next;
-                                tx_rd_addr_next <= {tx_rd_addr_next[57:6], tx_rd_addr_next_try[5:0]};
-                                src_cnt <= src_cnt - `MAX_TRANSFER_SIZE;
+                                tx_rd_addr <= src_ptr[rd_cur];
+                                src_ptr[rd_cur] <= {src_ptr[rd_cur][57:6], tx_rd_addr_next_try[5:0]};
+                                src_cnt[rd_cur] <= src_cnt[rd_cur] - `MAX_TRANSFER_SIZE;
+                                rd_turn <= rd_turn + `MAX_TRANSFER_SIZE;
                             end
                         end
                         else begin
                             tx_rd_len <= 1'b1;
-                            tx_rd_addr <= tx_rd_addr_next;
-                            tx_rd_addr_next <= tx_rd_addr_next + 1'b1; 
-                            src_cnt <= src_cnt - 1'b1;                        
+                            tx_rd_addr <= src_ptr[rd_cur];
+                            src_ptr[rd_cur] <= src_ptr[rd_cur] + 1'b1; 
+                            src_cnt[rd_cur] <= src_cnt[rd_cur] - 1'b1;                        
+                            rd_turn <= rd_turn + 1'b1;
                         end
-                    end                         
+                    end
+
+                    // hand the stream over; a tenant that ran out closed its
+                    // last output line itself
+                    else if (rd_other_ok & (rd_aligned | ~rd_has[rd_cur])) begin
+                        rd_cur <= ~rd_cur;
+                        rd_turn <= 16'b0;
+                    end
                 end    
             endcase                    
         end
@@ -633,40 +1000,86 @@ module afu_core (
     //-------------------------------------------------
     // RX_RD response
     //-------------------------------------------------  
+    assign rd_tag_din = {cor_tx_rd_kind, cor_tx_rd_ctx, cor_tx_rd_len};
+    assign rd_tag_re = io_rx_rd_valid & ((rd_tag_line + 1'b1) == rd_tag[5:0]);    // 64 lines wrap to 0 like the length
+
+    asyn_read_fifo #(.FIFO_WIDTH(9),
+                     .FIFO_DEPTH_BITS(RD_WINDOW_BITS+1),       // above the data and table read limits together
+                     .FIFO_ALMOSTFULL_THRESHOLD(2**(RD_WINDOW_BITS+1)-4),
+                     .FIFO_ALMOSTEMPTY_THRESHOLD(2)
+                    ) rd_tag_fifo(
+                .clk                (clk),
+                .reset_n            (reset_n & (~spl_reset)),
+                .din                (rd_tag_din),
+                .we                 (cor_tx_rd_valid),
+                .re                 (rd_tag_re),
+                .dout               (rd_tag),
+                .empty              (rd_tag_empty),
+                .full               (),
+                .count              (),
+                .almostempty        (),
+                .almostfull         ()
+            );
+
     always @(posedge clk) begin
         if ((~reset_n) | spl_reset)begin
             ctx_valid <= 1'b0;
+            ctx_valid_d <= 2'b0;
+            ctx_new1 <= 1'b0;
             rxq_we <= 1'b0;
             rxq_wr_cnt <= 32'b0;
-            rx_rd_state <= RX_RD_STATE__IDLE;
+            rd_tag_line <= 6'b0;
+            tbl_we <= 1'b0;
+            tbl_rx_cnt <= 16'b0;
         end
 
         else begin
             rxq_we <= 1'b0;
+            tbl_we <= 1'b0;
+            ctx_new1 <= 1'b0;
+            ctx_valid_d <= {ctx_valid_d[0], ctx_valid};
+            if (tbl_load_start) tbl_rx_cnt <= 16'b0;
         
-            case (rx_rd_state)             
-                RX_RD_STATE__IDLE : begin
-                    if (io_rx_rd_valid) begin
+            // responses come in request order, the oldest tag says what they are
+            if (io_rx_rd_valid) begin
+                rd_tag_line <= rd_tag_re ? 6'b0 : rd_tag_line + 1'b1;
+
+                // synthesis translate_off
+                assert (~rd_tag_empty) else $fatal("RX_RD without a pending TX_RD");
+                // synthesis translate_on
+
+                case (rd_tag[8:7])
+                    RD_KIND_CTX : begin
 //                        ctx_delay <= io_rx_data[63:32];
 //                        ctx_threshold <= io_rx_data[31:16];
-                        ctx_src_ptr <= io_rx_data[127:70];
-                        ctx_dst_ptr <= io_rx_data[191:134];
-                        ctx_length <= io_rx_data[223:192];    
-                        ctx_valid <= 1'b1;
-                        rx_rd_state <= RX_RD_STATE__RUN;
+                        ctx_src_ptr[rd_tag[6]] <= io_rx_data[127:70];
+                        ctx_dst_ptr[rd_tag[6]] <= io_rx_data[191:134];
+                        ctx_length[rd_tag[6]] <= io_rx_data[223:192];    
+                        rx_left[rd_tag[6]] <= io_rx_data[223:192];
+                        if (rd_tag[6]) begin
+                            ctx_new1 <= 1'b1;
+                            ctx1_job <= io_rx_data[31:0];
+                        end
+                        else ctx_valid <= 1'b1;
+                    end
+
+                    RD_KIND_TBL : begin
+                        tbl_we <= 1'b1;
+                        tbl_din <= io_rx_data;
+                        tbl_rx_cnt <= tbl_rx_cnt + 1'b1;
                     end
-                end
 
-                RX_RD_STATE__RUN : begin
-                    if (io_rx_rd_valid) begin
+                    default : begin
                         rxq_we <= 1'b1;
                         rxq_din <= io_rx_data;                        
+                        rxq_ctx <= rd_tag[6];
+                        rxq_last <= (rx_left[rd_tag[6]] == 32'b1);
+                        rx_left[rd_tag[6]] <= rx_left[rd_tag[6]] - 1'b1;
                         
                         rxq_wr_cnt <= rxq_wr_cnt + 1'b1;
                     end
-                end
-
-            endcase
+                endcase
+            end
         end
     end   
 
@@ -674,16 +1087,20 @@ module afu_core (
     //-------------------------------------------------
     // tracking pending RD
     //-------------------------------------------------  
-    assign tr_pend_full = (tr_pend_cnt >= 2**(4+`MAX_TRANSFER_SIZE) - 2**(1+`MAX_TRANSFER_SIZE)); //6'h1e);
+    // the window is the whole input FIFO, less the bursts still on their
+    // way from the prepare stage to the count
+    assign tr_pend_full = (tr_pend_cnt >= 2**RD_WINDOW_BITS - 4*`MAX_TRANSFER_SIZE);
     
     always @(posedge clk) begin
         if ((~reset_n) | spl_reset) begin
-            tr_pend_cnt <= 10'b0;        
+            tr_pend_cnt <= {(RD_WINDOW_BITS+1){1'b0}};
         end
 
         else begin
 //            case ({cor_tx_rd_valid, io_rx_rd_valid})
-            case ({cor_tx_rd_valid, rxq_re})
+            // source lines leave when the trees take them; output lines no
+            // longer match input lines one to one (DENSE, MATCH)
+            case ({cor_tx_rd_valid & (cor_tx_rd_kind == RD_KIND_DATA), rxq_input_re})
                 2'b01 : begin
                     tr_pend_cnt <= tr_pend_cnt - 1'b1;
                     
@@ -696,7 +1113,7 @@ module afu_core (
                     tr_pend_cnt <= tr_pend_cnt + cor_tx_rd_len;     //1'b1;
                     
                     // synthesis translate_off
-                    assert(tr_pend_cnt < 2**(4+`MAX_TRANSFER_SIZE)) else $fatal("trying to generate new TX_RD while the limit is hit");
+                    assert(tr_pend_cnt < 2**RD_WINDOW_BITS) else $fatal("trying to generate new TX_RD while the limit is hit");
                     // synthesis translate_on                                        
                 end
                 
@@ -704,7 +1121,7 @@ module afu_core (
                     tr_pend_cnt <= tr_pend_cnt + cor_tx_rd_len - 1'b1;     //1'b1;
                     
                     // synthesis translate_off
-                    assert(tr_pend_cnt < 2**(4+`MAX_TRANSFER_SIZE)) else $fatal("trying to generate new TX_RD while the limit is hit");
+                    assert(tr_pend_cnt < 2**RD_WINDOW_BITS) else $fatal("trying to generate new TX_RD while the limit is hit");
                     // synthesis translate_on                                        
                 end 
                                
@@ -714,6 +1131,39 @@ module afu_core (
             endcase
         end
     end
+
+
+    //-------------------------------------------------
+    // read-starved counters, over the owner's task
+    //-------------------------------------------------
+    always @(posedge clk) begin
+        if ((~reset_n) | spl_reset) begin
+            rd_busy_cnt <= 32'b0;
+            rd_starve_window_cnt <= 32'b0;
+            rd_starve_mem_cnt <= 32'b0;
+            rd_starve_issue_cnt <= 32'b0;
+            rd_pend_max <= 32'b0;
+        end
+
+        else if ((tx_rd_state == TX_RD_STATE_CTX) & ctx_valid) begin
+            // the task starts, as dsr_performance_cnt
+            rd_busy_cnt <= 32'b0;
+            rd_starve_window_cnt <= 32'b0;
+            rd_starve_mem_cnt <= 32'b0;
+            rd_starve_issue_cnt <= 32'b0;
+            rd_pend_max <= 32'b0;
+        end
+
+        else if (tx_rd_state == TX_RD_STATE_RUN) begin
+            if (tr_pend_cnt > rd_pend_max) rd_pend_max <= tr_pend_cnt;
+
+            // with the input FIFO empty every pending line is still in flight
+            if (~rxq_input_empty) rd_busy_cnt <= rd_busy_cnt + 1'b1;
+            else if (tr_pend_full) rd_starve_window_cnt <= rd_starve_window_cnt + 1'b1;
+            else if (tr_pend_cnt != 0) rd_starve_mem_cnt <= rd_starve_mem_cnt + 1'b1;
+            else if (|rd_has) rd_starve_issue_cnt <= rd_starve_issue_cnt + 1'b1;
+        end
+    end
         
 endmodule        
 
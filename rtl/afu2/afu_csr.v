@@ -50,7 +50,30 @@ module afu_csr(
 
     // afu_csr-->afu_core, afu_ctx_base
     output reg                              csr_ctx_base_valid,
-    output reg  [57:0]                      csr_ctx_base
+    output reg  [57:0]                      csr_ctx_base,
+
+    // afu_csr-->afu_core, requested output line format
+    output reg  [1:0]                       csr_out_fmt,
+
+    // afu_csr-->afu_core, tree table image to load
+    output reg                              csr_tbl_valid,
+    input  wire                             csr_tbl_done,
+    output reg  [57:0]                      csr_tbl_base,
+
+    // afu_csr-->afu_core, further tenants of a shared AFU
+    output reg                              csr_ctx1_valid,
+    input  wire                             csr_ctx1_done,
+    output reg  [57:0]                      csr_ctx1_base,
+    output reg                              csr_shared,
+    output reg  [15:0]                      csr_ctx_weight,   // bursts per turn, 8 bits per tenant
+    output reg                              csr_tbl_ctx,      // tenant whose bank a shared-mode load writes
+
+    // afu_csr-->afu_core, job descriptor ring served as tenant 1
+    output reg                              csr_q_on,
+    output reg  [57:0]                      csr_q_base,
+    output reg  [4:0]                       csr_q_bits,       // log2 ring entries
+    output reg  [31:0]                      csr_q_tail,       // jobs submitted
+    output reg                              csr_q_stop
 );
 
 
@@ -59,6 +82,18 @@ module afu_csr(
         AFU_CSR_DSR_BASEH          = 6'b00_0001,   //10'h281,      // a04
         AFU_CSR_CTX_BASEL          = 6'b00_0010,   //10'h282,      // a08
         AFU_CSR_CTX_BASEH          = 6'b00_0011,   //10'h283,      // a0c  
+        AFU_CSR_OUT_FMT            = 6'b00_0100,   //10'h284,      // a10, write before DSR_BASEL
+        AFU_CSR_TBL_BASEL          = 6'b00_0101,   //10'h285,      // a14, starts the table load
+        AFU_CSR_TBL_BASEH          = 6'b00_0110,   //10'h286,      // a18
+        AFU_CSR_CTX1_BASEL         = 6'b00_0111,   //10'h287,      // a1c, starts tenant 1
+        AFU_CSR_CTX1_BASEH         = 6'b00_1000,   //10'h288,      // a20
+        AFU_CSR_SHARE              = 6'b00_1001,   //10'h289,      // a24, write before DSR_BASEL
+        AFU_CSR_TBL_CTX            = 6'b00_1010,   //10'h28a,      // a28, write before TBL_BASEL
+        AFU_CSR_Q_BASEL            = 6'b00_1011,   //10'h28b,      // a2c, starts the ring, write before DSR_BASEL
+        AFU_CSR_Q_BASEH            = 6'b00_1100,   //10'h28c,      // a30
+        AFU_CSR_Q_SIZE             = 6'b00_1101,   //10'h28d,      // a34, write before Q_BASEL
+        AFU_CSR_Q_TAIL             = 6'b00_1110,   //10'h28e,      // a38, tail doorbell
+        AFU_CSR_Q_STOP             = 6'b00_1111,   //10'h28f,      // a3c, finish once the ring is drained
         AFU_CSR_SCRATCH            = 6'b11_1111;   //10'h2bf;      // afc        
                 
 
@@ -73,11 +108,24 @@ module afu_csr(
             csr_id_valid <= 1'b0;
             csr_scratch_valid <= 1'b0;
             csr_ctx_base_valid <= 1'b0;
+            csr_tbl_valid <= 1'b0;
+            csr_ctx1_valid <= 1'b0;
+            if (~reset_n) csr_out_fmt <= 2'b0;      // kept across spl_reset
+            if (~reset_n) csr_shared <= 1'b0;
+            if (~reset_n) csr_ctx_weight <= 16'h0101;
+            if (~reset_n) csr_tbl_ctx <= 1'b0;
+            // the ring is set up before the transaction and outlives its
+            // start; a stopped ring is gone with the next one
+            if (~reset_n) csr_q_on <= 1'b0;
+            else if (csr_q_stop) csr_q_on <= 1'b0;
+            if (~reset_n) csr_q_stop <= 1'b0;
         end 
         
         else begin
             if (csr_id_done) csr_id_valid <= 1'b0;
             if (csr_scratch_done) csr_scratch_valid <= 1'b0;
+            if (csr_tbl_done) csr_tbl_valid <= 1'b0;
+            if (csr_ctx1_done) csr_ctx1_valid <= 1'b0;
                                     
             if (io_rx_csr_valid) begin
                 if (io_rx_csr_addr[13:6] == 8'h8a) begin
@@ -114,6 +162,72 @@ module afu_csr(
                             // synthesis translate_on                            
                         end
 
+                        AFU_CSR_OUT_FMT : begin
+                            csr_out_fmt <= io_rx_csr_data[1:0];
+                        end
+
+                        AFU_CSR_TBL_BASEH : begin
+                            csr_tbl_base[57:26] <= io_rx_csr_data;
+                        end
+
+                        AFU_CSR_TBL_BASEL : begin
+                            csr_tbl_base[25:0] <= io_rx_csr_data[31:6];
+                            csr_tbl_valid <= 1'b1;
+
+                            // synthesis translate_off
+                            assert (io_rx_csr_data[5:0] == 6'b0) else $fatal("csr_tbl_base = %x is not CL aligned", {csr_tbl_base[57:26], io_rx_csr_data});
+                            // synthesis translate_on
+                        end
+
+                        AFU_CSR_CTX1_BASEH : begin
+                            csr_ctx1_base[57:26] <= io_rx_csr_data;
+                        end
+
+                        AFU_CSR_CTX1_BASEL : begin
+                            csr_ctx1_base[25:0] <= io_rx_csr_data[31:6];
+                            csr_ctx1_valid <= 1'b1;
+
+                            // synthesis translate_off
+                            assert (io_rx_csr_data[5:0] == 6'b0) else $fatal("csr_ctx1_base = %x is not CL aligned", {csr_ctx1_base[57:26], io_rx_csr_data});
+                            // synthesis translate_on
+                        end
+
+                        AFU_CSR_SHARE : begin
+                            csr_shared <= io_rx_csr_data[0];
+                            csr_ctx_weight <= io_rx_csr_data[23:8];
+                        end
+
+                        AFU_CSR_TBL_CTX : begin
+                            csr_tbl_ctx <= io_rx_csr_data[0];
+                        end
+
+                        AFU_CSR_Q_BASEH : begin
+                            csr_q_base[57:26] <= io_rx_csr_data;
+                        end
+
+                        AFU_CSR_Q_BASEL : begin
+                            csr_q_base[25:0] <= io_rx_csr_data[31:6];
+                            csr_q_on <= 1'b1;
+                            csr_q_stop <= 1'b0;
+                            csr_q_tail <= 32'b0;
+
+                            // synthesis translate_off
+                            assert (io_rx_csr_data[5:0] == 6'b0) else $fatal("csr_q_base = %x is not CL aligned", {csr_q_base[57:26], io_rx_csr_data});
+                            // synthesis translate_on
+                        end
+
+                        AFU_CSR_Q_SIZE : begin
+                            csr_q_bits <= io_rx_csr_data[4:0];
+                        end
+
+                        AFU_CSR_Q_TAIL : begin
+                            csr_q_tail <= io_rx_csr_data;
+                        end
+
+                        AFU_CSR_Q_STOP : begin
+                            csr_q_stop <= 1'b1;
+                        end
+
                         AFU_CSR_SCRATCH : begin                
                             csr_scratch_valid <= 1'b1;                            
                             csr_scratch_addr <= afu_dsr_base + AFU_CSR_SCRATCH;
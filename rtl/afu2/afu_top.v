@@ -78,6 +78,21 @@ module afu_top (
 
     wire                    csr_ctx_base_valid;
     wire [57:0]             csr_ctx_base;
+    wire [1:0]              csr_out_fmt;
+    wire                    csr_tbl_valid;
+    wire                    csr_tbl_done;
+    wire [57:0]             csr_tbl_base;
+    wire                    csr_ctx1_valid;
+    wire                    csr_ctx1_done;
+    wire [57:0]             csr_ctx1_base;
+    wire                    csr_shared;
+    wire [15:0]             csr_ctx_weight;
+    wire                    csr_tbl_ctx;
+    wire                    csr_q_on;
+    wire [57:0]             csr_q_base;
+    wire [4:0]              csr_q_bits;
+    wire [31:0]             csr_q_tail;
+    wire                    csr_q_stop;
     
     wire                    cor_tx_rd_valid;
     wire [57:0]             cor_tx_rd_addr;
@@ -112,6 +127,21 @@ module afu_top (
         // afu_csr-->afu_core, afu_ctx_base
         .csr_ctx_base_valid         (csr_ctx_base_valid),
         .csr_ctx_base               (csr_ctx_base),                
+        .csr_out_fmt                (csr_out_fmt),
+        .csr_tbl_valid              (csr_tbl_valid),
+        .csr_tbl_done               (csr_tbl_done),
+        .csr_tbl_base               (csr_tbl_base),
+        .csr_ctx1_valid             (csr_ctx1_valid),
+        .csr_ctx1_done              (csr_ctx1_done),
+        .csr_ctx1_base              (csr_ctx1_base),
+        .csr_shared                 (csr_shared),
+        .csr_ctx_weight             (csr_ctx_weight),
+        .csr_tbl_ctx                (csr_tbl_ctx),
+        .csr_q_on                   (csr_q_on),
+        .csr_q_base                 (csr_q_base),
+        .csr_q_bits                 (csr_q_bits),
+        .csr_q_tail                 (csr_q_tail),
+        .csr_q_stop                 (csr_q_stop),
 
         // RX, afu_io --> afu_csr
         .io_rx_csr_valid            (io_rx_csr_valid),
@@ -120,7 +150,8 @@ module afu_top (
     );
        
     
-    afu_core afu_core(
+    afu_core #(.RD_WINDOW_BITS(7+`MAX_TRANSFER_SIZE)    // 256 source lines in flight at transfer size 1
+              ) afu_core(
         .clk                        (clk),
         .reset_n                    (reset_n),
         .spl_enable                 (spl_enable),
@@ -160,7 +191,22 @@ module afu_top (
 
         // afu_csr-->afu_core, afu_ctx_base
         .csr_ctx_base_valid         (csr_ctx_base_valid),
-        .csr_ctx_base               (csr_ctx_base)                                     
+        .csr_ctx_base               (csr_ctx_base),
+        .csr_out_fmt                (csr_out_fmt),
+        .csr_tbl_valid              (csr_tbl_valid),
+        .csr_tbl_done               (csr_tbl_done),
+        .csr_tbl_base               (csr_tbl_base),
+        .csr_ctx1_valid             (csr_ctx1_valid),
+        .csr_ctx1_done              (csr_ctx1_done),
+        .csr_ctx1_base              (csr_ctx1_base),
+        .csr_shared                 (csr_shared),
+        .csr_ctx_weight             (csr_ctx_weight),
+        .csr_tbl_ctx                (csr_tbl_ctx),
+        .csr_q_on                   (csr_q_on),
+        .csr_q_base                 (csr_q_base),
+        .csr_q_bits                 (csr_q_bits),
+        .csr_q_tail                 (csr_q_tail),
+        .csr_q_stop                 (csr_q_stop)
     );
 
 
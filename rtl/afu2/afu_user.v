@@ -7,32 +7,76 @@ module afu_user # (
     parameter INPUT_FIFO_DEPTH_BITS = 5,    //8 entries for input FIFO
     //32 entries for output FIFO. The output fifo should never be full, otherwise, would cause data lost. BIG trouble!
     parameter OUTPUT_FIFO_DEPTH_BITS = 5,
-	parameter CORE_SET_BITS = 3      // number of inputs for merge sorter
+	parameter CORE_SET_BITS = 3,      // number of inputs for merge sorter
+    parameter MATCH_ENABLE = 1,       // build the rule_match stage (MATCH output format)
+    parameter MATCH_LANES = 2,        // lanes per packet intersected by rule_match
+    parameter LIST_SIZE = 8,          // rule ids per list in the rule_match tables
+    // init files: tree tables (tree.v ram_init_data), rule lists (rule_match list_init_data)
+    parameter TREE_INIT_DATA = "/import/usc/home/renchen/ren_ancs/rtl/afu2/tree_data_",
+    parameter LIST_INIT_DATA = "/import/usc/home/renchen/ren_ancs/rtl/afu2/rule_lists"
 ) (
     input clk,    // Clock
     input reset_n,  // Asynchronous reset active low
-    input [31:0] ctx_length,   // number of cachelines
+    // output format: requested by the host through AFU_CSR_OUT_FMT, the
+    // accepted one and the line geometry are reported back in the DSM
+    input [1:0] out_fmt_req,
+    output [1:0] out_fmt,
+    output [7:0] out_fmt_caps,     // bit f set: format f supported
+    output [7:0] out_lines_per_cl, // input lines packed into one output line
+    output [7:0] out_index_bits,   // significant bits of each 16-bit index
+    output [7:0] out_match_lanes,  // lanes per packet in MATCH format
     // fifo specific
     input [511:0] rxq_din,  // request input from CPU MM
+    input rxq_ctx,          // tenant of the line (shared AFU), selects its table bank
+    input rxq_last,         // last line of the tenant's task, flushes a part-filled output line
     input rxq_we, // if the data is valid, then write to the fifo
     // input fifo interfaces deal with outer afu and qpi
     input rxq_re,   // if there is data in the output fifo, afu should assert this signal
     output [511:0] rxq_dout,   // output fifo dout, data which has been sorted
+    output rxq_dout_ctx,       // tenant the output line belongs to
     output rxq_output_empty,    //used to make decision whether to make write request
     output rxq_output_almost_empty,
     output rxq_input_full,      // used to make decision whether to make read request
     output [INPUT_FIFO_DEPTH_BITS - 1:0] rxq_input_count,  // it seems that in sample fifo afu, it is not used.
-    output rxq_input_almostfull
+    output rxq_input_almostfull,
+    output rxq_input_re,        // an input line entered the trees
+    output rxq_input_empty,     // trees waiting for input
+    // tree table reload (tree_loader): tbl_lines image lines follow load_start
+    input load_start,
+    input shared,               // tenants own a bank each, loads do not swap
+    input load_ctx,             // shared: tenant whose bank is loaded
+    output [15:0] tbl_lines,
+    input [511:0] tbl_din,
+    input tbl_we,
+    output [INPUT_FIFO_DEPTH_BITS-1:0] tbl_count,
+    output active_bank,
+    output load_done
 );
     localparam BLOCK_NUM = 2**BLOCK_SIZE_BITS;
     localparam CORE_NUM = 2**CORE_NUM_BITS;
 	localparam NUM_IN  = 2**CORE_SET_BITS;
-	localparam REST_BITS = 512 - CORE_NUM*16 - CORE_NUM - NUM_IN*0;
+	// every tree core takes two keys per line, one per BRAM port:
+	// keys [16*2*CORE_NUM-1:0], index bits [16*2*CORE_NUM+2*CORE_NUM-1:16*2*CORE_NUM]
+	localparam REST_BITS = 512 - CORE_NUM*32 - CORE_NUM*2 - NUM_IN*0;
 
 	localparam TREE_LEVEL = 10;
+
+	// output line formats
+	//  SPARSE: indices of one input line in words 0..15, words 16..31 16'h1313
+	//  DENSE : indices of input lines 2o and 2o+1 in words 0..15 and 16..31
+	//  MATCH : best rule of each packet (rule_match), MATCH_LPC input lines
+	//          per output line
+	localparam OUT_FMT_SPARSE = 2'd0;
+	localparam OUT_FMT_DENSE = 2'd1;
+	localparam OUT_FMT_MATCH = 2'd2;
+	localparam LINE_IDX_BITS = 2*CORE_NUM*16;      // one input line's indices
+	localparam MATCH_BITS = LINE_IDX_BITS / MATCH_LANES;  // one input line's rule ids
+	localparam MATCH_LPC = 512 / MATCH_BITS;
+	localparam [7:0] OUT_FMT_CAPS = {5'b0, (MATCH_ENABLE != 0), (2*LINE_IDX_BITS == 512), 1'b1};
     wire fifo_input_re;
     wire [511:0] rxq_unsorted_data;
-    wire rxq_input_empty;
+    wire line_ctx;
+    wire line_last;
 
 	reg reset_n_r;
 	
@@ -41,17 +85,17 @@ module afu_user # (
 	    reset_n_r <= reset_n;
 	end
 
-    asyn_read_fifo #(.FIFO_WIDTH(512),
+    asyn_read_fifo #(.FIFO_WIDTH(514),
                      .FIFO_DEPTH_BITS(INPUT_FIFO_DEPTH_BITS),       // transfer size 1 -> 32 entries
                      .FIFO_ALMOSTFULL_THRESHOLD(2**(INPUT_FIFO_DEPTH_BITS)-4),
                      .FIFO_ALMOSTEMPTY_THRESHOLD(2)
                     ) input_fifo(
                 .clk                (clk),
                 .reset_n            (reset_n_r),
-                .din                (rxq_din),
+                .din                ({rxq_last, rxq_ctx, rxq_din}),
                 .we                 (rxq_we),
                 .re                 (fifo_input_re),
-                .dout               (rxq_unsorted_data),
+                .dout               ({line_last, line_ctx, rxq_unsorted_data}),
                 .empty              (rxq_input_empty),
                 .full               (rxq_input_full),
                 .count              (rxq_input_count),
@@ -61,86 +105,33 @@ module afu_user # (
 
     // reg [31:0] inputA [CORE_NUM-1:0];
     // reg [31:0] inputB [CORE_NUM-1:0];
-	reg [15:0]            inKey [CORE_NUM-1:0];
-	reg [0:0]             inIdx [CORE_NUM-1:0];
+	wire [15:0]           inKey [CORE_NUM-1:0];
+	wire [0:0]            inIdx [CORE_NUM-1:0];
 	wire [TREE_LEVEL-1:0] outIdx [CORE_NUM-1:0];
-	reg [CORE_NUM-1:0]    valid_in ;
+	wire [15:0]           inKey_b [CORE_NUM-1:0];     // keys CORE_NUM..2*CORE_NUM-1, port B
+	wire [0:0]            inIdx_b [CORE_NUM-1:0];
+	wire [TREE_LEVEL-1:0] outIdx_b [CORE_NUM-1:0];
+	wire                  tree_valid_in;
+	wire [CORE_NUM-1:0]   tree_ready;
 	
 	reg [15:0]           inSet [NUM_IN-1:0];
-	reg [REST_BITS-1:0]  reservedBits;
+	wire [REST_BITS-1:0] reservedBits;
 	
     reg [31:0] cacheline_count;
 
-	//localparam LOOKUP = 2'b00;
-    //localparam LOOKUPMERGE = 2'b01;
-
-    reg[1:0] state;
-    reg stall;
-
-	//Read e
-    //assign fifo_input_re = (~rxq_input_empty & ((state == LOOKUP) || (state == LOOKUPMERGE))) 
-	assign fifo_input_re = (~rxq_input_empty & (~reset_n_r)) 
-	                       ? 1'b1 : 1'b0;
+	//Read: the head line enters all trees in the cycle they can take it.
+	//The trees run in lockstep (same input, same downstream ready), so
+	//tree 0's ready stands for all of them.
+	assign tree_valid_in = ~rxq_input_empty;
+	assign fifo_input_re = tree_valid_in & tree_ready[0];
+	assign rxq_input_re = fifo_input_re;
+	assign reservedBits = rxq_unsorted_data[511:CORE_NUM*34];
 
-	//integer idx_core;
-	//integer idx_core2;
-	/******Updated by Ren*********/
     always @ (posedge clk) begin
         if (~reset_n_r) begin
-            //state <= LOOKUP;
-            stall <= 1;
             cacheline_count <= 0;
-        end else begin
-            //case(state)
-           //     LOOKUP: begin
-                    if (~rxq_input_empty) begin
-                        stall <= 0;
-                        //state <= LOOKUP;
-                        
-						//for(idx_core = 0; idx_core < CORE_NUM; idx_core = idx_core + 1)
-						//begin: CORE_INKEY
-						inKey[0] <= rxq_unsorted_data[15:0];
-						inKey[1] <= rxq_unsorted_data[31:16];
-						inKey[2] <= rxq_unsorted_data[47:32];
-						inKey[3] <= rxq_unsorted_data[63:48];
-						inKey[4] <= rxq_unsorted_data[79:64];
-						inKey[5] <= rxq_unsorted_data[95:80];
-						inKey[6] <= rxq_unsorted_data[111:96];
-						inKey[7] <= rxq_unsorted_data[127:112];
-						//end
-								
-						//for(idx_core2 = 0; idx_core2 < CORE_NUM; idx_core2 = idx_core2 + 1)
-						//begin: CORE_INIDX
-						//inKey[idx_core2] <= rxq_unsorted_data[CORE_NUM*16+idx_core2];
-						inIdx[0] <=  rxq_unsorted_data[128];
-						inIdx[1] <=  rxq_unsorted_data[129];
-						inIdx[2] <=  rxq_unsorted_data[130];
-						inIdx[3] <=  rxq_unsorted_data[131];
-						inIdx[4] <=  rxq_unsorted_data[132];
-						inIdx[5] <=  rxq_unsorted_data[133];
-						inIdx[6] <=  rxq_unsorted_data[134];
-						inIdx[7] <=  rxq_unsorted_data[135];
-						//end	
-                        valid_in <= {CORE_NUM{1'b1}};	
-						
-						reservedBits <= rxq_unsorted_data[511:CORE_NUM*17];   //needs update
-						
-                        cacheline_count <= cacheline_count + 1'b1;	
-						
-                    end else if (cacheline_count == ctx_length) begin
-                        stall <= 0;
-						//valid_in = {CORE_NUM{1'b0}};
-						//state <= WAIT;
-                    end else begin
-                        stall <= 1;
-						//valid_in = {CORE_NUM{1'b0}};
-						//state <= WAIT;
-                    end
-                //end
-                // LOOKUPMERGE: begin                    
-                     // state <= WAIT;
-                // end
-           // endcase
+        end else if (fifo_input_re) begin
+            cacheline_count <= cacheline_count + 1'b1;
         end
     end
    
@@ -166,6 +157,40 @@ module afu_user # (
     // wire [31:0] outB [CORE_NUM-1:0];
     //wire [31:0] serial_merge_out [CORE_NUM-1:0];
     wire [CORE_NUM-1:0] valid_out;
+    wire [CORE_NUM-1:0] valid_out_b;
+    wire [2*CORE_NUM*TREE_LEVEL-1:0] idx_line;      // leaf index of key k at [TREE_LEVEL*k +: TREE_LEVEL]
+    wire idx_skid_ready;
+
+	// table reload, broadcast to all trees; they hold the same keys in
+	// the same stages, so tree 0's bank_busy stands for all of them
+	wire [1:0]  bank_busy [CORE_NUM-1:0];
+	wire        tbl_wr_en;
+	wire [4:0]  tbl_wr_level;
+	wire [15:0] tbl_wr_addr;
+	wire [15:0] tbl_wr_data;
+	wire        tbl_wr_bank;
+
+	tree_loader #(.TREE_LEVEL(TREE_LEVEL),
+	              .FIFO_DEPTH_BITS(INPUT_FIFO_DEPTH_BITS)
+	             ) loader(
+	            .clk                (clk),
+	            .rst                (~reset_n_r),
+	            .load_start         (load_start),
+	            .swap               (~shared),
+	            .load_bank          (load_ctx ^ active_bank),
+	            .tbl_lines          (tbl_lines),
+	            .tbl_din            (tbl_din),
+	            .tbl_we             (tbl_we),
+	            .tbl_count          (tbl_count),
+	            .wr_en              (tbl_wr_en),
+	            .wr_level           (tbl_wr_level),
+	            .wr_addr            (tbl_wr_addr),
+	            .wr_data            (tbl_wr_data),
+	            .wr_bank            (tbl_wr_bank),
+	            .active_bank        (active_bank),
+	            .bank_busy          (bank_busy[0]),
+	            .load_done          (load_done)
+	        );
 	
     genvar i;
     generate
@@ -185,35 +210,53 @@ module afu_user # (
             // assign serial_merge_out[i] = (in_ctrl_addr == 1'b0) ? outA[i] : outB[i];
         // end
 		for (i=0; i<CORE_NUM; i=i+1) begin:TREE
-		    tree #(.total_level(TREE_LEVEL)) tree_inst(
-		                                     .clk(clk & ~stall),
+		    assign inKey[i]   = rxq_unsorted_data[16*i+15:16*i];
+		    assign inKey_b[i] = rxq_unsorted_data[16*(i+CORE_NUM)+15:16*(i+CORE_NUM)];
+		    assign inIdx[i]   = rxq_unsorted_data[CORE_NUM*32+i];
+		    assign inIdx_b[i] = rxq_unsorted_data[CORE_NUM*33+i];
+		    assign idx_line[TREE_LEVEL*i +: TREE_LEVEL] = outIdx[i];
+		    assign idx_line[TREE_LEVEL*(i+CORE_NUM) +: TREE_LEVEL] = outIdx_b[i];
+
+		    tree #(.total_level(TREE_LEVEL),
+		           .ram_init_data(TREE_INIT_DATA)
+		          ) tree_inst(
+		                                     .clk(clk),
 											 .rst(~reset_n_r),
 											 .Key_in(inKey[i]),
 											 .Index_in(inIdx[i]),
 											 .Index_out(outIdx[i]),
-											 .valid_in(valid_in[i]),
-											 .valid_out(valid_out[i])
+											 .valid_in(tree_valid_in),
+											 .valid_out(valid_out[i]),
+											 .Key_in_b(inKey_b[i]),
+											 .Index_in_b(inIdx_b[i]),
+											 .Index_out_b(outIdx_b[i]),
+											 .valid_in_b(tree_valid_in),
+											 .valid_out_b(valid_out_b[i]),
+											 .ready_in(idx_skid_ready),
+											 .ready_out(tree_ready[i]),
+											 .bank_in(active_bank ^ line_ctx),
+											 .bank_busy(bank_busy[i]),
+											 .wr_en(tbl_wr_en),
+											 .wr_level(tbl_wr_level),
+											 .wr_bank(tbl_wr_bank),
+											 .wr_addr(tbl_wr_addr),
+											 .wr_data(tbl_wr_data)
 											 );
 		end
     endgenerate
 
-    localparam OUTFIRST = 1'b0;
-    localparam OUTSECOND = 1'b1;
-    reg out_state;
     // reg [31:0] out_first [CORE_NUM-1:0];
     // reg [31:0] out_second [CORE_NUM-1:0];
 	
-	//reg [CORE_NUM-1:0] valid_out_r;
-	reg [15:0] outIdx_r [CORE_NUM-1:0];
-	reg [15:0] outIdx_next_r [CORE_NUM-1:0];
 	localparam HIGHBITSNUM = 16-TREE_LEVEL;
 	
     // output
     wire [511:0] rxq_output_din;
     reg rxq_output_we;
     wire rxq_output_full;
+    wire rxq_output_almostfull;
     reg [31:0] cacheline_count_out;
-	reg all_cl_out;
+	wire last_cl_in;
 	
 	//output register
 	// reg [TREE_LEVEL-1:0] outIdx_r_tmp [CORE_NUM-1:0];
@@ -235,101 +278,154 @@ module afu_user # (
 	// endgenerate
 	
 	
-	always@(posedge clk) begin
-	    if (~reset_n_r) begin
-            all_cl_out <= 1'b0;
-			//valid_out_r <= {CORE_NUM{1'b0}};
-        end else begin
-		    all_cl_out <= (cacheline_count_out >= ctx_length-1)? 1'b1: 1'b0;
-			//valid_out_r <= valid_out;
-		end
-	end
+	assign out_fmt = OUT_FMT_CAPS[out_fmt_req] ? out_fmt_req : OUT_FMT_SPARSE;
+	assign out_fmt_caps = OUT_FMT_CAPS;
+	assign out_lines_per_cl = (out_fmt == OUT_FMT_MATCH) ? MATCH_LPC :
+	                          (out_fmt == OUT_FMT_DENSE) ? 8'd2 : 8'd1;
+	assign out_index_bits = TREE_LEVEL;
+	assign out_match_lanes = MATCH_LANES;
+
+	// tenant and last flag of each line from the input FIFO to the packer;
+	// the trees and rule_match keep line order, so a FIFO pushed when a
+	// line enters the trees and popped when the packer takes it pairs up
+	wire side_ctx;
+	wire side_last;
+	wire pack_take;
+
+	asyn_read_fifo #(.FIFO_WIDTH(2),
+	                 .FIFO_DEPTH_BITS(5),       // lines between input FIFO and packer, < 32
+	                 .FIFO_ALMOSTFULL_THRESHOLD(28),
+	                 .FIFO_ALMOSTEMPTY_THRESHOLD(2)
+	                ) side_fifo(
+	            .clk                (clk),
+	            .reset_n            (reset_n_r),
+	            .din                ({line_last, line_ctx}),
+	            .we                 (fifo_input_re),
+	            .re                 (pack_take),
+	            .dout               ({side_last, side_ctx}),
+	            .empty              (),
+	            .full               (),
+	            .count              (),
+	            .almostempty        (),
+	            .almostfull         ()
+	        );
+
+	// a tenant's last line closes its output line
+	assign last_cl_in = side_last;
+
+	// tree results -> skid -> packer.  The skid registers the ready seen by
+	// the trees, so a full output FIFO stops the pipeline cleanly and a
+	// short batch still drains the moment the output side has room.
+	wire [2*CORE_NUM*TREE_LEVEL-1:0] idx_line_q;
+	wire [LINE_IDX_BITS-1:0] idx_words;
+	wire idx_valid;
+	wire idx_ready;
+	wire packer_ready;
+	wire [MATCH_BITS-1:0] match_words;
+	wire match_valid;
+	wire match_ready;
+	wire pack_valid;
+
+	assign packer_ready = ~rxq_output_almostfull;
+	// MATCH: skid -> rule_match -> packer, otherwise skid -> packer
+	assign idx_ready = (out_fmt == OUT_FMT_MATCH) ? match_ready : packer_ready;
+	assign pack_valid = (out_fmt == OUT_FMT_MATCH) ? match_valid : idx_valid;
+
+	skid_buffer #(.WIDTH(2*CORE_NUM*TREE_LEVEL)) idx_skid (
+	    .clk        (clk),
+	    .rst        (~reset_n_r),
+	    .in_valid   (valid_out[0]),
+	    .in_ready   (idx_skid_ready),
+	    .in_data    (idx_line),
+	    .out_valid  (idx_valid),
+	    .out_ready  (idx_ready),
+	    .out_data   (idx_line_q)
+	);
+
+	genvar j;
+	generate
+	    for (j=0; j<2*CORE_NUM; j=j+1) begin:OUTWORD
+	        assign idx_words[16*j +: 16] = {{HIGHBITSNUM{1'b0}}, idx_line_q[TREE_LEVEL*j +: TREE_LEVEL]};
+	    end
+
+	    if (MATCH_ENABLE) begin:MATCH
+	        rule_match #(.LANES(2*CORE_NUM),
+	                     .MATCH_LANES(MATCH_LANES),
+	                     .INDEX_BITS(TREE_LEVEL),
+	                     .LIST_SIZE(LIST_SIZE),
+	                     .list_init_data(LIST_INIT_DATA)
+	                    ) rule_match_inst (
+	            .clk        (clk),
+	            .rst        (~reset_n_r),
+	            .in_valid   (idx_valid & (out_fmt == OUT_FMT_MATCH)),
+	            .in_ready   (match_ready),
+	            .in_idx     (idx_words),
+	            .out_valid  (match_valid),
+	            .out_ready  (packer_ready),
+	            .out_rule   (match_words)
+	        );
+	    end else begin:NO_MATCH
+	        assign match_ready = 1'b1;
+	        assign match_valid = 1'b0;
+	        assign match_words = {MATCH_BITS{1'b0}};
+	    end
+	endgenerate
+
+	// packer: cacheline_count_out counts input lines packed, out_slot the
+	// ones already in out_line_r; a line goes out when full or on a tenant's last one
+	reg [511:0] out_line_r;
+	reg out_ctx_r;
+	reg [7:0] out_slot;
+	wire out_full;
+
+	assign out_full = (out_slot + 1'b1 == out_lines_per_cl) | last_cl_in;
+	assign pack_take = pack_valid & packer_ready;
 
-	//integer idx_o;
     always @ (posedge clk) begin
         if (~reset_n_r) begin
-            out_state <= OUTFIRST;
             rxq_output_we <= 1'b0;
             cacheline_count_out <= 0;
+            out_slot <= 0;
         end else begin
-            case (out_state)
-                OUTFIRST: begin
-                    if (valid_out[0] & ~stall & ~rxq_output_full & ~all_cl_out) begin
-                        out_state <= OUTSECOND;
-						
-						//for(idx_o = 0; idx_o < CORE_NUM; idx_o = idx_o + 1)
-						//begin: CORE_OUTIDX
-						//outIdx_r[idx_o] <= {{HIGHBITSNUM{1'b0}},outIdx[idx_o]};
-						outIdx_r[0] <=  {{HIGHBITSNUM{1'b0}},outIdx[0]};
-                        outIdx_r[1] <=  {{HIGHBITSNUM{1'b0}},outIdx[1]};
-                        outIdx_r[2] <=  {{HIGHBITSNUM{1'b0}},outIdx[2]};
-                        outIdx_r[3] <=  {{HIGHBITSNUM{1'b0}},outIdx[3]};
-                        outIdx_r[4] <=  {{HIGHBITSNUM{1'b0}},outIdx[4]};
-                        outIdx_r[5] <=  {{HIGHBITSNUM{1'b0}},outIdx[5]};
-                        outIdx_r[6] <=  {{HIGHBITSNUM{1'b0}},outIdx[6]};
-                        outIdx_r[7] <=  {{HIGHBITSNUM{1'b0}},outIdx[7]};
-						//end
-						
-                    end
-                    rxq_output_we <= 1'b0;
-                end
-                OUTSECOND: begin
-                    if (~stall & ~rxq_output_full) begin
-                        out_state <= OUTFIRST;
-						
-						
-						//for(idx_o = 0; idx_o < CORE_NUM; idx_o = idx_o + 1)
-						//begin: CORE_OUTIDX_NEXT
-						//    outIdx_next_r[idx_o] <= {{HIGHBITSNUM{1'b0}},outIdx[idx_o]};
-						//end
-						outIdx_next_r[0] <=  {{HIGHBITSNUM{1'b0}},outIdx[0]};
-                        outIdx_next_r[1] <=  {{HIGHBITSNUM{1'b0}},outIdx[1]};
-                        outIdx_next_r[2] <=  {{HIGHBITSNUM{1'b0}},outIdx[2]};
-                        outIdx_next_r[3] <=  {{HIGHBITSNUM{1'b0}},outIdx[3]};
-                        outIdx_next_r[4] <=  {{HIGHBITSNUM{1'b0}},outIdx[4]};
-                        outIdx_next_r[5] <=  {{HIGHBITSNUM{1'b0}},outIdx[5]};
-                        outIdx_next_r[6] <=  {{HIGHBITSNUM{1'b0}},outIdx[6]};
-                        outIdx_next_r[7] <=  {{HIGHBITSNUM{1'b0}},outIdx[7]};
-						
-						
-                        rxq_output_we <= 1'b1;
-                        cacheline_count_out <= cacheline_count_out + 1'b1;
-                    end
+            rxq_output_we <= 1'b0;
+            if (pack_take) begin
+                cacheline_count_out <= cacheline_count_out + 1'b1;
+                if (out_slot == 0) begin
+                    out_ctx_r <= side_ctx;
+                    out_line_r <= (out_fmt == OUT_FMT_MATCH) ? {{(512-MATCH_BITS)/16{16'hffff}}, match_words}
+                                                             : {{(512-LINE_IDX_BITS)/16{16'h1313}}, idx_words};
+                end else if (out_fmt == OUT_FMT_MATCH) begin
+                    out_line_r[MATCH_BITS*out_slot +: MATCH_BITS] <= match_words;
+                end else begin
+                    out_line_r[511:LINE_IDX_BITS] <= idx_words;
                 end
-            endcase
+                rxq_output_we <= out_full;
+                out_slot <= out_full ? 8'd0 : out_slot + 1'b1;
+            end
         end
     end 
 	
-	//little endian
-    assign rxq_output_din =  {
-							  16'h1313, 16'h1313, 16'h1313, 16'h1313, 
-							  16'h1313, 16'h1313, 16'h1313, 16'h1313,
-							  16'h1313, 16'h1313, 16'h1313, 16'h1313,
-							  16'h1313, 16'h1313, 16'h1313, 16'h1313,
-                              outIdx_next_r[7], outIdx_next_r[6], outIdx_next_r[5], outIdx_next_r[4], 
-                              outIdx_next_r[3], outIdx_next_r[2], outIdx_next_r[1], outIdx_next_r[0], 
-							  outIdx_r[7], outIdx_r[6], outIdx_r[5],  outIdx_r[4], 
-                              outIdx_r[3], outIdx_r[2], outIdx_r[1],  outIdx_r[0]		  
-							  } ;
+	//little endian: word k holds the leaf index of key k of the (first) input line
+    assign rxq_output_din = out_line_r;
     // output buffer
     
 
-    syn_read_fifo #(.FIFO_WIDTH(512),
+    syn_read_fifo #(.FIFO_WIDTH(513),
                        .FIFO_DEPTH_BITS(OUTPUT_FIFO_DEPTH_BITS),       // transfer size 1 -> 32 entries
                        .FIFO_ALMOSTFULL_THRESHOLD(2**(OUTPUT_FIFO_DEPTH_BITS)-4),
                        .FIFO_ALMOSTEMPTY_THRESHOLD(2)
                       ) output_fifo(
                 .clk                (clk),
                 .reset_n            (reset_n_r),
-                .din                (rxq_output_din),
+                .din                ({out_ctx_r, rxq_output_din}),
                 .we                 (rxq_output_we),
                 .re                 (rxq_re),
-                .dout               (rxq_dout),
+                .dout               ({rxq_dout_ctx, rxq_dout}),
                 .empty              (rxq_output_empty),
                 .almostempty        (rxq_output_almost_empty),
                 .full               (rxq_output_full),
                 .count              (),
-                .almostfull         ()
+                .almostfull         (rxq_output_almostfull)
             );
 
 endmodule
@@ -0,0 +1,58 @@
+// self-defined true dual-port bram, two independent read/write ports
+
+module bram_tdp #(parameter DATA_WIDTH=16, ADDR_WIDTH_RAM=7, init_file = "input.hex") (
+    input clk,
+    // port A
+    input en_a,
+    input wen_a,
+    input [ADDR_WIDTH_RAM-1:0] addr_a,
+    input [DATA_WIDTH-1:0] din_a,
+    output reg [DATA_WIDTH-1:0] dout_a,
+    // port B
+    input en_b,
+    input wen_b,
+    input [ADDR_WIDTH_RAM-1:0] addr_b,
+    input [DATA_WIDTH-1:0] din_b,
+    output reg [DATA_WIDTH-1:0] dout_b
+    );
+
+    localparam ARRAY_SIZE = 1 << ADDR_WIDTH_RAM;
+    reg [DATA_WIDTH-1:0] ram [0:ARRAY_SIZE-1];
+
+    //port A, read-first
+    always@(posedge clk)
+    begin
+        if (en_a)
+        begin
+            if (wen_a)
+            begin
+                ram[addr_a] <= din_a;
+            end
+            dout_a <= ram[addr_a];
+        end
+    end
+
+    //port B, read-first
+    always@(posedge clk)
+    begin
+        if (en_b)
+        begin
+            if (wen_b)
+            begin
+                ram[addr_b] <= din_b;
+            end
+            dout_b <= ram[addr_b];
+        end
+    end
+
+    reg [DATA_WIDTH-1:0] data[ARRAY_SIZE-1:0];
+    integer i;
+    initial
+    begin
+        $readmemh(init_file, data);
+        for(i=0; i<ARRAY_SIZE; i=i+1)
+    	begin
+            ram[i] = data[i];
+    	end
+    end
+endmodule
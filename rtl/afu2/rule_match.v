@@ -0,0 +1,118 @@
+`timescale 1ns / 1ps
+
+// Final-match stage: leaf indices of one input line -> best rule per packet.
+//
+// A packet is MATCH_LANES consecutive lanes of the line.  The leaf index of
+// every lane selects an ascending rule list (LIST_SIZE ids, one RAM word);
+// the packet's result is the lowest id present in all of its lists, i.e. the
+// first element where merging the lists would put equal ids next to each
+// other.  With lists this short the merge collapses to comparing every id of
+// the first list against every id of the others in one cycle.  16'hffff means
+// no common rule.
+//
+// Pipeline: list read, membership compare, priority select.  Stalls the
+// same way as the trees: every stage holds while the output is not taken.
+module rule_match #(
+    parameter LANES = 16,                 // leaf indices per line, 16-bit words
+    parameter MATCH_LANES = 2,            // lanes intersected per packet, power of 2
+    parameter INDEX_BITS = 10,            // tree depth (afu_user passes TREE_LEVEL): 2^INDEX_BITS lists,
+                                          // addressed by the leaf index; the host rejects MATCH otherwise
+    parameter LIST_SIZE = 8,              // rule ids per list, ascending
+    parameter list_init_data = "/import/usc/home/renchen/ren_ancs/rtl/afu2/rule_lists",
+    parameter PKTS = LANES / MATCH_LANES  // packets per line
+) (
+    input clk,
+    input rst,
+    // leaf indices
+    input in_valid,
+    output in_ready,
+    input [16*LANES-1:0] in_idx,
+    // rule id of packet p at [16*p +: 16]
+    output reg out_valid,
+    input out_ready,
+    output [16*PKTS-1:0] out_rule
+);
+    localparam LIST_BITS = 16*LIST_SIZE;
+
+    wire ce;
+    wire [LIST_BITS-1:0] list [LANES-1:0];
+    reg valid_rd;
+    reg valid_hit;
+
+    assign ce = out_ready | ~out_valid;
+    assign in_ready = ce;
+
+    always@(posedge clk)
+    begin
+        if (rst)
+        begin
+            valid_rd <= 1'b0;
+            valid_hit <= 1'b0;
+            out_valid <= 1'b0;
+        end
+        else if (ce)
+        begin
+            valid_rd <= in_valid;
+            valid_hit <= valid_rd;
+            out_valid <= valid_hit;
+        end
+    end
+
+    genvar l, p;
+    generate
+        // one list table per lane pair, lanes 2l and 2l+1 on its two ports
+        for (l=0; l<LANES/2; l=l+1) begin:LIST
+            bram_tdp #(LIST_BITS, INDEX_BITS, list_init_data) list_ram (
+                .clk    (clk),
+                .en_a   (ce),
+                .wen_a  (1'b0),
+                .addr_a (in_idx[32*l +: INDEX_BITS]),
+                .din_a  ({LIST_BITS{1'b0}}),
+                .dout_a (list[2*l]),
+                .en_b   (ce),
+                .wen_b  (1'b0),
+                .addr_b (in_idx[32*l+16 +: INDEX_BITS]),
+                .din_b  ({LIST_BITS{1'b0}}),
+                .dout_b (list[2*l+1])
+            );
+        end
+
+        for (p=0; p<PKTS; p=p+1) begin:PACKET
+            integer i, j, m;
+            reg in_all;
+            reg in_one;
+            reg [LIST_SIZE-1:0] hit;          // id i of the packet's first list is in all others
+            reg [LIST_BITS-1:0] head;
+            reg [15:0] rule;
+
+            assign out_rule[16*p +: 16] = rule;
+
+            always@(posedge clk)
+            begin
+                if (ce)
+                begin
+                    head <= list[MATCH_LANES*p];
+                    for (i=0; i<LIST_SIZE; i=i+1)
+                    begin
+                        in_all = 1'b1;
+                        for (m=1; m<MATCH_LANES; m=m+1)
+                        begin
+                            in_one = 1'b0;
+                            for (j=0; j<LIST_SIZE; j=j+1)
+                                in_one = in_one | (list[MATCH_LANES*p][16*i +: 16] == list[MATCH_LANES*p+m][16*j +: 16]);
+                            in_all = in_all & in_one;
+                        end
+                        hit[i] <= in_all;
+                    end
+
+                    // lists ascend: the lowest hit is the best match
+                    rule <= 16'hffff;
+                    for (i=LIST_SIZE-1; i>=0; i=i-1)
+                        if (hit[i])
+                            rule <= head[16*i +: 16];
+                end
+            end
+        end
+    endgenerate
+
+endmodule
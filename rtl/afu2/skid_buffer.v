@@ -0,0 +1,60 @@
+`timescale 1ns / 1ps
+
+// Two-entry skid buffer for a valid/ready stream.
+// in_ready is a register output, so the consumer's ready never reaches the
+// producer combinationally; one item arriving in the cycle the consumer
+// stalls is parked in the skid register instead of being dropped.
+
+module skid_buffer #(parameter WIDTH = 32) (
+    input clk,
+    input rst,
+    // upstream
+    input in_valid,
+    output in_ready,
+    input [WIDTH-1:0] in_data,
+    // downstream
+    output out_valid,
+    input out_ready,
+    output [WIDTH-1:0] out_data
+    );
+
+    reg [WIDTH-1:0] data_r;
+    reg [WIDTH-1:0] skid_r;
+    reg valid_r;
+    reg skid_valid;
+
+    assign in_ready = ~skid_valid;
+    assign out_valid = valid_r;
+    assign out_data = data_r;
+
+    always@(posedge clk)
+    begin
+        if (rst)
+        begin
+            valid_r <= 1'b0;
+            skid_valid <= 1'b0;
+        end
+        else if (out_ready | ~valid_r)
+        begin
+            // output register free: refill from the skid first
+            if (skid_valid)
+            begin
+                data_r <= skid_r;
+                valid_r <= 1'b1;
+                skid_valid <= 1'b0;
+            end
+            else
+            begin
+                data_r <= in_data;
+                valid_r <= in_valid;
+            end
+        end
+        else if (in_valid & ~skid_valid)
+        begin
+            // output stalled, park the item that was already on its way
+            skid_r <= in_data;
+            skid_valid <= 1'b1;
+        end
+    end
+
+endmodule
@@ -0,0 +1,467 @@
+`timescale 1ns / 1ps
+
+// Testbench of afu_core with afu_user behind it, against a host memory
+// model.  Reads are answered in request order after RD_LATENCY cycles and
+// a random delay, a line per cycle at most, and no more lines may be
+// outstanding than the read window (RD_WINDOW_BITS) holds; writes land in
+// the same memory (DSM lines too, the DSM sits at DSM_BASE).  Source lines
+// are the tree_vectors input lines, so every output line is checked against
+// the host's leaf indices in the SPARSE or DENSE layout (afu_output.h).
+// The read stats in the DSM must show the window and stay within it.
+//
+// Tenants (SHARED = 1): tenant 0 owns the transaction at CTX0, tenant 1
+// attaches through AFU_CSR_CTX1_BASEL while tenant 0 runs; the tenants'
+// reads are arbitrated by weight and their output lines interleave.  Both
+// outputs, tenant 0's status line and tenant 1's completion record are
+// checked, and nothing past either output may be written.
+//
+// Job ring (Q_JOBS > 0, SHARED): tenant 1 takes Q_JOBS jobs from the ring
+// at Q_BASE instead, 2^Q_BITS descriptors and their completion records
+// after them.  The host posts a job by moving the tail, reusing a slot once
+// its record is in, then stops the ring; tenant 0's status must not come
+// before that.  Every record, every job's output and the head in the DSM
+// are checked.  -P tb_afu_core.Q_JOBS=6 runs the ring.
+//
+// afu_core includes spl_defines.vh (MAX_TRANSFER_SIZE), which comes with the
+// SPL sources; run from rtl/afu2 with its directory on the include path:
+//   iverilog -g2012 -I <spl include dir> -o tb_afu_core tb_afu_core.v afu_core.v afu_user.v \
+//            asyn_read_fifo.v syn_read_fifo.v ../spl2/memory/spl_sdp_mem.v skid_buffer.v \
+//            rule_match.v tree_loader.v tree.v tree_start_level.v tree_level.v tree_last_level.v \
+//            tree_bram.v tree_dram.v bram_tdp.v && vvp tb_afu_core
+
+module tb_afu_core;
+
+parameter OUT_FMT    = 0;               // AFU_OUT_FMT_SPARSE 0, AFU_OUT_FMT_DENSE 1
+parameter SHARED     = 1;
+parameter N0         = 700;             // source lines of tenant 0
+parameter N1         = 301;             // source lines of tenant 1
+parameter Q_JOBS     = 0;               // jobs of tenant 1 through the ring, 0: one through CTX1
+parameter Q_BITS     = 2;
+parameter VEC_LINES  = 256;
+parameter VEC_FILE   = "tree_vectors";
+parameter RD_WINDOW_BITS = 8;           // afu_core, 7+MAX_TRANSFER_SIZE in afu_top
+parameter RD_LATENCY = 16;              // a few hundred make the read window the limit
+parameter TIMEOUT    = 2000000;
+
+localparam TREE_LEVEL = 10;             // afu_user
+localparam MEM_BITS   = 15;
+localparam DSM_BASE   = 15'h0000;
+localparam CTX0       = 15'h0040;       // tenant 0 context, status line next to it
+localparam CTX1       = 15'h0080;       // tenant 1 descriptor, completion record next to it
+localparam SRC0       = 15'h1000;
+localparam DST0       = 15'h2000;
+localparam SRC1       = 15'h3000;
+localparam DST1       = 15'h4000;
+localparam VEC1       = 100;            // tenant 1 starts at this vector line
+localparam Q_BASE     = 15'h0100;       // ring descriptors, completion records after them
+localparam Q_DST      = 15'h0100;       // output lines of a ring job, at DST1 + job*Q_DST
+localparam FILL       = {32{16'hbebe}};
+localparam [63:0] AFU_ID = 64'h111_00181;
+
+reg                   clk;
+reg                   reset_n;
+reg  [33*16-1:0]      vec [0:VEC_LINES-1];
+reg  [511:0]          mem [0:(1<<MEM_BITS)-1];
+integer               errors;
+integer               k;
+
+// afu_core ports
+reg                   spl_tx_rd_almostfull;
+wire                  cor_tx_rd_valid;
+wire [57:0]           cor_tx_rd_addr;
+wire [5:0]            cor_tx_rd_len;
+reg                   spl_tx_wr_almostfull;
+wire                  cor_tx_wr_valid;
+wire                  cor_tx_dsr_valid;
+wire                  cor_tx_fence_valid;
+wire                  cor_tx_done_valid;
+wire [57:0]           cor_tx_wr_addr;
+wire [5:0]            cor_tx_wr_len;
+wire [511:0]          cor_tx_data;
+reg                   io_rx_rd_valid;
+reg  [511:0]          io_rx_data;
+reg                   csr_id_valid;
+wire                  csr_id_done;
+reg                   csr_ctx_base_valid;
+reg                   csr_ctx1_valid;
+wire                  csr_ctx1_done;
+reg  [31:0]           csr_q_tail;
+reg                   csr_q_stop;
+wire                  csr_tbl_done;
+wire                  csr_scratch_done;
+
+afu_core #(.RD_WINDOW_BITS(RD_WINDOW_BITS),
+           .TREE_INIT_DATA("tree_data_"),
+           .LIST_INIT_DATA("rule_lists")
+          ) dut (
+    .clk                    (clk),
+    .reset_n                (reset_n),
+    .spl_enable             (1'b1),
+    .spl_reset              (1'b0),
+    .spl_tx_rd_almostfull   (spl_tx_rd_almostfull),
+    .cor_tx_rd_valid        (cor_tx_rd_valid),
+    .cor_tx_rd_addr         (cor_tx_rd_addr),
+    .cor_tx_rd_len          (cor_tx_rd_len),
+    .spl_tx_wr_almostfull   (spl_tx_wr_almostfull),
+    .cor_tx_wr_valid        (cor_tx_wr_valid),
+    .cor_tx_dsr_valid       (cor_tx_dsr_valid),
+    .cor_tx_fence_valid     (cor_tx_fence_valid),
+    .cor_tx_done_valid      (cor_tx_done_valid),
+    .cor_tx_wr_addr         (cor_tx_wr_addr),
+    .cor_tx_wr_len          (cor_tx_wr_len),
+    .cor_tx_data            (cor_tx_data),
+    .io_rx_rd_valid         (io_rx_rd_valid),
+    .io_rx_data             (io_rx_data),
+    .csr_id_valid           (csr_id_valid),
+    .csr_id_done            (csr_id_done),
+    .csr_id_addr            ({17'b0, DSM_BASE}),
+    .csr_scratch_valid      (1'b0),
+    .csr_scratch_done       (csr_scratch_done),
+    .csr_scratch_addr       (32'b0),
+    .csr_scratch            (64'b0),
+    .csr_ctx_base_valid     (csr_ctx_base_valid),
+    .csr_ctx_base           ({43'b0, CTX0}),
+    .csr_out_fmt            (OUT_FMT[1:0]),
+    .csr_tbl_valid          (1'b0),
+    .csr_tbl_done           (csr_tbl_done),
+    .csr_tbl_base           (58'b0),
+    .csr_ctx1_valid         (csr_ctx1_valid),
+    .csr_ctx1_done          (csr_ctx1_done),
+    .csr_ctx1_base          ({43'b0, CTX1}),
+    .csr_shared             (SHARED[0]),
+    .csr_ctx_weight         (16'h0201),
+    .csr_tbl_ctx            (1'b0),
+    .csr_q_on               ((SHARED != 0) && (Q_JOBS != 0)),
+    .csr_q_base             ({43'b0, Q_BASE}),
+    .csr_q_bits             (Q_BITS[4:0]),
+    .csr_q_tail             (csr_q_tail),
+    .csr_q_stop             (csr_q_stop)
+);
+
+always #5 clk = ~clk;
+
+//-----------------------------------------------------------
+// host memory: reads
+//-----------------------------------------------------------
+reg  [MEM_BITS-1:0]   rd_q_addr [0:1023];
+reg  [6:0]            rd_q_len  [0:1023];
+reg  [31:0]           rd_q_time [0:1023];
+reg  [9:0]            rd_q_head;
+reg  [9:0]            rd_q_tail;
+reg  [6:0]            rd_line;
+reg  [31:0]           rd_out;           // lines requested and not answered
+reg  [31:0]           rd_out_max;
+reg  [31:0]           cycle;
+
+always @(posedge clk) begin
+    if (~reset_n) begin
+        rd_q_head <= 0;
+        rd_q_tail <= 0;
+        rd_line <= 0;
+        rd_out <= 0;
+        rd_out_max <= 0;
+        io_rx_rd_valid <= 1'b0;
+        cycle <= 0;
+        spl_tx_rd_almostfull <= 1'b0;
+        spl_tx_wr_almostfull <= 1'b0;
+    end
+    else begin
+        cycle <= cycle + 1'b1;
+        spl_tx_rd_almostfull <= (($random & 15) == 0);
+        spl_tx_wr_almostfull <= (($random & 15) == 0);
+        if (cor_tx_rd_valid) begin
+            rd_q_addr[rd_q_tail] <= cor_tx_rd_addr[MEM_BITS-1:0];
+            rd_q_len[rd_q_tail] <= (cor_tx_rd_len == 6'b0) ? 7'd64 : cor_tx_rd_len;
+            rd_q_time[rd_q_tail] <= cycle + RD_LATENCY + ($random & 63);
+            rd_q_tail <= rd_q_tail + 1'b1;
+            if (cor_tx_rd_addr[57:MEM_BITS] != 0) begin
+                $display("tb_afu_core: read of line %h outside the memory", cor_tx_rd_addr);
+                errors = errors + 1;
+            end
+        end
+        rd_out <= rd_out + (cor_tx_rd_valid ? ((cor_tx_rd_len == 6'b0) ? 64 : cor_tx_rd_len) : 0) - io_rx_rd_valid;
+        if (rd_out > rd_out_max) rd_out_max <= rd_out;
+        if (rd_out > (1 << RD_WINDOW_BITS)) begin
+            $display("tb_afu_core: %0d lines outstanding, the window is %0d", rd_out, 1 << RD_WINDOW_BITS);
+            errors = errors + 1;
+        end
+        io_rx_rd_valid <= 1'b0;
+        if ((rd_q_head != rd_q_tail) && (cycle >= rd_q_time[rd_q_head]) && (($random & 3) != 0)) begin
+            io_rx_rd_valid <= 1'b1;
+            io_rx_data <= mem[rd_q_addr[rd_q_head] + rd_line];
+            if (rd_line + 1 == rd_q_len[rd_q_head]) begin
+                rd_line <= 0;
+                rd_q_head <= rd_q_head + 1'b1;
+            end
+            else begin
+                rd_line <= rd_line + 1'b1;
+            end
+        end
+    end
+end
+
+//-----------------------------------------------------------
+// host memory: writes, a header carries the address and length
+// of the burst, its other lines follow
+//-----------------------------------------------------------
+reg  [6:0]            wr_left;
+reg  [MEM_BITS-1:0]   wr_ptr;
+reg  [31:0]           fences;
+
+always @(posedge clk) begin
+    if (~reset_n) begin
+        wr_left <= 0;
+        fences <= 0;
+    end
+    else if (cor_tx_wr_valid) begin
+        if (cor_tx_fence_valid) begin
+            fences <= fences + 1'b1;
+        end
+        else if (wr_left == 0) begin
+            if (cor_tx_wr_addr[57:MEM_BITS] != 0) begin
+                $display("tb_afu_core: write of line %h outside the memory", cor_tx_wr_addr);
+                errors = errors + 1;
+            end
+            mem[cor_tx_wr_addr[MEM_BITS-1:0]] <= cor_tx_data;
+            wr_ptr <= cor_tx_wr_addr[MEM_BITS-1:0] + 1'b1;
+            wr_left <= ((cor_tx_wr_len == 6'b0) ? 7'd64 : cor_tx_wr_len) - 1'b1;
+        end
+        else begin
+            mem[wr_ptr] <= cor_tx_data;
+            wr_ptr <= wr_ptr + 1'b1;
+            wr_left <= wr_left - 1'b1;
+        end
+    end
+end
+
+//-----------------------------------------------------------
+// expected output
+//-----------------------------------------------------------
+// leaf indices of source line v of the vectors, 16 words
+function [255:0] leaves;
+    input integer v;
+    integer w;
+    begin
+        for (w=0; w<16; w=w+1)
+            leaves[16*w +: 16] = {{(16-TREE_LEVEL){1'b0}}, vec[v % VEC_LINES][16*(17+w) +: TREE_LEVEL]};
+    end
+endfunction
+
+// output line o of a task of n lines from vector line v0
+function [511:0] out_line;
+    input integer v0;
+    input integer n;
+    input integer o;
+    begin
+        if (OUT_FMT == 1)
+            out_line = {(2*o+1 < n) ? leaves(v0+2*o+1) : {16{16'h1313}}, leaves(v0+2*o)};
+        else
+            out_line = {{16{16'h1313}}, leaves(v0+o)};
+    end
+endfunction
+
+function integer out_lines;
+    input integer n;
+    begin
+        out_lines = (OUT_FMT == 1) ? (n+1)/2 : n;
+    end
+endfunction
+
+task check_output;
+    input [8*8-1:0] name;
+    input integer dst;
+    input integer v0;
+    input integer n;
+    integer o;
+    integer bad;
+    begin
+        bad = 0;
+        for (o=0; o<out_lines(n); o=o+1) begin
+            if (mem[dst+o] !== out_line(v0, n, o)) begin
+                if (bad < 4)
+                    $display("tb_afu_core: %0s line %0d: %h, host %h", name, o, mem[dst+o], out_line(v0, n, o));
+                bad = bad + 1;
+            end
+        end
+        if (mem[dst+out_lines(n)] !== FILL) begin
+            $display("tb_afu_core: %0s written past its %0d output lines", name, out_lines(n));
+            bad = bad + 1;
+        end
+        errors = errors + bad;
+    end
+endtask
+
+// ring job j: its input lines, and where they start in the source and vectors
+function integer q_len;
+    input integer j;
+    begin
+        q_len = 29 + 23*j;
+    end
+endfunction
+
+function integer q_first;
+    input integer j;
+    integer i;
+    begin
+        q_first = 0;
+        for (i=0; i<j; i=i+1)
+            q_first = q_first + q_len(i);
+    end
+endfunction
+
+// completion record of ring job j: input lines, sequence number, job id, done
+function [127:0] q_record;
+    input integer j;
+    begin
+        q_record = {q_len(j), j+1, 32'h100+j, 32'd1};
+    end
+endfunction
+
+task check_record;
+    input integer j;
+    begin
+        if (mem[Q_BASE + (1 << Q_BITS) + j % (1 << Q_BITS)][127:0] !== q_record(j)) begin
+            $display("tb_afu_core: ring job %0d completion record %h", j,
+                     mem[Q_BASE + (1 << Q_BITS) + j % (1 << Q_BITS)][127:0]);
+            errors = errors + 1;
+        end
+    end
+endtask
+
+// context line: job id [31:0], source [127:70], destination [191:134], lines [223:192]
+function [511:0] ctx_line;
+    input [31:0] job;
+    input [57:0] src;
+    input [57:0] dst;
+    input [31:0] len;
+    begin
+        ctx_line = 512'b0;
+        ctx_line[31:0] = job;
+        ctx_line[127:70] = src;
+        ctx_line[191:134] = dst;
+        ctx_line[223:192] = len;
+    end
+endfunction
+
+initial begin
+    $readmemh(VEC_FILE, vec);
+    for (k=0; k<(1<<MEM_BITS); k=k+1)
+        mem[k] = FILL;
+    for (k=0; k<N0; k=k+1)
+        mem[SRC0+k] = {240'b0, vec[k % VEC_LINES][17*16-1:0]};
+    for (k=0; k<((Q_JOBS != 0) ? q_first(Q_JOBS) : N1); k=k+1)
+        mem[SRC1+k] = {240'b0, vec[(VEC1+k) % VEC_LINES][17*16-1:0]};
+    mem[CTX0] = ctx_line(32'b0, SRC0, DST0, N0);
+    mem[CTX1] = ctx_line(32'h5a, SRC1, DST1, N1);
+
+    clk = 1'b0;
+    reset_n = 1'b0;
+    errors = 0;
+    csr_id_valid = 1'b0;
+    csr_ctx_base_valid = 1'b0;
+    csr_ctx1_valid = 1'b0;
+    csr_q_tail = 32'b0;
+    csr_q_stop = 1'b0;
+    repeat (8) @(posedge clk);
+    reset_n <= 1'b1;
+    repeat (4) @(posedge clk);
+
+    // DSM base, then the transaction
+    csr_id_valid <= 1'b1;
+    @(posedge clk);
+    while (~csr_id_done) @(posedge clk);
+    csr_id_valid <= 1'b0;
+    csr_ctx_base_valid <= 1'b1;
+
+    // tenant 1 attaches once tenant 0's output is coming
+    if (SHARED && Q_JOBS) begin
+        while (mem[DST0] === FILL) @(posedge clk);
+        for (k=0; k<Q_JOBS; k=k+1) begin
+            // a slot is free again once the job before in it has its record
+            if (k >= (1 << Q_BITS)) begin
+                while (mem[Q_BASE + (1 << Q_BITS) + k % (1 << Q_BITS)][63:32] !== k - (1 << Q_BITS) + 1)
+                    @(posedge clk);
+                check_record(k - (1 << Q_BITS));
+            end
+            mem[Q_BASE + k % (1 << Q_BITS)] = ctx_line(32'h100+k, SRC1+q_first(k), DST1+k*Q_DST, q_len(k));
+            @(posedge clk);
+            csr_q_tail <= k+1;
+            repeat ($random & 255) @(posedge clk);
+        end
+        if (mem[CTX0+1][0] === 1'b1) begin
+            $display("tb_afu_core: tenant 0 done with the ring running");
+            errors = errors + 1;
+        end
+        csr_q_stop <= 1'b1;
+        while (mem[Q_BASE + (1 << Q_BITS) + (Q_JOBS-1) % (1 << Q_BITS)][63:32] !== Q_JOBS)
+            @(posedge clk);
+    end
+    else if (SHARED) begin
+        while (mem[DST0] === FILL) @(posedge clk);
+        csr_ctx1_valid <= 1'b1;
+        @(posedge clk);
+        while (~csr_ctx1_done) @(posedge clk);
+        csr_ctx1_valid <= 1'b0;
+    end
+
+    while ((mem[CTX0+1][0] !== 1'b1) || (SHARED && (Q_JOBS == 0) && (mem[CTX1+1][0] !== 1'b1))) @(posedge clk);
+    repeat (64) @(posedge clk);
+
+    // DSM: AFU_ID, accepted format and its geometry, tenants
+    if ((mem[DSM_BASE][63:0] !== AFU_ID) || (mem[DSM_BASE][65:64] !== OUT_FMT) ||
+        (mem[DSM_BASE][79:72] !== TREE_LEVEL) || (mem[DSM_BASE][87:80] !== ((OUT_FMT == 1) ? 2 : 1)) ||
+        (mem[DSM_BASE][111:104] !== 8'd2) || (mem[DSM_BASE][119:112] !== 8'd16)) begin
+        $display("tb_afu_core: DSM line 0 %h", mem[DSM_BASE][127:0]);
+        errors = errors + 1;
+    end
+    if (mem[DSM_BASE+5][31:0] == 32'b0) begin
+        $display("tb_afu_core: no performance count");
+        errors = errors + 1;
+    end
+    // read stats, low word first: busy, starved by the window, by memory,
+    // by the issue side, pending maximum, window
+    if ((mem[DSM_BASE+8][191:160] !== (1 << RD_WINDOW_BITS)) || (mem[DSM_BASE+8][31:0] == 32'b0) ||
+        (mem[DSM_BASE+8][159:128] == 32'b0) || (mem[DSM_BASE+8][159:128] > (1 << RD_WINDOW_BITS))) begin
+        $display("tb_afu_core: DSM read stats %h", mem[DSM_BASE+8][191:0]);
+        errors = errors + 1;
+    end
+
+    check_output("tenant0", DST0, 0, N0);
+    if (SHARED && Q_JOBS) begin
+        for (k=0; k<Q_JOBS; k=k+1)
+            check_output("ring job", DST1+k*Q_DST, VEC1+q_first(k), q_len(k));
+        for (k=(Q_JOBS > (1 << Q_BITS)) ? Q_JOBS - (1 << Q_BITS) : 0; k<Q_JOBS; k=k+1)
+            check_record(k);
+        if (mem[DSM_BASE+7][31:0] !== Q_JOBS) begin
+            $display("tb_afu_core: ring head %0d, %0d jobs", mem[DSM_BASE+7][31:0], Q_JOBS);
+            errors = errors + 1;
+        end
+    end
+    else if (SHARED) begin
+        check_output("tenant1", DST1, VEC1, N1);
+        // done, job id, sequence number, input lines
+        if (mem[CTX1+1][127:0] !== {N1[31:0], 32'd1, 32'h5a, 32'd1}) begin
+            $display("tb_afu_core: tenant 1 completion record %h", mem[CTX1+1][127:0]);
+            errors = errors + 1;
+        end
+    end
+    if (fences < 1 + ((Q_JOBS != 0) ? Q_JOBS : 1)*SHARED) begin
+        $display("tb_afu_core: %0d fences", fences);
+        errors = errors + 1;
+    end
+
+    if (errors == 0)
+        $display("tb_afu_core: PASS, %0d + %0d lines, up to %0d of %0d read lines outstanding",
+                 N0, (SHARED == 0) ? 0 : (Q_JOBS != 0) ? q_first(Q_JOBS) : N1, rd_out_max, 1 << RD_WINDOW_BITS);
+    else
+        $display("tb_afu_core: FAIL, %0d errors", errors);
+    $finish;
+end
+
+initial begin
+    #(TIMEOUT);
+    $display("tb_afu_core: FAIL, timeout; status %b, record %b", mem[CTX0+1][0], mem[CTX1+1][0]);
+    $finish;
+end
+
+endmodule
@@ -0,0 +1,157 @@
+`timescale 1ns / 1ps
+
+// Testbench of rule_match against the host's firstCommonRule(): the lowest
+// id of a packet's first list that is in all of its other lists, 16'hffff
+// if there is none.  The lists are rule_lists (hw_app rule_list_hex), the
+// leaf indices random with the upper bits set as well, since only the low
+// INDEX_BITS address a list.  The consumer stalls at random.
+//
+// Run from rtl/afu2:
+//   iverilog -g2005 -o tb_rule_match tb_rule_match.v rule_match.v bram_tdp.v && vvp tb_rule_match
+
+module tb_rule_match;
+
+parameter LANES       = 16;
+parameter MATCH_LANES = 2;
+parameter INDEX_BITS  = 10;
+parameter LIST_SIZE   = 8;
+parameter LIST_FILE   = "rule_lists";
+parameter LINES       = 2048;
+parameter TIMEOUT     = 1000000;
+
+localparam PKTS      = LANES / MATCH_LANES;
+localparam LIST_BITS = 16*LIST_SIZE;
+
+reg                   clk;
+reg                   rst;
+reg  [LIST_BITS-1:0]  lists [0:(1<<INDEX_BITS)-1];
+reg  [16*LANES-1:0]   sent_idx [0:LINES-1];
+
+reg  [31:0]           in_cnt;
+reg                   in_valid;
+wire                  in_ready;
+reg  [16*LANES-1:0]   in_idx;
+reg  [31:0]           out_cnt;
+wire                  out_valid;
+reg                   out_ready;
+wire [16*PKTS-1:0]    out_rule;
+reg  [15:0]           rule;
+reg  [31:0]           hits;
+integer               errors;
+integer               k;
+
+rule_match #(.LANES(LANES),
+             .MATCH_LANES(MATCH_LANES),
+             .INDEX_BITS(INDEX_BITS),
+             .LIST_SIZE(LIST_SIZE),
+             .list_init_data(LIST_FILE)
+            ) dut (
+    .clk        (clk),
+    .rst        (rst),
+    .in_valid   (in_valid),
+    .in_ready   (in_ready),
+    .in_idx     (in_idx),
+    .out_valid  (out_valid),
+    .out_ready  (out_ready),
+    .out_rule   (out_rule)
+);
+
+// firstCommonRule() over the lists of packet p of a line
+function [15:0] host_rule;
+    input [16*LANES-1:0] idx;
+    input integer p;
+    integer i, j, m;
+    reg in_all;
+    reg in_one;
+    reg [LIST_BITS-1:0] first;
+    reg [LIST_BITS-1:0] other;
+    begin
+        host_rule = 16'hffff;
+        first = lists[idx[16*MATCH_LANES*p +: INDEX_BITS]];
+        for (i=LIST_SIZE-1; i>=0; i=i-1) begin
+            in_all = 1'b1;
+            for (m=1; m<MATCH_LANES; m=m+1) begin
+                other = lists[idx[16*(MATCH_LANES*p+m) +: INDEX_BITS]];
+                in_one = 1'b0;
+                for (j=0; j<LIST_SIZE; j=j+1)
+                    in_one = in_one | (first[16*i +: 16] == other[16*j +: 16]);
+                in_all = in_all & in_one;
+            end
+            if (in_all)
+                host_rule = first[16*i +: 16];
+        end
+    end
+endfunction
+
+always #5 clk = ~clk;
+
+// producer: a new line of random indices after every one taken
+always @(posedge clk) begin
+    if (rst) begin
+        in_cnt <= 0;
+        in_valid <= 1'b0;
+    end
+    else begin
+        if (in_valid & in_ready) begin
+            sent_idx[in_cnt] <= in_idx;
+            in_cnt <= in_cnt + 1'b1;
+        end
+        if ((in_valid & in_ready) | ~in_valid) begin
+            in_valid <= (in_cnt + (in_valid & in_ready) < LINES) & (($random & 3) != 0);
+            for (k=0; k<LANES; k=k+1)
+                in_idx[16*k +: 16] <= $random;
+        end
+    end
+end
+
+always @(posedge clk) begin
+    if (rst) begin
+        out_cnt <= 0;
+        out_ready <= 1'b0;
+    end
+    else begin
+        out_ready <= (($random & 3) != 0);
+        if ((out_valid === 1'b1) & out_ready) begin
+            if (out_cnt >= in_cnt) begin
+                $display("tb_rule_match: line %0d out, %0d sent", out_cnt, in_cnt);
+                errors = errors + 1;
+            end
+            else begin
+                for (k=0; k<PKTS; k=k+1) begin
+                    rule = host_rule(sent_idx[out_cnt], k);
+                    hits = hits + (rule != 16'hffff);
+                    if (out_rule[16*k +: 16] !== rule) begin
+                        $display("tb_rule_match: line %0d packet %0d: %h, host %h", out_cnt, k, out_rule[16*k +: 16], rule);
+                        errors = errors + 1;
+                    end
+                end
+            end
+            out_cnt <= out_cnt + 1'b1;
+        end
+    end
+end
+
+initial begin
+    $readmemh(LIST_FILE, lists);
+    clk = 1'b0;
+    rst = 1'b1;
+    errors = 0;
+    hits = 0;
+    repeat (4) @(posedge clk);
+    rst <= 1'b0;
+    wait (out_cnt == LINES);
+    repeat (16) @(posedge clk);
+    if (errors == 0)
+        $display("tb_rule_match: PASS, %0d lines, %0d of %0d packets matched", out_cnt, hits, out_cnt*PKTS);
+    else
+        $display("tb_rule_match: FAIL, %0d errors", errors);
+    $finish;
+end
+
+initial begin
+    #(TIMEOUT);
+    $display("tb_rule_match: FAIL, timeout after %0d of %0d lines", out_cnt, LINES);
+    $finish;
+end
+
+endmodule
@@ -0,0 +1,111 @@
+`timescale 1ns / 1ps
+
+// Testbench of skid_buffer: a producer that holds an item until it is taken
+// (as the trees do) and a consumer that stalls at random.  Every item must
+// come out once, in order, and out_data must hold while out_valid waits.
+//
+//   iverilog -g2005 -o tb_skid_buffer tb_skid_buffer.v skid_buffer.v && vvp tb_skid_buffer
+
+module tb_skid_buffer;
+
+parameter WIDTH   = 16;
+parameter ITEMS   = 4096;
+parameter TIMEOUT = 1000000;
+
+reg              clk;
+reg              rst;
+
+reg              in_valid;
+wire             in_ready;
+reg  [WIDTH-1:0] in_data;
+wire             out_valid;
+reg              out_ready;
+wire [WIDTH-1:0] out_data;
+
+reg  [31:0]      sent;
+reg  [31:0]      got;
+reg              stalled;          // out_valid & ~out_ready last cycle
+reg  [WIDTH-1:0] stalled_data;
+integer          errors;
+
+skid_buffer #(.WIDTH(WIDTH)) dut (
+    .clk        (clk),
+    .rst        (rst),
+    .in_valid   (in_valid),
+    .in_ready   (in_ready),
+    .in_data    (in_data),
+    .out_valid  (out_valid),
+    .out_ready  (out_ready),
+    .out_data   (out_data)
+);
+
+always #5 clk = ~clk;
+
+// producer: item n carries n; once offered it stays until taken
+always @(posedge clk) begin
+    if (rst) begin
+        in_valid <= 1'b0;
+        in_data <= 0;
+        sent <= 0;
+    end
+    else if (in_valid & in_ready) begin
+        sent <= sent + 1'b1;
+        in_data <= sent + 1'b1;
+        in_valid <= (sent + 1 < ITEMS) & (($random & 3) != 0);
+    end
+    else if (~in_valid) begin
+        in_valid <= (sent < ITEMS) & (($random & 3) != 0);
+    end
+end
+
+// consumer
+always @(posedge clk) begin
+    if (rst) begin
+        out_ready <= 1'b0;
+        got <= 0;
+        stalled <= 1'b0;
+    end
+    else begin
+        out_ready <= (($random & 3) != 0);
+        if (stalled & ((out_valid !== 1'b1) | (out_data !== stalled_data))) begin
+            $display("tb_skid_buffer: item %0d changed while stalled: %h -> %h (valid %b)", got, stalled_data, out_data, out_valid);
+            errors = errors + 1;
+        end
+        stalled <= (out_valid === 1'b1) & ~out_ready;
+        stalled_data <= out_data;
+        if ((out_valid === 1'b1) & out_ready) begin
+            if (out_data !== got[WIDTH-1:0]) begin
+                $display("tb_skid_buffer: item %0d is %h", got, out_data);
+                errors = errors + 1;
+            end
+            got <= got + 1'b1;
+        end
+    end
+end
+
+initial begin
+    clk = 1'b0;
+    rst = 1'b1;
+    errors = 0;
+    repeat (4) @(posedge clk);
+    rst <= 1'b0;
+    wait (got == ITEMS);
+    repeat (16) @(posedge clk);
+    if (got != ITEMS) begin
+        $display("tb_skid_buffer: %0d items out, %0d sent", got, ITEMS);
+        errors = errors + 1;
+    end
+    if (errors == 0)
+        $display("tb_skid_buffer: PASS, %0d items", got);
+    else
+        $display("tb_skid_buffer: FAIL, %0d errors", errors);
+    $finish;
+end
+
+initial begin
+    #(TIMEOUT);
+    $display("tb_skid_buffer: FAIL, timeout after %0d of %0d items", got, ITEMS);
+    $finish;
+end
+
+endmodule
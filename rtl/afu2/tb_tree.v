@@ -0,0 +1,255 @@
+`timescale 1ns / 1ps
+
+// Testbench of the tree cores against the host tree walk.
+//
+// tree_vectors holds AFU input lines and the leaf indices the host gives
+// them over TREE_LEVEL levels of the init tables
+// (TreeWalkEngine::writeAfuVectors(), hw_app tree_vector_file): one text
+// line per input line, most significant word first: the leaf indices of
+// keys 15..0, the index bits, keys 15..0.  CORE_NUM trees take every line
+// as afu_user does, key i on port A and key i+CORE_NUM on port B of core i,
+// and each result is compared with the host's.  Lines are offered and
+// results taken at random, so the pipeline stalls with results waiting.
+//
+// Table reload: tree_reload_vectors are the same for the tables in
+// tree_reload_data (writeTreeLevelsHex(), hw_app tree_vector_tables).
+//   phase 0: tree_vectors on bank 0, while bank 1 is written
+//   phase 1: tree_reload_vectors on bank 1, while bank 0 is written once
+//            no key of bank 0 is left (bank_busy)
+//   phase 2: tree_reload_vectors on bank 0
+// Writes go in between lookups at random; a write to a bank with keys in
+// the tree is an error.
+//
+// Run from rtl/afu2, the levels read their init tables from tree_data_*:
+//   iverilog -g2005 -o tb_tree tb_tree.v tree.v tree_start_level.v tree_level.v \
+//            tree_last_level.v tree_bram.v tree_dram.v bram_tdp.v && vvp tb_tree
+
+module tb_tree;
+
+parameter TREE_LEVEL = 10;              // afu_user TREE_LEVEL, the depth the vectors were walked
+parameter VEC_LINES  = 256;
+parameter VEC_FILE   = "tree_vectors";
+parameter INIT_FILE  = "tree_data_";    // tree.v ram_init_data, level n reads tree_data_<n-1 in hex>
+parameter RELOAD_VEC_FILE = "tree_reload_vectors";
+parameter RELOAD_FILE = "tree_reload_data";
+parameter TIMEOUT    = 1000000;
+
+localparam CORE_NUM = 8;                // 16 keys per line
+localparam VEC_BITS = 33*16;
+localparam TBL_WORDS = (1 << TREE_LEVEL) - 2;   // levels 1..TREE_LEVEL-1
+
+reg                   clk;
+reg                   rst;
+reg  [VEC_BITS-1:0]   vec [0:VEC_LINES-1];
+reg  [VEC_BITS-1:0]   vec_reload [0:VEC_LINES-1];
+reg  [15:0]           tbl [0:TBL_WORDS-1];
+
+// input side: line in_cnt of the phase is offered while go is set
+reg  [1:0]            phase;
+reg  [31:0]           in_cnt;
+reg                   go;
+wire                  valid_in;
+wire                  bank_in;
+wire [VEC_BITS-1:0]   in_line;
+wire [CORE_NUM-1:0]   ready_out;
+
+// output side, results are taken while ready_in is set
+reg  [31:0]           out_cnt;
+reg                   ready_in;
+integer               errors;
+integer               c;
+wire [CORE_NUM-1:0]   valid_out;
+wire [CORE_NUM-1:0]   valid_out_b;
+wire [TREE_LEVEL-1:0] idx_a [CORE_NUM-1:0];
+wire [TREE_LEVEL-1:0] idx_b [CORE_NUM-1:0];
+wire [VEC_BITS-1:0]   exp_line;
+
+// table writes: load l writes bank ~l
+wire [1:0]            bank_busy [CORE_NUM-1:0];
+reg                   loading;
+reg                   load_id;
+reg                   load_fin;
+reg  [1:0]            load_done;
+reg  [4:0]            ld_level;
+reg  [15:0]           ld_addr;
+reg                   wr_en;
+reg  [4:0]            wr_level;
+reg                   wr_bank;
+reg  [15:0]           wr_addr;
+reg  [15:0]           wr_data;
+
+assign valid_in = go & (in_cnt < VEC_LINES);
+assign bank_in  = (phase == 2'd1);
+assign in_line  = (phase == 2'd0) ? vec[in_cnt % VEC_LINES] : vec_reload[in_cnt % VEC_LINES];
+assign exp_line = (out_cnt < VEC_LINES) ? vec[out_cnt % VEC_LINES] : vec_reload[out_cnt % VEC_LINES];
+
+genvar i;
+generate
+    for (i=0; i<CORE_NUM; i=i+1) begin:TREE
+        tree #(.total_level(TREE_LEVEL),
+               .ram_init_data(INIT_FILE)
+              ) tree_inst(
+            .clk(clk),
+            .rst(rst),
+            .Key_in(in_line[16*i +: 16]),
+            .Index_in(in_line[16*16+i]),
+            .Index_out(idx_a[i]),
+            .valid_in(valid_in),
+            .valid_out(valid_out[i]),
+            .Key_in_b(in_line[16*(i+CORE_NUM) +: 16]),
+            .Index_in_b(in_line[16*16+i+CORE_NUM]),
+            .Index_out_b(idx_b[i]),
+            .valid_in_b(valid_in),
+            .valid_out_b(valid_out_b[i]),
+            .ready_in(ready_in),
+            .ready_out(ready_out[i]),
+            .bank_in(bank_in),
+            .bank_busy(bank_busy[i]),
+            .wr_en(wr_en),
+            .wr_level(wr_level),
+            .wr_bank(wr_bank),
+            .wr_addr(wr_addr),
+            .wr_data(wr_data)
+        );
+    end
+endgenerate
+
+always #5 clk = ~clk;
+
+// the trees run in lockstep, tree 0's ready stands for all (afu_user);
+// the next phase starts once its tables are written
+always @(posedge clk) begin
+    if (rst) begin
+        phase <= 2'd0;
+        in_cnt <= 0;
+        go <= 1'b0;
+        ready_in <= 1'b0;
+    end
+    else begin
+        if (valid_in & ready_out[0]) begin
+            in_cnt <= in_cnt + 1'b1;
+        end
+        else if ((in_cnt == VEC_LINES) & (phase != 2'd2) & load_done[phase[0]]) begin
+            phase <= phase + 1'b1;
+            in_cnt <= 0;
+        end
+        go <= (($random & 3) != 0);
+        ready_in <= (($random & 3) != 0);
+    end
+end
+
+// load 0 writes bank 1 from a quarter into phase 0, load 1 bank 0 once
+// phase 1 runs and bank 0 drained
+always @(posedge clk) begin
+    if (rst) begin
+        loading <= 1'b0;
+        load_fin <= 1'b0;
+        load_done <= 2'b0;
+        wr_en <= 1'b0;
+    end
+    else begin
+        wr_en <= 1'b0;
+        load_fin <= 1'b0;
+        if (load_fin) load_done[load_id] <= 1'b1;
+
+        if (~loading & ~load_fin & (load_done == 2'b00) & (phase == 2'd0) & (in_cnt >= VEC_LINES/4)) begin
+            loading <= 1'b1;
+            load_id <= 1'b0;
+            ld_level <= 5'd1;
+            ld_addr <= 16'd0;
+        end
+        else if (~loading & ~load_fin & (load_done == 2'b01) & (phase == 2'd1) & ~bank_busy[0][0]) begin
+            loading <= 1'b1;
+            load_id <= 1'b1;
+            ld_level <= 5'd1;
+            ld_addr <= 16'd0;
+        end
+        else if (loading & (($random & 1) != 0)) begin
+            wr_en <= 1'b1;
+            wr_bank <= ~load_id;
+            wr_level <= ld_level;
+            wr_addr <= ld_addr;
+            wr_data <= tbl[(1 << ld_level) - 2 + ld_addr];
+            if (ld_addr == (1 << ld_level) - 1) begin
+                ld_addr <= 16'd0;
+                ld_level <= ld_level + 1'b1;
+                if (ld_level == TREE_LEVEL-1) begin
+                    loading <= 1'b0;
+                    load_fin <= 1'b1;
+                end
+            end
+            else begin
+                ld_addr <= ld_addr + 1'b1;
+            end
+        end
+    end
+end
+
+always @(posedge clk) begin
+    if (~rst & wr_en & bank_busy[0][wr_bank]) begin
+        $display("tb_tree: level %0d addr %0d of bank %0d written with its keys in the tree", wr_level, wr_addr, wr_bank);
+        errors = errors + 1;
+    end
+end
+
+always @(posedge clk) begin
+    if (rst) begin
+        out_cnt <= 0;
+    end
+    else if ((valid_out[0] === 1'b1) & ready_in) begin
+        if (out_cnt >= 3*VEC_LINES) begin
+            $display("tb_tree: line %0d out of %0d sent", out_cnt, 3*VEC_LINES);
+            errors = errors + 1;
+        end
+        else if ((valid_out !== {CORE_NUM{1'b1}}) || (valid_out_b !== {CORE_NUM{1'b1}}) ||
+                 (ready_out !== {CORE_NUM{1'b1}})) begin
+            $display("tb_tree: line %0d, cores out of step: valid_out %b valid_out_b %b ready_out %b",
+                     out_cnt, valid_out, valid_out_b, ready_out);
+            errors = errors + 1;
+        end
+        else begin
+            for (c=0; c<CORE_NUM; c=c+1) begin
+                if (idx_a[c] !== exp_line[16*(17+c) +: TREE_LEVEL]) begin
+                    $display("tb_tree: line %0d key %0d: %h, host %h", out_cnt, c, idx_a[c], exp_line[16*(17+c) +: TREE_LEVEL]);
+                    errors = errors + 1;
+                end
+                if (idx_b[c] !== exp_line[16*(17+c+CORE_NUM) +: TREE_LEVEL]) begin
+                    $display("tb_tree: line %0d key %0d: %h, host %h", out_cnt, c+CORE_NUM, idx_b[c],
+                             exp_line[16*(17+c+CORE_NUM) +: TREE_LEVEL]);
+                    errors = errors + 1;
+                end
+            end
+        end
+        out_cnt <= out_cnt + 1'b1;
+    end
+end
+
+initial begin
+    $readmemh(VEC_FILE, vec);
+    $readmemh(RELOAD_VEC_FILE, vec_reload);
+    $readmemh(RELOAD_FILE, tbl);
+    clk = 1'b0;
+    rst = 1'b1;
+    errors = 0;
+    repeat (4) @(posedge clk);
+    rst <= 1'b0;
+    wait (out_cnt == 3*VEC_LINES);
+    repeat (4*TREE_LEVEL) @(posedge clk);
+    if (bank_busy[0] != 2'b00) begin
+        $display("tb_tree: bank_busy %b with the tree drained", bank_busy[0]);
+        errors = errors + 1;
+    end
+    if (errors == 0)
+        $display("tb_tree: PASS, %0d lines", out_cnt);
+    else
+        $display("tb_tree: FAIL, %0d errors", errors);
+    $finish;
+end
+
+initial begin
+    #(TIMEOUT);
+    $display("tb_tree: FAIL, timeout after %0d of %0d lines", out_cnt, 3*VEC_LINES);
+    $finish;
+end
+
+endmodule
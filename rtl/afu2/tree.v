@@ -7,11 +7,32 @@ module tree(
     Index_in,
     Index_out,
     valid_in,
-    valid_out
+    valid_out,
+    Key_in_b,
+    Index_in_b,
+    Index_out_b,
+    valid_in_b,
+    valid_out_b,
+    ready_in,
+    ready_out,
+    bank_in,
+    bank_busy,
+    wr_en,
+    wr_level,
+    wr_bank,
+    wr_addr,
+    wr_data
 );
 
 parameter                   total_level = 12;
-parameter                   ram_init_data = "/import/usc/home/renchen/ren_ancs/rtl/afu2/tree_data_0";
+// level n (1..total_level-1) reads <ram_init_data><n-1 in hex>: tree_data_0 .. tree_data_f,
+// then tree_data_10, tree_data_11, ... for trees deeper than 17 levels
+parameter                   ram_init_data = "/import/usc/home/renchen/ren_ancs/rtl/afu2/tree_data_";
+
+function [7:0] hex_char;
+    input integer n;
+    hex_char = (n < 10) ? ("0" + n) : ("a" + n - 10);
+endfunction
 
 input                         clk;
 input                         rst;
@@ -20,24 +41,86 @@ input    [0:0]                Index_in;
 output   [total_level-1:0]    Index_out; 
 input                         valid_in;
 output                        valid_out;
+// second key stream, served by the other BRAM port of every level
+input    [15:0]               Key_in_b;
+input    [0:0]                Index_in_b;
+output   [total_level-1:0]    Index_out_b;
+input                         valid_in_b;
+output                        valid_out_b;
+// valid/ready: the pipeline advances unless its last stage holds a result
+// the consumer does not take; ready_out tells the producer a key is taken
+input                         ready_in;
+output                        ready_out;
+// double-banked tables: a key looks up every level in the bank it entered
+// with; the loader writes the other bank and may only start once no key of
+// that bank is left in the tree (bank_busy)
+input                         bank_in;
+output   [1:0]                bank_busy;
+input                         wr_en;
+input    [4:0]                wr_level;    // 1..total_level-1
+input                         wr_bank;
+input    [15:0]               wr_addr;
+input    [15:0]               wr_data;
  
 wire    [15:0] key_wire                     [total_level-2:0];
 wire    [total_level-1:0]     index_wire    [total_level-2:0];
 
 wire                         valid_out_tmp [total_level-2:0];
 
+wire    [15:0] key_wire_b                   [total_level-2:0];
+wire    [total_level-1:0]     index_wire_b  [total_level-2:0];
+wire                         valid_out_tmp_b [total_level-2:0];
+
+wire                         bank_wire     [total_level-2:0];
+wire                         bank_out;
+
+wire                         ce;
+
+assign ce = ready_in | ~(valid_out | valid_out_b);
+assign ready_out = ce;
+
+genvar b;
+generate
+    for (b=0; b<2; b=b+1) begin: BANK_KEYS
+        wire key_in  = ce & valid_in & (bank_in == b);
+        wire key_out = ce & valid_out & (bank_out == b);
+        reg  [6:0] keys;                 // lines of this bank in the tree
+
+        always@(posedge clk)
+        begin
+            if (rst)
+                keys <= 0;
+            else if (key_in & ~key_out)
+                keys <= keys + 1'b1;
+            else if (key_out & ~key_in)
+                keys <= keys - 1'b1;
+        end
+
+        assign bank_busy[b] = (keys != 0);
+    end
+endgenerate
+
 generate
     tree_start_level #(.level(0)
 	                  ,.total_level(total_level)) 
     start_level (
         .Key_in(Key_in), 
         .Index_in(Index_in),
+        .Key_in_b(Key_in_b), 
+        .Index_in_b(Index_in_b),
         .clk(clk),
         .rst(rst),
+        .ce(ce),
         .Index_out(index_wire[0]),
         .Key_out(key_wire[0]),
+        .Index_out_b(index_wire_b[0]),
+        .Key_out_b(key_wire_b[0]),
         .valid_in(valid_in),
-        .valid_out(valid_out_tmp[0]) 
+        .valid_out(valid_out_tmp[0]),
+        .valid_in_b(valid_in_b),
+        .valid_out_b(valid_out_tmp_b[0]),
+        .Bank_in(bank_in),
+        .Bank_out(bank_wire[0])
     );
 endgenerate
 
@@ -46,19 +129,34 @@ genvar numstg,tag;
 generate
     for(numstg=1; numstg < total_level-1; numstg = numstg+1)
     begin: elements
+        // both names padded to one width; a leading NUL is not part of a string
         tree_level #(.level(numstg)
 		            ,.total_level(total_level)
-					,.ram_init_data(ram_init_data+((numstg>9)? (numstg + 39): numstg-1))
+					,.ram_init_data((numstg-1 < 16) ? {8'h00, ram_init_data, hex_char(numstg-1)}
+					                                : {ram_init_data, hex_char((numstg-1)/16), hex_char((numstg-1)%16)})
 					)
         tree_stage (
                 .Key_in(key_wire[numstg-1]), 
                 .Index_in(index_wire[numstg-1]),
+                .Key_in_b(key_wire_b[numstg-1]), 
+                .Index_in_b(index_wire_b[numstg-1]),
                 .clk(clk),
                 .rst(rst),
+                .ce(ce),
                 .Index_out(index_wire[numstg]),
                 .Key_out(key_wire[numstg]),
+                .Index_out_b(index_wire_b[numstg]),
+                .Key_out_b(key_wire_b[numstg]),
                 .valid_in(valid_out_tmp[numstg-1]),
-                .valid_out(valid_out_tmp[numstg]) 
+                .valid_out(valid_out_tmp[numstg]),
+                .valid_in_b(valid_out_tmp_b[numstg-1]),
+                .valid_out_b(valid_out_tmp_b[numstg]),
+                .Bank_in(bank_wire[numstg-1]),
+                .Bank_out(bank_wire[numstg]),
+                .wr_en(wr_en & (wr_level == numstg)),
+                .wr_bank(wr_bank),
+                .wr_addr(wr_addr),
+                .wr_data(wr_data)
         );
     end
 	
@@ -67,15 +165,28 @@ endgenerate
 generate
 	tree_last_level #(.level(total_level-1)
 	                 ,.total_level(total_level)
-					 ,.ram_init_data(ram_init_data+((total_level>10)? (total_level + 38): total_level-2))) 
+					 ,.ram_init_data((total_level-2 < 16) ? {8'h00, ram_init_data, hex_char(total_level-2)}
+					                                    : {ram_init_data, hex_char((total_level-2)/16), hex_char((total_level-2)%16)})) 
     last_level (
         .Key_in(key_wire[total_level-2]), 
         .Index_in(index_wire[total_level-2]),
+        .Key_in_b(key_wire_b[total_level-2]), 
+        .Index_in_b(index_wire_b[total_level-2]),
         .clk(clk),
         .rst(rst),
+        .ce(ce),
         .Index_out(Index_out),
+        .Index_out_b(Index_out_b),
         .valid_in(valid_out_tmp[total_level-2]),
-        .valid_out(valid_out) 
+        .valid_out(valid_out),
+        .valid_in_b(valid_out_tmp_b[total_level-2]),
+        .valid_out_b(valid_out_b),
+        .Bank_in(bank_wire[total_level-2]),
+        .Bank_out(bank_out),
+        .wr_en(wr_en & (wr_level == total_level-1)),
+        .wr_bank(wr_bank),
+        .wr_addr(wr_addr),
+        .wr_data(wr_data)
     );
 endgenerate
 
@@ -1,12 +1,22 @@
 `timescale 1ns / 1ps
 
-// dual port ram, both ports for read
+// dual port ram, both ports for read: one key stream per port
+// Two banks: reads go to the bank the key carries, the table loader writes
+// the other one through its port A, so a reload never disturbs lookups.
 
 module tree_bram(
-	Addr_in,	// R
+	Addr_in,	// R, port A
+	Addr_in_b,	// R, port B
+	Bank_in,	// bank both reads use
+	en,		// read enable, both ports; dout holds while low
 	clk,
 	//rst,
-	Data_out		
+	Data_out,
+	Data_out_b,
+	wr_en,		// W, port A of bank wr_bank
+	wr_bank,
+	wr_addr,
+	wr_data
 	);
 //`include "common_func.v"
 parameter level = 4;
@@ -15,22 +25,53 @@ localparam DEPTH =2**level;
 parameter DATA_WIDTH = 16;
 
 input [level-1:0] Addr_in;
+input [level-1:0] Addr_in_b;
+input Bank_in;
+input en;
 input clk;
 //input rst;
 output [15:0] Data_out;
+output [15:0] Data_out_b;
+input wr_en;
+input wr_bank;
+input [level-1:0] wr_addr;
+input [15:0] wr_data;
 
 //(* ram_style="block" *) reg [15:0] ram [DEPTH-1:0];
 
- bram_dp #(DATA_WIDTH,level,init_file) output_bufferB(.clk(clk)
-                                                     ,.wen(1'b0)
-                                                     ,.en(1'b1)
-                                                     ,.addrR(Addr_in)
-													 ,.addrW({level{1'b0}})
-                                                     ,.din({DATA_WIDTH{1'b0}})
-                                                     ,.dout(Data_out));
-													 
+wire [15:0] dout_a [1:0];
+wire [15:0] dout_b [1:0];
+reg         bank_r;
+
+// the bank of the read in flight picks the output
+always @(posedge clk)
+    if (en) bank_r <= Bank_in;
+
+assign Data_out = dout_a[bank_r];
+assign Data_out_b = dout_b[bank_r];
+
+genvar k;
+generate
+    for (k=0; k<2; k=k+1) begin: BANK
+        wire wr_this = wr_en & (wr_bank == k);
+
+        // both banks start from init_file
+        bram_tdp #(DATA_WIDTH,level,init_file) output_bufferB(.clk(clk)
+                                                             ,.en_a(en | wr_this)
+                                                             ,.wen_a(wr_this)
+                                                             ,.addr_a(wr_this ? wr_addr : Addr_in)
+                                                             ,.din_a(wr_data)
+                                                             ,.dout_a(dout_a[k])
+                                                             ,.en_b(en)
+                                                             ,.wen_b(1'b0)
+                                                             ,.addr_b(Addr_in_b)
+                                                             ,.din_b({DATA_WIDTH{1'b0}})
+                                                             ,.dout_b(dout_b[k]));
+    end
+endgenerate
+
 
 //initial $readmemh("ram.init", ram, 0, DEPTH-1);
 
-		
-endmodule
\ No newline at end of file
+
+endmodule
@@ -1,10 +1,19 @@
 `timescale 1ns / 1ps
 
+// Two banks like tree_bram: reads from the key's bank, writes to wr_bank.
 module tree_dram(
-	Addr_in,	// R
+	Addr_in,	// R, port A
+	Addr_in_b,	// R, port B
+	Bank_in,	// bank both reads use
+	en,		// read enable; Data_out holds while low
 	clk,
 	rst,
-	Data_out		
+	Data_out,
+	Data_out_b,
+	wr_en,		// W, bank wr_bank
+	wr_bank,
+	wr_addr,
+	wr_data
 	);
 //`include "common_func.v"
 parameter level = 4;
@@ -12,21 +21,33 @@ parameter init_file = "input.hex";
 localparam DEPTH =2**level;
 
 input [level-1:0] Addr_in;
+input [level-1:0] Addr_in_b;
+input Bank_in;
+input en;
 input clk;
 input rst;
 output reg [15:0] Data_out;
+output reg [15:0] Data_out_b;
+input wr_en;
+input wr_bank;
+input [level-1:0] wr_addr;
+input [15:0] wr_data;
 
-(* ram_style="distributed" *)  reg [15:0] ram [DEPTH-1:0];
+(* ram_style="distributed" *)  reg [15:0] ram [2*DEPTH-1:0];
 //initial $readmemh("ram.init", ram, 0, DEPTH-1);
 
 
 always @(posedge clk) begin
     if(rst==1) begin
 	   Data_out <= 0;
-	end else begin   
-	   Data_out <= ram[Addr_in];
-	end   
-end    
+	   Data_out_b <= 0;
+	end else if (en) begin
+	   Data_out <= ram[{Bank_in, Addr_in}];
+	   Data_out_b <= ram[{Bank_in, Addr_in_b}];
+	end
+	if (wr_en)
+	   ram[{wr_bank, wr_addr}] <= wr_data;
+end
 
 
 reg [15:0] data[DEPTH-1:0];
@@ -39,9 +60,10 @@ begin
 	begin
 	    //data_o[i] = i;
         ram[i] = data[i];
+        ram[DEPTH+i] = data[i];
 	end
 	//$writememh("output.hex",data_o);
-end					
+end
+
 
-					
-endmodule
\ No newline at end of file
+endmodule
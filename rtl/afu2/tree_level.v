@@ -1,52 +1,103 @@
 `timescale 1ns / 1ps
 
 
+// One tree level, two independent key streams (A, B) sharing the level's
+// table through the two read ports of the same BRAM.
 module tree_level(
-    Key_in, 
+    Key_in,
     Index_in,
+    Key_in_b,
+    Index_in_b,
     clk,
     rst,
+    ce,
     Index_out,
     Key_out,
+    Index_out_b,
+    Key_out_b,
     valid_in,
-    valid_out
+    valid_out,
+    valid_in_b,
+    valid_out_b,
+    Bank_in,
+    Bank_out,
+    wr_en,
+    wr_bank,
+    wr_addr,
+    wr_data
 );
 //`include "common_func.v"
-parameter    level = 12;				        // which level 
-parameter    total_level = 12;				    // which level 
+parameter    level = 12;				        // which level
+parameter    total_level = 12;				    // which level
 parameter    ram_init_data = "/import/usc/home/renchen/ren_ancs/rtl/afu2/tree_data_0";
-localparam   no_nodes = 2**(level);		    // how many nodes 
+localparam   no_nodes = 2**(level);		    // how many nodes
 
 input   [15:0]                  Key_in;
 input   [level-1:0]             Index_in;
+input   [15:0]                  Key_in_b;
+input   [level-1:0]             Index_in_b;
 input                           clk;
 input                           rst;
+input                           ce;             // pipeline advance, all stages and the BRAM read
 input                           valid_in;
+input                           valid_in_b;
+input                           Bank_in;        // table bank of the key(s) entering, kept to the end
+input                           wr_en;          // table load into bank wr_bank of this level
+input                           wr_bank;
+input   [15:0]                  wr_addr;
+input   [15:0]                  wr_data;
 
 output  reg[level:0]            Index_out;
 output  reg[15:0]               Key_out;
 output  reg                     valid_out;
+output  reg[level:0]            Index_out_b;
+output  reg[15:0]               Key_out_b;
+output  reg                     valid_out_b;
+output  reg                     Bank_out;
 
 reg[15:0]                       Key_in_tmp;
-reg[level-1:0]                  Index_in_tmp1;
-reg[level-1:0]                  Index_in_tmp2;
+// child indices of the 2^level nodes take level+1 bits
+reg[level:0]                    Index_in_tmp1;
+reg[level:0]                    Index_in_tmp2;
 reg                             valid_in_tmp;
+reg[15:0]                       Key_in_b_tmp;
+reg[level:0]                    Index_in_b_tmp1;
+reg[level:0]                    Index_in_b_tmp2;
+reg                             valid_in_b_tmp;
+reg                             Bank_tmp;
 wire [15:0]        Data_out;
+wire [15:0]        Data_out_b;
 
 generate
 	if(level>0) begin
 		tree_bram #(.level(level),.init_file(ram_init_data)) bram (
 		.Addr_in(Index_in),
+		.Addr_in_b(Index_in_b),
+		.Bank_in(Bank_in),
+		.en(ce),
 		.clk(clk),
 		//.rst(rst),
-		.Data_out(Data_out)
+		.Data_out(Data_out),
+		.Data_out_b(Data_out_b),
+		.wr_en(wr_en),
+		.wr_bank(wr_bank),
+		.wr_addr(wr_addr[level-1:0]),
+		.wr_data(wr_data)
 		);
 	end else begin
 		tree_dram #(.level(level),.init_file(ram_init_data)) dram (
         .Addr_in(Index_in),
+        .Addr_in_b(Index_in_b),
+        .Bank_in(Bank_in),
+        .en(ce),
         .clk(clk),
         .rst(rst),
-        .Data_out(Data_out)
+        .Data_out(Data_out),
+        .Data_out_b(Data_out_b),
+        .wr_en(wr_en),
+        .wr_bank(wr_bank),
+        .wr_addr(wr_addr[level-1:0]),
+        .wr_data(wr_data)
         );
 	end
 endgenerate
@@ -54,16 +105,18 @@ endgenerate
 always@(posedge clk)
 begin
     if(rst)
-	begin	
+	begin
         Key_in_tmp <= 0;
-        valid_in_tmp <= 0; 
+        valid_in_tmp <= 0;
         Index_in_tmp1 <= 0;
 		Index_in_tmp2 <= 0;
 	    Key_out <= 0;
 		Index_out <= 0;
 		valid_out <= 0;
+		Bank_tmp <= 0;
+		Bank_out <= 0;
 	end
-	else
+	else if(ce)
 	begin
 	    Key_in_tmp <= Key_in;
 	    valid_in_tmp <= valid_in;
@@ -72,6 +125,33 @@ begin
 	    Key_out <= Key_in_tmp;
         Index_out <= (Key_in_tmp < Data_out) ? Index_in_tmp1: Index_in_tmp2;
         valid_out <= valid_in_tmp;
+        Bank_tmp <= Bank_in;
+        Bank_out <= Bank_tmp;
+	end
+end
+
+//stream B, same pipeline on the second port
+always@(posedge clk)
+begin
+    if(rst)
+	begin
+        Key_in_b_tmp <= 0;
+        valid_in_b_tmp <= 0;
+        Index_in_b_tmp1 <= 0;
+		Index_in_b_tmp2 <= 0;
+	    Key_out_b <= 0;
+		Index_out_b <= 0;
+		valid_out_b <= 0;
+	end
+	else if(ce)
+	begin
+	    Key_in_b_tmp <= Key_in_b;
+	    valid_in_b_tmp <= valid_in_b;
+	    Index_in_b_tmp1 <= Index_in_b*2+1;
+		Index_in_b_tmp2 <= (Index_in_b+1)*2;
+	    Key_out_b <= Key_in_b_tmp;
+        Index_out_b <= (Key_in_b_tmp < Data_out_b) ? Index_in_b_tmp1: Index_in_b_tmp2;
+        valid_out_b <= valid_in_b_tmp;
 	end
 end
 
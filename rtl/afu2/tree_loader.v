@@ -0,0 +1,162 @@
+`timescale 1ns / 1ps
+
+// Tree table loader: writes a table image into the shadow bank of every
+// tree level and then makes it the active bank.
+//
+// Image: the tables of levels 1..TREE_LEVEL-1 in order, level n holding 2^n
+// 16-bit thresholds, 32 per line, entry a of a level in word a%32 of its
+// line a/32; a level smaller than a line still takes a whole line.  The
+// image lines arrive on tbl_din/tbl_we after load_start and are buffered
+// here; writing starts once no key that uses the shadow bank is left in the
+// trees, one threshold per cycle to all trees at once.  The swap only
+// changes the bank new keys take, so lookups never stop during a load.
+//
+// A shared AFU gives each tenant a bank of its own instead: swap is low,
+// the load writes load_bank (the tenant's) and nothing is swapped.  The
+// tenant's reads are held until load_done so that its bank drains.
+
+module tree_loader #(
+    parameter TREE_LEVEL = 10,
+    parameter FIFO_DEPTH_BITS = 5
+) (
+    input clk,
+    input rst,
+    // image lines, afu_core --> loader
+    input load_start,                   // a load begins, tbl_lines lines follow
+    input swap,                         // write the shadow bank and swap, else write load_bank
+    input load_bank,
+    output [15:0] tbl_lines,
+    input [511:0] tbl_din,
+    input tbl_we,
+    output [FIFO_DEPTH_BITS-1:0] tbl_count,
+    // tree write port, broadcast to all trees
+    output reg wr_en,
+    output reg [4:0] wr_level,
+    output reg [15:0] wr_addr,
+    output reg [15:0] wr_data,
+    output reg wr_bank,
+    // banks
+    output reg active_bank,             // bank of the keys entering the trees
+    input [1:0] bank_busy,
+    output reg load_done                // pulse, the new tables are active
+);
+
+    // lines of the whole image
+    function [15:0] image_lines;
+        input integer levels;
+        integer n;
+        begin
+            image_lines = 0;
+            for (n=1; n<levels; n=n+1)
+                image_lines = image_lines + ((n < 5) ? 1 : (1 << (n-5)));
+        end
+    endfunction
+
+    assign tbl_lines = image_lines(TREE_LEVEL);
+
+    localparam [1:0]
+        LD_IDLE  = 2'b00,
+        LD_WAIT  = 2'b01,
+        LD_WRITE = 2'b10;
+
+    wire [511:0] line;
+    wire line_empty;
+    reg line_re;
+
+    asyn_read_fifo #(.FIFO_WIDTH(512),
+                     .FIFO_DEPTH_BITS(FIFO_DEPTH_BITS),
+                     .FIFO_ALMOSTFULL_THRESHOLD(2**FIFO_DEPTH_BITS-4),
+                     .FIFO_ALMOSTEMPTY_THRESHOLD(2)
+                    ) image_fifo(
+                .clk                (clk),
+                .reset_n            (~rst),
+                .din                (tbl_din),
+                .we                 (tbl_we),
+                .re                 (line_re),
+                .dout               (line),
+                .empty              (line_empty),
+                .full               (),
+                .count              (tbl_count),
+                .almostempty        (),
+                .almostfull         ()
+            );
+
+    reg [1:0] state;
+    reg [4:0] level;                    // level being written, 1..TREE_LEVEL-1
+    reg [15:0] addr;                    // next entry of that level
+    reg target;                         // bank being written
+    reg target_swap;
+    wire [4:0] word;
+    wire line_last;
+    wire level_last;
+
+    assign word = addr[4:0];
+    assign level_last = (addr == (16'd1 << level) - 1'b1);
+    assign line_last = (word == 5'd31) | level_last;
+
+    always@(posedge clk)
+    begin
+        if (rst)
+        begin
+            state <= LD_IDLE;
+            wr_en <= 1'b0;
+            line_re <= 1'b0;
+            active_bank <= 1'b0;
+            load_done <= 1'b0;
+        end
+        else
+        begin
+            wr_en <= 1'b0;
+            line_re <= 1'b0;
+            load_done <= 1'b0;
+
+            case (state)
+            LD_IDLE:
+            begin
+                if (load_start)
+                begin
+                    level <= 5'd1;
+                    addr <= 16'd0;
+                    target <= swap ? ~active_bank : load_bank;
+                    target_swap <= swap;
+                    state <= LD_WAIT;
+                end
+            end
+
+            LD_WAIT:
+            begin
+                // keys still looking up the target bank hold the load back
+                if (~bank_busy[target])
+                    state <= LD_WRITE;
+            end
+
+            LD_WRITE:
+            begin
+                if (~line_empty & ~line_re)
+                begin
+                    wr_en <= 1'b1;
+                    wr_bank <= target;
+                    wr_level <= level;
+                    wr_addr <= addr;
+                    wr_data <= line[16*word +: 16];
+
+                    addr <= level_last ? 16'd0 : addr + 1'b1;
+                    line_re <= line_last;
+                    if (level_last)
+                    begin
+                        level <= level + 1'b1;
+                        if (level == TREE_LEVEL-1)
+                        begin
+                            if (target_swap)
+                                active_bank <= ~active_bank;
+                            load_done <= 1'b1;
+                            state <= LD_IDLE;
+                        end
+                    end
+                end
+            end
+            endcase
+        end
+    end
+
+endmodule
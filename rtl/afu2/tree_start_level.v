@@ -4,12 +4,21 @@
 module tree_start_level(
     Key_in, 
     Index_in,
+    Key_in_b,
+    Index_in_b,
     clk,
     rst,
+    ce,
     Index_out,
 	Key_out,
+    Index_out_b,
+	Key_out_b,
 	valid_in,
-    valid_out
+    valid_out,
+	valid_in_b,
+    valid_out_b,
+    Bank_in,
+    Bank_out
 );
 //`include "common_func.v"
 parameter      level = 12;				                    // which level 
@@ -21,13 +30,22 @@ parameter Data_out = 16;
 
 input   [15:0]           Key_in;
 input   [0:0]            Index_in;
+input   [15:0]           Key_in_b;
+input   [0:0]            Index_in_b;
 input                    clk;
 input                    rst;
+input                    ce;
 input                    valid_in;
+input                    valid_in_b;
+input                    Bank_in;          // table bank the key uses on every level
 
 output  reg[1:0]        Index_out;
 output  reg[15:0]       Key_out;
 output  reg             valid_out;
+output  reg[1:0]        Index_out_b;
+output  reg[15:0]       Key_out_b;
+output  reg             valid_out_b;
+output  reg             Bank_out;
 
 //wire [15:0]        Data_out;
 
@@ -55,12 +73,20 @@ begin
 	    Key_out <= 0;
 		Index_out <= 0;
 		valid_out <= 0;
+	    Key_out_b <= 0;
+		Index_out_b <= 0;
+		valid_out_b <= 0;
+		Bank_out <= 0;
 	end
-	else
+	else if(ce)
 	begin
 	    Key_out <= Key_in;
         Index_out <= (Key_in < Data_out) ? Index_in*2+1: Index_in*2+2;
         valid_out <= valid_in;
+	    Key_out_b <= Key_in_b;
+        Index_out_b <= (Key_in_b < Data_out) ? Index_in_b*2+1: Index_in_b*2+2;
+        valid_out_b <= valid_in_b;
+        Bank_out <= Bank_in;
 	end
 end
 
@@ -69,6 +69,18 @@
 #include <fstream>
 #include <iostream>
 
+#include "field_layout.h"
+#include "merge_planner.h"
+#include "result_cache.h"
+#include "rule_builder.h"
+#include "workload_rng.h"
+#include "rule_dedup.h"
+#include "cross_product.h"
+#include "compressed_list.h"
+#include "pcap_reader.h"
+#include "classify_batch.h"
+#include "afu_decode.h"
+
 //****************************************************************************
 // UN-COMMENT appropriate #define in order to enable either Hardware or ASE.
 //    DEFAULT is to use Software Simulation.
@@ -119,6 +131,29 @@ using namespace AAL;
 #define num_setSize             1024
 #define tree_depth              14
 
+// Header fields looked up per packet: FL_PRESET_IPV4 or FL_PRESET_IPV6 (see field_layout.h)
+#define key_layout              FL_PRESET_IPV4
+
+// Memory of the flow cache in front of lookup() and merge(), 0 disables it
+#define flow_cache_MB           64
+// Memory of the leaf-tuple memo in front of merge(), 0 disables it
+#define merge_memo_MB           64
+// Memory for precomputed lane-pair intersections (RFC-style cross products), 0 disables them
+#define cross_product_MB        32
+// Seed of the generated rule lists and tree keys, 0 = seed from the clock
+#define ruleset_seed            1
+// Source buffer without a capture: WL_SOURCE_UNIFORM or WL_SOURCE_HEADERS (see workload_rng.h)
+#define source_model            WL_SOURCE_UNIFORM
+// Seed of the generated source buffer
+#define source_seed             1
+// Per-packet classify() through the coalescing submitter after the bulk run, 0 skips it
+#define small_batch_packets     4096
+#define small_batch_callers     4     // concurrent callers, one packet per call
+#define small_batch_max         16    // packets per engine call
+#define small_batch_delay_us    20    // longest wait for a batch to fill
+// merge() reads bit-packed rule lists (compressed_list.h) instead of setData rows
+#define compressed_rules        1
+
 typedef unsigned short int bt16bitInt;
 /// @addtogroup HelloSPLLB
 /// @{
@@ -263,7 +298,7 @@ IRuntime * RuntimeClient::getRuntime()
 ///          The Service Client contains the application logic.
 ///
 /// When we request an AFU (Service) from AAL, the request will be fulfilled by calling into this interface.
-class HelloSPLLBApp: public CAASBase, public IServiceClient, public ISPLClient
+class HelloSPLLBApp: public CAASBase, public IServiceClient, public ISPLClient, public ClassifyEngine
 {
 public:
 
@@ -271,6 +306,9 @@ public:
    ~HelloSPLLBApp();
 
    btInt run();
+
+   /// Replay a pcap/pcapng capture instead of filling the source buffer with random data.
+   void setTraceFile(const char *path) { m_TraceFile = path; }
    void Show2CLs(void *pCLExpected,
                  void *pCLFound,
                  ostringstream &oss);
@@ -279,9 +317,21 @@ public:
 
    // self defined application method
    //void merge(btUnsigned32bitInt *pDestInt, btUnsignedInt length);
-   std::vector<bt16bitInt> merge(std::vector<bt16bitInt> setGroupIdx);
+   /// slot: the calling thread's MergePlanner shard
+   std::vector<bt16bitInt> merge(const std::vector<bt16bitInt> &setGroupIdx, int slot);
+   bool mergeFields(const std::vector<bt16bitInt> &setGroupIdx, int slot, unsigned fields,
+                    bool started, std::vector<bt16bitInt> &intersec);
    
    bt16bitInt lookup(bt16bitInt keyIn, bool idxIn);
+   void lookupFields(const bt16bitInt *pPacket, unsigned fields, std::vector<bt16bitInt> &idxOut);
+
+   void flowKey(const bt16bitInt *pPacket, FlowCache::Key &key);
+   void classifyPacket(const bt16bitInt *pPacket, CachedRules &result, int slot);
+
+   // <ClassifyEngine>
+   virtual void classifyLines(const unsigned char *lines, size_t numPackets, ClassifyResult *out,
+                              int slot);
+   // </ClassifyEngine>
    
    timeval calculate_time_interval(timeval late, timeval early);
 
@@ -337,6 +387,22 @@ protected:
    bt16bitInt ** setData;
    //std::vector<std::vector<bt16bitInt> > keyData;
    bt16bitInt ** keyData;
+
+   const char    *m_TraceFile;      ///< Capture to replay, NULL for random source data
+
+   FieldLayout    m_Layout;         ///< Field to lane assignment of the lookup keys
+   int            m_NumLanes;       ///< Lanes with rule sets in setData
+   MergePlanner   m_Planner;        ///< Step order of merge(), most selective first
+   std::vector< std::vector<int> > m_StepLanes; ///< Lanes of each merge step
+   std::vector<int>      m_StepPair;   ///< Cross-product pair of a step, -1 to walk its lists
+   std::vector<unsigned> m_StepFields; ///< Fields a step covers, one bit each
+   unsigned       m_AllFields;      ///< One bit per field of m_Layout
+   unsigned       m_FlowFields;     ///< Fields that stay the same within a flow
+   FlowCache      m_FlowCache;      ///< Flow-invariant lane keys -> rules those lanes leave
+   MergeMemo      m_MergeMemo;      ///< Leaf-index tuple -> merged rule list
+   CrossProductStage m_CrossProduct; ///< Pre-intersected lists of low-cardinality lane pairs
+   DedupRuleStore m_RuleLists;      ///< Distinct lists behind setData, one copy each
+   CompressedRuleStore m_RuleStore;  ///< Bit-packed distinct lists, indexed by list id
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -352,7 +418,10 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
    m_pWkspcVirt(NULL),
    m_WkspcSize(0),
    m_AFUDSMVirt(NULL),
-   m_AFUDSMSize(0)
+   m_AFUDSMSize(0),
+   m_TraceFile(NULL),
+   m_Layout(num_set),
+   m_NumLanes(num_set)
 {
    SetSubClassInterface(iidServiceClient, dynamic_cast<IServiceClient *>(this));
    SetInterface(iidSPLClient, dynamic_cast<ISPLClient *>(this));
@@ -365,22 +434,88 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
    //Initialize setData
    const int max_num = 1<<8-1;  
    
-   setData  = new bt16bitInt * [num_setgroup*num_set];  //
-   for(int i = 0; i < num_setgroup*num_set; i++) {
+   // one rule-set table per lane; wide fields may need more lanes than one line holds
+   m_Layout.preset(key_layout);
+   m_NumLanes = std::max(num_set, m_Layout.numLanes());
+   m_AllFields  = (1u << m_Layout.numFields()) - 1;
+   m_FlowFields = m_Layout.flowFields();
+   int flow_lanes = 0;
+   for(int j = 0; j < m_Layout.numLanes(); j++)
+      flow_lanes += (m_FlowFields >> m_Layout.laneField(j)) & 1;
+   if ( flow_cache_MB > 0 && m_FlowFields != 0 && flow_lanes <= FLOW_KEY_LANES && max_num <= RC_FLOW_RULES ) {
+      m_FlowCache.create(MB(flow_cache_MB));
+   }
+   if ( merge_memo_MB > 0 && m_Layout.numLanes() <= MERGE_MEMO_WORDS ) {
+      m_MergeMemo.create(MB(merge_memo_MB));
+   }
+
+   setData  = new bt16bitInt * [num_setgroup*m_NumLanes];  //
+   for(int i = 0; i < num_setgroup*m_NumLanes; i++) {
         setData[i] = new bt16bitInt[num_setSize];
     }
    
-   std::srand((uint)std::time(0));
-   for(int i = 0; i < num_setgroup*num_set; i++)
-	   for(int k = 0; k < num_setSize; k++)
-	   {
-		   setData[i][k] = (bt16bitInt)(std::rand() % max_num);
-	   }
+   // fill and sort on all cores, one seeded stream per list
+   RuleBuilder builder(ruleset_seed);
+   RuleBuildTiming bt = builder.buildSorted(setData, num_setgroup*m_NumLanes, num_setSize, max_num);
+   MSG("Built " << bt.lists << " rule lists (" << bt.bytes << " bytes) in " << bt.seconds
+       << " s on " << bt.threads << " threads, seed " << builder.seed());
+
+	// keep each distinct list once; setData rows become views of the shared copies
+	m_RuleLists.build(setData, num_setgroup*m_NumLanes, num_setSize);
+	for(int i = 0; i < num_setgroup*m_NumLanes; i++)
+		delete [] setData[i];
+	delete [] setData;
+	setData = m_RuleLists.rows();
+	MSG("Rule lists: " << m_RuleLists.numUnique() << " distinct of " << m_RuleLists.numRows()
+	    << ", " << m_RuleLists.bytes() << " bytes for " << m_RuleLists.rawBytes() << " bytes of lists");
+
+	// cached results are only valid for the rule sets they were computed from
+	m_FlowCache.invalidate();
+	m_MergeMemo.invalidate();
+
+	if ( compressed_rules ) {
+		m_RuleStore.build(m_RuleLists.uniqueRows(), m_RuleLists.numUnique(), num_setSize);
+		MSG("Compressed rule store: " << m_RuleStore.bytes() << " bytes for "
+		    << m_RuleStore.rawBytes() << " bytes of lists");
+	}
 
+	// lane pairs with few distinct lists, of any fields, get their intersections
+	// precomputed; merge() applies each pair as one step.  With the flow cache
+	// on, a pair stays on one side of the flow-invariant/varying split.
+	if ( cross_product_MB > 0 ) {
+		std::vector<int> group(m_NumLanes, -1);
+		for(int j = 0; j < m_Layout.numLanes(); j++)
+			group[j] = m_FlowCache.isValid() ? (int)((m_FlowFields >> m_Layout.laneField(j)) & 1) : 0;
+		m_CrossProduct.build(setData, m_NumLanes, num_setgroup, num_setSize, group, MB(cross_product_MB),
+		                     MP_MAX_FIELDS - m_Layout.numFields());
+		MSG("Cross-product tables: " << m_CrossProduct.numPairs() << " lane pairs, "
+		    << m_CrossProduct.bytes() << " bytes");
+	}
 
-    for(int i = 0; i < num_setgroup*num_set; i++)
-	    //std::sort(setData[i], num_setSize, sizeof(bt16bitInt), compareUint);
-		std::sort(setData[i], setData[i]+num_setSize);
+	// merge steps: every cross-product pair, then the unpaired lanes of each field
+	m_StepLanes.clear();
+	m_StepPair.clear();
+	m_StepFields.clear();
+	for(int p = 0; p < m_CrossProduct.numPairs(); p++) {
+		const CrossProductTable &t = m_CrossProduct.pair(p);
+		m_StepLanes.push_back(std::vector<int>());
+		m_StepLanes.back().push_back(t.laneA());
+		m_StepLanes.back().push_back(t.laneB());
+		m_StepPair.push_back(p);
+		m_StepFields.push_back((1u << m_Layout.laneField(t.laneA())) | (1u << m_Layout.laneField(t.laneB())));
+	}
+	for(int f = 0; f < m_Layout.numFields(); f++) {
+		std::vector<int> lanes;
+		for(size_t c = 0; c < m_Layout.fieldLanes(f).size(); c++)
+			if (m_CrossProduct.pairOf(m_Layout.fieldLanes(f)[c]) < 0)
+				lanes.push_back(m_Layout.fieldLanes(f)[c]);
+		if (lanes.empty())
+			continue;
+		m_StepLanes.push_back(lanes);
+		m_StepPair.push_back(-1);
+		m_StepFields.push_back(1u << f);
+	}
+	m_Planner.reset((int)m_StepLanes.size());
 	
 	//Initialize keyData
 	// char ram_init_data[] = "tree_data_0";
@@ -390,12 +525,8 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
         keyData[i] = new bt16bitInt[1<<tree_depth];
      }
    
-    std::srand((uint)std::time(0));
-    for(int i = 0; i < tree_depth; i++)
-	   for(int k = 0; k < (1<<tree_depth); k++)
-	   {
-		   keyData[i][k] = (bt16bitInt)(std::rand() % max_num);
-	   }
+    bt = builder.buildRandom(keyData, tree_depth, 1<<tree_depth, max_num);
+    MSG("Built tree keys in " << bt.seconds << " s");
 	   
 	//for(int i=0; i<14; i++)   //cannot be 14
 	//{
@@ -425,10 +556,7 @@ HelloSPLLBApp::HelloSPLLBApp(RuntimeClient *rtc) :
 HelloSPLLBApp::~HelloSPLLBApp()
 {
    m_Sem.Destroy();
-   for(int i = 0; i < num_setgroup*num_set; ++i) {
-        delete [] setData[i];
-    }
-    delete [] setData;
+   // setData rows belong to m_RuleLists
 	
 	 for(int i = 0; i < tree_depth; ++i) {
         delete [] keyData[i];
@@ -436,95 +564,209 @@ HelloSPLLBApp::~HelloSPLLBApp()
     delete [] keyData;
 }
 
-//std::vector<bt16bitInt> HelloSPLLBApp::merge(bt16bitInt *pDestInt, btUnsigned32bitInt length)
-std::vector<bt16bitInt> HelloSPLLBApp::merge(std::vector<bt16bitInt> setGroupIdx)
+// Lookup and merge of one packet at pPacket (linesPerPacket() lines), going
+// through the flow cache and the merge memo when they are enabled.  The
+// result is the final rule and the number of rules matched (packRules()).
+// slot is the caller's counter slot in the caches and the merge planner.
+void HelloSPLLBApp::classifyPacket(const bt16bitInt *pPacket, CachedRules &result, int slot)
 {
-   	std::vector<std::vector<bt16bitInt> > intersecGroup;
-	
-	//MSG("STEP1");
-	//ASSERT(setGroupIdx < num_setgroup);
-	MSG("size of segGroupIdx");
-	MSG(setGroupIdx.size());
-	
-	for(int i=0; i<num_set/2; i++)
+	vector<bt16bitInt> idxOut(m_Layout.numLanes(), 0);
+	vector<bt16bitInt> rules;
+	unsigned varying = m_AllFields & ~m_FlowFields;
+
+	// a repeated flow skips the lookups and the merge of its invariant lanes;
+	// the lanes that change per packet are intersected into the cached rules
+	FlowCache::Key fkey;
+	FlowRules      flow;
+	if (m_FlowCache.isValid()) {
+		flowKey(pPacket, fkey);
+		if (m_FlowCache.lookup(fkey, flow, slot)) {
+			unpackFlowRules(flow, rules);
+			lookupFields(pPacket, varying, idxOut);
+			if (!rules.empty())
+				mergeFields(idxOut, slot, varying, true, rules);
+			m_Planner.packetDone(slot);
+			if (rules.empty())
+				rules.push_back(0);
+			packRules(rules, result);
+			return;
+		}
+	}
+
+	lookupFields(pPacket, m_AllFields, idxOut);
+	bool flowDone = false;
+	if (m_FlowCache.isValid()) {
+		flowDone = mergeFields(idxOut, slot, m_FlowFields, false, rules);
+		packFlowRules(rules, flow);
+		m_FlowCache.insert(fkey, flow, slot);
+	}
+
+	// packets on the same leaves share the merge result
+	MergeMemo::Key mkey;
+	if (m_MergeMemo.isValid()) {
+		::memset(&mkey, 0, sizeof(mkey));
+		for(size_t j=0; j<idxOut.size(); j++)
+			mkey.w[j] = idxOut[j] % (1<<tree_depth);
+		if (m_MergeMemo.lookup(mkey, result, slot)) {
+			m_Planner.packetDone(slot);
+			return;
+		}
+	}
+	if (!m_FlowCache.isValid())
+		mergeFields(idxOut, slot, m_AllFields, false, rules);
+	else if (flowDone)
+		mergeFields(idxOut, slot, varying, true, rules);
+	m_Planner.packetDone(slot);
+	// lists may repeat an id; count each rule once, as the flow-cache bitmap does
+	rules.erase(std::unique(rules.begin(), rules.end()), rules.end());
+	if (rules.empty())
+		rules.push_back(0);
+	packRules(rules, result);
+	if (m_MergeMemo.isValid())
+		m_MergeMemo.insert(mkey, result, slot);
+}
+
+// ClassifyEngine for BatchSubmitter: the software lookup and merge per packet.
+void HelloSPLLBApp::classifyLines(const unsigned char *lines, size_t numPackets, ClassifyResult *out,
+                                  int slot)
+{
+	const bt16bitInt *pPacket = reinterpret_cast<const bt16bitInt *>(lines);
+	for(size_t n = 0; n < numPackets; n++)
 	{
-		//MSG("STEP10");
-	    std::vector<bt16bitInt> intersec(num_setSize);
-	    //MSG(num_setSize);
-		//MSG(setGroupIdx*num_set+2*i);
-		int setGroupIdxA = setGroupIdx[2*i] % (1<<tree_depth);
-		int setGroupIdxB = setGroupIdx[2*i+1] % (1<<tree_depth);
-		
-		//MSG("STEP11");
-	    std::vector<bt16bitInt>::iterator it;
-        it=std::set_intersection (setData[setGroupIdxA+2*i*num_setgroup], 
-		                          setData[setGroupIdxA+2*i*num_setgroup]+num_setSize, 
-	                              setData[setGroupIdxB+(2*i+1)*num_setgroup], 
-								  setData[setGroupIdxB+(2*i+1)*num_setgroup]+num_setSize,
-	 						      intersec.begin());   
-
-
-		//MSG("STEP12");								  
-        //MSG((int)(it-intersec.begin()));								  
-	    intersec.resize(it-intersec.begin());  
-		//MSG("STEP13");	
-		MSG("Size of intersec");
-		MSG(intersec.size());
-		
-		if(intersec.size() == 0){
-		    // for(int j=0; j<num_setSize; j++)
-	         // {
-	             // std::cout<<setData[setGroupIdx*num_set+2*i][j]<<" ,";
-	         // }
-	         // std::cout<<std::endl; std::cout<<std::endl;
-
-			 // for(int j=0; j<num_setSize; j++)
-	         // {
-	             // std::cout<<setData[setGroupIdx*num_set+2*i+1][j]<<" ,";
-	         // }
-	         // std::cout<<std::endl; std::cout<<std::endl;
-			intersec.push_back(0);
-			return intersec;
-		}		 
-        //MSG("STEP4");		
-        intersecGroup.push_back(intersec);	
+		classifyPacket(pPacket, out[n], slot);
+		pPacket += 32*m_Layout.linesPerPacket();
 	}
-	
-	std::vector<bt16bitInt> commonData(intersecGroup[0]);
+}
 
-	MSG("STEP14");
-	for(int i=0; i<num_set/2-1; i++)
+// Flow-cache key of a packet: the keys of its flow-invariant lanes followed by
+// their start-index bits.
+void HelloSPLLBApp::flowKey(const bt16bitInt *pPacket, FlowCache::Key &key)
+{
+	unsigned int idxBits = 0;
+	int k = 0;
+	::memset(&key, 0, sizeof(key));
+	for(int j=0; j<m_Layout.numLanes(); j++)
 	{
-		std::vector<bt16bitInt> commonDataTmp(1024);	
-		std::vector<bt16bitInt>::iterator it_cdt;	
-		MSG("STEP15");
-		MSG(i<<endl<<intersecGroup.size());
-		MSG("commonData.size()");
-		MSG(commonData.size());
-		MSG(intersecGroup[i+1].size());
-		MSG(commonDataTmp.size());
-		
-        it_cdt=std::set_intersection (commonData.begin(), commonData.end(), 
-	                              intersecGroup[i+1].begin(), intersecGroup[i+1].end(), 
-							      commonDataTmp.begin());  
-								  
-								  MSG("STEP16");
-								  
-        commonDataTmp.resize(it_cdt-commonDataTmp.begin());  
-		MSG("commonDataTmp.size()");
-		MSG(commonDataTmp.size());
-        commonData.erase(commonData.begin(),commonData.end());
+		if (!((m_FlowFields >> m_Layout.laneField(j)) & 1))
+			continue;
+		int line = m_Layout.laneLine(j);
+		int slot = m_Layout.laneSlot(j);
+		key.w[k] = pPacket[32*line + 31 - slot];
+		idxBits |= ((pPacket[32*line + 15] >> (15-slot)) & 0x1) << k;
+		k++;
+	}
+	key.w[FLOW_KEY_LANES]     = (bt16bitInt)(idxBits & 0xffff);
+	key.w[FLOW_KEY_LANES + 1] = (bt16bitInt)(idxBits >> 16);
+}
+
+// Tree lookups of the lanes of the given fields (bit f = field f); the other
+// entries of idxOut are left as they are.
+void HelloSPLLBApp::lookupFields(const bt16bitInt *pPacket, unsigned fields, std::vector<bt16bitInt> &idxOut)
+{
+	for(int j=0; j<m_Layout.numLanes(); j++)
+	{
+		if (!((fields >> m_Layout.laneField(j)) & 1))
+			continue;
+		int line = m_Layout.laneLine(j);
+		int slot = m_Layout.laneSlot(j);
+		bt16bitInt keyIn = pPacket[32*line + 31 - slot];
+		bool idxInBool = (pPacket[32*line + 15] >> (15-slot)) & 0x1;
+		idxOut[j] = lookup(keyIn, idxInBool);
+	}
+}
+
+//std::vector<bt16bitInt> HelloSPLLBApp::merge(bt16bitInt *pDestInt, btUnsigned32bitInt length)
+std::vector<bt16bitInt> HelloSPLLBApp::merge(const std::vector<bt16bitInt> &setGroupIdx, int slot)
+{
+	std::vector<bt16bitInt> intersec;
+	mergeFields(setGroupIdx, slot, m_AllFields, false, intersec);
+	m_Planner.packetDone(slot);
+	if (intersec.empty())
+		intersec.push_back(0);
+	return intersec;
+}
+
+// Intersect the lanes of the given fields (bit f = field f) into intersec;
+// with started false the first list read becomes the candidate set.  Returns
+// false once the candidates run out.
+bool HelloSPLLBApp::mergeFields(const std::vector<bt16bitInt> &setGroupIdx, int slot, unsigned fields,
+                                bool started, std::vector<bt16bitInt> &intersec)
+{
+	// One running candidate set: the merge steps (a cross-product pair, or the
+	// unpaired lanes of one field) are intersected into it in the planner's
+	// order, most selective step first, and the packet is rejected at the
+	// first step that leaves it empty.  The planner sees the size left after
+	// every step.  A list already intersected cannot remove anything.
+	std::vector<bt16bitInt> intersecTmp;
+	std::vector<unsigned> applied;
+
+	unsigned long long plan = m_Planner.plan();
+	for(int step=0; step<m_Planner.numFields(); step++)
+	{
+		int s = MergePlanner::planStep(plan, step);
+		if (m_StepFields[s] & ~fields)
+			continue;
+
+		if (m_StepPair[s] >= 0) {
+			// one table load stands for both lanes' lists
+			const CrossProductTable &t = m_CrossProduct.pair(m_StepPair[s]);
+			const bt16bitInt *list;
+			size_t            n;
+			m_CrossProduct.lookup(m_StepPair[s], setGroupIdx[t.laneA()] % (1<<tree_depth),
+			                      setGroupIdx[t.laneB()] % (1<<tree_depth), list, n);
+			if (!started) {
+				intersec.assign(list, list + n);
+			} else {
+				intersecTmp.resize(intersec.size());
+				intersecTmp.resize(std::set_intersection(intersec.begin(), intersec.end(), list, list + n,
+				                                         intersecTmp.begin()) - intersecTmp.begin());
+				intersec.swap(intersecTmp);
+			}
+			started = true;
+		}
+
+		const std::vector<int> &lanes = m_StepLanes[s];
+		size_t numLists = (m_StepPair[s] >= 0) ? 0 : lanes.size();
+		for(size_t c=0; c<numLists && (!started || !intersec.empty()); c++)
+		{
+			int laneB = lanes[c];
+			int setGroupIdxB = setGroupIdx[laneB] % (1<<tree_depth);
+			unsigned idB = m_RuleLists.listId(setGroupIdxB+laneB*num_setgroup);
+			if (std::find(applied.begin(), applied.end(), idB) != applied.end())
+				continue;
+			applied.push_back(idB);
+			if (!started) {
+				if (m_RuleStore.numLists() > 0)
+					m_RuleStore.decodeList(idB, intersec);
+				else
+					intersec.assign(setData[setGroupIdxB+laneB*num_setgroup], 
+					                setData[setGroupIdxB+laneB*num_setgroup]+num_setSize);
+				started = true;
+				continue;
+			}
+			intersecTmp.resize(intersec.size());
+			if (m_RuleStore.numLists() > 0) {
+				// decode only the blocks that can hold a remaining candidate
+				intersecTmp.resize(m_RuleStore.intersect(&intersec[0], intersec.size(),
+				                                         idB, &intersecTmp[0]));
+			} else {
+				std::vector<bt16bitInt>::iterator it;
+				it=std::set_intersection (intersec.begin(), intersec.end(), 
+				                          setData[setGroupIdxB+laneB*num_setgroup], 
+				                          setData[setGroupIdxB+laneB*num_setgroup]+num_setSize,
+				                          intersecTmp.begin());
+				intersecTmp.resize(it-intersecTmp.begin());
+			}
+			intersec.swap(intersecTmp);
+		}
+		if (!started)
+			continue;
+		m_Planner.record(slot, s, intersec.size());
 		
-        if(commonDataTmp.size()==0)	{
-			 commonDataTmp.push_back(0);
-			 return commonDataTmp;
-		}	
-			 MSG("STEP17");
-		commonData.insert(commonData.begin(),commonDataTmp.begin(),commonDataTmp.end());
+		if(intersec.size() == 0)
+			return false;
 	}
-    MSG("STEP18");
-    
-	return commonData;
+	return true;
 }
 
 bt16bitInt HelloSPLLBApp::lookup(bt16bitInt keyIn, bool idxIn)
@@ -668,12 +910,28 @@ btInt HelloSPLLBApp::run()
           " 0x"            << std::hex << pVAFU2_cntxt->num_cl * CL(1) << std::dec << ")");
 
       // Init the src/dest buffers, based on the desired sequence (either fixed or random).
-      MSG("Initializing source buffer with random pattern. (src=random 32 bits unsigned integer)");
-
-      std::srand((uint)std::time(0));
-      for (int i = 0; i < a_num_bytes; i++) {
-          char random = (char) (std::rand() % 256);
-          ::memset( pSource + i, random, 1);
+      PcapFile trace;
+      if ( (NULL != m_TraceFile) && trace.open(m_TraceFile) && (trace.numPackets() > 0) ) {
+         MSG("Initializing source buffer from capture " << m_TraceFile << " (" << trace.numPackets() << " packets)");
+         PacketIngest ingest(CL_LAYOUT_SW);
+         ingest.fields() = m_Layout;
+         ingest.emit(trace, 0, pSource, a_num_cl);
+         MSG("Packets parsed=" << ingest.parsed() << " non-IP=" << ingest.nonIp());
+      } else {
+         if ( NULL != m_TraceFile ) {
+            ERR("Cannot read capture " << m_TraceFile << ", falling back to random source data");
+         }
+         if ( WL_SOURCE_HEADERS == source_model ) {
+            PacketIngest ingest(CL_LAYOUT_SW);
+            ingest.fields() = m_Layout;
+            HeaderModel model(source_seed);
+            MSG("Initializing source buffer with generated headers (" << model.numFlows() << " Zipf flows)");
+            ::memset(pSource, 0, a_num_bytes);
+            fillHeaderLines(model, ingest, source_seed, pSource, a_num_cl);
+         } else {
+            MSG("Initializing source buffer with random pattern. (src=random 32 bits unsigned integer)");
+            parallelStreamFill<UniformLineGen>(pSource, a_num_bytes, source_seed);
+         }
       }
      
       MSG("Initializing destination buffer with fixed pattern. (dest=0xbebebebe)");
@@ -726,6 +984,14 @@ btInt HelloSPLLBApp::run()
       bt16bitInt curr_block = 1;
       bt16bitInt a_num_block = a_num_cl / block_size;
 	  std::vector<vector<bt16bitInt> > intersecGroup;
+
+	  // leaf indices of a block, slot by slot (one sparse row per line); a
+	  // packet wider than a line takes its lanes from linesPerPacket() rows
+	  const int lines_per_pkt = m_Layout.linesPerPacket();
+	  AfuOutputFormat out_fmt;
+	  AfuLeafDecoder leaf_decode;
+	  leaf_decode.init(std::min(m_Layout.numLanes(), (int)CL_LANES_SW), tree_depth, block_size);
+	  std::vector<bt16bitInt> setGroupIdx(m_Layout.numLanes());
 	  
 	  MSG("Value of a_num_cl");
 	  MSG(a_num_cl);
@@ -759,20 +1025,13 @@ btInt HelloSPLLBApp::run()
 				  (double)diff_fpga.tv_sec*1000 + (double)diff_fpga.tv_usec/1000 << "ms");
 			 }
 			   
-			 for(int i = 0; i < block_size; i++)
+			 leaf_decode.decode(out_fmt, pDestInt, (size_t)(curr_block - 1) * block_size, block_size);
+			 for(int i = 0; i < block_size / lines_per_pkt; i++)
 			 {
                  //for(int j = 0; j < 2; j++){
-					 std::vector<bt16bitInt> setGroupIdx;
-				     for(int k = 0; k < num_set; k++){
-				         bt16bitInt setIdx = ((bt16bitInt)(*(pDestInt 
-				  	                                     + (curr_block - 1) * 32 * block_size    //one block 16 cache lines
-				  	  								   + i*32   // one cl 32 16-bit data
-				  	  								   //+ j*num_set   // one cl two set groups
-													   + k
-				  	  								   )));
-				  	   setGroupIdx.push_back(setIdx);
-                     }
-				     std::vector<bt16bitInt> intersecVec = merge(setGroupIdx);
+					 for(int j = 0; j < m_Layout.numLanes(); j++)
+					     setGroupIdx[j] = leaf_decode.lane(m_Layout.laneSlot(j))[i*lines_per_pkt + m_Layout.laneLine(j)];
+				     std::vector<bt16bitInt> intersecVec = merge(setGroupIdx, 0);
 				     intersecGroup.push_back(intersecVec);
 				 //}
 			 }
@@ -860,8 +1119,8 @@ btInt HelloSPLLBApp::run()
      timeval curr_time_cpu;	 
      gettimeofday(&start_time_cpu, NULL);
 	  
-	 std::vector<std::vector<bt16bitInt> > intsecGroup;
-	 std::vector<bt16bitInt> intsec;
+	 std::vector<CachedRules> intsecGroup;
+	 CachedRules intsec;
 	 // MSG("STEP1");
      // use std::qsort
      //qsort(pSourceInt, a_num_cl * 16, sizeof(btUnsigned32bitInt), compareUint);
@@ -874,45 +1133,66 @@ btInt HelloSPLLBApp::run()
 	  MSG("pKeyInt[0]");
 	  MSG(pKeyInt[0]);
 	 
-	 for(int i=0; i<a_num_cl; i++)
+	 // a packet spans linesPerPacket() lines when its lanes do not fit one line
+	 for(int i=0; i+lines_per_pkt<=a_num_cl; i+=lines_per_pkt)
 	 {
-		 //unsigned int setGroupIdx;
-		 vector<bt16bitInt> idxOut;
-		 //bt16bitInt random = rand();
-		 //idxOut.push_back(random);
-		 //MSG("STEP2");
-		 
-		 for(int j=0; j<num_set; j++)
-		  {
-		      bt16bitInt * keyIn;
-		      bt16bitInt * idxIn;   //byte size
-			//MSG("STEP3");			   
-		      keyIn = pKeyInt + 31 - j;
-			// MSG(pKeyInt); MSG(keyIn);
-			  //MSG("STEP4");
-		     idxIn = pIdxInt + 15; 
-			 bool idxInBool = ((*idxIn) >> (15-j)) & 0x1;
-			 
-			 // MSG(pIdxInt); MSG(idxIn);
-			 //MSG("STEP5");
-		      bt16bitInt idxOutTmp = lookup(*keyIn, idxInBool);
-			  //MSG("STEP6");
-		      idxOut.push_back(idxOutTmp);
-		 }
-		 
-		 MSG("STEP7");
-		 pKeyInt += 32;
-		 pIdxInt += 32;
-		 MSG("STEP8");
-		 //setGroupIdx = ((unsigned int)idxOut[0]) % num_setgroup;
-		 intsec = merge(idxOut);
+		 classifyPacket(pKeyInt, intsec, 0);
 		 intsecGroup.push_back(intsec);
+		 pKeyInt += 32*lines_per_pkt;
+		 pIdxInt += 32*lines_per_pkt;
 	 }
 		 
      gettimeofday(&curr_time_cpu, NULL);
      timeval diff_cpu = calculate_time_interval(curr_time_cpu, start_time_cpu);
      MSG("The CPU look up and merge process takes " << (double)diff_cpu.tv_sec*1000 + (double)diff_cpu.tv_usec/1000 << "ms");
+
+     if (m_FlowCache.isValid()) {
+         ResultCacheStats fc = m_FlowCache.stats();
+         MSG("Flow cache: " << m_FlowCache.capacity() << " entries, hits " << fc.hits
+             << ", misses " << fc.misses << ", evictions " << fc.evictions);
+     }
+
+     if (m_MergeMemo.isValid()) {
+         ResultCacheStats mm = m_MergeMemo.stats();
+         MSG("Merge memo: " << m_MergeMemo.capacity() << " entries, hits " << mm.hits
+             << ", misses " << mm.misses << ", evictions " << mm.evictions);
+     }
+
+     MSG("Merge step order after " << m_Planner.replans() << " re-plans:");
+     for(int step=0; step<m_Planner.numFields(); step++)
+     {
+         int s = MergePlanner::planStep(m_Planner.plan(), step);
+         std::ostringstream lanes;
+         for(size_t c=0; c<m_StepLanes[s].size(); c++)
+             lanes << (c ? "," : "") << m_StepLanes[s][c] << "/f" << m_Layout.laneField(m_StepLanes[s][c]);
+         MSG("  " << (m_StepPair[s] >= 0 ? "pair" : "lists") << " of lanes " << lanes.str() << ": empty "
+             << m_Planner.emptyRate(s)*100 << "%, mean candidates left " << m_Planner.meanSize(s));
+     }
 	  
+     // latency path: single-packet calls from several threads, coalesced into small batches
+     if (small_batch_packets > 0) {
+         PacketIngest ingest(CL_LAYOUT_SW);
+         ingest.fields() = m_Layout;
+         // engine calls of the submitter never overlap: one counter slot, apart from the bulk run's
+         BatchSubmitter submitter(*this, ingest, small_batch_max, small_batch_delay_us, 1);
+         HeaderModel model(source_seed);
+         #pragma omp parallel num_threads(small_batch_callers)
+         {
+             Xoshiro256 rng(source_seed, (uint64_t)omp_get_thread_num());
+             #pragma omp for schedule(static)
+             for(int n = 0; n < small_batch_packets; n++) {
+                 PacketHeader   h;
+                 ClassifyResult r;
+                 model.sample(rng, h);
+                 submitter.classify(&h, 1, &r);
+             }
+         }
+         ClassifyBatchStats bs = submitter.stats();
+         MSG("Small-batch classify: " << bs.packets << " packets in " << bs.batches << " engine calls (largest "
+             << bs.largestBatch << "), latency p50 < " << submitter.latencyPercentileUs(0.5)
+             << "us, p99 < " << submitter.latencyPercentileUs(0.99) << "us");
+     }
+
      MSG("Finish look up and merge in Source Memory");
      MSG("Final checking...");
      bool success = true;
@@ -1124,6 +1404,9 @@ int main(int argc, char *argv[])
       ERR("Runtime Failed to Start");
       exit(1);
    }
+   if ( argc > 1 ) {
+      theApp.setTraceFile(argv[1]);
+   }
    btInt Result = theApp.run();
 
    MSG("Done");